@@ -0,0 +1,307 @@
+#include "Publisher.h"
+#include <sys/socket.h>
+#include <cstring>
+#include <cmath>
+#include <cctype>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <sstream>
+#include "utils.h"
+
+using namespace std;
+
+
+Publisher::Publisher(string id, uint32_t server_ip, uint16_t server_port,
+                     publisher_options &options) {
+    this->id = id;
+    this->server_ip = server_ip;
+    this->server_port = server_port;
+    this->options = options;
+    this->batch_records = 0;
+}
+
+
+Publisher::~Publisher() {
+    close(tcp_sockfd);
+}
+
+
+void Publisher::prepare() {
+    // Create TCP socket to connect to the server.
+    tcp_sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    DIE(tcp_sockfd < 0, "Publisher: TCP socket creation failed.\n");
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(struct sockaddr_in));
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(server_port);
+    server_addr.sin_addr.s_addr = server_ip;
+
+    // Disable Nagle algorithm, the batches are already big enough.
+    int opt_flag = 1;
+    int rc = setsockopt(tcp_sockfd, IPPROTO_TCP, TCP_NODELAY, &opt_flag, sizeof(int));
+    DIE(rc < 0, "Publisher: Nagle disabling for TCP socket failed.\n");
+
+    // Connect to the server.
+    rc = connect(tcp_sockfd, (const struct sockaddr *)&server_addr, sizeof(server_addr));
+    DIE(rc < 0, "Publisher: Connection to server failed.\n");
+}
+
+
+bool Publisher::check_connection_validity() {
+    // Send publisher id to the server, it is a client like the others.
+    tcp_message *msg = (tcp_message*) calloc(1, sizeof(tcp_message));
+    DIE(!msg, "calloc failed\n");
+
+    msg->command = CONNECT_REQ;
+    msg->len = id.length() + 1;
+    msg->payload = (char *) id.c_str();
+
+    int rc = send_efficient(tcp_sockfd, msg);
+    DIE(rc < 0, "Error sending id to the server\n");
+
+    memset(msg, 0, sizeof(tcp_message));
+
+    // Receive response regarding acceptance from server.
+    rc = recv_efficient(tcp_sockfd, msg);
+    DIE(rc < 0, "Error receiving connect confirmation from the server\n");
+
+    bool accepted = msg->command == CONNECT_ACCEPTED;
+    if (msg->len > 0) {
+        free(msg->payload);
+    }
+    free(msg);
+
+    if (!accepted) {
+        // Connection denied.
+        cout << "Connection denied\n";
+    }
+
+    return accepted;
+}
+
+
+bool Publisher::add_publication(const string &topic, const string &type,
+                                const string &value) {
+    // The topic is padded with zeroes to 50 bytes, like in the datagrams.
+    string record(50, '\0');
+    memcpy(&record[0], topic.data(), min(topic.length(), (size_t) 50));
+
+    char *end = NULL;
+
+    if (type == "INT") {
+        long long number = strtoll(value.c_str(), &end, 10);
+        if (value.empty() || *end != '\0' || llabs(number) > UINT32_MAX) {
+            return false;
+        }
+
+        uint32_t net_number = htonl((uint32_t) llabs(number));
+        record += (char) INT_TYPE;
+        record += (char) (number < 0);
+        record.append((char *) &net_number, sizeof(uint32_t));
+    } else if (type == "SHORT_REAL") {
+        double number = strtod(value.c_str(), &end);
+        if (*end != '\0' || number < 0 || number > 655.35) {
+            return false;
+        }
+
+        uint16_t net_number = htons((uint16_t) lround(number * 100));
+        record += (char) SHORT_REAL_TYPE;
+        record.append((char *) &net_number, sizeof(uint16_t));
+    } else if (type == "FLOAT") {
+        // The digits are sent as an integer, with the number of decimals.
+        string digits;
+        uint8_t power = 0;
+        bool negative = false, point = false;
+
+        for (size_t i = 0; i < value.length(); i++) {
+            if (i == 0 && value[i] == '-') {
+                negative = true;
+            } else if (value[i] == '.' && !point) {
+                point = true;
+            } else if (isdigit(value[i])) {
+                digits += value[i];
+                power += point;
+            } else {
+                return false;
+            }
+        }
+
+        if (digits.empty() || digits.length() > 10 || stoull(digits) > UINT32_MAX) {
+            return false;
+        }
+
+        uint32_t net_number = htonl((uint32_t) stoull(digits));
+        record += (char) FLOAT_TYPE;
+        record += (char) negative;
+        record.append((char *) &net_number, sizeof(uint32_t));
+        record += (char) power;
+    } else if (type == "STRING") {
+        // Unlike in the datagrams, the content is not limited to 1500 bytes.
+        if (record.length() + 1 + value.length() > MAX_PUBLISH_RECORD) {
+            return false;
+        }
+
+        record += (char) STRING_TYPE;
+        record += value;
+    } else {
+        return false;
+    }
+
+    // Keep the frames under the limit the server accepts.
+    if (batch.length() + sizeof(uint32_t) + record.length() > MAX_TCP_PAYLOAD) {
+        if (!send_batch()) {
+            return false;
+        }
+    }
+
+    uint32_t net_len = htonl(record.length());
+    batch.append((char *) &net_len, sizeof(uint32_t));
+    batch += record;
+    batch_records++;
+
+    if (batch_records >= options.batch_size) {
+        return send_batch();
+    }
+
+    return true;
+}
+
+
+bool Publisher::send_batch() {
+    if (batch_records == 0) {
+        return true;
+    }
+
+    tcp_message msg;
+    msg.command = PUBLISH;
+    msg.len = batch.length();
+    msg.payload = (char *) batch.data();
+
+    int rc = send_efficient(tcp_sockfd, &msg);
+
+    batch.clear();
+    batch_records = 0;
+
+    if (rc < 0) {
+        fprintf(stderr, "Error sending publications to the server\n");
+        connection_lost = true;
+        return false;
+    }
+
+    return true;
+}
+
+
+bool Publisher::manage_stdin_line(const string &line) {
+    if (line == "exit") {
+        return true;
+    }
+
+    stringstream line_stream(line);
+    string first, second, value;
+    line_stream >> first >> second;
+
+    if (first == "burst") {
+        unsigned long count;
+        if (!(line_stream >> count)) {
+            cout << "Usage: burst <topic> <count>\n";
+            return false;
+        }
+
+        for (unsigned long i = 0; i < count && !connection_lost; i++) {
+            add_publication(second, "INT", to_string(i));
+        }
+        return connection_lost;
+    }
+
+    // The value is the rest of the line (a string may contain spaces).
+    line_stream >> ws;
+    getline(line_stream, value);
+
+    if (first.empty() || !add_publication(first, second, value)) {
+        if (connection_lost) {
+            return true;
+        }
+        cout << "Invalid publication: " << line << "\n";
+    }
+
+    return false;
+}
+
+
+bool Publisher::manage_stdin_data() {
+    char buff[65536];
+
+    // Take everything that is available, so the lines are batched.
+    while (true) {
+        int rc = read(STDIN_FILENO, buff, sizeof(buff));
+        if (rc <= 0) {
+            // End of input, send what is left and stop.
+            send_batch();
+            return true;
+        }
+        stdin_buff.append(buff, rc);
+
+        size_t start = 0, end;
+        while ((end = stdin_buff.find('\n', start)) != string::npos) {
+            if (manage_stdin_line(stdin_buff.substr(start, end - start))) {
+                send_batch();
+                return true;
+            }
+            start = end + 1;
+        }
+        stdin_buff.erase(0, start);
+
+        pollfd stdin_pollfd;
+        stdin_pollfd.fd = STDIN_FILENO;
+        stdin_pollfd.events = POLLIN;
+        if (poll(&stdin_pollfd, 1, 0) <= 0) {
+            break;
+        }
+    }
+
+    return !send_batch();
+}
+
+
+void Publisher::run() {
+    pollfd poll_fds[2];
+    poll_fds[0].fd = STDIN_FILENO;
+    poll_fds[0].events = POLLIN;
+    poll_fds[1].fd = tcp_sockfd;
+    poll_fds[1].events = POLLIN;
+
+    tcp_message msg;
+
+    while (true) {
+        int rc = poll(poll_fds, 2, -1);
+        DIE(rc < 0, "Publisher: poll failed.\n");
+
+        if (poll_fds[0].revents & (POLLIN | POLLHUP)) {
+            // Received publications from stdin.
+            if (manage_stdin_data()) {
+                break;
+            }
+        }
+
+        if (poll_fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            memset(&msg, 0, sizeof(tcp_message));
+            rc = recv_efficient(tcp_sockfd, &msg);
+            if (rc <= 0) {
+                // The server closed the connection.
+                break;
+            }
+
+            // Only the heartbeats are answered, the rest is ignored.
+            if (msg.command == HEARTBEAT && send_command(tcp_sockfd, HEARTBEAT_ACK) < 0) {
+                break;
+            }
+            free(msg.payload);
+        }
+    }
+}
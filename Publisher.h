@@ -0,0 +1,115 @@
+#ifndef PUBLISHER_H
+#define PUBLISHER_H
+
+#include <string>
+#include <cstdint>
+
+#include "protocols.h"
+
+
+/**
+ * Optional settings of the publisher, given as command line arguments.
+ */
+struct publisher_options {
+    // Maximum number of publications sent in a PUBLISH frame.
+    size_t batch_size = 1024;
+};
+
+
+class Publisher {
+ private:
+    std::string id;
+    uint32_t server_ip;
+    uint16_t server_port;
+
+    int tcp_sockfd; // Socket to communicate with the server.
+
+    publisher_options options;
+
+    // Records of the next PUBLISH frame, each one preceded by its length.
+    std::string batch;
+    size_t batch_records;
+
+    // Input from stdin that does not make a whole line yet.
+    std::string stdin_buff;
+
+    // Set when a batch could not be sent, the publisher stops afterwards.
+    bool connection_lost = false;
+
+
+    /**
+     * Encodes a publication in the UDP format (topic, type, content) and
+     * adds it to the batch, which is sent if it is full.
+     * @return false if the value does not match the type or the connection
+     * was lost while sending the batch
+     */
+    bool add_publication(const std::string &topic, const std::string &type,
+                         const std::string &value);
+
+
+    /**
+     * Sends the batch as a single PUBLISH frame, if it is not empty.
+     * @return false if the connection was lost
+     */
+    bool send_batch();
+
+
+    /**
+     * Parses a line from stdin: "<topic> <INT|SHORT_REAL|FLOAT|STRING>
+     * <value>" or "burst <topic> <count>" (count INT publications,
+     * valued 0 to count - 1, for load tests).
+     * @return true if the input is "exit" or the connection was lost, false
+     * otherwise
+     */
+    bool manage_stdin_line(const std::string &line);
+
+
+    /**
+     * Reads everything available on stdin and manages the whole lines.
+     * The batch is sent when no more input is waiting, so the
+     * publications are not delayed.
+     * @return true if the publisher must stop, false otherwise
+     */
+    bool manage_stdin_data();
+
+
+ public:
+
+    /**
+     * Constructor.
+     * @param id String id of the Publisher (at most 10 characters)
+     * @param options Optional settings (i.e. the batch size)
+     */
+    Publisher(std::string id, uint32_t server_ip, uint16_t server_port,
+              publisher_options &options);
+
+
+    /**
+     * Destructor. Closes the tcp_sockfd.
+     */
+    ~Publisher();
+
+
+    /**
+     * Sets up the TCP socket and connects to the server.
+     */
+    void prepare();
+
+
+    /**
+     * Sends the ID to the server and waits for confirmation of acceptance.
+     * @return true, if the connection was accepted, false otherwise.
+     */
+    bool check_connection_validity();
+
+
+    /**
+     * The main control function for the publisher. It polls stdin, for
+     * the publications, and the server, to answer its heartbeats and to
+     * notice when it closes the connection.
+     */
+    void run();
+};
+
+
+#endif /* PUBLISHER_H */
@@ -0,0 +1,199 @@
+#include "Replayer.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <cstring>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <unistd.h>
+#include "utils.h"
+
+using namespace std;
+
+
+/**
+ * Current value of the monotonic clock, in nanoseconds.
+ */
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/**
+ * Waits until the monotonic clock reaches target_ns: sleeps for most of
+ * the time, then spins, so the datagram is not late by a whole timer slack.
+ */
+static void wait_until(uint64_t target_ns) {
+    uint64_t now_ns = monotonic_ns();
+    if (now_ns + REPLAY_SPIN_NS < target_ns) {
+        struct timespec ts;
+        uint64_t wake_ns = target_ns - REPLAY_SPIN_NS;
+        ts.tv_sec = wake_ns / 1000000000;
+        ts.tv_nsec = wake_ns % 1000000000;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+
+    while (monotonic_ns() < target_ns) {
+    }
+}
+
+
+Replayer::Replayer(string path, uint32_t server_ip, uint16_t server_port,
+                   replay_options &options) {
+    this->path = path;
+    this->server_ip = server_ip;
+    this->server_port = server_port;
+    this->options = options;
+}
+
+
+bool Replayer::load() {
+    if (!capture_load(path, data, records)) {
+        return false;
+    }
+
+    // The topic is at the start of the datagram, padded with '\0'.
+    lanes.assign(options.threads, vector<size_t>());
+    for (size_t i = 0; i < records.size(); i++) {
+        const char *datagram = data.data() + records[i].offset;
+        string topic(datagram, strnlen(datagram, min((size_t) records[i].len, (size_t) 50)));
+
+        lanes[hash<string>()(topic) % options.threads].push_back(i);
+    }
+
+    return true;
+}
+
+
+void Replayer::replay_lane_max_speed(int sockfd, size_t lane, replay_lane_stats &stats) {
+    vector<size_t> &indexes = lanes[lane];
+
+    mmsghdr msgs[REPLAY_BATCH];
+    iovec iovs[REPLAY_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+
+    for (size_t loop = 0; loop < options.loops; loop++) {
+        for (size_t start = 0; start < indexes.size(); start += REPLAY_BATCH) {
+            unsigned int count = min(indexes.size() - start, (size_t) REPLAY_BATCH);
+
+            for (unsigned int i = 0; i < count; i++) {
+                capture_record &record = records[indexes[start + i]];
+                iovs[i].iov_base = &data[record.offset];
+                iovs[i].iov_len = record.len;
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+
+            // A full socket buffer only delays the rest of the batch.
+            unsigned int done = 0;
+            while (done < count) {
+                int rc = sendmmsg(sockfd, msgs + done, count - done, 0);
+                if (rc < 0) {
+                    stats.errors += count - done;
+                    break;
+                }
+                done += rc;
+            }
+            stats.sent += done;
+        }
+    }
+}
+
+
+void Replayer::replay_lane(size_t lane, uint64_t start_ns, replay_lane_stats &stats) {
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    DIE(sockfd < 0, "Replay: UDP socket creation failed.\n");
+
+    // The datagrams come from the replay, not from the original publishers.
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(struct sockaddr_in));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(server_port);
+    server_addr.sin_addr.s_addr = server_ip;
+
+    int rc = connect(sockfd, (struct sockaddr *) &server_addr, sizeof(server_addr));
+    DIE(rc < 0, "Replay: UDP connect failed.\n");
+
+    if (options.max_speed) {
+        replay_lane_max_speed(sockfd, lane, stats);
+        close(sockfd);
+        return;
+    }
+
+    // The schedule is absolute, so the delays do not add up over time.
+    uint64_t first_ns = records.front().rx_ns;
+    uint64_t last_ns = records.back().rx_ns;
+    uint64_t span_ns = last_ns > first_ns ? last_ns - first_ns : 0;
+
+    for (size_t loop = 0; loop < options.loops; loop++) {
+        uint64_t loop_start_ns = start_ns + loop * (uint64_t) (span_ns / options.speed);
+
+        for (size_t index : lanes[lane]) {
+            capture_record &record = records[index];
+
+            // Clocks may step back while capturing; keep the order.
+            uint64_t offset_ns = record.rx_ns > first_ns ? record.rx_ns - first_ns : 0;
+            uint64_t target_ns = loop_start_ns + (uint64_t) (offset_ns / options.speed);
+            wait_until(target_ns);
+
+            uint64_t late_ns = monotonic_ns() - target_ns;
+            stats.total_late_ns += late_ns;
+            stats.max_late_ns = max(stats.max_late_ns, late_ns);
+
+            if (send(sockfd, &data[record.offset], record.len, 0) < 0) {
+                stats.errors++;
+            } else {
+                stats.sent++;
+            }
+        }
+    }
+
+    close(sockfd);
+}
+
+
+void Replayer::run() {
+    if (records.empty()) {
+        cout << "Replay: the capture is empty\n";
+        return;
+    }
+
+    vector<replay_lane_stats> stats(options.threads);
+    vector<thread> threads;
+
+    // All the threads start from the same point in time.
+    uint64_t start_ns = monotonic_ns() + 10000000;
+    for (size_t lane = 0; lane < options.threads; lane++) {
+        threads.emplace_back(&Replayer::replay_lane, this, lane, start_ns, ref(stats[lane]));
+    }
+
+    for (thread &replay_thread : threads) {
+        replay_thread.join();
+    }
+
+    uint64_t elapsed_ns = monotonic_ns() - start_ns;
+
+    replay_lane_stats total;
+    for (replay_lane_stats &lane_stats : stats) {
+        total.sent += lane_stats.sent;
+        total.errors += lane_stats.errors;
+        total.total_late_ns += lane_stats.total_late_ns;
+        total.max_late_ns = max(total.max_late_ns, lane_stats.max_late_ns);
+    }
+
+    // Clocks may step back while capturing, like for the offsets.
+    uint64_t first_ns = records.front().rx_ns;
+    uint64_t last_ns = records.back().rx_ns;
+    uint64_t span_ns = last_ns > first_ns ? last_ns - first_ns : 0;
+
+    cout << "Replay: " << total.sent << " datagrams sent (" << total.errors << " errors) in "
+         << elapsed_ns / 1000000 << " ms, " << total.sent * 1000000000 / max(elapsed_ns, (uint64_t) 1)
+         << " datagrams/s; the capture spans " << span_ns / 1000000 << " ms\n";
+
+    if (!options.max_speed && total.sent > 0) {
+        cout << "Lateness: " << total.total_late_ns / total.sent / 1000 << " us on average, "
+             << total.max_late_ns / 1000 << " us at most\n";
+    }
+}
@@ -0,0 +1,102 @@
+#ifndef REPLAYER_H
+#define REPLAYER_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "capture_file.h"
+
+// Datagrams sent with a single sendmmsg() at maximum speed.
+#define REPLAY_BATCH 64
+
+// The threads sleep until this long before a datagram is due, then spin.
+#define REPLAY_SPIN_NS 100000
+
+
+/**
+ * Optional settings of the replay, given as command line arguments.
+ */
+struct replay_options {
+    // Speedup of the capture timing (2 replays twice as fast). Ignored
+    // at maximum speed, where the datagrams are sent back to back.
+    double speed = 1.0;
+    bool max_speed = false;
+
+    // Sending threads; a topic is always sent by the same one, so the
+    // publications of a topic keep their order.
+    size_t threads = 1;
+
+    // Times the whole capture is played.
+    size_t loops = 1;
+};
+
+
+/**
+ * What a thread did, for the final report.
+ */
+struct replay_lane_stats {
+    uint64_t sent = 0;
+    uint64_t errors = 0;
+
+    // Delay of the datagrams after their scheduled time, in nanoseconds.
+    uint64_t total_late_ns = 0;
+    uint64_t max_late_ns = 0;
+};
+
+
+class Replayer {
+ private:
+    std::string path;
+    uint32_t server_ip;
+    uint16_t server_port;
+
+    replay_options options;
+
+    // Content of the capture file and its records.
+    std::string data;
+    std::vector<capture_record> records;
+
+    // Indexes of the records sent by each thread, in capture order.
+    std::vector<std::vector<size_t>> lanes;
+
+
+    /**
+     * Sends the records of a lane, each at its time (relative to
+     * start_ns, on the monotonic clock) or back to back at max speed.
+     */
+    void replay_lane(size_t lane, uint64_t start_ns, replay_lane_stats &stats);
+
+
+    /**
+     * Sends the records of a lane back to back, with sendmmsg().
+     */
+    void replay_lane_max_speed(int sockfd, size_t lane, replay_lane_stats &stats);
+
+
+ public:
+
+    /**
+     * Constructor.
+     * @param path Capture file written by the server
+     * @param options Optional settings (i.e. the speed, the threads)
+     */
+    Replayer(std::string path, uint32_t server_ip, uint16_t server_port,
+             replay_options &options);
+
+
+    /**
+     * Loads the capture file and splits its records between the threads.
+     * @return false if the file is not a valid capture
+     */
+    bool load();
+
+
+    /**
+     * Replays the capture from all the threads and prints a report.
+     */
+    void run();
+};
+
+
+#endif /* REPLAYER_H */
@@ -4,23 +4,166 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <cstdlib>
 #include <algorithm>
 #include <sstream>
+#include <sys/uio.h>
+#include <sched.h>
+#include <endian.h>
+#include <linux/sock_diag.h>
 #include "utils.h"
+#include "handoff.h"
 
 #define LISTEN_BACKLOG 50
 
+// Number of clients checked for a fan-out job before moving to the next one.
+#define FANOUT_QUANTUM 64
+
+// Time (in microseconds) the scheduler may spend in one loop iteration.
+#define FANOUT_BUDGET_US 500
+
+// Bytes written to a client before moving to the next writable one.
+#define FLUSH_BUDGET 65536
+
+// Largest number of datagrams given to one sendmmsg() call.
+#define UDP_BATCH_SIZE 1024
+
+// Time (in microseconds) the kernel may busy poll a socket on a read.
+#define SOCKET_BUSY_POLL_US 50
+
+// Time (in milliseconds) a new connection has to send its first message.
+#define HANDSHAKE_TIMEOUT_MS 5000
+
+// Time (in milliseconds) the accepting waits when the server is out of fds.
+#define ACCEPT_RETRY_MS 100
+
+// A connection silent for this many heartbeat intervals is dropped.
+#define IDLE_HEARTBEATS 3
+
+// Time (in milliseconds) a connection may not take any of its pending
+// bytes before it is dropped.
+#define WRITE_STALL_TIMEOUT_MS 10000
+
+// Messages (and bytes) the outbound queue of a client may hold before its
+// oldest publications are dropped, the least urgent ones first.
+#define MAX_QUEUED_MESSAGES 65536
+#define MAX_QUEUED_BYTES (64 << 20)
+
+// What the timers of the wheel are for.
+#define TIMER_CORO 0
+#define TIMER_CLIENT_IDLE 1
+#define TIMER_CLIENT_STALL 2
+#define TIMER_PEER_IDLE 3
+#define TIMER_PEER_STALL 4
+#define TIMER_SESSION_EXPIRY 5
+#define TIMER_AGG_WINDOW 6
+#define TIMER_PEER_DIAL 7
+#define TIMER_SPILL 8
+
+// Time (in milliseconds) without kernel drops, and with a lag under half
+// of the limit, after which the overload is considered over.
+#define OVERLOAD_CALM_MS 100
+
+// Weight of a new sample in the moving average of the ingress lag.
+#define LAG_EWMA_SHIFT 3
+
+// Delays (in milliseconds) before linking again to a peer given with
+// --peer: the first one, doubled after each failure up to the last one.
+#define PEER_RETRY_MIN_MS 500
+#define PEER_RETRY_MAX_MS 30000
+
+// Delay (in milliseconds) before trying again to evict a session that a
+// fan-out may still be using.
+#define EVICTION_RETRY_MS 1000
+
+// Work done on the spill file per tick: records expired, and bytes copied
+// by a compaction. A failed copy is tried again after SPILL_RETRY_MS.
+#define SPILL_EXPIRE_BATCH 256
+#define SPILL_COMPACT_STEP (256 * 1024)
+#define SPILL_RETRY_MS 1000
+
+// Publications held for a client with flow control, in credit windows.
+// Absorbs the bursts that come faster than the credit is granted back.
+#define CREDIT_HELD_WINDOWS 8
+
+// Start of the state handed off to a new server, and the version of
+// its format, checked by the new server before using it.
+#define HANDOFF_MAGIC 0x484e4446
+#define HANDOFF_VERSION 12
+
+// Functions of the aggregate subscriptions.
+#define AGG_AVG 0
+#define AGG_MIN 1
+#define AGG_MAX 2
+#define AGG_SUM 3
+#define AGG_COUNT 4
+#define NUM_AGG_FUNCTIONS 5
+
+// Shortest window accepted for an aggregate, in microseconds.
+#define MIN_AGG_WINDOW_US 10000
+
+// Most topics an aggregate with wildcards keeps a window for at once. The
+// samples of the other topics are dropped until the windows close.
+#define MAX_AGG_WINDOWS 4096
+
 using namespace std;
 
+static const char *aggregate_names[NUM_AGG_FUNCTIONS] = {"avg", "min", "max", "sum", "count"};
+
 
-Server::Server(uint16_t port) {
+Server::Server(uint16_t port, server_options &options) {
     this->port = port;
     this->num_pollfds = 0;
+    this->options = options;
+    this->publish_seq = 0;
+    this->shm_consumers = 0;
+    this->last_activity_us = 0;
+    this->handed_off = false;
+
+    this->ingress_lag_ns = 0;
+    this->max_ingress_lag_ns = 0;
+    this->kernel_drops = 0;
+    this->invalid_publications = 0;
+    this->mux_frames = 0;
+    this->mux_deliveries = 0;
+    this->overloaded = false;
+    this->last_overload_ms = 0;
+    this->last_datagram_ms = 0;
+    this->overload_episodes = 0;
+    this->target_mark = 0;
+    this->offloaded_matches = 0;
+    this->inline_matches = 0;
+    this->stale_matches = 0;
+    this->cached_matches = 0;
+
+    for (shed_rule &rule : options.shed_rules) {
+        topic_classes.push_back({rule, 0, 0, {}});
+    }
+    topic_classes.push_back({{"", 1}, 0, 0, {}});
+    this->now_ms = monotonic_us() / 1000;
+
+    wheel_init(&wheel, now_ms);
+
+    loop.wheel = &wheel;
+    loop.timer_kind = TIMER_CORO;
+    loop.context = this;
+    loop.watch = &Server::watch_fd;
+
+    index_init(&subscription_index);
+    matchers_start(&matchers, &subscription_index, options.matchers);
+
+    // A restarted server gets a new id, so the peers do not confuse
+    // its sequence numbers with the old ones.
+    srand(time(NULL) ^ getpid());
+    this->node_id = ((uint32_t) rand() << 16) ^ (uint32_t) rand() ^ port;
 }
 
 
 Server::~Server() {
+    // The matcher threads may still read the topics of the jobs.
+    matchers_stop(&matchers);
+
     // Close all the fds (except STDIN_FILENO).
     for (int i = 1; i < num_pollfds; i++) {
         close(poll_fds[i].fd);
@@ -30,6 +173,33 @@ Server::~Server() {
     for (auto &entry : clients) {
         delete entry.second;
     }
+
+    // Delete the jobs with undelivered publications.
+    for (auto &entry : fanout_jobs) {
+        delete entry.second;
+    }
+
+    for (auto &entry : aggregates) {
+        delete entry.second;
+    }
+
+    for (auto &entry : peers) {
+        delete entry.second;
+    }
+
+    // Their sockets were closed with the other pollfds.
+    for (auto &entry : connections) {
+        coro_cancel(entry.second);
+    }
+    if (listener.loop) {
+        coro_cancel(&listener);
+    }
+    reap_connections();
+
+    shm_ring_close(&ring, !handed_off);
+    spill_close(&spill, !handed_off);
+    capture_close(&capture);
+    index_destroy(&subscription_index);
 }
 
 
@@ -61,6 +231,49 @@ void Server::prepare_udp_socket() {
     // Bind the UDP socket to the address.
     rc = bind(udp_sockfd, (const struct sockaddr *)&udp_addr, sizeof(udp_addr));
     DIE(rc < 0, "Server: UDP socket bind failed.\n");
+
+    // Get the time each datagram was received by the kernel, to tell how
+    // long the publications wait in the server.
+    rc = setsockopt(udp_sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &udp_flag, sizeof(int));
+    DIE(rc < 0, "Server: setsockopt() for UDP timestamps failed.\n");
+
+    // Also get the number of datagrams dropped because the queue was full.
+    rc = setsockopt(udp_sockfd, SOL_SOCKET, SO_RXQ_OVFL, &udp_flag, sizeof(int));
+    DIE(rc < 0, "Server: setsockopt() for UDP drop counter failed.\n");
+
+    enable_busy_poll(udp_sockfd);
+}
+
+
+void Server::enable_busy_poll(int sockfd) {
+    if (!options.busy_poll) {
+        return;
+    }
+
+    // Raising it above net.core.busy_read needs CAP_NET_ADMIN. Without
+    // it, the loop still spins, only the kernel does not.
+    int busy_poll_us = SOCKET_BUSY_POLL_US;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof(int)) < 0) {
+        static bool warned = false;
+        if (!warned) {
+            perror("Server: SO_BUSY_POLL not available");
+            warned = true;
+        }
+    }
+}
+
+
+void Server::pin_to_cpu() {
+    if (options.cpu < 0) {
+        return;
+    }
+
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(options.cpu, &cpu_set);
+
+    int rc = sched_setaffinity(0, sizeof(cpu_set), &cpu_set);
+    DIE(rc < 0, "Server: sched_setaffinity() failed.\n");
 }
 
 
@@ -92,9 +305,28 @@ void Server::prepare_tcp_socket() {
 
 
 void Server::prepare() {
-    prepare_udp_socket();
-    prepare_tcp_socket();
+    pin_to_cpu();
+
+    if (!options.capture_path.empty()) {
+        set_capture(options.capture_path);
+    }
+
+    if (!options.takeover_path.empty()) {
+        take_over();
+    } else {
+        prepare_udp_socket();
+        prepare_tcp_socket();
+
+        add_listen_pollfds();
+        start_acceptor();
+        prepare_spill();
+    }
+
+    connect_to_peers();
+}
+
 
+void Server::add_listen_pollfds() {
     // Initialize the poll_fds vector with pollfds corresponding to
     // stdin and the UDP and TCP sockets.
     pollfd stdin_pollfd;
@@ -111,25 +343,108 @@ void Server::prepare() {
     tcp_pollfd.fd = tcp_sockfd;
     tcp_pollfd.events = POLLIN;
     poll_fds.push_back(tcp_pollfd);
+    pollfd_positions[tcp_sockfd] = 2;
 
     num_pollfds = 3;
 }
 
 
-void Server::run() {
-    tcp_message *msg = (tcp_message *) calloc(1, sizeof(tcp_message));
-    DIE(!msg, "calloc failed\n");
+void Server::prepare_spill() {
+    if (options.session_expiry_s == 0 || spill.fd >= 0) {
+        return;
+    }
+
+    if (options.spill_path.empty()) {
+        options.spill_path = "sessions-" + to_string(port) + ".spill";
+    }
+
+    bool opened = spill_open(&spill, options.spill_path);
+    DIE(!opened, "Server: spill file creation failed.\n");
+}
+
+
+void Server::arm_spill_timer() {
+    spill_timer.kind = TIMER_SPILL;
+    spill_timer.owner = &spill;
+
+    uint64_t live_bytes = spill.end - spill.dead_bytes;
+    if (spill.next_fd >= 0 || (spill.dead_bytes > SPILL_COMPACT_MIN
+                               && spill.dead_bytes > live_bytes)) {
+        // The compaction goes on at the next tick.
+        wheel_arm(&wheel, &spill_timer, now_ms + 1);
+    } else if (options.spill_ttl_s > 0 && !spill.order.empty()) {
+        wheel_arm(&wheel, &spill_timer, spill.order.front().second
+                                        + options.spill_ttl_s * 1000);
+    } else {
+        wheel_cancel(&wheel, &spill_timer);
+    }
+}
+
+
+void Server::maintain_spill() {
+    // A few records at a time, so the loop is never blocked for long.
+    bool expiring = false;
+    if (options.spill_ttl_s > 0 && now_ms > options.spill_ttl_s * 1000) {
+        expiring = spill_expire(&spill, now_ms - options.spill_ttl_s * 1000,
+                                SPILL_EXPIRE_BATCH);
+    }
+
+    int rc = spill_compact_step(&spill, SPILL_COMPACT_STEP);
+    if (rc < 0) {
+        // The file just keeps growing until the next try.
+        perror("Server: compacting the spill file failed");
+        wheel_arm(&wheel, &spill_timer, now_ms + SPILL_RETRY_MS);
+        return;
+    }
+
+    if (expiring) {
+        wheel_arm(&wheel, &spill_timer, now_ms + 1);
+        return;
+    }
+
+    arm_spill_timer();
+}
 
+
+void Server::run() {
     // Buffers to avoid repeatedly allocating memory.
     char udp_msg[MAX_UDP_MSG];
     char formatted_msg[MAX_UDP_MSG];
 
     while (true) {
+        // Deliver a slice of the pending publications.
+        run_fanout_scheduler();
+
+        // If deliveries (or matches) are still pending, only check the
+        // sockets and come back to them without sleeping. Otherwise, sleep
+        // at most until the first timer (i.e. the end of an aggregate
+        // window) expires.
+        int timeout = 0;
+        if (ready_jobs.empty() && unmatched_jobs.empty() && matching_jobs.empty()) {
+            timeout = wheel_timeout(&wheel, monotonic_us() / 1000);
+        }
+
+        // In the busy polling mode, do not sleep for a while after the
+        // last event, so the next one is seen without any wake up delay.
+        if (options.busy_poll && monotonic_us() - last_activity_us < options.busy_poll_idle_us) {
+            timeout = 0;
+        }
+
         // Use vector::data to access the start of the memory zone
         // internally used by the vector.
-        int rc = poll(poll_fds.data(), poll_fds.size(), -1);
+        int rc = poll(poll_fds.data(), poll_fds.size(), timeout);
         DIE(rc < 0, "Server: poll failed.\n");
 
+        if (options.busy_poll && (rc > 0 || !ready_jobs.empty())) {
+            last_activity_us = monotonic_us();
+        }
+
+        now_ms = monotonic_us() / 1000;
+
+        // The connections dropped here are removed from poll_fds before
+        // their events are looked at.
+        expire_timers();
+
         if (poll_fds[0].revents & POLLIN) {
             // Received something from stdin.
             if (check_stdin_data()) {
@@ -144,57 +459,55 @@ void Server::run() {
 
         if (poll_fds[2].revents & POLLIN) {
             // Received connection request on tcp_socket.
-            manage_connection_request();
+            coro_on_readable(&listener);
         }
 
         if (num_pollfds < 4) {
+            reap_connections();
             continue;
         }
 
-        // Iterate the TCP client sockets.
-        auto it = poll_fds.begin() + 3;
-        while (it != poll_fds.end()) {
-            pollfd client_pollfd = *it;
-
-            // Flag to know if a pollfd has been deleted,
-            // so the iterator is not incremented.
-            bool deleted = false;
-
-            if (client_pollfd.revents & POLLIN) {
-                // Got message from client.
-                memset(msg, 0, sizeof(tcp_message));
-                rc = recv_efficient(client_pollfd.fd, msg);
-                DIE(rc < 0, "Failed to receive message from the TCP client\n");
-
-                if (rc == 0) {
-                    // Connection has been closed.
-                    pair<string, client*> entry = get_client_from_fd(client_pollfd.fd);
-                    client* exiting_client = entry.second;
-
-                    // Mark client as disconnected.
-                    exiting_client->is_connected = false;
-                    exiting_client->curr_fd = -1; // the fd is not useful anymore
+        // Serving a connection may close others (or itself), so the ready
+        // ones are taken first, then looked up by their fd.
+        ready_fds.clear();
+        for (int i = 3; i < num_pollfds; i++) {
+            if (poll_fds[i].revents) {
+                ready_fds.push_back(poll_fds[i]);
+            }
+        }
 
-                    close(client_pollfd.fd);
-                    it = poll_fds.erase(it);
-                    num_pollfds--;
-                    deleted = true;
+        for (pollfd &client_pollfd : ready_fds) {
+            auto conn_it = connections.find(client_pollfd.fd);
+            if (conn_it == connections.end()) {
+                // Closed while serving an earlier one.
+                continue;
+            }
+            coro_conn *conn = conn_it->second;
+
+            if (client_pollfd.revents & POLLOUT) {
+                // The client (or the peer) can take more of its pending
+                // messages, or the coroutine can go on writing its own.
+                auto client_it = fd_clients.find(client_pollfd.fd);
+                if (client_it != fd_clients.end()) {
+                    flush_client(client_it->second);
+                }
 
-                    cout << "Client " << entry.first << " disconnected.\n";
-                } else {
-                    // GOt subscribe/unsubscribe request.
-                    manage_subscribe_unsubscribe(client_pollfd.fd, msg);
-                    free(msg->payload);
+                auto peer_it = peers.find(client_pollfd.fd);
+                if (peer_it != peers.end()) {
+                    flush_peer(peer_it->second);
                 }
+                coro_on_writable(conn);
             }
 
-            if (!deleted) {
-                it++;
+            if (client_pollfd.revents & (POLLIN | POLLHUP | POLLERR)
+                && connections.count(client_pollfd.fd)) {
+                // The coroutine of the connection gets its messages.
+                coro_on_readable(conn);
             }
         }
-    }
 
-    free(msg);
+        reap_connections();
+    }
 }
 
 
@@ -208,28 +521,167 @@ bool Server::check_stdin_data() {
         return true;
     }
 
-    cout << "Only exit command is supported\n";
+    if (stdin_data == "mem" || stdin_data.compare(0, 4, "mem ") == 0) {
+        print_memory_report(stdin_data.length() > 4 ? stdin_data.substr(4) : "");
+        return false;
+    }
+
+    if (stdin_data == "stats") {
+        print_ingress_stats();
+        print_outbound_stats();
+        print_credit_stats();
+        print_mux_stats();
+        print_alias_stats();
+        print_match_stats();
+        return false;
+    }
+
+    if (stdin_data.compare(0, 8, "handoff ") == 0 && stdin_data.length() > 8) {
+        return hand_off(stdin_data.substr(8));
+    }
+
+    if (stdin_data == "top reset") {
+        for (space_saving *sketch : {&top_topic_msgs, &top_topic_bytes_in,
+                                     &top_topic_deliveries, &top_topic_bytes_out,
+                                     &top_source_msgs, &top_source_bytes}) {
+            hh_clear(sketch);
+        }
+        return false;
+    }
+
+    if (stdin_data == "top" || stdin_data.compare(0, 4, "top ") == 0) {
+        size_t count = 10;
+        if (stdin_data.length() > 4 && (sscanf(stdin_data.c_str() + 4, "%zu", &count) != 1
+                                        || count == 0)) {
+            cout << "Usage: top [count|reset]\n";
+            return false;
+        }
+
+        print_top(count);
+        return false;
+    }
+
+    if (stdin_data.compare(0, 8, "capture ") == 0 && stdin_data.length() > 8) {
+        string path = stdin_data.substr(8);
+        set_capture(path == "stop" ? "" : path);
+        return false;
+    }
+
+    cout << "Accepted commands: <exit> <mem [client id]> <stats> <handoff <path>>"
+         << " <capture <path>|stop> <top [count|reset]>\n";
     return false;
 }
 
 
-void Server::send_connection_response(bool response, int client_sockfd) {
-    tcp_message *msg = (tcp_message *) calloc(1, sizeof(tcp_message));
-    DIE(!msg, "calloc failed\n");
+/**
+ * Heap memory used by a string, in bytes (none if it is short enough to
+ * be stored in the string object itself).
+ */
+static size_t string_memory(const string &text) {
+    const char *data = text.data();
+    const char *object = (const char *) &text;
+
+    if (data >= object && data < object + sizeof(string)) {
+        return 0;
+    }
+    return text.capacity() + 1;
+}
+
+
+void Server::subscription_memory(client *target_client, size_t &own, double &shared) {
+    own = target_client->subscriptions.capacity() * sizeof(subscription);
+    shared = 0;
+
+    for (auto &sub : target_client->subscriptions) {
+        if (sub.filter) {
+            own += sizeof(content_filter) + string_memory(sub.filter->text)
+                   + string_memory(sub.filter->last_text);
+        }
+
+        shared += (double) pool_entry_memory(patterns, sub.pattern_id)
+                  / patterns.entries[sub.pattern_id].refs;
+    }
+}
+
+
+void Server::print_memory_report(const string &client_id) {
+    size_t total_subscriptions = 0, total_own = 0;
+    size_t num_clients = 0;
+
+    for (auto &entry : clients) {
+        if (!client_id.empty() && entry.first != client_id) {
+            continue;
+        }
+
+        size_t own;
+        double shared;
+        subscription_memory(entry.second, own, shared);
+
+        size_t count = entry.second->subscriptions.size();
+        cout << "Client " << entry.first << ": " << count << " subscriptions, "
+             << own << " bytes + " << (size_t) shared << " bytes of shared patterns";
+        if (count > 0) {
+            cout << " (" << (size_t) ((own + shared) / count) << " bytes per subscription)";
+        }
+        cout << "\n";
+
+        total_subscriptions += count;
+        total_own += own;
+        num_clients++;
+    }
+
+    if (!client_id.empty()) {
+        if (num_clients == 0) {
+            cout << "No client " << client_id << "\n";
+        }
+        return;
+    }
+
+    // The whole pool, with the freed entries and the buckets of the index.
+    size_t pool_bytes = patterns.entries.size() * sizeof(pooled_pattern)
+                        + patterns.free_ids.capacity() * sizeof(uint32_t)
+                        + patterns.index.bucket_count() * sizeof(void *);
+    for (size_t id = 0; id < patterns.entries.size(); id++) {
+        if (patterns.entries[id].refs > 0) {
+            pool_bytes += pool_entry_memory(patterns, id) - sizeof(pooled_pattern);
+        }
+    }
+
+    cout << "Pattern pool: " << patterns.index.size() << " patterns, "
+         << pool_bytes << " bytes\n";
+    if (spill.fd >= 0) {
+        cout << "Spill file: " << spill.index.size() << " sessions, "
+             << spill.end - spill.dead_bytes << " bytes (" << spill.end << " with the dead ones), "
+             << spill.expired << " expired" << (spill.next_fd >= 0 ? ", compacting" : "") << "\n";
+    }
+    cout << "Total: " << num_clients << " clients, " << total_subscriptions
+         << " subscriptions, " << total_own + pool_bytes << " bytes";
+    if (total_subscriptions > 0) {
+        cout << " (" << (total_own + pool_bytes) / total_subscriptions
+             << " bytes per subscription)";
+    }
+    cout << "\n";
+}
+
 
+shared_ptr<string> Server::encode_connection_response(bool response, const string &info) {
+    tcp_message msg;
     if (response) {
-        msg->command = CONNECT_ACCEPTED;
+        msg.command = CONNECT_ACCEPTED;
     } else {
-        msg->command = CONNECT_DENIED;
+        msg.command = CONNECT_DENIED;
     }
 
     // No payload is needed, response is deduced from the command attribute.
-    msg->len = 0;
-
-    int rc = send_efficient(client_sockfd, msg);
-    DIE(rc < 0, "Error sending connection response to client\n");
+    // Only the details for the accepted client, if any, are sent.
+    msg.len = 0;
+    msg.payload = NULL;
+    if (response && !info.empty()) {
+        msg.len = info.length() + 1;
+        msg.payload = (char *) info.c_str();
+    }
 
-    free(msg);
+    return encode_message(&msg);
 }
 
 
@@ -239,197 +691,3399 @@ void Server::add_client_pollfd(int client_sockfd) {
     client_pollfd.events = POLLIN;
     client_pollfd.revents = 0;
 
+    pollfd_positions[client_sockfd] = poll_fds.size();
     poll_fds.push_back(client_pollfd);
     num_pollfds++;
 }
 
 
-void Server::manage_connection_request() {
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
-
-    int client_sockfd = accept(tcp_sockfd, (struct sockaddr*)&client_addr, &client_len);
-    DIE(client_sockfd < 0, "Server: connection accept failed.\n");
+void Server::remove_pollfd(int fd) {
+    auto it = pollfd_positions.find(fd);
+    if (it == pollfd_positions.end() || it->second < 3) {
+        return;
+    }
 
-    // Disable Nagle algorithm.
-    int opt_flag = 1;
-    int rc = setsockopt(client_sockfd, IPPROTO_TCP, TCP_NODELAY, &opt_flag, sizeof(int));
-    DIE(rc < 0, "Server: Nagle disabling for new client failed.\n");
+    // The order of the connections does not matter, the last one moves.
+    size_t position = it->second;
+    pollfd_positions.erase(it);
 
-    tcp_message *msg = (tcp_message*) calloc(1, sizeof(tcp_message));
-    DIE(!msg, "calloc failed\n");
+    if (position != poll_fds.size() - 1) {
+        poll_fds[position] = poll_fds.back();
+        pollfd_positions[poll_fds[position].fd] = position;
+    }
+    poll_fds.pop_back();
+    num_pollfds--;
+}
 
-    rc = recv_efficient(client_sockfd, msg);
-    DIE(rc < 0, "Failed to receive client id\n");
 
-    string client_id = string(msg->payload);
+void Server::set_pollout(int fd, bool enable) {
+    set_poll_events(fd, POLLOUT, enable);
+}
 
-    free(msg->payload);
-    free(msg);
 
-    // Check if the id is already present in the id-client map.
-    unordered_map<string, client*>::iterator it = clients.find(client_id);
-    if (it == clients.end()) {
-        // It is a new client, so add it to the map.
-        client* new_client;
-        try {
-            new_client = new client();
-        } catch (bad_alloc &exception) {
-            fprintf(stderr, "Client allocation failed\n");
-            exit(-1);
-        }
+void Server::set_poll_events(int fd, short events, bool enable) {
+    auto it = pollfd_positions.find(fd);
+    if (it == pollfd_positions.end()) {
+        return;
+    }
 
-        new_client->curr_fd = client_sockfd;
-        new_client->is_connected = true;
+    pollfd &target = poll_fds[it->second];
+    short wanted = enable ? target.events | events : target.events & ~events;
+    if (wanted != target.events) {
+        target.events = wanted;
+    }
+}
 
-        clients.insert({client_id, new_client});
 
-        // Add new pollfd to the vector of poll_fds.
-        add_client_pollfd(client_sockfd);
+void Server::watch_fd(void *context, int fd, short events, bool enable) {
+    ((Server *) context)->set_poll_events(fd, events, enable);
+}
 
-        // Send confirmation.
-        send_connection_response(true, client_sockfd);
 
-        cout << "New client " << client_id << " connected from "
-            << inet_ntoa(client_addr.sin_addr) << ":"
-            << ntohs(client_addr.sin_port) << ".\n";
+void Server::flush_client(client *dest_client) {
+    if (!dest_client || !dest_client->is_connected || dest_client->mux_link) {
         return;
     }
 
-    // Client id is already registered. Check if the client is connected.
-    client* database_client = it->second;
-    if (database_client->is_connected) {
-        // Send decline message.
-        send_connection_response(false, client_sockfd);
-        close(client_sockfd);
-
-        cout << "Client " << client_id << " already connected.\n";
+    outbound_queue *out = &dest_client->out;
+    size_t queued = outbound_size(out);
+    size_t offset = out->front_offset;
+
+    int rc = flush_outbound(dest_client->curr_fd, out, FLUSH_BUDGET);
+    if (rc < 0) {
+        // The connection is broken, the disconnection will be noticed
+        // when reading from it, so just drop what was pending.
+        clear_outbound(out);
+        set_pollout(dest_client->curr_fd, false);
+        watch_write_stall(&dest_client->live, false, false);
         return;
     }
 
-    // Client is not connected, so update the client sock_fd and mark as connected.
-    database_client->is_connected = true;
-    database_client->curr_fd = client_sockfd;
-
-    // Add new pollfd to the vector of poll_fds.
-    add_client_pollfd(client_sockfd);
+    // Only wait for POLLOUT while there is something left to send.
+    set_pollout(dest_client->curr_fd, rc == 0);
+    watch_write_stall(&dest_client->live, rc == 0,
+                      outbound_size(out) != queued || out->front_offset != offset);
+}
 
-    // Send confirmation.
-    send_connection_response(true, client_sockfd);
 
-    cout << "New client " << client_id << " connected from "
-         << inet_ntoa(client_addr.sin_addr) << ":"
-         << ntohs(client_addr.sin_port) << "\n";
-}
+shared_ptr<string> Server::queue_frame(client *dest_client, shared_ptr<string> frame,
+                                       const string &conflation_key, size_t stamp_offset,
+                                       int lane, uint8_t topic_len) {
+    if (dest_client->mux_link) {
+        // A session uses the queue of its connection, tagging its frames.
+        uint16_t tag = dest_client->mux_tag;
+        shared_ptr<string> tagged = encode_mux_frame(&tag, 1, *frame);
+        size_t header_len = tagged->size() - frame->size();
 
+        return queue_frame(dest_client->mux_link, tagged,
+                           conflation_key.empty() ? "" : conflation_key + '\0' + to_string(tag),
+                           stamp_offset ? stamp_offset + header_len : 0, lane);
+    }
 
-pair<string, client*> Server::get_client_from_fd(int fd) {
-    for (auto const& entry : clients) {
-        if (entry.second->curr_fd == fd) {
-            return entry;
+    bool was_empty = outbound_size(&dest_client->out) == 0;
+
+    shared_ptr<string> replaced = enqueue_frame(&dest_client->out, frame, conflation_key,
+                                                stamp_offset, lane, topic_len);
+
+    // The memory of a client that does not keep up stays bounded. The
+    // high lane (the answers and the heartbeats) is never dropped, a client
+    // that takes nothing at all is dropped by its write stall timer.
+    outbound_queue *out = &dest_client->out;
+    int victim = LANE_LOW;
+    while (victim > LANE_HIGH
+           && (outbound_size(out) > MAX_QUEUED_MESSAGES || out->bytes > MAX_QUEUED_BYTES)) {
+        if (drop_oldest(out, victim)) {
+            dest_client->out_dropped++;
+        } else {
+            victim--;
         }
     }
 
-    // Never reached.
-    pair<string, client*> placeholder("placeholder", NULL);
-    return placeholder;
+    // If older messages are still pending, the socket is full anyway,
+    // so wait for POLLOUT instead of trying to send.
+    if (was_empty) {
+        flush_client(dest_client);
+    }
+
+    return replaced;
 }
 
 
-void Server::manage_subscribe_unsubscribe(int client_fd, tcp_message *req_msg) {
-    string topic(req_msg->payload);
-    client *req_client = get_client_from_fd(client_fd).second;
-    int rc;
+void Server::queue_command(client *dest_client, uint8_t command) {
+    tcp_message msg;
+    msg.command = command;
+    msg.len = 0;
+    msg.payload = NULL;
 
-    tcp_message *ans_msg = (tcp_message *) calloc(1, sizeof(tcp_message));
-    DIE(!ans_msg, "calloc failed\n");
-    ans_msg->len = 0; // will not send any payload.
+    // The answers and the heartbeats do not wait behind the publications.
+    queue_frame(dest_client, encode_message(&msg), "", 0, LANE_HIGH);
+}
 
-    // Check if the client is subscribed to the requested topic.
-    map<string, vector<string>>::iterator it;
-    it = req_client->subscribed_topics.find(topic);
 
-    if (req_msg->command == SUBSCRIBE_REQ) {
-        if (it != req_client->subscribed_topics.end()) {
-            // Client is already subscribed to the topic, send fail message.
-            ans_msg->command = SUBSCRIBE_FAIL;
-            rc = send_efficient(client_fd, ans_msg);
-            DIE(rc < 0, "Failed to send error msg for subscribe\n");
+void Server::queue_publication(client *dest_client, shared_ptr<string> frame,
+                               const string &conflation_key, size_t stamp_offset, int lane,
+                               uint8_t topic_len) {
+    credit_window &credit = dest_client->credit;
+    if (!credit.enabled) {
+        queue_frame(dest_client, frame, conflation_key, stamp_offset, lane, topic_len);
+        return;
+    }
 
-            free(ans_msg);
-            return;
+    outbound_queue &held = credit.held;
+    enqueue_frame(&held, frame, conflation_key, stamp_offset, lane, topic_len);
+
+    if (outbound_size(&held) > credit.held_limit) {
+        // The client can not keep up, its memory stays bounded. The
+        // least urgent publications are dropped first.
+        int victim = NUM_LANES - 1;
+        while (held.lanes[victim].empty()) {
+            victim--;
         }
 
-        // Client can subscribe to the new topic.
-        vector<string> tokens;
-        tokenize_topic(topic, tokens);
-        req_client->subscribed_topics.insert({topic, tokens});
+        drop_oldest(&held, victim);
+        credit.dropped++;
+    }
 
-        // Send success message.
-        ans_msg->command = SUBSCRIBE_SUCC;
-        rc = send_efficient(client_fd, ans_msg);
-        DIE(rc < 0, "Failed to send success msg for subscribe\n");
+    release_credit(dest_client);
+}
 
-        free(ans_msg);
-        return;
+
+void Server::release_credit(client *dest_client) {
+    credit_window &credit = dest_client->credit;
+    outbound_queue &held = credit.held;
+
+    // The credit goes to the most urgent publications first.
+    int lane;
+    while ((lane = next_lane(&held)) >= 0 && credit.messages > 0
+           && (!credit.limit_bytes || credit.bytes > 0)) {
+        pending_msg &msg = held.lanes[lane].front();
+        credit.messages--;
+        if (credit.limit_bytes) {
+            credit.bytes -= msg.frame->size();
+        }
+
+        // Its conflation goes on in the outbound queue.
+        if (!msg.conflation_key.empty()) {
+            held.conflation_slots.erase(msg.conflation_key);
+        }
+
+        shared_ptr<string> replaced = queue_frame(dest_client, msg.frame, msg.conflation_key,
+                                                  msg.stamp_offset, lane, msg.topic_len);
+        if (replaced) {
+            // It took the place of a publication that was already paid for
+            // and that the client will never get, nor give credit back for.
+            credit.messages++;
+            if (credit.limit_bytes) {
+                credit.bytes += replaced->size();
+            }
+        }
+        pop_lane(&held, lane);
     }
+}
 
-    // UNSUBSCRIBE_REQ
-    if (it == req_client->subscribed_topics.end()) {
-        // Not subscribed to the topic, cannot unsubscribe.
-        ans_msg->command = UNSUBSCRIBE_FAIL;
-        rc = send_efficient(client_fd, ans_msg);
-        DIE(rc < 0, "Failed to send error msg for unsubscribe\n");
 
-        free(ans_msg);
+void Server::manage_credit_grant(client *src_client, tcp_message *msg) {
+    credit_window &credit = src_client->credit;
+    if (!credit.enabled || msg->len != 2 * sizeof(uint32_t)) {
+        fprintf(stderr, "Unexpected credit grant from client %s\n", src_client->id.c_str());
         return;
     }
 
-    req_client->subscribed_topics.erase(it);
-    ans_msg->command = UNSUBSCRIBE_SUCC;
-    rc = send_efficient(client_fd, ans_msg);
-    DIE(rc < 0, "Failed to send success msg for unsubscribe\n");
+    uint32_t messages, bytes;
+    memcpy(&messages, msg->payload, sizeof(uint32_t));
+    memcpy(&bytes, msg->payload + sizeof(uint32_t), sizeof(uint32_t));
+    credit.messages += ntohl(messages);
+    credit.bytes += ntohl(bytes);
 
-    free(ans_msg);
+    release_credit(src_client);
 }
 
 
-void Server::manage_udp_message(int client_fd, char *buff, char *formatted_msg) {
-    struct sockaddr_in udp_client_addr;
-    socklen_t udp_len = sizeof(udp_client_addr);
+void Server::start_liveness(liveness *live, void *owner, int idle_kind, int stall_kind) {
+    live->last_recv = now_ms;
+    live->last_progress = now_ms;
+    live->ping_sent = false;
 
-    memset(buff, 0, MAX_UDP_MSG);
-    memset(formatted_msg, 0, MAX_UDP_MSG);
+    live->idle_timer.kind = idle_kind;
+    live->idle_timer.owner = owner;
+    live->stall_timer.kind = stall_kind;
+    live->stall_timer.owner = owner;
 
-    int rc = recvfrom(client_fd, buff, MAX_UDP_MSG, 0,
-                      (struct sockaddr*) &udp_client_addr, &udp_len);
-    DIE(rc < 0, "Error receiving from UDP client\n");
+    wheel_arm(&wheel, &live->idle_timer, now_ms + options.heartbeat_ms);
+}
 
-    // Get the topic from the received buff.
-    char topic[51];
-    memcpy(topic, buff, 50);
-    topic[50] = '\0';
 
-    // Data type from the received buff.
-    uint8_t data_type = buff[50];
+void Server::stop_liveness(liveness *live) {
+    wheel_cancel(&wheel, &live->idle_timer);
+    wheel_cancel(&wheel, &live->stall_timer);
+}
 
-    char *client_ip = inet_ntoa(udp_client_addr.sin_addr);
-    uint16_t client_port = htons(udp_client_addr.sin_port);
 
-    sprintf(formatted_msg, "%s:%hu - %s - ", client_ip, client_port, topic);
+void Server::watch_write_stall(liveness *live, bool pending, bool progress) {
+    if (!pending) {
+        wheel_cancel(&wheel, &live->stall_timer);
+        return;
+    }
 
-    bool valid = interpret_udp_payload((int) data_type, buff + 51,
-                                       formatted_msg + strlen(formatted_msg));
-    if (valid) {
-        send_msg_if_subscribed(topic, formatted_msg);
+    // The timer is only moved when it expires, to the last progress.
+    if (progress || !live->stall_timer.armed) {
+        live->last_progress = now_ms;
     }
+
+    if (!live->stall_timer.armed) {
+        wheel_arm(&wheel, &live->stall_timer, now_ms + WRITE_STALL_TIMEOUT_MS);
+    }
+}
+
+
+bool Server::idle_timer_expired(liveness *live, bool &send_ping) {
+    uint64_t idle_timeout = IDLE_HEARTBEATS * options.heartbeat_ms;
+    uint64_t silence = now_ms - live->last_recv;
+    send_ping = false;
+
+    if (silence < options.heartbeat_ms) {
+        // Something was received since the timer was armed.
+        wheel_arm(&wheel, &live->idle_timer, live->last_recv + options.heartbeat_ms);
+        return false;
+    }
+
+    if (!live->ping_sent) {
+        send_ping = true;
+        live->ping_sent = true;
+    }
+
+    if (silence < idle_timeout) {
+        wheel_arm(&wheel, &live->idle_timer, live->last_recv + idle_timeout);
+        return false;
+    }
+
+    return true;
+}
+
+
+bool Server::stall_timer_expired(liveness *live) {
+    if (now_ms - live->last_progress < WRITE_STALL_TIMEOUT_MS) {
+        wheel_arm(&wheel, &live->stall_timer, live->last_progress + WRITE_STALL_TIMEOUT_MS);
+        return false;
+    }
+
+    return true;
+}
+
+
+void Server::expire_timers() {
+    expired_timers.clear();
+    wheel_advance(&wheel, now_ms, expired_timers);
+
+    for (size_t i = 0; i < expired_timers.size(); i++) {
+        wheel_timer *timer = expired_timers[i];
+        if (!timer) {
+            // Its connection was dropped by an earlier timer.
+            continue;
+        }
+
+        // The timer is freed with its owner, if the owner is dropped.
+        void *owner = timer->owner;
+        bool dead = false;
+        bool send_ping = false;
+
+        if (timer->kind == TIMER_CORO) {
+            // A coroutine waited for too long (i.e. for the first message).
+            coro_on_timer((coro_conn *) timer->owner);
+            continue;
+        }
+
+        if (timer->kind == TIMER_AGG_WINDOW) {
+            close_aggregate_windows((aggregate *) timer->owner);
+            continue;
+        }
+
+        if (timer->kind == TIMER_PEER_DIAL) {
+            dial_peer((peer_dial *) timer->owner);
+            continue;
+        }
+
+        if (timer->kind == TIMER_SPILL) {
+            maintain_spill();
+            continue;
+        }
+
+        if (timer->kind == TIMER_SESSION_EXPIRY) {
+            dead = evict_session((client *) timer->owner);
+        } else if (timer->kind == TIMER_CLIENT_IDLE || timer->kind == TIMER_CLIENT_STALL) {
+            client *target_client = (client *) timer->owner;
+
+            dead = timer->kind == TIMER_CLIENT_IDLE
+                   ? idle_timer_expired(&target_client->live, send_ping)
+                   : stall_timer_expired(&target_client->live);
+
+            if (send_ping) {
+                queue_command(target_client, HEARTBEAT);
+            }
+
+            if (dead) {
+                int fd = target_client->curr_fd;
+                cout << "Client " << get_client_from_fd(fd).first << " is not responding.\n";
+
+                disconnect_client(fd);
+                remove_pollfd(fd);
+                cancel_connection(fd);
+            }
+        } else {
+            peer *target_peer = (peer *) timer->owner;
+
+            dead = timer->kind == TIMER_PEER_IDLE
+                   ? idle_timer_expired(&target_peer->live, send_ping)
+                   : stall_timer_expired(&target_peer->live);
+
+            if (send_ping) {
+                tcp_message ping;
+                ping.command = HEARTBEAT;
+                ping.len = 0;
+                ping.payload = NULL;
+
+                enqueue_frame(&target_peer->out, encode_message(&ping), "");
+                flush_peer(target_peer);
+            }
+
+            if (dead) {
+                int fd = target_peer->fd;
+                cout << "Peer " << target_peer->address << " is not responding.\n";
+
+                remove_pollfd(fd);
+                remove_peer(fd);
+                cancel_connection(fd);
+            }
+        }
+
+        if (dead) {
+            // The other timers of the connection may be in the batch too.
+            for (size_t j = i + 1; j < expired_timers.size(); j++) {
+                if (expired_timers[j] && expired_timers[j]->owner == owner) {
+                    expired_timers[j] = NULL;
+                }
+            }
+        }
+    }
+}
+
+
+void Server::disconnect_client(int client_fd) {
+    pair<string, client*> entry = get_client_from_fd(client_fd);
+    client* exiting_client = entry.second;
+
+    // The sessions it carried leave with it.
+    while (!exiting_client->mux_sessions.empty()) {
+        detach_session(exiting_client->mux_sessions.begin()->second);
+    }
+
+    // Mark client as disconnected. Messages that were not delivered
+    // yet are lost, as for any other disconnected client.
+    mark_disconnected(exiting_client);
+    clear_outbound(&exiting_client->out);
+    clear_outbound(&exiting_client->credit.held);
+    stop_liveness(&exiting_client->live);
+
+    // The peers do not need to forward its topics anymore.
+    update_client_interest(exiting_client, false);
+
+    // Its consumer index of the ring can be given to someone else.
+    if (exiting_client->shm_index >= 0) {
+        shm_consumers &= ~(1ULL << exiting_client->shm_index);
+        exiting_client->shm_index = -1;
+    }
+
+    close(client_fd);
+
+    cout << "Client " << entry.first << " disconnected.\n";
+}
+
+
+void Server::mark_connected(client *target_client, int fd) {
+    wheel_cancel(&wheel, &target_client->expiry_timer);
+
+    target_client->is_connected = true;
+    target_client->curr_fd = fd;
+
+    target_client->live_index = connected_clients.size();
+    connected_clients.push_back(target_client);
+
+    // The sessions of a multiplexed connection have no socket of their own.
+    if (fd >= 0) {
+        fd_clients[fd] = target_client;
+    }
+}
+
+
+void Server::mark_disconnected(client *target_client) {
+    fd_clients.erase(target_client->curr_fd);
+
+    // The last one takes its place.
+    client *last = connected_clients.back();
+    connected_clients[target_client->live_index] = last;
+    last->live_index = target_client->live_index;
+    connected_clients.pop_back();
+
+    target_client->is_connected = false;
+    target_client->curr_fd = -1; // the fd is not useful anymore
+    target_client->disconnected_at = now_ms;
+
+    arm_session_expiry(target_client);
+}
+
+
+void Server::arm_session_expiry(client *target_client) {
+    if (options.session_expiry_s == 0) {
+        return;
+    }
+
+    target_client->expiry_timer.kind = TIMER_SESSION_EXPIRY;
+    target_client->expiry_timer.owner = target_client;
+    wheel_arm(&wheel, &target_client->expiry_timer,
+              target_client->disconnected_at + options.session_expiry_s * 1000);
+}
+
+
+/**
+ * Appends a value to a session, as it is in memory (the spill file is
+ * only read by the server that wrote it, and the handed off state by a
+ * server on the same host).
+ */
+template <typename T>
+static void append_value(string &session, T value) {
+    session.append((char *) &value, sizeof(T));
+}
+
+
+static void append_text(string &session, const string &text) {
+    append_value<uint32_t>(session, text.length());
+    session += text;
+}
+
+
+/**
+ * Reads the fields of a session (or of the state handed off to a new
+ * server) in order, failing (and staying failed) if it is shorter than
+ * expected.
+ */
+struct session_reader {
+    const string &session;
+    size_t pos;
+    bool ok;
+
+    template <typename T>
+    T value() {
+        T result = T();
+        if (!ok || pos + sizeof(T) > session.length()) {
+            ok = false;
+            return result;
+        }
+
+        memcpy(&result, session.data() + pos, sizeof(T));
+        pos += sizeof(T);
+        return result;
+    }
+
+    string text() {
+        uint32_t len = value<uint32_t>();
+        if (!ok || pos + len > session.length()) {
+            ok = false;
+            return "";
+        }
+
+        pos += len;
+        return session.substr(pos - len, len);
+    }
+};
+
+
+string Server::encode_session(client *target_client) {
+    string session;
+
+    append_value<uint32_t>(session, target_client->subscriptions.size());
+    for (auto &sub : target_client->subscriptions) {
+        append_text(session, pool_pattern(patterns, sub.pattern_id).text);
+        append_value<uint8_t>(session, sub.conflate);
+        append_value<uint8_t>(session, sub.lane);
+        append_value<uint8_t>(session, sub.filter != NULL);
+
+        if (sub.filter) {
+            content_filter &filter = *sub.filter;
+            append_value<uint8_t>(session, filter.op);
+            append_value<double>(session, filter.low);
+            append_value<double>(session, filter.high);
+            append_text(session, filter.text);
+            append_value<uint8_t>(session, filter.is_text);
+            append_value<uint8_t>(session, filter.has_last);
+            append_value<uint8_t>(session, filter.last_type);
+            append_value<double>(session, filter.last_number);
+            append_text(session, filter.last_text);
+        }
+    }
+
+    append_value<uint32_t>(session, target_client->aggregate_specs.size());
+    for (auto &spec : target_client->aggregate_specs) {
+        append_text(session, spec);
+    }
+
+    return session;
+}
+
+
+bool Server::decode_session(client *target_client, const string &session) {
+    session_reader reader{session, 0, true};
+
+    uint32_t num_subscriptions = reader.value<uint32_t>();
+    for (uint32_t i = 0; i < num_subscriptions && reader.ok; i++) {
+        string topic = reader.text();
+
+        subscription sub;
+        sub.conflate = reader.value<uint8_t>();
+        sub.lane = min(reader.value<uint8_t>(), (uint8_t) LANE_LOW);
+        if (reader.value<uint8_t>()) {
+            sub.filter.reset(new content_filter());
+            content_filter &filter = *sub.filter;
+
+            filter.op = reader.value<uint8_t>();
+            filter.low = reader.value<double>();
+            filter.high = reader.value<double>();
+            filter.text = reader.text();
+            filter.is_text = reader.value<uint8_t>();
+            filter.has_last = reader.value<uint8_t>();
+            filter.last_type = reader.value<uint8_t>();
+            filter.last_number = reader.value<double>();
+            filter.last_text = reader.text();
+        }
+
+        // The pattern may have a new id, or may need to be compiled again.
+        sub.pattern_id = reader.ok ? pool_intern(patterns, topic) : NO_PATTERN;
+        if (sub.pattern_id == NO_PATTERN) {
+            continue;
+        }
+
+        sub.has_wildcards = pool_pattern(patterns, sub.pattern_id).has_wildcards;
+        add_subscriber(sub.pattern_id, target_client);
+        target_client->subscriptions.push_back(std::move(sub));
+    }
+
+    sort(target_client->subscriptions.begin(), target_client->subscriptions.end(),
+         [](const subscription &first, const subscription &second) {
+             return first.pattern_id < second.pattern_id;
+         });
+
+    uint32_t num_specs = reader.value<uint32_t>();
+    for (uint32_t i = 0; i < num_specs && reader.ok; i++) {
+        string spec = reader.text();
+        if (reader.ok) {
+            target_client->aggregate_specs.insert(spec);
+        }
+    }
+
+    return reader.ok;
+}
+
+
+client *Server::restore_session(const string &client_id) {
+    string session;
+    if (spill.fd < 0 || !spill_take(&spill, client_id, session)) {
+        return NULL;
+    }
+    arm_spill_timer();
+
+    client *restored;
+    try {
+        restored = new client();
+    } catch (bad_alloc &exception) {
+        fprintf(stderr, "Client allocation failed\n");
+        exit(-1);
+    }
+
+    restored->id = client_id;
+    restored->is_connected = false;
+    restored->curr_fd = -1;
+    restored->shm_index = -1;
+
+    if (!decode_session(restored, session)) {
+        fprintf(stderr, "Corrupted session of client %s in the spill file\n",
+                client_id.c_str());
+    }
+
+    // The aggregates forgot the client while it was in the file.
+    for (auto &spec : restored->aggregate_specs) {
+        join_aggregate(spec, client_id);
+    }
+
+    clients.insert({client_id, restored});
+    return restored;
+}
+
+
+bool Server::evict_session(client *target_client) {
+    // A fan-out whose targets were taken before the disconnection may
+    // still reach the client, so it must stay in memory until it is done.
+    for (fanout_job *job : ready_jobs) {
+        if (!job->targets.empty() && job->snapshot_ms <= target_client->disconnected_at) {
+            wheel_arm(&wheel, &target_client->expiry_timer, now_ms + EVICTION_RETRY_MS);
+            return false;
+        }
+    }
+
+    if (!spill_put(&spill, target_client->id, encode_session(target_client), now_ms)) {
+        // Keep it in memory, it is only an optimization.
+        perror("Server: writing to the spill file failed");
+        return false;
+    }
+    if (!spill_timer.armed) {
+        arm_spill_timer();
+    }
+
+    for (auto &sub : target_client->subscriptions) {
+        remove_subscriber(sub.pattern_id, target_client);
+        pool_release(patterns, sub.pattern_id);
+    }
+
+    // It joins its aggregates again when it is loaded back.
+    for (auto &spec : target_client->aggregate_specs) {
+        leave_aggregate(spec, target_client->id);
+    }
+
+    clients.erase(target_client->id);
+    delete target_client;
+
+    return true;
+}
+
+
+/**
+ * Frames of the outbound queues in the handed off state. A frame shared
+ * by many queues (i.e. a publication) is only sent once.
+ */
+struct frame_table {
+    unordered_map<const string*, uint32_t> ids;
+    string encoded;
+    uint32_t count = 0;
+};
+
+
+static uint32_t add_unshared_frame(frame_table &table, const string &frame) {
+    append_text(table.encoded, frame);
+    return table.count++;
+}
+
+
+static uint32_t add_frame(frame_table &table, const shared_ptr<string> &frame) {
+    auto it = table.ids.find(frame.get());
+    if (it != table.ids.end()) {
+        return it->second;
+    }
+
+    uint32_t id = add_unshared_frame(table, *frame);
+    table.ids[frame.get()] = id;
+    return id;
+}
+
+
+/**
+ * Appends the messages of an outbound queue, lane by lane. What is left
+ * of a frame that was partially sent becomes a frame of its own, at the
+ * front of the most urgent lane, so the new server sends it first and
+ * continues the byte stream exactly where this one stopped.
+ */
+static void encode_queue(string &state, outbound_queue &out, frame_table &table) {
+    for (int lane = 0; lane < NUM_LANES; lane++) {
+        uint32_t size = out.lanes[lane].size();
+        if (out.front_offset > 0) {
+            // The rest of the partial frame moves to the most urgent lane.
+            size += (lane == LANE_HIGH) - (lane == out.sending_lane);
+        }
+        append_value<uint32_t>(state, size);
+    }
+
+    if (out.front_offset > 0) {
+        // It may be sent with an alias, then it was built for this client.
+        pending_msg &msg = out.lanes[out.sending_lane].front();
+        bool aliased = out.aliases && out.aliases->active;
+        const string &frame = aliased ? out.aliases->frame : *msg.frame;
+        size_t head_len = msg.stamp_offset ? msg.stamp_offset + sizeof(uint64_t) : 0;
+
+        // The send time was stamped in the copy of the start.
+        string rest = out.front_offset < head_len
+                      ? out.stamped_head.substr(out.front_offset) + frame.substr(head_len)
+                      : frame.substr(out.front_offset);
+
+        append_value<uint32_t>(state, add_unshared_frame(table, rest));
+        append_text(state, "");
+        append_value<uint64_t>(state, 0);
+        append_value<uint8_t>(state, 0);
+    }
+
+    for (int lane = 0; lane < NUM_LANES; lane++) {
+        bool partial = lane == out.sending_lane && out.front_offset > 0;
+
+        for (size_t i = partial ? 1 : 0; i < out.lanes[lane].size(); i++) {
+            pending_msg &msg = out.lanes[lane][i];
+
+            // Only the messages still in a conflation slot may be replaced.
+            auto slot = out.conflation_slots.find(msg.conflation_key);
+            bool conflated = slot != out.conflation_slots.end() && slot->second == &msg;
+
+            append_value<uint32_t>(state, add_frame(table, msg.frame));
+            append_text(state, conflated ? msg.conflation_key : "");
+            append_value<uint64_t>(state, msg.stamp_offset);
+            append_value<uint8_t>(state, msg.topic_len);
+        }
+    }
+}
+
+
+static bool decode_queue(session_reader &reader, outbound_queue &out,
+                         vector<shared_ptr<string>> &frames) {
+    uint32_t lane_sizes[NUM_LANES];
+    for (int lane = 0; lane < NUM_LANES; lane++) {
+        lane_sizes[lane] = reader.value<uint32_t>();
+    }
+
+    for (int lane = 0; lane < NUM_LANES; lane++) {
+        for (uint32_t i = 0; i < lane_sizes[lane] && reader.ok; i++) {
+            uint32_t id = reader.value<uint32_t>();
+            string conflation_key = reader.text();
+            uint64_t stamp_offset = reader.value<uint64_t>();
+            uint8_t topic_len = reader.value<uint8_t>();
+
+            if (!reader.ok || id >= frames.size()) {
+                return false;
+            }
+
+            enqueue_frame(&out, frames[id], conflation_key, stamp_offset, lane, topic_len);
+        }
+    }
+
+    return reader.ok;
+}
+
+
+bool Server::hand_off(const string &path) {
+    int sockfd = handoff_connect(path);
+    if (sockfd < 0) {
+        perror("Server: connecting to the new server failed");
+        return false;
+    }
+
+    // The jobs point to the clients, so their publications are queued
+    // first, then handed off with the rest of the outbound queues.
+    while (!ready_jobs.empty() || !unmatched_jobs.empty() || !matching_jobs.empty()) {
+        run_fanout_scheduler();
+    }
+
+    // Only one file of the spill is handed off, so a compaction is finished.
+    int rc;
+    while (spill.next_fd >= 0 && (rc = spill_compact_step(&spill, SIZE_MAX)) > 0) {
+    }
+    if (spill.next_fd >= 0) {
+        perror("Server: compacting the spill file failed");
+        close(sockfd);
+        return false;
+    }
+
+    vector<int> fds;
+    string state = encode_state(fds);
+
+    // The new server does not write anything before acknowledging, so
+    // if it fails, this one can go on as if nothing happened.
+    bool done = handoff_send(sockfd, state, fds) && handoff_recv_ack(sockfd);
+    close(sockfd);
+
+    if (!done) {
+        fprintf(stderr, "Server: the handoff failed, still serving.\n");
+        return false;
+    }
+
+    // The sockets stay open in the new server when this one closes them.
+    handed_off = true;
+    cout << "Handed off " << clients.size() << " clients to the new server.\n";
+
+    return true;
+}
+
+
+string Server::encode_state(vector<int> &fds) {
+    frame_table table;
+    string body;
+
+    // The fds are referred to by their index in the array sent after the state.
+    auto add_fd = [&](int fd) {
+        append_value<uint32_t>(body, fds.size());
+        fds.push_back(fd);
+    };
+
+    add_fd(udp_sockfd);
+    add_fd(tcp_sockfd);
+
+    append_value<uint8_t>(body, ring.fd >= 0);
+    if (ring.fd >= 0) {
+        append_text(body, ring.name);
+        add_fd(ring.fd);
+        append_value<uint64_t>(body, shm_consumers);
+    }
+
+    append_value<uint8_t>(body, spill.fd >= 0);
+    if (spill.fd >= 0) {
+        append_text(body, spill.path);
+        add_fd(spill.fd);
+        append_value<uint64_t>(body, spill.end);
+        append_value<uint64_t>(body, spill.dead_bytes);
+
+        append_value<uint64_t>(body, spill.expired);
+
+        append_value<uint32_t>(body, spill.index.size());
+        for (auto &entry : spill.index) {
+            append_text(body, entry.first);
+            append_value<uint64_t>(body, entry.second.offset);
+            append_value<uint32_t>(body, entry.second.len);
+            append_value<uint64_t>(body, entry.second.spilled_ms);
+        }
+    }
+
+    append_value<uint32_t>(body, clients.size());
+    for (auto &entry : clients) {
+        client *target_client = entry.second;
+
+        append_text(body, target_client->id);
+        append_text(body, encode_session(target_client));
+
+        // A session of a multiplexed connection is connected through it.
+        client *link = target_client->mux_link;
+        append_value<uint8_t>(body, target_client->is_connected && !link);
+        if (target_client->is_connected && !link) {
+            add_fd(target_client->curr_fd);
+            append_text(body, coro_pending_input(connections[target_client->curr_fd]));
+        } else {
+            append_value<uint64_t>(body, target_client->disconnected_at);
+        }
+
+        append_value<uint8_t>(body, target_client->udp_mode);
+        append_value(body, target_client->udp_addr);
+        append_value<uint32_t>(body, target_client->udp_seqs.size());
+        for (auto &seq : target_client->udp_seqs) {
+            append_text(body, seq.first);
+            append_value<uint32_t>(body, seq.second);
+        }
+
+        append_value<int32_t>(body, target_client->shm_index);
+        append_value(body, target_client->tcp_addr);
+        append_value<uint8_t>(body, target_client->timestamps);
+
+        append_value<uint8_t>(body, target_client->multiplexed);
+        append_value<uint8_t>(body, link != NULL);
+        if (link) {
+            append_text(body, link->id);
+            append_value<uint16_t>(body, target_client->mux_tag);
+        }
+
+        // The aliases the client knows, the least recently used first.
+        alias_table &aliases = target_client->aliases;
+        append_value<uint16_t>(body, aliases.capacity);
+        append_value<uint32_t>(body, aliases.lru.size());
+        for (auto it = aliases.lru.rbegin(); it != aliases.lru.rend(); it++) {
+            append_value<uint16_t>(body, it->alias);
+            append_text(body, it->topic);
+        }
+        append_value<uint64_t>(body, aliases.defined);
+        append_value<uint64_t>(body, aliases.reused);
+        append_value<int64_t>(body, aliases.saved_bytes);
+
+        credit_window &credit = target_client->credit;
+        append_value<uint8_t>(body, credit.enabled);
+        append_value<int64_t>(body, credit.messages);
+        append_value<int64_t>(body, credit.bytes);
+        append_value<uint8_t>(body, credit.limit_bytes);
+        append_value<uint64_t>(body, credit.held_limit);
+        append_value<uint64_t>(body, credit.dropped);
+        encode_queue(body, credit.held, table);
+
+        encode_queue(body, target_client->out, table);
+        append_value<uint64_t>(body, target_client->out_dropped);
+    }
+
+    // The connections that did not identify yet, with what they sent so far.
+    vector<coro_conn*> unidentified;
+    for (auto &entry : connections) {
+        // The links this server opened and that are not made yet are left
+        // to close, the new server opens them again.
+        if (!fd_clients.count(entry.first) && !peers.count(entry.first)
+            && !pending_links.count(entry.first) && entry.second->wants_input) {
+            unidentified.push_back(entry.second);
+        }
+    }
+
+    append_value<uint32_t>(body, unidentified.size());
+    for (coro_conn *conn : unidentified) {
+        add_fd(conn->fd);
+        append_value(body, conn->addr);
+        append_text(body, coro_pending_input(conn));
+    }
+
+    append_value<uint32_t>(body, peers.size());
+    for (auto &entry : peers) {
+        peer *target_peer = entry.second;
+
+        add_fd(target_peer->fd);
+        append_value<uint32_t>(body, target_peer->node_id);
+        append_text(body, target_peer->address);
+        append_value<uint8_t>(body, target_peer->dialed);
+        append_text(body, coro_pending_input(connections[target_peer->fd]));
+
+        append_value<uint32_t>(body, target_peer->interest.size());
+        for (auto &interest : target_peer->interest) {
+            append_text(body, interest.first);
+        }
+
+        encode_queue(body, target_peer->out, table);
+    }
+
+    append_value<uint32_t>(body, aggregates.size());
+    for (auto &entry : aggregates) {
+        aggregate *agg = entry.second;
+
+        append_text(body, agg->spec);
+        append_text(body, agg->topic);
+        append_value<uint8_t>(body, agg->function);
+        append_value<uint64_t>(body, agg->window_us);
+        append_value<uint64_t>(body, agg->window_end);
+
+        append_value<uint32_t>(body, agg->windows.size());
+        for (auto &window : agg->windows) {
+            append_text(body, window.first);
+            append_value<uint64_t>(body, window.second.count);
+            append_value<double>(body, window.second.sum);
+            append_value<double>(body, window.second.min);
+            append_value<double>(body, window.second.max);
+        }
+
+        append_value<uint32_t>(body, agg->subscriber_ids.size());
+        for (auto &id : agg->subscriber_ids) {
+            append_text(body, id);
+        }
+    }
+
+    append_value<uint32_t>(body, local_interest.size());
+    for (auto &entry : local_interest) {
+        append_text(body, entry.first);
+        append_value<int32_t>(body, entry.second);
+    }
+
+    append_value<uint32_t>(body, last_peer_seq.size());
+    for (auto &entry : last_peer_seq) {
+        append_value<uint32_t>(body, entry.first);
+        append_value<uint64_t>(body, entry.second);
+    }
+
+    // The frames come before the queues that refer to them.
+    string state;
+    append_value<uint32_t>(state, HANDOFF_MAGIC);
+    append_value<uint32_t>(state, HANDOFF_VERSION);
+    append_value<uint32_t>(state, node_id);
+    append_value<uint64_t>(state, publish_seq);
+    append_value<uint32_t>(state, table.count);
+    state += table.encoded;
+    state += body;
+
+    return state;
+}
+
+
+void Server::take_over() {
+    const string &path = options.takeover_path;
+
+    int listen_fd = handoff_listen(path);
+    DIE(listen_fd < 0, "Server: handoff socket creation failed.\n");
+
+    cout << "Waiting for the running server on " << path << ".\n";
+
+    int sockfd = accept(listen_fd, NULL, NULL);
+    DIE(sockfd < 0, "Server: handoff connection accept failed.\n");
+
+    close(listen_fd);
+    unlink(path.c_str());
+
+    string state;
+    vector<int> fds;
+    bool received = handoff_recv(sockfd, state, fds);
+    DIE(!received, "Server: receiving the state of the running server failed.\n");
+
+    // The timers start from now, not from when the server started waiting.
+    now_ms = monotonic_us() / 1000;
+
+    bool restored = restore_state(state, fds);
+    DIE(!restored, "Server: the state of the running server is not valid.\n");
+
+    prepare_spill();
+    arm_spill_timer();
+
+    // From here on, the running server stops using the sockets and exits.
+    bool acked = handoff_send_ack(sockfd);
+    DIE(!acked, "Server: acknowledging the handoff failed.\n");
+    close(sockfd);
+
+    // The connections are served from where the previous server left them.
+    start_acceptor();
+    vector<pair<int, coro_conn*>> restored_conns(connections.begin(), connections.end());
+    for (auto &entry : restored_conns) {
+        auto client_it = fd_clients.find(entry.first);
+        client *src_client = client_it != fd_clients.end() ? client_it->second : NULL;
+        auto peer_it = peers.find(entry.first);
+        peer *src_peer = peer_it != peers.end() ? peer_it->second : NULL;
+        coro_spawn(entry.second, serve_connection(entry.second, src_client, src_peer));
+    }
+
+    // Send what was queued and not written yet by the previous server.
+    for (client *target_client : connected_clients) {
+        flush_client(target_client);
+    }
+    for (auto &entry : peers) {
+        flush_peer(entry.second);
+    }
+
+    cout << "Took over " << clients.size() << " clients and " << peers.size()
+         << " peers.\n";
+}
+
+
+bool Server::restore_state(const string &state, vector<int> &fds) {
+    session_reader reader{state, 0, true};
+
+    if (reader.value<uint32_t>() != HANDOFF_MAGIC
+        || reader.value<uint32_t>() != HANDOFF_VERSION) {
+        return false;
+    }
+
+    // Same id, so the peers keep recognizing the sequence numbers.
+    node_id = reader.value<uint32_t>();
+    publish_seq = reader.value<uint64_t>();
+
+    vector<shared_ptr<string>> frames;
+    uint32_t num_frames = reader.value<uint32_t>();
+    for (uint32_t i = 0; i < num_frames && reader.ok; i++) {
+        frames.push_back(make_shared<string>(reader.text()));
+    }
+
+    auto take_fd = [&]() {
+        uint32_t index = reader.value<uint32_t>();
+        if (index >= fds.size()) {
+            reader.ok = false;
+            return -1;
+        }
+        return fds[index];
+    };
+
+    udp_sockfd = take_fd();
+    tcp_sockfd = take_fd();
+    if (!reader.ok) {
+        return false;
+    }
+
+    add_listen_pollfds();
+
+    // The drop counter of the UDP socket goes on from where it was.
+    uint32_t meminfo[SK_MEMINFO_VARS];
+    socklen_t meminfo_len = sizeof(meminfo);
+    if (getsockopt(udp_sockfd, SOL_SOCKET, SO_MEMINFO, meminfo, &meminfo_len) == 0) {
+        kernel_drops = meminfo[SK_MEMINFO_DROPS];
+    }
+
+    if (reader.value<uint8_t>()) {
+        string name = reader.text();
+        int ring_fd = take_fd();
+        shm_consumers = reader.value<uint64_t>();
+
+        if (!reader.ok || !shm_ring_adopt(&ring, ring_fd, name)) {
+            return false;
+        }
+    }
+
+    if (reader.value<uint8_t>()) {
+        spill.path = reader.text();
+        spill.fd = take_fd();
+        spill.end = reader.value<uint64_t>();
+        spill.dead_bytes = reader.value<uint64_t>();
+
+        spill.expired = reader.value<uint64_t>();
+
+        uint32_t num_records = reader.value<uint32_t>();
+        for (uint32_t i = 0; i < num_records && reader.ok; i++) {
+            string id = reader.text();
+            uint64_t offset = reader.value<uint64_t>();
+            uint32_t len = reader.value<uint32_t>();
+            uint64_t spilled_ms = reader.value<uint64_t>();
+
+            spill.index[id] = {offset, len, spilled_ms, spill.gen};
+            spill.order.push_back({id, spilled_ms});
+        }
+
+        // The records expire in the order they were written.
+        sort(spill.order.begin(), spill.order.end(),
+             [](const pair<string, uint64_t> &first, const pair<string, uint64_t> &second) {
+                 return first.second < second.second;
+             });
+    }
+
+    // Sessions of multiplexed connections, with their connection and tag.
+    vector<pair<client*, pair<string, uint16_t>>> sessions;
+
+    uint32_t num_clients = reader.value<uint32_t>();
+    for (uint32_t i = 0; i < num_clients && reader.ok; i++) {
+        client *new_client;
+        try {
+            new_client = new client();
+        } catch (bad_alloc &exception) {
+            fprintf(stderr, "Client allocation failed\n");
+            exit(-1);
+        }
+
+        new_client->id = reader.text();
+        clients.insert({new_client->id, new_client});
+
+        if (!decode_session(new_client, reader.text())) {
+            return false;
+        }
+
+        bool connected = reader.value<uint8_t>();
+        int fd = -1;
+        string pending_input;
+        if (connected) {
+            fd = take_fd();
+            pending_input = reader.text();
+        } else {
+            new_client->disconnected_at = reader.value<uint64_t>();
+        }
+
+        new_client->udp_mode = reader.value<uint8_t>();
+        new_client->udp_addr = reader.value<struct sockaddr_in>();
+        uint32_t num_seqs = reader.value<uint32_t>();
+        for (uint32_t j = 0; j < num_seqs && reader.ok; j++) {
+            string topic = reader.text();
+            new_client->udp_seqs[topic] = reader.value<uint32_t>();
+        }
+
+        new_client->shm_index = reader.value<int32_t>();
+        new_client->tcp_addr = reader.value<struct sockaddr_in>();
+        new_client->timestamps = reader.value<uint8_t>();
+
+        new_client->multiplexed = reader.value<uint8_t>();
+        bool through_link = reader.value<uint8_t>();
+        if (through_link) {
+            string link_id = reader.text();
+            sessions.push_back({new_client, {link_id, reader.value<uint16_t>()}});
+        }
+
+        alias_table &aliases = new_client->aliases;
+        alias_reset(&aliases, reader.value<uint16_t>());
+        uint32_t num_aliases = reader.value<uint32_t>();
+        for (uint32_t j = 0; j < num_aliases && reader.ok; j++) {
+            uint16_t alias = reader.value<uint16_t>();
+            aliases.lru.push_front({reader.text(), alias});
+            aliases.by_topic[aliases.lru.front().topic] = aliases.lru.begin();
+        }
+        aliases.defined = reader.value<uint64_t>();
+        aliases.reused = reader.value<uint64_t>();
+        aliases.saved_bytes = reader.value<int64_t>();
+        new_client->out.aliases = aliases.capacity > 0 ? &aliases : NULL;
+
+        credit_window &credit = new_client->credit;
+        credit.enabled = reader.value<uint8_t>();
+        credit.messages = reader.value<int64_t>();
+        credit.bytes = reader.value<int64_t>();
+        credit.limit_bytes = reader.value<uint8_t>();
+        credit.held_limit = reader.value<uint64_t>();
+        credit.dropped = reader.value<uint64_t>();
+        if (!decode_queue(reader, credit.held, frames)) {
+            return false;
+        }
+
+        if (!decode_queue(reader, new_client->out, frames)) {
+            return false;
+        }
+        new_client->out_dropped = reader.value<uint64_t>();
+
+        if (connected) {
+            mark_connected(new_client, fd);
+            add_connection(fd, new_client->tcp_addr, pending_input);
+            start_liveness(&new_client->live, new_client, TIMER_CLIENT_IDLE,
+                           TIMER_CLIENT_STALL);
+        } else {
+            new_client->is_connected = false;
+            new_client->curr_fd = -1;
+            if (!through_link) {
+                arm_session_expiry(new_client);
+            }
+        }
+    }
+
+    // The sessions are attached once their connections are restored.
+    for (auto &entry : sessions) {
+        client *session = entry.first;
+        auto link_it = clients.find(entry.second.first);
+        if (link_it == clients.end() || !link_it->second->is_connected) {
+            return false;
+        }
+
+        client *link = link_it->second;
+        session->mux_link = link;
+        session->mux_tag = entry.second.second;
+        link->mux_sessions[session->mux_tag] = session;
+        mark_connected(session, -1);
+    }
+
+    // Their coroutines start once the old server let go (see take_over()).
+    uint32_t num_unidentified = reader.value<uint32_t>();
+    for (uint32_t i = 0; i < num_unidentified && reader.ok; i++) {
+        int fd = take_fd();
+        struct sockaddr_in addr = reader.value<struct sockaddr_in>();
+        string pending_input = reader.text();
+
+        if (reader.ok) {
+            add_connection(fd, addr, pending_input);
+        }
+    }
+
+    uint32_t num_peers = reader.value<uint32_t>();
+    for (uint32_t i = 0; i < num_peers && reader.ok; i++) {
+        peer *new_peer;
+        try {
+            new_peer = new peer();
+        } catch (bad_alloc &exception) {
+            fprintf(stderr, "Peer allocation failed\n");
+            exit(-1);
+        }
+
+        new_peer->fd = take_fd();
+        new_peer->node_id = reader.value<uint32_t>();
+        new_peer->address = reader.text();
+        new_peer->dialed = reader.value<uint8_t>();
+        string pending_input = reader.text();
+        peers.insert({new_peer->fd, new_peer});
+
+        uint32_t num_topics = reader.value<uint32_t>();
+        for (uint32_t j = 0; j < num_topics && reader.ok; j++) {
+            string topic = reader.text();
+            compiled_pattern pattern;
+            if (compile_pattern(topic, pattern)) {
+                new_peer->interest[topic] = std::move(pattern);
+            }
+        }
+
+        if (!decode_queue(reader, new_peer->out, frames)) {
+            return false;
+        }
+
+        // The address of the connection only names the unidentified ones.
+        struct sockaddr_in peer_addr;
+        memset(&peer_addr, 0, sizeof(struct sockaddr_in));
+        add_connection(new_peer->fd, peer_addr, pending_input);
+        start_liveness(&new_peer->live, new_peer, TIMER_PEER_IDLE, TIMER_PEER_STALL);
+    }
+
+    uint32_t num_aggregates = reader.value<uint32_t>();
+    for (uint32_t i = 0; i < num_aggregates && reader.ok; i++) {
+        aggregate *agg;
+        try {
+            agg = new aggregate();
+        } catch (bad_alloc &exception) {
+            fprintf(stderr, "Aggregate allocation failed\n");
+            exit(-1);
+        }
+
+        agg->spec = reader.text();
+        agg->topic = reader.text();
+        agg->function = reader.value<uint8_t>();
+        agg->window_us = reader.value<uint64_t>();
+        agg->window_end = reader.value<uint64_t>();
+
+        uint32_t num_windows = reader.value<uint32_t>();
+        for (uint32_t j = 0; j < num_windows && reader.ok; j++) {
+            aggregate_window &window = agg->windows[reader.text()];
+            window.count = reader.value<uint64_t>();
+            window.sum = reader.value<double>();
+            window.min = reader.value<double>();
+            window.max = reader.value<double>();
+        }
+        aggregates.insert({agg->spec, agg});
+
+        uint32_t num_ids = reader.value<uint32_t>();
+        for (uint32_t j = 0; j < num_ids && reader.ok; j++) {
+            agg->subscriber_ids.insert(reader.text());
+        }
+
+        if (agg->function >= NUM_AGG_FUNCTIONS || !compile_pattern(agg->topic, agg->pattern)) {
+            return false;
+        }
+        index_aggregate(agg);
+    }
+
+    uint32_t num_topics = reader.value<uint32_t>();
+    for (uint32_t i = 0; i < num_topics && reader.ok; i++) {
+        string topic = reader.text();
+        local_interest[topic] = reader.value<int32_t>();
+    }
+
+    uint32_t num_seqs = reader.value<uint32_t>();
+    for (uint32_t i = 0; i < num_seqs && reader.ok; i++) {
+        uint32_t peer_id = reader.value<uint32_t>();
+        last_peer_seq[peer_id] = reader.value<uint64_t>();
+    }
+
+    return reader.ok && reader.pos == state.length();
+}
+
+
+void Server::start_acceptor() {
+    int rc = fcntl(tcp_sockfd, F_SETFL, fcntl(tcp_sockfd, F_GETFL) | O_NONBLOCK);
+    DIE(rc < 0, "Server: fcntl() for the listen socket failed.\n");
+
+    struct sockaddr_in listen_addr = fill_sockaddr();
+    coro_init(&listener, &loop, tcp_sockfd, listen_addr);
+    listener.listening = true;
+
+    coro_spawn(&listener, accept_connections(&listener));
+}
+
+
+conn_task Server::accept_connections(coro_conn *listen_conn) {
+    while (true) {
+        struct sockaddr_in client_addr;
+        int client_sockfd = co_await coro_accept(listen_conn, &client_addr);
+
+        if (client_sockfd < 0) {
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                // The connection stays in the backlog until an fd is freed.
+                perror("Server: connection accept failed");
+                co_await coro_sleep_until(listen_conn, now_ms + ACCEPT_RETRY_MS);
+            }
+            continue;
+        }
+
+        // Disable Nagle algorithm.
+        int opt_flag = 1;
+        int rc = setsockopt(client_sockfd, IPPROTO_TCP, TCP_NODELAY, &opt_flag, sizeof(int));
+        DIE(rc < 0, "Server: Nagle disabling for new client failed.\n");
+
+        enable_busy_poll(client_sockfd);
+
+        coro_conn *conn = add_connection(client_sockfd, client_addr);
+        coro_spawn(conn, serve_connection(conn, NULL));
+    }
+}
+
+
+coro_conn *Server::add_connection(int fd, const struct sockaddr_in &addr,
+                                  const string &pending_input) {
+    coro_conn *conn;
+    try {
+        conn = new coro_conn();
+    } catch (bad_alloc &exception) {
+        fprintf(stderr, "Connection allocation failed\n");
+        exit(-1);
+    }
+
+    coro_init(conn, &loop, fd, addr, pending_input);
+    connections.insert({fd, conn});
+    add_client_pollfd(fd);
+
+    return conn;
+}
+
+
+conn_task Server::serve_connection(coro_conn *conn, client *src_client, peer *src_peer) {
+    tcp_message msg;
+    memset(&msg, 0, sizeof(tcp_message));
+
+    if (!src_client && !src_peer) {
+        auto link = pending_links.find(conn->fd);
+        peer_dial *dial = link != pending_links.end() ? link->second : NULL;
+
+        if (dial) {
+            // A link this server opened: the hello is sent once the
+            // connection is made, without waiting for it.
+            outbound_queue hello;
+            bool sent = co_await coro_write_frame(conn, &hello, encode_peer_hello(false));
+            if (!sent) {
+                fprintf(stderr, "Peer %s is not reachable\n", dial->address.c_str());
+                retry_link(conn, dial);
+                co_return;
+            }
+        }
+
+        // Nothing is read before the first message arrives, so a client that
+        // connects and stays silent can not block the server.
+        int rc = co_await coro_read_frame(conn, &msg, now_ms + HANDSHAKE_TIMEOUT_MS);
+
+        if (dial && (rc <= 0 || msg.command != PEER_HELLO)) {
+            // The server this one linked itself to did not answer.
+            fprintf(stderr, "Peer %s refused the link\n", dial->address.c_str());
+            if (rc > 0) {
+                free(msg.payload);
+            }
+            retry_link(conn, dial);
+            co_return;
+        }
+
+        if (rc <= 0) {
+            if (conn->timed_out) {
+                cout << "Connection from " << inet_ntoa(conn->addr.sin_addr) << ":"
+                     << ntohs(conn->addr.sin_port) << " timed out before identifying.\n";
+            }
+
+            // Closed (or reset) before identifying.
+            close_connection(conn);
+            co_return;
+        }
+
+        if (msg.command == PEER_HELLO) {
+            // Another server of the cluster, linking itself to this one or
+            // answering, is served by this coroutine too.
+            bool opened_here = dial != NULL;
+            src_peer = accept_peer(conn, &msg);
+            free(msg.payload);
+
+            if (!src_peer) {
+                if (!opened_here) {
+                    // Tell the other server the two are already linked, so
+                    // it stops dialing.
+                    outbound_queue linked;
+                    co_await coro_write_frame(conn, &linked, encode_peer_hello(true));
+                }
+                close_connection(conn);
+                co_return;
+            }
+        } else {
+            src_client = identify_client(conn, &msg);
+            free(msg.payload);
+        }
+
+        if (!src_client && !src_peer) {
+            // The decline is written before closing, without blocking.
+            outbound_queue decline;
+            co_await coro_write_frame(conn, &decline, encode_connection_response(false));
+            close_connection(conn);
+            co_return;
+        }
+    }
+
+    while (true) {
+        memset(&msg, 0, sizeof(tcp_message));
+        int rc = co_await coro_read_frame(conn, &msg);
+
+        if (rc <= 0) {
+            // Connection has been closed (or reset by the other end).
+            int fd = conn->fd;
+            if (src_peer) {
+                remove_pollfd(fd);
+                remove_peer(fd);
+            } else {
+                disconnect_client(fd);
+                remove_pollfd(fd);
+            }
+            connections.erase(fd);
+            co_return;
+        }
+
+        if (src_peer) {
+            manage_peer_message(src_peer, &msg);
+        } else {
+            manage_client_message(src_client, &msg);
+        }
+        free(msg.payload);
+    }
+}
+
+
+void Server::manage_client_message(client *src_client, tcp_message *msg) {
+    // Whatever it sent, the client is alive.
+    src_client->live.last_recv = now_ms;
+    src_client->live.ping_sent = false;
+
+    if (msg->command == HEARTBEAT || msg->command == HEARTBEAT_ACK) {
+        // Heartbeats are only answered, the server sends its own.
+        if (msg->command == HEARTBEAT) {
+            queue_command(src_client, HEARTBEAT_ACK);
+        }
+    } else if (msg->command == SUBSCRIBE_AGG_REQ || msg->command == UNSUBSCRIBE_AGG_REQ) {
+        manage_aggregate_request(src_client, msg);
+    } else if (msg->command == CREDIT_GRANT) {
+        // The client can take more publications.
+        manage_credit_grant(src_client, msg);
+    } else if (msg->command == PUBLISH) {
+        // Got a batch of publications.
+        manage_publish_batch(src_client, msg);
+    } else if (src_client->multiplexed && msg->command == MUX_ATTACH) {
+        attach_session(src_client, msg);
+    } else if (src_client->multiplexed && msg->command == MUX_DETACH) {
+        uint16_t tag;
+        auto it = src_client->mux_sessions.end();
+        if (msg->len == sizeof(uint16_t)) {
+            memcpy(&tag, msg->payload, sizeof(uint16_t));
+            it = src_client->mux_sessions.find(ntohs(tag));
+        }
+
+        if (it != src_client->mux_sessions.end()) {
+            detach_session(it->second);
+        }
+    } else if (src_client->multiplexed && msg->command == MUX_FRAME) {
+        manage_session_message(src_client, msg);
+    } else {
+        // GOt subscribe/unsubscribe request.
+        manage_subscribe_unsubscribe(src_client, msg);
+    }
+}
+
+
+void Server::attach_session(client *link, tcp_message *msg) {
+    if (msg->len <= sizeof(uint16_t)) {
+        fprintf(stderr, "Invalid session from client %s\n", link->id.c_str());
+        return;
+    }
+
+    uint16_t tag;
+    memcpy(&tag, msg->payload, sizeof(uint16_t));
+    tag = ntohs(tag);
+
+    const char *id = msg->payload + sizeof(uint16_t);
+    string client_id(id, strnlen(id, msg->len - sizeof(uint16_t)));
+
+    unordered_map<string, client*>::iterator it = clients.find(client_id);
+    if (it == clients.end() && restore_session(client_id)) {
+        it = clients.find(client_id);
+    }
+
+    if (link->mux_sessions.count(tag) || client_id == link->id
+        || (it != clients.end() && it->second->is_connected)) {
+        // The tag is taken, or the client is already connected.
+        shared_ptr<string> response = encode_connection_response(false);
+        queue_frame(link, encode_mux_frame(&tag, 1, *response), "", 0, LANE_HIGH);
+
+        cout << "Client " << client_id << " already connected.\n";
+        return;
+    }
+
+    client *session;
+    if (it == clients.end()) {
+        try {
+            session = new client();
+        } catch (bad_alloc &exception) {
+            fprintf(stderr, "Client allocation failed\n");
+            exit(-1);
+        }
+
+        session->id = client_id;
+        clients.insert({client_id, session});
+    } else {
+        session = it->second;
+    }
+
+    // Only the connection has options (i.e. credit), the session has none.
+    reset_connect_options(session, link->tcp_addr);
+    session->mux_link = link;
+    session->mux_tag = tag;
+    link->mux_sessions[tag] = session;
+
+    mark_connected(session, -1);
+    update_client_interest(session, true);
+
+    queue_frame(session, encode_connection_response(true), "", 0, LANE_HIGH);
+
+    cout << "New client " << client_id << " connected through " << link->id << ".\n";
+}
+
+
+void Server::detach_session(client *session) {
+    session->mux_link->mux_sessions.erase(session->mux_tag);
+    session->mux_link = NULL;
+
+    mark_disconnected(session);
+    update_client_interest(session, false);
+
+    cout << "Client " << session->id << " disconnected.\n";
+}
+
+
+void Server::manage_session_message(client *link, tcp_message *msg) {
+    vector<uint16_t> tags;
+    tcp_message session_msg;
+
+    if (!decode_mux_frame(msg->payload, msg->len, tags, &session_msg)) {
+        fprintf(stderr, "Invalid tagged message from client %s\n", link->id.c_str());
+        return;
+    }
+
+    auto it = tags.size() == 1 ? link->mux_sessions.find(tags[0]) : link->mux_sessions.end();
+    if (it == link->mux_sessions.end()) {
+        // Detached meanwhile (or never attached).
+        free(session_msg.payload);
+        return;
+    }
+
+    client *session = it->second;
+    uint8_t command = session_msg.command;
+
+    if (command == SUBSCRIBE_REQ || command == UNSUBSCRIBE_REQ) {
+        manage_subscribe_unsubscribe(session, &session_msg);
+    } else if (command == SUBSCRIBE_AGG_REQ || command == UNSUBSCRIBE_AGG_REQ) {
+        manage_aggregate_request(session, &session_msg);
+    } else if (command == PUBLISH) {
+        manage_publish_batch(session, &session_msg);
+    } else {
+        // The heartbeats and the credit are for the whole connection.
+        fprintf(stderr, "Unexpected message for session %s\n", session->id.c_str());
+    }
+
+    free(session_msg.payload);
+}
+
+
+void Server::close_connection(coro_conn *conn) {
+    remove_pollfd(conn->fd);
+    close(conn->fd);
+    connections.erase(conn->fd);
+}
+
+
+void Server::cancel_connection(int fd) {
+    auto it = connections.find(fd);
+    if (it == connections.end()) {
+        return;
+    }
+
+    coro_cancel(it->second);
+    connections.erase(it);
+}
+
+
+void Server::reap_connections() {
+    for (coro_conn *conn : loop.finished) {
+        if (conn != &listener) {
+            delete conn;
+        }
+    }
+    loop.finished.clear();
+}
+
+
+client *Server::identify_client(coro_conn *conn, tcp_message *msg) {
+    int client_sockfd = conn->fd;
+    struct sockaddr_in client_addr = conn->addr;
+
+    string client_id = string(msg->payload, strnlen(msg->payload, msg->len));
+
+    // Check if the id is already present in the id-client map, or if its
+    // session was moved to the spill file.
+    unordered_map<string, client*>::iterator it = clients.find(client_id);
+    if (it == clients.end() && restore_session(client_id)) {
+        it = clients.find(client_id);
+    }
+
+    if (it == clients.end()) {
+        // It is a new client, so add it to the map.
+        client* new_client;
+        try {
+            new_client = new client();
+        } catch (bad_alloc &exception) {
+            fprintf(stderr, "Client allocation failed\n");
+            exit(-1);
+        }
+
+        new_client->id = client_id;
+        mark_connected(new_client, client_sockfd);
+        parse_connect_options(msg, new_client, client_addr);
+        start_liveness(&new_client->live, new_client, TIMER_CLIENT_IDLE, TIMER_CLIENT_STALL);
+
+        clients.insert({client_id, new_client});
+
+        // Send confirmation. The queue is empty, so it goes first.
+        queue_frame(new_client, encode_connection_response(true, connection_info(new_client)),
+                    "", 0, LANE_HIGH);
+
+        cout << "New client " << client_id << " connected from "
+            << inet_ntoa(client_addr.sin_addr) << ":"
+            << ntohs(client_addr.sin_port) << ".\n";
+        return new_client;
+    }
+
+    // Client id is already registered. Check if the client is connected.
+    client* database_client = it->second;
+    if (database_client->is_connected) {
+        cout << "Client " << client_id << " already connected.\n";
+        return NULL;
+    }
+
+    // The options of the new connection replace the old ones.
+    parse_connect_options(msg, database_client, client_addr);
+
+    // Client is not connected, so update the client sock_fd and mark as connected.
+    mark_connected(database_client, client_sockfd);
+    start_liveness(&database_client->live, database_client, TIMER_CLIENT_IDLE,
+                   TIMER_CLIENT_STALL);
+
+    // Its old subscriptions are active again.
+    update_client_interest(database_client, true);
+
+    // Send confirmation.
+    queue_frame(database_client,
+                encode_connection_response(true, connection_info(database_client)),
+                "", 0, LANE_HIGH);
+
+    cout << "New client " << client_id << " connected from "
+         << inet_ntoa(client_addr.sin_addr) << ":"
+         << ntohs(client_addr.sin_port) << "\n";
+    return database_client;
+}
+
+
+void Server::reset_connect_options(client *new_client, struct sockaddr_in &client_addr) {
+    new_client->udp_mode = false;
+    new_client->udp_seqs.clear();
+    new_client->shm_index = -1;
+    new_client->tcp_addr = client_addr;
+    new_client->timestamps = false;
+    new_client->credit = credit_window();
+    new_client->multiplexed = false;
+    alias_reset(&new_client->aliases, 0);
+    new_client->out.aliases = NULL;
+}
+
+
+void Server::parse_connect_options(tcp_message *msg, client *new_client,
+                                   struct sockaddr_in &client_addr) {
+    reset_connect_options(new_client, client_addr);
+
+    // Options may follow the null-terminated id in the payload.
+    size_t id_len = strlen(msg->payload);
+    if (id_len + 1 >= msg->len) {
+        return;
+    }
+
+    msg->payload[msg->len - 1] = '\0';
+    stringstream options_stream(msg->payload + id_len + 1);
+    string option;
+
+    while (options_stream >> option) {
+        uint16_t udp_port;
+        if (sscanf(option.c_str(), "udp=%hu", &udp_port) == 1) {
+            // The datagrams go to the same host, on the given port.
+            new_client->udp_mode = true;
+            new_client->udp_addr = client_addr;
+            new_client->udp_addr.sin_port = htons(udp_port);
+            continue;
+        }
+
+        if (option == "shm") {
+            // If this fails, the client gets the publications over TCP.
+            attach_shm_consumer(new_client, client_addr);
+            continue;
+        }
+
+        if (option == "timestamps") {
+            new_client->timestamps = true;
+            continue;
+        }
+
+        if (option == "mux") {
+            // The connection will carry the sessions of other clients.
+            new_client->multiplexed = true;
+            continue;
+        }
+
+        unsigned int capacity;
+        if (sscanf(option.c_str(), "aliases=%u", &capacity) == 1) {
+            // The client accepts aliases below the number it gave.
+            alias_reset(&new_client->aliases, min(capacity, (unsigned int) ALIAS_MAX_CAPACITY));
+            new_client->out.aliases = capacity > 0 ? &new_client->aliases : NULL;
+            continue;
+        }
+
+        // The initial window, in publications and optionally in bytes.
+        uint32_t messages, bytes;
+        int count = sscanf(option.c_str(), "credit=%u:%u", &messages, &bytes);
+        if (count >= 1 && messages > 0) {
+            credit_window &credit = new_client->credit;
+            credit.enabled = true;
+            credit.messages = messages;
+            credit.held_limit = (size_t) messages * CREDIT_HELD_WINDOWS;
+            credit.limit_bytes = count == 2;
+            credit.bytes = count == 2 ? bytes : 0;
+        }
+    }
+}
+
+
+bool Server::attach_shm_consumer(client *new_client, struct sockaddr_in &client_addr) {
+    // Only the clients on the same host can map the ring.
+    if ((ntohl(client_addr.sin_addr.s_addr) >> 24) != 127) {
+        return false;
+    }
+
+    if (ring.fd < 0 && !shm_ring_create(&ring, "/scapp-" + to_string(port))) {
+        perror("Server: shared memory ring creation failed");
+        return false;
+    }
+
+    for (int i = 0; i < SHM_MAX_CONSUMERS; i++) {
+        if (!(shm_consumers & (1ULL << i))) {
+            shm_consumers |= 1ULL << i;
+            new_client->shm_index = i;
+            return true;
+        }
+    }
+
+    // All the consumer indexes are taken.
+    return false;
+}
+
+
+string Server::connection_info(client *new_client) {
+    if (new_client->shm_index < 0) {
+        return "";
+    }
+
+    // The client starts reading with the next message written.
+    uint64_t start = ring.header->write_seq.load();
+    return "shm=" + ring.name + " " + to_string(new_client->shm_index) + " " + to_string(start);
+}
+
+
+pair<string, client*> Server::get_client_from_fd(int fd) {
+    auto it = fd_clients.find(fd);
+    if (it != fd_clients.end()) {
+        return {it->second->id, it->second};
+    }
+
+    // Never reached.
+    pair<string, client*> placeholder("placeholder", NULL);
+    return placeholder;
+}
+
+
+bool Server::parse_subscription_options(const char *options, subscription &sub) {
+    sub.conflate = false;
+    sub.lane = LANE_NORMAL;
+    sub.filter.reset();
+
+    if (!options) {
+        return true;
+    }
+
+    stringstream options_stream(options);
+    string option;
+
+    while (options_stream >> option) {
+        if (option == "conflate") {
+            sub.conflate = true;
+            continue;
+        }
+
+        if (option.compare(0, 9, "priority=") == 0) {
+            string priority = option.substr(9);
+            if (priority == "high") {
+                sub.lane = LANE_HIGH;
+            } else if (priority == "normal") {
+                sub.lane = LANE_NORMAL;
+            } else if (priority == "low") {
+                sub.lane = LANE_LOW;
+            } else {
+                return false;
+            }
+            continue;
+        }
+
+        if (option == "where") {
+            // The rest of the options describe the content filter.
+            vector<string> words;
+            string word;
+            while (options_stream >> word) {
+                words.push_back(word);
+            }
+
+            sub.filter.reset(new content_filter());
+            return parse_content_filter(words, *sub.filter);
+        }
+
+        // Unknown option.
+        return false;
+    }
+
+    return true;
+}
+
+
+/**
+ * Converts the whole word to a number.
+ * @return true on success, false if the word is not a number
+ */
+static bool parse_number(string &word, double &number) {
+    char *end;
+    number = strtod(word.c_str(), &end);
+
+    return !word.empty() && *end == '\0';
+}
+
+
+bool Server::parse_content_filter(vector<string> &words, content_filter &filter) {
+    if (words.empty()) {
+        return false;
+    }
+
+    string &op = words[0];
+
+    if (op == "changed") {
+        filter.op = FILTER_CHANGED;
+        return words.size() == 1;
+    }
+
+    if (op == "prefix") {
+        if (words.size() != 2) {
+            return false;
+        }
+
+        filter.op = FILTER_PREFIX;
+        filter.text = words[1];
+        filter.is_text = true;
+        return true;
+    }
+
+    if (op == "between") {
+        filter.op = FILTER_BETWEEN;
+        return words.size() == 3 && parse_number(words[1], filter.low)
+               && parse_number(words[2], filter.high) && filter.low <= filter.high;
+    }
+
+    // Only comparisons are left, which take exactly one operand.
+    if (words.size() != 2) {
+        return false;
+    }
+
+    if (op == "<") {
+        filter.op = FILTER_LT;
+    } else if (op == "<=") {
+        filter.op = FILTER_LE;
+    } else if (op == ">") {
+        filter.op = FILTER_GT;
+    } else if (op == ">=") {
+        filter.op = FILTER_GE;
+    } else if (op == "==") {
+        filter.op = FILTER_EQ;
+    } else if (op == "!=") {
+        filter.op = FILTER_NE;
+    } else {
+        return false;
+    }
+
+    if (parse_number(words[1], filter.low)) {
+        return true;
+    }
+
+    // Strings can only be checked for (in)equality.
+    if (filter.op != FILTER_EQ && filter.op != FILTER_NE) {
+        return false;
+    }
+
+    filter.text = words[1];
+    filter.is_text = true;
+    return true;
+}
+
+
+bool Server::filter_accepts(content_filter &filter, decoded_value &value) {
+    bool is_string = value.type == STRING_TYPE;
+
+    switch (filter.op) {
+        case FILTER_NONE:
+            return true;
+        case FILTER_CHANGED: {
+            bool changed = !filter.has_last || filter.last_type != value.type
+                           || (is_string ? filter.last_text != value.text
+                                         : filter.last_number != value.number);
+
+            filter.has_last = true;
+            filter.last_type = value.type;
+            if (is_string) {
+                filter.last_text = value.text;
+            } else {
+                filter.last_number = value.number;
+            }
+            return changed;
+        }
+        case FILTER_PREFIX:
+            return is_string && value.text.compare(0, filter.text.length(), filter.text) == 0;
+        default:
+            break;
+    }
+
+    // Comparisons.
+    if (filter.is_text != is_string) {
+        return false;
+    }
+
+    if (is_string) {
+        bool equal = value.text == filter.text;
+        return filter.op == FILTER_EQ ? equal : !equal;
+    }
+
+    double number = value.number;
+
+    switch (filter.op) {
+        case FILTER_LT:
+            return number < filter.low;
+        case FILTER_LE:
+            return number <= filter.low;
+        case FILTER_GT:
+            return number > filter.low;
+        case FILTER_GE:
+            return number >= filter.low;
+        case FILTER_EQ:
+            return number == filter.low;
+        case FILTER_NE:
+            return number != filter.low;
+        case FILTER_BETWEEN:
+            return number >= filter.low && number <= filter.high;
+        default:
+            return false;
+    }
+}
+
+
+subscription *Server::find_subscription(client *target_client, uint32_t pattern_id) {
+    vector<subscription> &subscriptions = target_client->subscriptions;
+
+    auto it = lower_bound(subscriptions.begin(), subscriptions.end(), pattern_id,
+                          [](const subscription &sub, uint32_t id) {
+                              return sub.pattern_id < id;
+                          });
+
+    if (it == subscriptions.end() || it->pattern_id != pattern_id) {
+        return NULL;
+    }
+    return &*it;
+}
+
+
+void Server::manage_subscribe_unsubscribe(client *req_client, tcp_message *req_msg) {
+    string topic(req_msg->payload);
+
+    // Options may follow the null-terminated topic in the payload.
+    const char *options = NULL;
+    if (topic.length() + 1 < req_msg->len) {
+        req_msg->payload[req_msg->len - 1] = '\0';
+        options = req_msg->payload + topic.length() + 1;
+    }
+
+    if (req_msg->command == SUBSCRIBE_REQ) {
+        subscription new_sub;
+        new_sub.pattern_id = pool_intern(patterns, topic);
+
+        if (new_sub.pattern_id == NO_PATTERN) {
+            // An impossible topic, send fail message.
+            queue_command(req_client, SUBSCRIBE_FAIL);
+            return;
+        }
+
+        // The previous value of a "changed" filter is that of a single
+        // topic, so it can not be shared by the topics of a wildcard.
+        if (find_subscription(req_client, new_sub.pattern_id)
+            || !parse_subscription_options(options, new_sub)
+            || (new_sub.filter && new_sub.filter->op == FILTER_CHANGED
+                && pool_pattern(patterns, new_sub.pattern_id).has_wildcards)) {
+            // Client is already subscribed to the topic or asked for
+            // unknown (or unsupported) options, send fail message.
+            pool_release(patterns, new_sub.pattern_id);
+            queue_command(req_client, SUBSCRIBE_FAIL);
+            return;
+        }
+
+        new_sub.has_wildcards = pool_pattern(patterns, new_sub.pattern_id).has_wildcards;
+
+        // Client can subscribe to the new topic, keep the array sorted.
+        vector<subscription> &subscriptions = req_client->subscriptions;
+        auto position = lower_bound(subscriptions.begin(), subscriptions.end(),
+                                    new_sub.pattern_id,
+                                    [](const subscription &sub, uint32_t id) {
+                                        return sub.pattern_id < id;
+                                    });
+        add_subscriber(new_sub.pattern_id, req_client);
+        subscriptions.insert(position, std::move(new_sub));
+        add_local_interest(topic);
+
+        // Send success message.
+        queue_command(req_client, SUBSCRIBE_SUCC);
+        return;
+    }
+
+    // UNSUBSCRIBE_REQ
+    uint32_t pattern_id = pool_find(patterns, topic);
+    subscription *sub = pattern_id == NO_PATTERN
+                        ? NULL : find_subscription(req_client, pattern_id);
+    if (!sub) {
+        // Not subscribed to the topic, cannot unsubscribe.
+        queue_command(req_client, UNSUBSCRIBE_FAIL);
+        return;
+    }
+
+    req_client->subscriptions.erase(req_client->subscriptions.begin()
+                                    + (sub - req_client->subscriptions.data()));
+    remove_subscriber(pattern_id, req_client);
+    pool_release(patterns, pattern_id);
+    remove_local_interest(topic);
+    queue_command(req_client, UNSUBSCRIBE_SUCC);
+}
+
+
+/**
+ * Converts a window like "500ms", "1s" or "2m" to microseconds.
+ * @return true on success, false if the window is not valid
+ */
+static bool parse_window(string &window, uint64_t &window_us) {
+    char *end;
+    unsigned long long amount = strtoull(window.c_str(), &end, 10);
+
+    if (end == window.c_str()) {
+        return false;
+    }
+
+    string unit(end);
+    if (unit == "ms") {
+        window_us = amount * 1000;
+    } else if (unit == "s") {
+        window_us = amount * 1000000;
+    } else if (unit == "m") {
+        window_us = amount * 60000000;
+    } else {
+        return false;
+    }
+
+    return window_us >= MIN_AGG_WINDOW_US;
+}
+
+
+void Server::manage_aggregate_request(client *req_client, tcp_message *req_msg) {
+    string topic(req_msg->payload);
+    bool subscribe = req_msg->command == SUBSCRIBE_AGG_REQ;
+
+    // The function and the window follow the null-terminated topic.
+    string function_name, window;
+    if (topic.length() + 1 < req_msg->len) {
+        req_msg->payload[req_msg->len - 1] = '\0';
+        stringstream spec_stream(req_msg->payload + topic.length() + 1);
+        spec_stream >> function_name >> window;
+    }
+
+    int function = 0;
+    while (function < NUM_AGG_FUNCTIONS && function_name != aggregate_names[function]) {
+        function++;
+    }
+
+    uint64_t window_us;
+    if (function == NUM_AGG_FUNCTIONS || !parse_window(window, window_us)) {
+        queue_command(req_client, subscribe ? SUBSCRIBE_FAIL : UNSUBSCRIBE_FAIL);
+        return;
+    }
+
+    // Equivalent windows ("1s" and "1000ms") share the same aggregate.
+    string spec = topic + " " + function_name + " " + to_string(window_us / 1000) + "ms";
+    bool is_subscribed = req_client->aggregate_specs.count(spec) > 0;
+
+    if (!subscribe) {
+        if (!is_subscribed) {
+            queue_command(req_client, UNSUBSCRIBE_FAIL);
+            return;
+        }
+
+        leave_aggregate(spec, req_client->id);
+        req_client->aggregate_specs.erase(spec);
+        remove_local_interest(topic);
+
+        queue_command(req_client, UNSUBSCRIBE_SUCC);
+        return;
+    }
+
+    compiled_pattern pattern;
+    if (is_subscribed || !compile_pattern(topic, pattern)) {
+        queue_command(req_client, SUBSCRIBE_FAIL);
+        return;
+    }
+
+    join_aggregate(spec, req_client->id);
+    req_client->aggregate_specs.insert(spec);
+
+    // The samples published on the other servers are needed too.
+    add_local_interest(topic);
+
+    queue_command(req_client, SUBSCRIBE_SUCC);
+}
+
+
+bool Server::join_aggregate(const string &spec, const string &client_id) {
+    auto it = aggregates.find(spec);
+    if (it == aggregates.end()) {
+        // The spec is "<topic> <function> <window>ms".
+        string topic = spec.substr(0, spec.find(' '));
+        string function_name, window;
+        stringstream spec_stream(spec.substr(topic.length()));
+        spec_stream >> function_name >> window;
+
+        int function = 0;
+        while (function < NUM_AGG_FUNCTIONS && function_name != aggregate_names[function]) {
+            function++;
+        }
+
+        uint64_t window_us;
+        compiled_pattern pattern;
+        if (function == NUM_AGG_FUNCTIONS || !parse_window(window, window_us)
+            || !compile_pattern(topic, pattern)) {
+            return false;
+        }
+
+        aggregate *new_agg;
+        try {
+            new_agg = new aggregate();
+        } catch (bad_alloc &exception) {
+            fprintf(stderr, "Aggregate allocation failed\n");
+            exit(-1);
+        }
+
+        new_agg->spec = spec;
+        new_agg->topic = topic;
+        new_agg->pattern = pattern;
+        new_agg->function = function;
+        new_agg->window_us = window_us;
+        new_agg->window_end = monotonic_us() + window_us;
+
+        it = aggregates.insert({spec, new_agg}).first;
+        index_aggregate(new_agg);
+    }
+
+    it->second->subscriber_ids.insert(client_id);
+    return true;
+}
+
+
+void Server::leave_aggregate(const string &spec, const string &client_id) {
+    auto it = aggregates.find(spec);
+    if (it == aggregates.end()) {
+        return;
+    }
+
+    aggregate *agg = it->second;
+    agg->subscriber_ids.erase(client_id);
+
+    if (agg->subscriber_ids.empty()) {
+        // Nobody needs it anymore.
+        unindex_aggregate(agg);
+        aggregates.erase(it);
+        delete agg;
+    }
+}
+
+
+void Server::index_aggregate(aggregate *agg) {
+    auto &by_topic = agg->pattern.has_wildcards ? wildcard_aggregates : exact_aggregates;
+    by_topic[agg->topic].push_back(agg);
+
+    // Armed for the first tick after the end, so it never expires early.
+    agg->timer.kind = TIMER_AGG_WINDOW;
+    agg->timer.owner = agg;
+    wheel_arm(&wheel, &agg->timer, (agg->window_end + 999) / 1000);
+}
+
+
+void Server::unindex_aggregate(aggregate *agg) {
+    auto &by_topic = agg->pattern.has_wildcards ? wildcard_aggregates : exact_aggregates;
+    auto it = by_topic.find(agg->topic);
+
+    vector<aggregate*> &same_topic = it->second;
+    same_topic.erase(find(same_topic.begin(), same_topic.end(), agg));
+    if (same_topic.empty()) {
+        by_topic.erase(it);
+    }
+
+    wheel_cancel(&wheel, &agg->timer);
+}
+
+
+/**
+ * Adds a sample to the window of the topic.
+ */
+static void add_sample(aggregate *agg, const char *topic, double number) {
+    auto it = agg->windows.find(topic);
+    if (it == agg->windows.end()) {
+        if (agg->windows.size() >= MAX_AGG_WINDOWS) {
+            return;
+        }
+        it = agg->windows.insert({topic, aggregate_window()}).first;
+    }
+
+    aggregate_window &window = it->second;
+    if (window.count == 0) {
+        window.min = number;
+        window.max = number;
+    }
+
+    window.count++;
+    window.sum += number;
+    window.min = min(window.min, number);
+    window.max = max(window.max, number);
+}
+
+
+void Server::update_aggregates(char *topic, decoded_value &value) {
+    if (aggregates.empty() || value.type == STRING_TYPE) {
+        return;
+    }
+
+    auto exact_it = exact_aggregates.find(topic);
+    if (exact_it != exact_aggregates.end()) {
+        for (aggregate *agg : exact_it->second) {
+            add_sample(agg, topic, value.number);
+        }
+    }
+
+    if (wildcard_aggregates.empty()) {
+        return;
+    }
+
+    topic_levels levels;
+    if (!split_topic(topic, levels)) {
+        return;
+    }
+
+    // The aggregates of a topic share its pattern.
+    for (auto &entry : wildcard_aggregates) {
+        if (!match_pattern(entry.second.front()->pattern, levels)) {
+            continue;
+        }
+
+        for (aggregate *agg : entry.second) {
+            add_sample(agg, topic, value.number);
+        }
+    }
+}
+
+
+void Server::close_aggregate_windows(aggregate *agg) {
+    uint64_t now = monotonic_us();
+
+    // Nothing is sent for the topics without samples.
+    for (auto &entry : agg->windows) {
+        aggregate_window &window = entry.second;
+
+        double result;
+        switch (agg->function) {
+            case AGG_AVG:
+                result = window.sum / window.count;
+                break;
+            case AGG_MIN:
+                result = window.min;
+                break;
+            case AGG_MAX:
+                result = window.max;
+                break;
+            case AGG_SUM:
+                result = window.sum;
+                break;
+            default:
+                result = window.count;
+                break;
+        }
+
+        char formatted_msg[MAX_UDP_MSG];
+        snprintf(formatted_msg, MAX_UDP_MSG, "aggregate - %s - %s/%llums - %.2lf (%llu samples)",
+                 entry.first.c_str(), aggregate_names[agg->function],
+                 (unsigned long long) agg->window_us / 1000, result,
+                 (unsigned long long) window.count);
+
+        // One summary per topic, shared by all the subscribers.
+        tcp_message msg;
+        msg.command = MSG_FROM_UDP;
+        msg.len = strlen(formatted_msg) + 1;
+        msg.payload = formatted_msg;
+        shared_ptr<string> frame = encode_message(&msg);
+
+        // The sessions of a connection get a single frame, tagged for all
+        // of them, which takes the credit of the connection.
+        map<client*, vector<uint16_t>> link_tags;
+
+        for (auto &id : agg->subscriber_ids) {
+            // Only the connected subscribers get the summaries.
+            auto client_it = clients.find(id);
+            if (client_it == clients.end() || !client_it->second->is_connected) {
+                continue;
+            }
+
+            client *subscriber = client_it->second;
+            if (subscriber->mux_link) {
+                link_tags[subscriber->mux_link].push_back(subscriber->mux_tag);
+            } else {
+                queue_publication(subscriber, frame, "");
+            }
+        }
+
+        for (auto &link : link_tags) {
+            vector<uint16_t> &tags = link.second;
+            for (size_t start = 0; start < tags.size(); start += MUX_MAX_TAGS) {
+                size_t count = min(tags.size() - start, (size_t) MUX_MAX_TAGS);
+                queue_publication(link.first, encode_mux_frame(&tags[start], count, *frame), "");
+                mux_frames++;
+                mux_deliveries += count;
+            }
+        }
+    }
+
+    agg->windows.clear();
+
+    // Skip the windows that were missed, if any.
+    agg->window_end += agg->window_us;
+    if (agg->window_end <= now) {
+        agg->window_end = now + agg->window_us;
+    }
+
+    wheel_arm(&wheel, &agg->timer, (agg->window_end + 999) / 1000);
+}
+
+
+void Server::connect_to_peers() {
+    dials.reserve(options.peers.size());
+
+    for (string &address : options.peers) {
+        // Split "<ip>:<port>".
+        size_t colon = address.rfind(':');
+        uint16_t peer_port;
+        if (colon == string::npos
+            || sscanf(address.c_str() + colon + 1, "%hu", &peer_port) != 1) {
+            fprintf(stderr, "Invalid peer address %s\n", address.c_str());
+            continue;
+        }
+
+        peer_dial dial;
+        dial.address = address;
+        memset(&dial.addr, 0, sizeof(struct sockaddr_in));
+        dial.addr.sin_family = AF_INET;
+        dial.addr.sin_port = htons(peer_port);
+        dial.addr.sin_addr.s_addr = inet_addr(address.substr(0, colon).c_str());
+        dial.node_id = 0;
+        dial.retry_ms = PEER_RETRY_MIN_MS;
+        dials.push_back(dial);
+    }
+
+    for (peer_dial &dial : dials) {
+        dial.timer.kind = TIMER_PEER_DIAL;
+        dial.timer.owner = &dial;
+
+        // The links the previous server made were handed off.
+        for (auto &entry : peers) {
+            if (entry.second->address == dial.address) {
+                dial.node_id = entry.second->node_id;
+            }
+        }
+
+        if (!dial.node_id) {
+            dial_peer(&dial);
+        }
+    }
+}
+
+
+void Server::dial_peer(peer_dial *dial) {
+    int peer_sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    DIE(peer_sockfd < 0, "Server: peer socket creation failed.\n");
+
+    int opt_flag = 1;
+    int rc = setsockopt(peer_sockfd, IPPROTO_TCP, TCP_NODELAY, &opt_flag, sizeof(int));
+    DIE(rc < 0, "Server: Nagle disabling for peer failed.\n");
+
+    enable_busy_poll(peer_sockfd);
+
+    // The peer may have linked itself to this server in the meantime.
+    for (auto &entry : peers) {
+        if (dial->node_id && entry.second->node_id == dial->node_id) {
+            close(peer_sockfd);
+            dial->retry_ms = PEER_RETRY_MIN_MS;
+            return;
+        }
+    }
+
+    rc = connect(peer_sockfd, (struct sockaddr *) &dial->addr, sizeof(dial->addr));
+    if (rc < 0 && errno != EINPROGRESS) {
+        fprintf(stderr, "Peer %s is not reachable\n", dial->address.c_str());
+        close(peer_sockfd);
+        retry_dial(dial);
+        return;
+    }
+
+    // The peer answers with its own id, which the coroutine of the link
+    // waits for, like the id of a client.
+    pending_links[peer_sockfd] = dial;
+    coro_conn *conn = add_connection(peer_sockfd, dial->addr);
+    coro_spawn(conn, serve_connection(conn, NULL));
+}
+
+
+void Server::retry_dial(peer_dial *dial) {
+    wheel_arm(&wheel, &dial->timer, now_ms + dial->retry_ms);
+    dial->retry_ms = min(2 * dial->retry_ms, (uint64_t) PEER_RETRY_MAX_MS);
+}
+
+
+void Server::retry_link(coro_conn *conn, peer_dial *dial) {
+    pending_links.erase(conn->fd);
+    close_connection(conn);
+    retry_dial(dial);
+}
+
+
+shared_ptr<string> Server::encode_peer_hello(bool linked) {
+    char payload[sizeof(uint32_t) + 1];
+    uint32_t net_id = htonl(node_id);
+    memcpy(payload, &net_id, sizeof(uint32_t));
+    payload[sizeof(uint32_t)] = linked;
+
+    tcp_message msg;
+    msg.command = PEER_HELLO;
+    msg.len = sizeof(payload);
+    msg.payload = payload;
+
+    return encode_message(&msg);
+}
+
+
+peer *Server::register_peer(int peer_sockfd, uint32_t peer_id, string address,
+                            bool send_hello) {
+    peer *new_peer;
+    try {
+        new_peer = new peer();
+    } catch (bad_alloc &exception) {
+        fprintf(stderr, "Peer allocation failed\n");
+        exit(-1);
+    }
+
+    new_peer->fd = peer_sockfd;
+    new_peer->node_id = peer_id;
+    new_peer->address = address;
+    new_peer->dialed = !send_hello;
+
+    peers.insert({peer_sockfd, new_peer});
+    start_liveness(&new_peer->live, new_peer, TIMER_PEER_IDLE, TIMER_PEER_STALL);
+
+    if (send_hello) {
+        enqueue_frame(&new_peer->out, encode_peer_hello(false), "");
+    }
+
+    // Tell the peer which topics to forward to this server.
+    for (auto &entry : local_interest) {
+        tcp_message msg;
+        msg.command = PEER_INTEREST_ADD;
+        msg.len = entry.first.length() + 1;
+        msg.payload = (char *) entry.first.c_str();
+
+        enqueue_frame(&new_peer->out, encode_message(&msg), "");
+    }
+    flush_peer(new_peer);
+
+    cout << "Linked to peer " << address << ".\n";
+    return new_peer;
+}
+
+
+peer *Server::accept_peer(coro_conn *conn, tcp_message *hello) {
+    uint32_t peer_id = 0;
+    bool linked = false;
+    if (hello->len == sizeof(uint32_t) + 1) {
+        memcpy(&peer_id, hello->payload, sizeof(uint32_t));
+        peer_id = ntohl(peer_id);
+        linked = hello->payload[sizeof(uint32_t)];
+    }
+
+    // The link was opened by this server if it waits for the answer.
+    string address;
+    auto link = pending_links.find(conn->fd);
+    bool opened_here = link != pending_links.end();
+    if (opened_here) {
+        peer_dial *dial = link->second;
+        dial->node_id = peer_id;
+        dial->retry_ms = PEER_RETRY_MIN_MS;
+
+        address = dial->address;
+        pending_links.erase(link);
+    } else {
+        address = string(inet_ntoa(conn->addr.sin_addr)) + ":"
+                  + to_string(ntohs(conn->addr.sin_port));
+    }
+
+    if (peer_id == node_id || (opened_here && linked)) {
+        // The other server already has a link to this one, the dial goes on
+        // when that link is lost.
+        return NULL;
+    }
+
+    // There is a single link between two servers. When both dialed, the
+    // link opened by the lower node id is kept, which both ends agree on.
+    peer *old_peer = NULL;
+    for (auto &entry : peers) {
+        if (entry.second->node_id == peer_id) {
+            old_peer = entry.second;
+        }
+    }
+
+    // A link opened again by the same end replaces the old one, which is
+    // lost on the other end.
+    if (old_peer && old_peer->dialed != opened_here
+        && (old_peer->dialed ? node_id < peer_id : peer_id < node_id)) {
+        return NULL;
+    }
+
+    peer *new_peer = register_peer(conn->fd, peer_id, address, !opened_here);
+
+    if (old_peer) {
+        int fd = old_peer->fd;
+        remove_pollfd(fd);
+        remove_peer(fd);
+        cancel_connection(fd);
+    }
+
+    return new_peer;
+}
+
+
+void Server::remove_peer(int peer_sockfd) {
+    peer *old_peer = peers[peer_sockfd];
+
+    cout << "Peer " << old_peer->address << " disconnected.\n";
+
+    stop_liveness(&old_peer->live);
+
+    // Whichever server opened the link, the one given the address opens it
+    // again, unless another link to the node is made or being made.
+    bool relinked = false;
+    for (auto &entry : peers) {
+        relinked = relinked || (entry.second != old_peer
+                                && entry.second->node_id == old_peer->node_id);
+    }
+    for (auto &link : pending_links) {
+        relinked = relinked || link.second->node_id == old_peer->node_id;
+    }
+
+    for (peer_dial &dial : dials) {
+        if (dial.node_id == old_peer->node_id && !dial.timer.armed && !relinked) {
+            retry_dial(&dial);
+        }
+    }
+
+    peers.erase(peer_sockfd);
+    close(peer_sockfd);
+    delete old_peer;
+}
+
+
+void Server::flush_peer(peer *dest_peer) {
+    outbound_queue *out = &dest_peer->out;
+    size_t queued = outbound_size(out);
+    size_t offset = out->front_offset;
+
+    int rc = flush_outbound(dest_peer->fd, out, FLUSH_BUDGET);
+    if (rc < 0) {
+        // The link is broken, it will be removed when reading from it.
+        clear_outbound(out);
+        set_pollout(dest_peer->fd, false);
+        watch_write_stall(&dest_peer->live, false, false);
+        return;
+    }
+
+    set_pollout(dest_peer->fd, rc == 0);
+    watch_write_stall(&dest_peer->live, rc == 0,
+                      outbound_size(out) != queued || out->front_offset != offset);
+}
+
+
+void Server::manage_peer_message(peer *src_peer, tcp_message *msg) {
+    // Whatever it sent, the peer is alive.
+    src_peer->live.last_recv = now_ms;
+    src_peer->live.ping_sent = false;
+
+    if (msg->command == HEARTBEAT || msg->command == HEARTBEAT_ACK) {
+        if (msg->command == HEARTBEAT) {
+            tcp_message ack;
+            ack.command = HEARTBEAT_ACK;
+            ack.len = 0;
+            ack.payload = NULL;
+
+            enqueue_frame(&src_peer->out, encode_message(&ack), "");
+            flush_peer(src_peer);
+        }
+        return;
+    }
+
+    if (msg->command == PEER_INTEREST_ADD || msg->command == PEER_INTEREST_DEL) {
+        if (msg->len == 0) {
+            return;
+        }
+        msg->payload[msg->len - 1] = '\0';
+        string topic(msg->payload);
+
+        if (msg->command == PEER_INTEREST_DEL) {
+            src_peer->interest.erase(topic);
+            return;
+        }
+
+        compiled_pattern pattern;
+        if (compile_pattern(topic, pattern)) {
+            src_peer->interest[topic] = std::move(pattern);
+        }
+        return;
+    }
+
+    // The header of the forwarded publications has the origin node id,
+    // the sequence number and the address of the UDP client.
+    size_t header_len = 2 * sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint16_t);
+    if (msg->command != PEER_PUBLISH || msg->len <= header_len
+        || msg->len - header_len > MAX_PUBLISH_RECORD) {
+        fprintf(stderr, "Invalid message from peer %s\n", src_peer->address.c_str());
+        return;
+    }
+
+    uint32_t origin, seq_high, seq_low;
+    memcpy(&origin, msg->payload, sizeof(uint32_t));
+    memcpy(&seq_high, msg->payload + 4, sizeof(uint32_t));
+    memcpy(&seq_low, msg->payload + 8, sizeof(uint32_t));
+
+    origin = ntohl(origin);
+    uint64_t seq = ((uint64_t) ntohl(seq_high) << 32) | ntohl(seq_low);
+
+    // Drop anything already seen from the origin (so a publication can
+    // never loop back), which also keeps the order of every publisher.
+    auto it = last_peer_seq.find(origin);
+    if (origin == node_id || (it != last_peer_seq.end() && seq <= it->second)) {
+        return;
+    }
+    last_peer_seq[origin] = seq;
+
+    struct sockaddr_in src_addr;
+    memset(&src_addr, 0, sizeof(struct sockaddr_in));
+    src_addr.sin_family = AF_INET;
+    memcpy(&src_addr.sin_addr.s_addr, msg->payload + 12, sizeof(uint32_t));
+    memcpy(&src_addr.sin_port, msg->payload + 16, sizeof(uint16_t));
+
+    // Only the origin forwards, so a publication is never forwarded twice.
+    process_record(msg->payload + header_len, msg->len - header_len, src_addr, false);
+}
+
+
+void Server::broadcast_interest(uint8_t command, const string &topic) {
+    if (peers.empty()) {
+        return;
+    }
+
+    tcp_message msg;
+    msg.command = command;
+    msg.len = topic.length() + 1;
+    msg.payload = (char *) topic.c_str();
+
+    shared_ptr<string> frame = encode_message(&msg);
+    for (auto &entry : peers) {
+        bool was_empty = outbound_size(&entry.second->out) == 0;
+        enqueue_frame(&entry.second->out, frame, "");
+        if (was_empty) {
+            flush_peer(entry.second);
+        }
+    }
+}
+
+
+void Server::add_subscriber(uint32_t pattern_id, client *target_client) {
+    if (pattern_id >= pattern_subscribers.size()) {
+        pattern_subscribers.resize(pattern_id + 1);
+    }
+
+    vector<client*> &subscribers = pattern_subscribers[pattern_id];
+    if (subscribers.empty()) {
+        index_change_pattern(&subscription_index, true, pattern_id,
+                             pool_pattern(patterns, pattern_id));
+    }
+    subscribers.push_back(target_client);
+}
+
+
+void Server::remove_subscriber(uint32_t pattern_id, client *target_client) {
+    vector<client*> &subscribers = pattern_subscribers[pattern_id];
+
+    auto it = find(subscribers.begin(), subscribers.end(), target_client);
+    if (it == subscribers.end()) {
+        return;
+    }
+
+    *it = subscribers.back();
+    subscribers.pop_back();
+
+    if (subscribers.empty()) {
+        // The id may be given to another pattern once released.
+        index_change_pattern(&subscription_index, false, pattern_id,
+                             pool_pattern(patterns, pattern_id));
+    }
+}
+
+
+void Server::add_local_interest(const string &topic) {
+    if (++local_interest[topic] == 1) {
+        broadcast_interest(PEER_INTEREST_ADD, topic);
+    }
+}
+
+
+void Server::remove_local_interest(const string &topic) {
+    auto it = local_interest.find(topic);
+    if (it == local_interest.end()) {
+        return;
+    }
+
+    if (--it->second == 0) {
+        local_interest.erase(it);
+        broadcast_interest(PEER_INTEREST_DEL, topic);
+    }
+}
+
+
+void Server::update_client_interest(client *target_client, bool connected) {
+    vector<string> topics;
+    for (auto &sub : target_client->subscriptions) {
+        topics.push_back(pool_pattern(patterns, sub.pattern_id).text);
+    }
+
+    // The topic of an aggregate is the spec up to the first space.
+    for (auto &spec : target_client->aggregate_specs) {
+        topics.push_back(spec.substr(0, spec.find(' ')));
+    }
+
+    for (string &topic : topics) {
+        if (connected) {
+            add_local_interest(topic);
+        } else {
+            remove_local_interest(topic);
+        }
+    }
+}
+
+
+void Server::forward_to_peers(char *buff, int len, struct sockaddr_in &src_addr, char *topic) {
+    if (peers.empty()) {
+        return;
+    }
+
+    publish_seq++;
+
+    string string_topic(topic);
+    topic_levels levels;
+    if (!split_topic(string_topic, levels)) {
+        return;
+    }
+
+    // Built only if at least one peer is interested.
+    shared_ptr<string> frame;
+
+    for (auto &entry : peers) {
+        peer *dest_peer = entry.second;
+
+        bool interested = dest_peer->interest.count(string_topic) > 0;
+        for (auto it = dest_peer->interest.begin();
+             !interested && it != dest_peer->interest.end(); it++) {
+            interested = match_pattern(it->second, levels);
+        }
+
+        if (!interested) {
+            continue;
+        }
+
+        if (!frame) {
+            uint32_t net_origin = htonl(node_id);
+            uint32_t seq_high = htonl((uint32_t) (publish_seq >> 32));
+            uint32_t seq_low = htonl((uint32_t) publish_seq);
+
+            string payload;
+            payload.append((char *) &net_origin, sizeof(uint32_t));
+            payload.append((char *) &seq_high, sizeof(uint32_t));
+            payload.append((char *) &seq_low, sizeof(uint32_t));
+            payload.append((char *) &src_addr.sin_addr.s_addr, sizeof(uint32_t));
+            payload.append((char *) &src_addr.sin_port, sizeof(uint16_t));
+            payload.append(buff, len);
+
+            tcp_message msg;
+            msg.command = PEER_PUBLISH;
+            msg.len = payload.length();
+            msg.payload = (char *) payload.data();
+            frame = encode_message(&msg);
+        }
+
+        bool was_empty = outbound_size(&dest_peer->out) == 0;
+        enqueue_frame(&dest_peer->out, frame, "");
+        if (was_empty) {
+            flush_peer(dest_peer);
+        }
+    }
+}
+
+
+void Server::manage_udp_message(int client_fd, char *buff, char *formatted_msg) {
+    struct sockaddr_in udp_client_addr;
+
+    memset(buff, 0, MAX_UDP_MSG);
+
+    // recvmsg() instead of recvfrom(), for the kernel timestamp.
+    iovec iov;
+    iov.iov_base = buff;
+    iov.iov_len = MAX_UDP_MSG;
+
+    char control[CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t))];
+
+    msghdr msg;
+    memset(&msg, 0, sizeof(msghdr));
+    msg.msg_name = &udp_client_addr;
+    msg.msg_namelen = sizeof(udp_client_addr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int rc = recvmsg(client_fd, &msg, 0);
+    DIE(rc < 0, "Error receiving from UDP client\n");
+
+    uint64_t rx_ns = 0;
+    bool has_drops = false;
+    uint32_t drops = 0;
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(struct timespec));
+            rx_ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+        }
+
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+            // Only sent once the kernel dropped something.
+            memcpy(&drops, CMSG_DATA(cmsg), sizeof(uint32_t));
+            has_drops = true;
+        }
+    }
+
+    // How long the datagram waited in the queue of the socket.
+    uint64_t now_ns = realtime_ns();
+    uint64_t lag_ns = rx_ns && rx_ns < now_ns ? now_ns - rx_ns : 0;
+    if (rx_ns == 0) {
+        rx_ns = now_ns;
+    }
+
+    update_overload(lag_ns, has_drops, drops);
+
+    // Captured and counted before shedding, to see the real ingress.
+    capture_append(&capture, rx_ns, udp_client_addr, buff, rc);
+    account_ingress(buff, udp_client_addr, rc);
+
+    // The topic is read before anything else, to shed as early as possible.
+    char topic[51];
+    memcpy(topic, buff, 50);
+    topic[50] = '\0';
+
+    if (shed_publication(topic)) {
+        return;
+    }
+
+    process_publication(buff, rc, udp_client_addr, formatted_msg, true, rx_ns);
+}
+
+
+void Server::print_ingress_stats() {
+    // The state is only updated when a datagram arrives.
+    bool still_overloaded = overloaded && now_ms - last_datagram_ms < OVERLOAD_CALM_MS;
+
+    cout << "Ingress: " << kernel_drops << " datagrams dropped by the kernel, "
+         << invalid_publications << " invalid publications\n";
+    cout << "Lag: " << ingress_lag_ns / 1000 << " us (max " << max_ingress_lag_ns / 1000
+         << " us since the last stats), limit " << options.max_lag_us << " us, "
+         << (still_overloaded ? "overloaded" : "not overloaded") << " ("
+         << overload_episodes << " overload episodes)\n";
+
+    for (topic_class &target_class : topic_classes) {
+        shed_rule &rule = target_class.rule;
+
+        string policy = rule.sample_every == 0 ? "shed"
+                        : rule.sample_every == 1 ? "kept"
+                        : "1 in " + to_string(rule.sample_every) + " kept";
+
+        cout << "  " << (rule.prefix.empty() ? "(other topics)" : rule.prefix + "*")
+             << ": " << target_class.received << " received, " << target_class.shed
+             << " shed (" << policy << " when overloaded)\n";
+    }
+
+    if (capture.fd >= 0) {
+        cout << "Capture: " << capture.records << " datagrams to " << capture.path << "\n";
+    }
+
+    max_ingress_lag_ns = 0;
+}
+
+
+void Server::print_outbound_stats() {
+    size_t backlogged = 0, messages = 0, bytes = 0;
+    uint64_t dropped = 0;
+
+    for (client *target_client : connected_clients) {
+        outbound_queue &out = target_client->out;
+        if (outbound_size(&out) > 0) {
+            backlogged++;
+        }
+        messages += outbound_size(&out);
+        bytes += out.bytes;
+        dropped += target_client->out_dropped;
+    }
+
+    cout << "Outbound: " << backlogged << " clients with a backlog, " << messages
+         << " messages (" << bytes << " bytes) queued, " << dropped
+         << " publications dropped (limit " << MAX_QUEUED_MESSAGES << " messages, "
+         << MAX_QUEUED_BYTES << " bytes per client)\n";
+}
+
+
+void Server::print_credit_stats() {
+    size_t num_clients = 0, blocked = 0, held = 0;
+    uint64_t dropped = 0;
+
+    for (client *target_client : connected_clients) {
+        credit_window &credit = target_client->credit;
+        if (!credit.enabled) {
+            continue;
+        }
+
+        num_clients++;
+        held += outbound_size(&credit.held);
+        dropped += credit.dropped;
+        if (outbound_size(&credit.held) > 0) {
+            blocked++;
+        }
+    }
+
+    if (num_clients == 0) {
+        return;
+    }
+
+    cout << "Flow control: " << num_clients << " clients, " << blocked
+         << " waiting for credit, " << held << " publications held, " << dropped
+         << " dropped\n";
+}
+
+
+void Server::print_mux_stats() {
+    size_t links = 0, sessions = 0;
+    for (client *target_client : connected_clients) {
+        if (target_client->multiplexed) {
+            links++;
+            sessions += target_client->mux_sessions.size();
+        }
+    }
+
+    if (links == 0 && mux_frames == 0) {
+        return;
+    }
+
+    cout << "Multiplexing: " << links << " connections, " << sessions << " sessions, "
+         << mux_frames << " frames for " << mux_deliveries << " publications";
+    if (mux_frames > 0) {
+        printf(" (%.2f sessions per frame)", (double) mux_deliveries / mux_frames);
+    }
+    cout << "\n";
+}
+
+
+void Server::print_alias_stats() {
+    size_t num_clients = 0;
+    uint64_t defined = 0, reused = 0;
+    int64_t saved_bytes = 0;
+
+    for (client *target_client : connected_clients) {
+        alias_table &aliases = target_client->aliases;
+        if (aliases.capacity == 0) {
+            continue;
+        }
+
+        num_clients++;
+        defined += aliases.defined;
+        reused += aliases.reused;
+        saved_bytes += aliases.saved_bytes;
+    }
+
+    if (num_clients == 0) {
+        return;
+    }
+
+    cout << "Topic aliases: " << num_clients << " clients, " << defined << " defined, "
+         << reused << " used, " << saved_bytes << " bytes saved\n";
+}
+
+
+void Server::print_match_stats() {
+    index_publish(&subscription_index);
+    const match_snapshot *snapshot = index_current(&subscription_index);
+
+    size_t exact = 0;
+    for (int i = 0; i < MATCH_SHARDS; i++) {
+        exact += snapshot->shards[i]->ids.size();
+    }
+
+    size_t wildcards = snapshot->wildcards->size();
+    cout << "Matching: " << exact + wildcards << " patterns (" << wildcards
+         << " with wildcards) in version " << snapshot->version << ", "
+         << matchers.num_matchers << " threads\n";
+    cout << "  topics matched by the threads: " << offloaded_matches << " (" << stale_matches
+         << " again in the loop), in the loop: " << inline_matches << ", reused: "
+         << cached_matches << "\n";
+
+    for (int i = 0; i < matchers.num_matchers; i++) {
+        cout << "  matcher " << i << ": " << matchers.matchers[i].matched.load() << " topics\n";
+    }
+}
+
+
+void Server::set_capture(const string &path) {
+    if (capture.fd >= 0) {
+        capture_close(&capture);
+        cout << "Capture: " << capture.records << " datagrams written to "
+             << capture.path << "\n";
+    }
+
+    if (path.empty()) {
+        return;
+    }
+
+    if (!capture_open(&capture, path)) {
+        perror("Capture: the file could not be created");
+    }
+}
+
+
+void Server::account_ingress(const char *topic, struct sockaddr_in &src_addr, size_t len) {
+    size_t topic_len = strnlen(topic, min(len, (size_t) 50));
+    uint64_t hash = hh_hash(topic, topic_len);
+    hh_add(&top_topic_msgs, topic, topic_len, hash, 1);
+    hh_add(&top_topic_bytes_in, topic, topic_len, hash, len);
+
+    // The address and the port, in network order, are the key.
+    char source[6];
+    memcpy(source, &src_addr.sin_addr.s_addr, 4);
+    memcpy(source + 4, &src_addr.sin_port, 2);
+    hash = hh_hash(source, sizeof(source));
+    hh_add(&top_source_msgs, source, sizeof(source), hash, 1);
+    hh_add(&top_source_bytes, source, sizeof(source), hash, len);
+}
+
+
+void Server::print_top(size_t count) {
+    struct sketch_report {
+        const char *title;
+        space_saving *sketch;
+        bool sources;
+    };
+
+    sketch_report reports[] = {
+        {"Topics by publications received", &top_topic_msgs, false},
+        {"Topics by bytes received", &top_topic_bytes_in, false},
+        {"Topics by deliveries", &top_topic_deliveries, false},
+        {"Topics by bytes delivered", &top_topic_bytes_out, false},
+        {"Publishers by publications", &top_source_msgs, true},
+        {"Publishers by bytes", &top_source_bytes, true},
+    };
+
+    for (sketch_report &report : reports) {
+        cout << report.title << " (" << report.sketch->total << " in total):\n";
+
+        for (const hh_entry *entry : hh_top(report.sketch, count)) {
+            string key;
+            if (report.sources) {
+                struct in_addr addr;
+                uint16_t port;
+                memcpy(&addr.s_addr, entry->key, 4);
+                memcpy(&port, entry->key + 4, 2);
+                key = string(inet_ntoa(addr)) + ":" + to_string(ntohs(port));
+            } else {
+                key = string(entry->key, entry->key_len);
+            }
+
+            // The real value is at most error less than the estimate.
+            cout << "  " << key << ": " << entry->count;
+            if (entry->error) {
+                cout << " (at most " << entry->error << " less)";
+            }
+            cout << "\n";
+        }
+    }
+}
+
+
+void Server::update_overload(uint64_t lag_ns, bool has_drops, uint32_t drops) {
+    // After a pause, the average only reflects the new traffic.
+    if (now_ms - last_datagram_ms >= OVERLOAD_CALM_MS) {
+        ingress_lag_ns = lag_ns;
+    } else {
+        ingress_lag_ns = ingress_lag_ns - (ingress_lag_ns >> LAG_EWMA_SHIFT)
+                         + (lag_ns >> LAG_EWMA_SHIFT);
+    }
+    last_datagram_ms = now_ms;
+    max_ingress_lag_ns = max(max_ingress_lag_ns, lag_ns);
+
+    // The counter only grows, a new value means new drops.
+    bool dropped = has_drops && drops != kernel_drops;
+    if (has_drops) {
+        kernel_drops = drops;
+    }
+
+    uint64_t max_lag_ns = options.max_lag_us * 1000;
+    if (dropped || ingress_lag_ns > max_lag_ns) {
+        if (!overloaded) {
+            overload_episodes++;
+        }
+
+        overloaded = true;
+        last_overload_ms = now_ms;
+        return;
+    }
+
+    // Hysteresis, so the shedding does not flap around the limit.
+    if (overloaded && ingress_lag_ns < max_lag_ns / 2
+        && now_ms - last_overload_ms >= OVERLOAD_CALM_MS) {
+        overloaded = false;
+
+        for (topic_class &target_class : topic_classes) {
+            memset(target_class.sample_counts, 0, sizeof(target_class.sample_counts));
+        }
+    }
+}
+
+
+bool Server::shed_publication(const char *topic) {
+    // The last class has no prefix, so it always matches.
+    topic_class *target_class = &topic_classes.back();
+    for (topic_class &candidate : topic_classes) {
+        const string &prefix = candidate.rule.prefix;
+        if (strncmp(topic, prefix.c_str(), prefix.length()) == 0) {
+            target_class = &candidate;
+            break;
+        }
+    }
+
+    target_class->received++;
+
+    uint32_t sample_every = target_class->rule.sample_every;
+    if (!overloaded || sample_every == 1) {
+        return false;
+    }
+
+    // Keep the first of every sample_every publications of the topic.
+    if (sample_every > 0) {
+        uint64_t &count = target_class->sample_counts[hh_hash(topic, strlen(topic))
+                                                      % SAMPLE_COUNTERS];
+        if (count++ % sample_every == 0) {
+            return false;
+        }
+    }
+
+    target_class->shed++;
+    return true;
+}
+
+
+void Server::manage_publish_batch(client *src_client, tcp_message *msg) {
+    size_t offset = 0;
+
+    while (offset < msg->len) {
+        uint32_t record_len;
+        if (msg->len - offset < sizeof(uint32_t)) {
+            break;
+        }
+        memcpy(&record_len, msg->payload + offset, sizeof(uint32_t));
+        record_len = ntohl(record_len);
+        offset += sizeof(uint32_t);
+
+        if (record_len > msg->len - offset) {
+            break;
+        }
+
+        process_record(msg->payload + offset, record_len, src_client->tcp_addr, true);
+        offset += record_len;
+    }
+
+    if (offset != msg->len) {
+        // The records before the broken one were already delivered.
+        fprintf(stderr, "Invalid PUBLISH batch\n");
+    }
+}
+
+
+void Server::process_record(const char *record, size_t len, struct sockaddr_in &src_addr,
+                            bool forward) {
+    // The topic and the type are mandatory.
+    if (len <= 50 || len > MAX_PUBLISH_RECORD) {
+        fprintf(stderr, "Invalid publication\n");
+        return;
+    }
+
+    // Zeroes after the record terminate the strings and complete the
+    // numbers that are too short, like for the datagrams.
+    if (record_buff.size() < len + 8) {
+        record_buff.resize(MAX_PUBLISH_RECORD + 8);
+        record_formatted.resize(MAX_PUBLISH_RECORD + MAX_UDP_MSG);
+    }
+    memcpy(record_buff.data(), record, len);
+    memset(record_buff.data() + len, 0, 8);
+
+    account_ingress(record_buff.data(), src_addr, len);
+
+    // Taken from a TCP stream, so only the time the server read it is known.
+    process_publication(record_buff.data(), len, src_addr, record_formatted.data(), forward,
+                        realtime_ns());
+}
+
+
+void Server::process_publication(char *buff, int len, struct sockaddr_in &src_addr,
+                                 char *formatted_msg, bool forward, uint64_t rx_ns) {
+    // Get the topic from the received buff.
+    char topic[51];
+    memcpy(topic, buff, 50);
+    topic[50] = '\0';
+
+    // Data type from the received buff.
+    uint8_t data_type = buff[50];
+
+    char *client_ip = inet_ntoa(src_addr.sin_addr);
+    uint16_t client_port = htons(src_addr.sin_port);
+
+    sprintf(formatted_msg, "%s:%hu - %s - ", client_ip, client_port, topic);
+
+    decoded_value value;
+    bool valid = interpret_udp_payload((int) data_type, buff + 51,
+                                       formatted_msg + strlen(formatted_msg), &value);
+    if (!valid) {
+        // Counted instead of printed, not to slow the loop down even more
+        // when a publisher floods it with them.
+        invalid_publications++;
+        return;
+    }
+
+    if (forward) {
+        forward_to_peers(buff, len, src_addr, topic);
+    }
+
+    update_aggregates(topic, value);
+    send_msg_if_subscribed(topic, formatted_msg, value, rx_ns);
 }
 
 
 bool Server::interpret_udp_payload(int data_type, char *udp_payload,
-                                   char *formatted_msg) {
+                                   char *formatted_msg, decoded_value *value) {
+    value->type = data_type;
+    value->number = 0;
+
     switch (data_type) {
-        case 0: {
+        case INT_TYPE: {
             uint8_t sign = udp_payload[0];
             uint32_t number = 0;
             memcpy(&number, udp_payload + 1, sizeof(uint32_t));
@@ -440,20 +4094,24 @@ bool Server::interpret_udp_payload(int data_type, char *udp_payload,
                 number *= -1;
             }
 
+            value->number = (int32_t) number;
+
             sprintf(formatted_msg, "INT - %d", number);
             return true;
         }
-        case 1: {
+        case SHORT_REAL_TYPE: {
             uint16_t number = 0;
             memcpy(&number, udp_payload, sizeof(uint16_t));
 
             double real_nr = (double) ntohs(number);
             real_nr /= 100.0;
 
+            value->number = real_nr;
+
             sprintf(formatted_msg, "SHORT_REAL - %.2lf", real_nr);
             return true;
         }
-        case 2: {
+        case FLOAT_TYPE: {
             uint8_t sign = udp_payload[0];
             uint32_t number = 0;
             memcpy(&number, udp_payload + 1, sizeof(uint32_t));
@@ -470,141 +4128,464 @@ bool Server::interpret_udp_payload(int data_type, char *udp_payload,
                 real_nr *= -1.0;
             }
 
+            value->number = real_nr;
+
             sprintf(formatted_msg, "FLOAT - %.*lf", power, real_nr);
             return true;
         }
-        case 3: {
+        case STRING_TYPE: {
+            value->text = udp_payload;
+
             sprintf(formatted_msg, "STRING - ");
             strcpy(formatted_msg + strlen(formatted_msg), udp_payload);
             return true;
         }
         default: {
-            fprintf(stderr, "This format is not supported\n");
             return false;
         }
     }
 }
 
 
-void Server::send_msg_if_subscribed(char *topic, char *formatted_msg) {
+void Server::send_msg_if_subscribed(char *topic, char *formatted_msg,
+                                    decoded_value &value, uint64_t rx_ns) {
     string string_topic(topic);
 
-    tcp_message *msg = (tcp_message *) calloc(1, sizeof(tcp_message));
-    DIE(!msg, "calloc failed\n");
+    // Encode the message only once, all the clients share the same frame.
+    tcp_message msg;
+    msg.command = MSG_FROM_UDP;
+    msg.len = strlen(formatted_msg) + 1;
+    msg.payload = formatted_msg;
+
+    publication new_pub;
+    new_pub.frame = encode_message(&msg);
+    new_pub.value = value;
+    new_pub.payload_offset = new_pub.frame->size() - msg.len;
+    new_pub.rx_ns = rx_ns;
+    new_pub.stamp_offset = 0;
+
+    // Add the publication to the job of its topic, creating it if needed.
+    auto it = fanout_jobs.find(string_topic);
+    if (it != fanout_jobs.end()) {
+        it->second->pending.push_back(new_pub);
+        return;
+    }
+
+    fanout_job *job;
+    try {
+        job = new fanout_job();
+    } catch (bad_alloc &exception) {
+        fprintf(stderr, "Fan-out job allocation failed\n");
+        exit(-1);
+    }
 
-    msg->command = MSG_FROM_UDP;
-    msg->len = strlen(formatted_msg) + 1;
-    msg->payload = strdup(formatted_msg);
-    DIE(!msg->payload, "strdup failed\n");
+    job->topic = string_topic;
+    split_topic(job->topic, job->levels);
+    job->topic_id = NO_PATTERN;
+    job->match_version = UINT64_MAX;
+    job->pending.push_back(new_pub);
+    job->cursor = 0;
+    job->shm_mask = 0;
+    job->deliveries = 0;
+
+    fanout_jobs.insert({string_topic, job});
+    unmatched_jobs.push_back(job);
+}
 
-    for (auto &entry : clients) {
-        client *curr_client = entry.second;
-        if (!curr_client->is_connected) {
-            continue;
+
+void Server::deliver_to_client(fanout_job *job, client *dest_client) {
+    if (!dest_client->is_connected) {
+        // Disconnected after the delivery started.
+        return;
+    }
+
+    publication &pub = job->pending.front();
+
+    // The id may have been given to another pattern since it was looked
+    // up, if everyone unsubscribed from the topic meanwhile.
+    subscription *sub = NULL;
+    if (job->topic_id != NO_PATTERN) {
+        sub = find_subscription(dest_client, job->topic_id);
+        if (sub && (pool_pattern(patterns, job->topic_id).text != job->topic
+                    || (sub->filter && !filter_accepts(*sub->filter, pub.value)))) {
+            sub = NULL;
         }
+    }
 
-        auto it = curr_client->subscribed_topics.find( string_topic);
-        if (it == curr_client->subscribed_topics.end()) {
-            // Did not find the topic directly, try with wildcards.
-            if (!check_wildcard_topic(string_topic, curr_client->subscribed_topics)) {
-                continue;
-            }
+    if (!sub) {
+        // Did not find the topic directly (or its filter rejected the
+        // value), try with wildcards.
+        sub = check_wildcard_topic(job->levels, dest_client->subscriptions, pub.value);
+        if (!sub) {
+            return;
         }
+    }
 
-        // Send the message to this client.
-        int rc = send_efficient(curr_client->curr_fd, msg);
-        DIE(rc < 0, "Error sending message from UDP to TCP client\n");
+    job->deliveries++;
+
+    if (dest_client->mux_link) {
+        // Sent once per connection, when all its sessions are known.
+        job->mux_batch.push_back({dest_client, sub->lane, sub->conflate});
+        return;
     }
 
-    free(msg->payload);
-    free(msg);
-}
+    if (dest_client->shm_index >= 0
+        && pub.frame->size() - pub.payload_offset <= SHM_SLOT_DATA) {
+        // The message is written in the ring only once, for all the
+        // consumers, as soon as they are all known.
+        job->shm_mask |= 1ULL << dest_client->shm_index;
+        return;
+    }
 
+    if (dest_client->udp_mode
+        && pub.frame->size() - pub.payload_offset + job->topic.length() < MAX_UDP_DELIVERY) {
+        // Numbered per topic, so the client can detect the lost datagrams.
+        udp_delivery delivery;
+        delivery.addr = dest_client->udp_addr;
+        delivery.seq = htonl(++dest_client->udp_seqs[job->topic]);
+        delivery.topic_len = job->topic.length();
 
-void Server::tokenize_topic(string &topic, vector<string> &tokens) {
-    char delim = '/';
-    stringstream topic_stream(topic);
-    string token;
+        job->udp_batch.push_back(delivery);
+        return;
+    }
 
-    while (getline(topic_stream, token, delim)) {
-        tokens.push_back(token);
+    // Queue the message for this client. For a conflating subscription,
+    // an older message on the same topic that is still queued gets
+    // overwritten, so a lagging client only gets the latest value.
+    if (dest_client->timestamps) {
+        encode_timestamped(pub);
+        queue_publication(dest_client, pub.ts_frame,
+                          sub->conflate ? job->topic : string(), pub.stamp_offset, sub->lane);
+        return;
     }
+
+    queue_publication(dest_client, pub.frame,
+                      sub->conflate ? job->topic : string(), 0, sub->lane, job->topic.length());
 }
 
 
-bool Server::check_wildcard_topic(string &topic, map<string, vector<string>> &subscr_topics) {
-    vector<string> new_tokens;
-    tokenize_topic(topic, new_tokens);
+void Server::encode_timestamped(publication &pub) {
+    if (pub.ts_frame) {
+        return;
+    }
 
-    string star_str("*");
-    string plus_str("+");
+    // The times are 64-bit, in network order.
+    uint64_t net_rx_ns = htobe64(pub.rx_ns);
+    uint64_t net_send_ns = 0;
 
-    for (auto &entry : subscr_topics) {
-        if (compare_token_vectors(entry.second, new_tokens, star_str, plus_str)) {
-            return true;
-        }
-    }
-    return false;
-}
+    string payload;
+    payload.append((char *) &net_rx_ns, sizeof(uint64_t));
+    payload.append((char *) &net_send_ns, sizeof(uint64_t));
+    payload.append(pub.frame->data() + pub.payload_offset,
+                   pub.frame->size() - pub.payload_offset);
 
+    tcp_message msg;
+    msg.command = MSG_FROM_UDP_TS;
+    msg.len = payload.length();
+    msg.payload = (char *) payload.data();
 
-bool Server::compare_token_vectors(vector<string> &old_tokens,
-                                   vector<string> &new_tokens,
-                                   string &star_str, string &plus_str) {
-    int new_size = new_tokens.size();
-    int old_size = old_tokens.size();
+    pub.ts_frame = encode_message(&msg);
+    pub.stamp_offset = pub.ts_frame->size() - msg.len + sizeof(uint64_t);
+}
 
-    int it_old = -1; // iterator through old_tokens
-    int it_new = -1; // iterator through new_tokens
 
-    while (true) {
-        it_old++;
-        it_new++;
+void Server::flush_udp_batch(fanout_job *job) {
+    if (job->udp_batch.empty()) {
+        return;
+    }
+
+    publication &pub = job->pending.front();
+
+    // The text is sent without its null terminator.
+    char *text = (char *) pub.frame->data() + pub.payload_offset;
+    size_t text_len = pub.frame->size() - pub.payload_offset - 1;
+
+    size_t count = job->udp_batch.size();
+    vector<mmsghdr> msgs(count);
+    vector<iovec> iovecs(4 * count);
+
+    for (size_t i = 0; i < count; i++) {
+        udp_delivery &delivery = job->udp_batch[i];
+        iovec *iov = &iovecs[4 * i];
+
+        iov[0].iov_base = &delivery.seq;
+        iov[0].iov_len = sizeof(delivery.seq);
+        iov[1].iov_base = &delivery.topic_len;
+        iov[1].iov_len = sizeof(delivery.topic_len);
+        iov[2].iov_base = (void *) job->topic.data();
+        iov[2].iov_len = job->topic.length();
+        iov[3].iov_base = text;
+        iov[3].iov_len = text_len;
+
+        memset(&msgs[i], 0, sizeof(mmsghdr));
+        msgs[i].msg_hdr.msg_name = &delivery.addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(delivery.addr);
+        msgs[i].msg_hdr.msg_iov = iov;
+        msgs[i].msg_hdr.msg_iovlen = 4;
+    }
 
-        if (it_old == old_size || it_new == new_size) {
+    // One system call for a whole batch of datagrams. Whatever can not
+    // be sent is lost, which the clients will notice from the numbers.
+    for (size_t sent = 0; sent < count; ) {
+        int batch = min(count - sent, (size_t) UDP_BATCH_SIZE);
+        int rc = sendmmsg(udp_sockfd, &msgs[sent], batch, MSG_DONTWAIT);
+        if (rc <= 0) {
             break;
         }
 
-        if (old_tokens[it_old] == star_str) {
-            // Found a "*" wildcard.
-            it_old++;
-            if (it_old == old_size) {
-                // The star is at the end, so return true.
-                return true;
-            }
+        sent += rc;
+    }
 
-            string after_star = old_tokens[it_old]; // next token after the *
+    job->udp_batch.clear();
+}
 
-            // Advance with the new_tokens until after_star is found.
-            while (true) {
-                if (it_new == new_size) {
-                    return false;
-                }
 
-                if (new_tokens[it_new] == after_star) {
-                    break;
-                }
+void Server::flush_mux_batch(fanout_job *job) {
+    if (job->mux_batch.empty()) {
+        return;
+    }
+
+    publication &pub = job->pending.front();
 
-                it_new++;
+    // The sessions of a connection (and lane) end up next to each other.
+    vector<mux_delivery> &batch = job->mux_batch;
+    sort(batch.begin(), batch.end(), [](const mux_delivery &a, const mux_delivery &b) {
+        if (a.session->mux_link != b.session->mux_link) {
+            return a.session->mux_link < b.session->mux_link;
+        }
+        if (a.lane != b.lane) {
+            return a.lane < b.lane;
+        }
+        if (a.conflate != b.conflate) {
+            return a.conflate < b.conflate;
+        }
+        return a.session->mux_tag < b.session->mux_tag;
+    });
+
+    vector<uint16_t> tags;
+    for (size_t start = 0; start < batch.size(); ) {
+        client *link = batch[start].session->mux_link;
+        uint8_t lane = batch[start].lane;
+        bool conflate = batch[start].conflate;
+
+        tags.clear();
+        size_t end = start;
+        while (end < batch.size() && batch[end].session->mux_link == link
+               && batch[end].lane == lane && batch[end].conflate == conflate
+               && tags.size() < MUX_MAX_TAGS) {
+            // Detached since it was matched, if it has no connection.
+            if (link && batch[end].session->is_connected) {
+                tags.push_back(batch[end].session->mux_tag);
             }
-            continue;
+            end++;
         }
+        start = end;
 
-        if (old_tokens[it_old] == plus_str) {
-            // Found a "+" wildcard. Jump over one comparison.
+        if (tags.empty()) {
             continue;
         }
 
-        // Normal case.
-        if (old_tokens[it_old] != new_tokens[it_new]) {
-            return false;
+        shared_ptr<string> frame = pub.frame;
+        size_t stamp_offset = 0;
+        if (link->timestamps) {
+            encode_timestamped(pub);
+            frame = pub.ts_frame;
+            stamp_offset = pub.stamp_offset;
+        }
+
+        shared_ptr<string> tagged = encode_mux_frame(tags.data(), tags.size(), *frame);
+        if (stamp_offset) {
+            stamp_offset += tagged->size() - frame->size();
+        }
+
+        // Conflated only with a publication for the same sessions.
+        string conflation_key;
+        if (conflate) {
+            conflation_key = job->topic + '\0';
+            conflation_key.append((char *) tags.data(), tags.size() * sizeof(uint16_t));
         }
+
+        queue_publication(link, tagged, conflation_key, stamp_offset, lane);
+        mux_frames++;
+        mux_deliveries += tags.size();
+    }
+
+    batch.clear();
+}
+
+
+bool Server::advance_fanout_job(fanout_job *job, size_t max_clients) {
+    size_t end = min(job->cursor + max_clients, job->targets.size());
+    for (; job->cursor < end; job->cursor++) {
+        deliver_to_client(job, job->targets[job->cursor]);
     }
 
-    // For a match, both iterators should have reached the end.
-    if (it_old != old_size || it_new != new_size) {
+    flush_udp_batch(job);
+
+    if (job->cursor < job->targets.size()) {
         return false;
     }
+
+    flush_mux_batch(job);
+
+    if (job->deliveries) {
+        // Counted once per publication, not once per client.
+        publication &pub = job->pending.front();
+        uint64_t hash = hh_hash(job->topic.data(), job->topic.length());
+        hh_add(&top_topic_deliveries, job->topic.data(), job->topic.length(), hash,
+               job->deliveries);
+        hh_add(&top_topic_bytes_out, job->topic.data(), job->topic.length(), hash,
+               job->deliveries * (pub.frame->size() - pub.payload_offset));
+        job->deliveries = 0;
+    }
+
+    // The first publication was delivered, prepare for the next one.
+    job->pending.pop_front();
+    job->targets.clear();
+    job->cursor = 0;
+
     return true;
 }
 
+
+void Server::start_matching(fanout_job *job) {
+    // The changes of the subscriptions are published in batches, when
+    // a topic needs to be matched.
+    index_publish(&subscription_index);
+    const match_snapshot *snapshot = index_current(&subscription_index);
+
+    job->matching = job->match_version != snapshot->version
+                    && matchers_submit(&matchers, job, job->topic, &job->levels);
+    job->offloaded = job->matching;
+    if (job->matching) {
+        offloaded_matches++;
+    }
+
+    matching_jobs.push_back(job);
+}
+
+
+void Server::collect_matches() {
+    match_request result;
+
+    while (matchers_collect(&matchers, result)) {
+        fanout_job *job = (fanout_job *) result.owner;
+        job->matched.swap(result.ids);
+        job->match_version = result.version;
+        job->matching = false;
+    }
+}
+
+
+void Server::release_matched_jobs() {
+    index_publish(&subscription_index);
+    const match_snapshot *snapshot = index_current(&subscription_index);
+
+    // Whichever thread is faster, the deliveries start in order.
+    while (!matching_jobs.empty() && !matching_jobs.front()->matching) {
+        fanout_job *job = matching_jobs.front();
+        matching_jobs.pop_front();
+
+        if (job->match_version != snapshot->version) {
+            // A pattern was added or removed since, the subscribers of the
+            // ids may not be the same.
+            snapshot_match(snapshot, job->topic, job->levels, job->matched);
+            job->match_version = snapshot->version;
+            if (job->offloaded) {
+                stale_matches++;
+            } else {
+                inline_matches++;
+            }
+        } else if (!job->offloaded) {
+            cached_matches++;
+        }
+
+        // The delivery of the first publication starts now, so take
+        // a snapshot of the subscribers that are connected at this moment.
+        // Their subscriptions and filters are checked one by one.
+        job->topic_id = pool_find(patterns, job->topic);
+        target_mark++;
+        for (uint32_t pattern_id : job->matched) {
+            for (client *subscriber : pattern_subscribers[pattern_id]) {
+                if (!subscriber->is_connected || subscriber->target_mark == target_mark) {
+                    continue;
+                }
+                subscriber->target_mark = target_mark;
+
+                if (subscriber->shm_index >= 0) {
+                    // A single write in the ring serves all of them, so
+                    // they are not left for the end of the fan-out.
+                    deliver_to_client(job, subscriber);
+                } else {
+                    job->targets.push_back(subscriber);
+                }
+            }
+        }
+
+        if (job->shm_mask) {
+            // Written before any consumer can leave and its bit be given
+            // to another one. The consumers filter the messages by it.
+            publication &pub = job->pending.front();
+            shm_ring_write(&ring, job->shm_mask, pub.frame->data() + pub.payload_offset,
+                           pub.frame->size() - pub.payload_offset - 1);
+            job->shm_mask = 0;
+        }
+
+        job->snapshot_ms = now_ms;
+        ready_jobs.push_back(job);
+    }
+}
+
+
+void Server::run_fanout_scheduler() {
+    uint64_t start = monotonic_us();
+
+    // The new jobs are matched now rather than when their publication
+    // was received, so the subscriptions made in between still count.
+    for (fanout_job *job : unmatched_jobs) {
+        start_matching(job);
+    }
+    unmatched_jobs.clear();
+
+    collect_matches();
+    release_matched_jobs();
+
+    while (!ready_jobs.empty()) {
+        fanout_job *job = ready_jobs.front();
+        ready_jobs.pop_front();
+
+        if (!advance_fanout_job(job, FANOUT_QUANTUM)) {
+            // Back at the end of the line, after the other topics.
+            ready_jobs.push_back(job);
+        } else if (job->pending.empty()) {
+            // Nothing left to deliver on this topic.
+            fanout_jobs.erase(job->topic);
+            delete job;
+        } else {
+            start_matching(job);
+            release_matched_jobs();
+        }
+
+        if (monotonic_us() - start >= FANOUT_BUDGET_US) {
+            break;
+        }
+    }
+}
+
+
+subscription *Server::check_wildcard_topic(const topic_levels &levels,
+                                           vector<subscription> &subscriptions,
+                                           decoded_value &value) {
+    for (auto &sub : subscriptions) {
+        if (!sub.has_wildcards) {
+            // Matches only its own topic, which was already checked.
+            continue;
+        }
+
+        if (match_pattern(pool_pattern(patterns, sub.pattern_id), levels)
+            && (!sub.filter || filter_accepts(*sub.filter, value))) {
+            return &sub;
+        }
+    }
+    return NULL;
+}
@@ -5,10 +5,279 @@
 #include <vector>
 #include <unordered_map>
 #include <string>
+#include <deque>
 #include <poll.h>
 #include <unistd.h>
 
 #include "protocols.h"
+#include "shm_ring.h"
+#include "timing_wheel.h"
+#include "session_spill.h"
+#include "capture_file.h"
+#include "heavy_hitters.h"
+#include "coroutine_io.h"
+#include "match_index.h"
+
+
+/**
+ * The value of a publication, decoded once when the message is received,
+ * so the content filters of the subscriptions can be evaluated on it.
+ */
+struct decoded_value {
+    int type;
+
+    // Set for INT, SHORT_REAL and FLOAT.
+    double number;
+
+    // Set for STRING.
+    std::string text;
+};
+
+
+/**
+ * What happens to the publications of the topics starting with prefix
+ * while the server is overloaded.
+ */
+struct shed_rule {
+    std::string prefix;
+
+    // 0 to drop all of them, otherwise only 1 in sample_every is kept
+    // (for each topic).
+    uint32_t sample_every;
+};
+
+
+/**
+ * Optional settings of the server, given as command line arguments.
+ */
+struct server_options {
+    // Servers of the cluster to link to, as "<ip>:<port>".
+    std::vector<std::string> peers;
+
+    // Set to keep polling the sockets without sleeping for up to
+    // busy_poll_idle_us after the last event, before sleeping again.
+    bool busy_poll = false;
+    uint64_t busy_poll_idle_us = 0;
+
+    // CPU the server is pinned to, or -1 to let the scheduler decide.
+    int cpu = -1;
+
+    // Time (in milliseconds) a connection may stay silent before it is
+    // sent a heartbeat. It is dropped after IDLE_HEARTBEATS of them.
+    uint64_t heartbeat_ms = 5000;
+
+    // Time (in seconds) the session of a disconnected client is kept in
+    // memory, before being moved to spill_path. 0 keeps it forever.
+    uint64_t session_expiry_s = 0;
+    std::string spill_path;
+
+    // Time (in seconds) a session is kept in the spill file before it is
+    // forgotten. 0 keeps it forever.
+    uint64_t spill_ttl_s = 7 * 24 * 3600;
+
+    // Set to take the sockets and the state over from a running server,
+    // which sends them on the Unix socket created at this path.
+    std::string takeover_path;
+
+    // The classes of topics that give way to the others when the
+    // datagrams wait for more than max_lag_us (or are dropped by the
+    // kernel). The first rule whose prefix matches applies.
+    std::vector<shed_rule> shed_rules;
+    uint64_t max_lag_us = 5000;
+
+    // File the received datagrams are captured to, for the replay tool.
+    std::string capture_path;
+
+    // Threads that match the topics of the publications against the
+    // subscriptions, 0 to match them in the event loop.
+    int matchers = 0;
+};
+
+
+// Counters of the sampling of a class. The topics are spread among them
+// by their hash, so the memory does not depend on the topics received.
+#define SAMPLE_COUNTERS 1024
+
+
+/**
+ * The publications received from UDP for the topics of a shed rule
+ * (or for the rest of the topics) and what was shed of them.
+ */
+struct topic_class {
+    shed_rule rule;
+
+    uint64_t received;
+    uint64_t shed;
+
+    // Publications seen while overloaded, by the hash of their topic, for
+    // the sampling. Topics with the same counter are sampled together.
+    // Cleared when the overload ends.
+    uint64_t sample_counts[SAMPLE_COUNTERS];
+};
+
+
+/**
+ * A publication waiting to be delivered to the subscribers of its topic.
+ */
+struct publication {
+    // Encoded MSG_FROM_UDP message, shared by all the receivers.
+    std::shared_ptr<std::string> frame;
+
+    decoded_value value;
+
+    // Offset of the formatted text (the payload) in the frame.
+    size_t payload_offset;
+
+    // Time the server received it (from the kernel, for the datagrams).
+    uint64_t rx_ns;
+
+    // Encoded MSG_FROM_UDP_TS message, built the first time a client
+    // that wants the timestamps gets it, and where its send time goes.
+    std::shared_ptr<std::string> ts_frame;
+    size_t stamp_offset;
+};
+
+
+/**
+ * A publication that will be sent as a datagram to a client in UDP mode.
+ */
+struct udp_delivery {
+    struct sockaddr_in addr;
+
+    // Header of the datagram: sequence number (in network order) of the
+    // publication for this topic and this client, then the topic length.
+    uint32_t seq;
+    uint8_t topic_len;
+};
+
+
+/**
+ * Current window of an aggregate for a single topic.
+ */
+struct aggregate_window {
+    uint64_t count = 0;
+    double sum = 0;
+    double min = 0;
+    double max = 0;
+};
+
+
+/**
+ * Incremental aggregate over the numeric values published on a topic
+ * (or on the topics matching a wildcard topic) during a time window, with
+ * a separate window for every topic. Shared by all the clients that asked
+ * for the same aggregate, it only keeps a constant amount of state per
+ * topic, whatever the number of samples.
+ */
+struct aggregate {
+    // The key, as "<topic> <function> <window>".
+    std::string spec;
+
+    std::string topic;
+    compiled_pattern pattern;
+
+    uint8_t function;
+    uint64_t window_us;
+
+    // End of the current windows, which all close together.
+    uint64_t window_end;
+
+    // The current windows, by the topics that got samples in them.
+    std::unordered_map<std::string, aggregate_window> windows;
+
+    // Closes the windows when they end.
+    wheel_timer timer;
+
+    // Ids of the subscribed clients.
+    std::set<std::string> subscriber_ids;
+};
+
+
+/**
+ * A server given with --peer, which this one links itself to, and again
+ * whenever the link is lost.
+ */
+struct peer_dial {
+    // "<ip>:<port>", as given.
+    std::string address;
+    struct sockaddr_in addr;
+
+    // Node id of the server, once it answered (0 before).
+    uint32_t node_id;
+
+    // Delay before the next attempt, doubled after each failure.
+    uint64_t retry_ms;
+    wheel_timer timer;
+};
+
+
+/**
+ * A publication for a session of a multiplexed connection, sent with the
+ * others of the same connection at the end of the delivery.
+ */
+struct mux_delivery {
+    client *session;
+
+    // From the subscription the publication was delivered for.
+    uint8_t lane;
+    bool conflate;
+};
+
+
+/**
+ * The delivery work for a topic. Publications of the same topic are
+ * delivered one after the other, to keep their order, while the jobs of
+ * different topics are advanced in round-robin by the scheduler.
+ */
+struct fanout_job {
+    std::string topic;
+
+    // The topic split once, for matching it against all the wildcards.
+    topic_levels levels;
+
+    // Id of the topic in the pattern pool (NO_PATTERN if no client is
+    // subscribed to it exactly), looked up once per publication.
+    uint32_t topic_id;
+
+    // Ids of the patterns that match the topic, in the snapshot of the
+    // subscriptions with the given version. Reused by the next publications
+    // while no pattern is added or removed.
+    std::vector<uint32_t> matched;
+    uint64_t match_version;
+
+    // Set while a matcher thread looks for them, and if it was asked to.
+    bool matching;
+    bool offloaded;
+
+    // The first one is currently being delivered.
+    std::deque<publication> pending;
+
+    // Clients subscribed to the matched patterns that were connected when
+    // the delivery of the first publication started and the index of the
+    // next one to check.
+    std::vector<client*> targets;
+    size_t cursor;
+
+    // Time the targets were taken, a client disconnected before it can
+    // not be among them.
+    uint64_t snapshot_ms;
+
+    // Datagrams for the clients in UDP mode, sent together at the end
+    // of each slice.
+    std::vector<udp_delivery> udp_batch;
+
+    // Sessions of multiplexed connections the first publication goes to.
+    // Each connection gets it once, with the tags of all its sessions.
+    std::vector<mux_delivery> mux_batch;
+
+    // Consumers of the shared memory ring subscribed to the topic. The
+    // publication is written in the ring as soon as they are known, before
+    // the delivery to the other subscribers.
+    uint64_t shm_mask;
+
+    // Clients the first publication was delivered to so far.
+    uint64_t deliveries;
+};
 
 
 class Server {
@@ -21,9 +290,172 @@ class Server {
     // Mappings of <id, client> type.
     std::unordered_map<std::string, client*> clients;
 
+    // The topics the clients are subscribed to, each one stored once.
+    pattern_pool patterns;
+
+    // The connected clients, in no particular order, so the fan-out only
+    // goes through them, and the same clients by their fd.
+    std::vector<client*> connected_clients;
+    std::unordered_map<int, client*> fd_clients;
+
+    // Sessions of the clients that were disconnected for too long, and the
+    // timer that expires them and compacts the file.
+    session_spill spill;
+    wheel_timer spill_timer;
+
+    // Capture of the received datagrams, if one was started.
+    capture_writer capture;
+
+    // The heaviest topics (by publications and bytes received, and by
+    // deliveries and bytes sent) and publishers (by publications and
+    // bytes), in fixed memory.
+    space_saving top_topic_msgs;
+    space_saving top_topic_bytes_in;
+    space_saving top_topic_deliveries;
+    space_saving top_topic_bytes_out;
+    space_saving top_source_msgs;
+    space_saving top_source_bytes;
+
     std::vector<pollfd> poll_fds;
     int num_pollfds;
 
+    // Mappings of <fd, position in poll_fds> type, for the listen socket
+    // and the connections, so their events are changed without a scan.
+    std::unordered_map<int, size_t> pollfd_positions;
+
+    // Copy of the pollfds of the connections that had events, in a loop.
+    std::vector<pollfd> ready_fds;
+
+    // Mappings of <topic, delivery job> type, for the topics with
+    // publications that are not completely delivered yet.
+    std::unordered_map<std::string, fanout_job*> fanout_jobs;
+
+    // Jobs in the order in which the scheduler will advance them.
+    std::deque<fanout_job*> ready_jobs;
+
+    // New jobs, matched when the scheduler runs next, and the jobs being
+    // matched, in the order in which their publications are to start.
+    std::vector<fanout_job*> unmatched_jobs;
+    std::deque<fanout_job*> matching_jobs;
+
+    // The patterns with subscribers, as immutable snapshots that the
+    // matcher threads read without locks, and the clients subscribed to
+    // each pattern (by id), which only the loop uses.
+    match_index subscription_index;
+    match_pool matchers;
+    std::vector<std::vector<client*>> pattern_subscribers;
+
+    // Mark of the last fan-out whose targets were taken.
+    uint64_t target_mark;
+
+    // Topics matched by the threads, in the loop, again in the loop because
+    // the patterns changed after the thread did, and not at all because
+    // they did not change since the previous publication of the topic.
+    uint64_t offloaded_matches;
+    uint64_t inline_matches;
+    uint64_t stale_matches;
+    uint64_t cached_matches;
+
+    // Mappings of <spec, aggregate> type.
+    std::map<std::string, aggregate*> aggregates;
+
+    // The same aggregates by topic (there may be several functions and
+    // windows for a topic): those without wildcards are found with the
+    // topic of the publication, the others are matched once per topic.
+    std::unordered_map<std::string, std::vector<aggregate*>> exact_aggregates;
+    std::unordered_map<std::string, std::vector<aggregate*>> wildcard_aggregates;
+
+    server_options options;
+
+    // Random id of this server in the cluster.
+    uint32_t node_id;
+
+    // Sequence number of the last publication received from UDP.
+    uint64_t publish_seq;
+
+    // Time of the last event, for the busy polling mode.
+    uint64_t last_activity_us;
+
+    // Mappings of <fd, peer> type, for the linked servers.
+    std::unordered_map<int, peer*> peers;
+
+    // The servers given with --peer. Never resized once filled, the timers
+    // of the wheel point to them.
+    std::vector<peer_dial> dials;
+
+    // Mappings of <fd, dial> type, for the links this server opened and
+    // whose PEER_HELLO answer did not arrive yet.
+    std::unordered_map<int, peer_dial*> pending_links;
+
+    // Mappings of <topic, number of subscriptions> type, for the topics
+    // the connected clients are interested in. Advertised to the peers.
+    std::map<std::string, int> local_interest;
+
+    // Mappings of <node id, last sequence number> type, for the
+    // publications that were forwarded by the peers.
+    std::unordered_map<uint32_t, uint64_t> last_peer_seq;
+
+    // Ring shared with the subscribers running on the same host, created
+    // when the first of them connects.
+    shm_ring ring;
+
+    // Bit i is set if the consumer index i is taken.
+    uint64_t shm_consumers;
+
+    // Buffers for the publications received over TCP (from a PUBLISH
+    // batch or from a peer), which can be bigger than the UDP ones.
+    std::vector<char> record_buff;
+    std::vector<char> record_formatted;
+
+    // Timers of the handshakes, heartbeats and write stalls.
+    timing_wheel wheel;
+    std::vector<wheel_timer*> expired_timers;
+
+    // Time of the last poll() wake up, in milliseconds.
+    uint64_t now_ms;
+
+    // The connections of the clients and of the peers (and of those that
+    // did not identify themselves yet), each one served by a coroutine,
+    // by their fd.
+    coro_loop loop;
+    std::unordered_map<int, coro_conn*> connections;
+
+    // The TCP listen socket, served by the coroutine that accepts.
+    coro_conn listener;
+
+    // Shedding classes, the last one (with no prefix) being the rest of
+    // the topics, which are never shed.
+    std::vector<topic_class> topic_classes;
+
+    // Age of the datagrams when the loop reads them (moving average and
+    // maximum since the last "stats" command), in nanoseconds.
+    uint64_t ingress_lag_ns;
+    uint64_t max_ingress_lag_ns;
+
+    // Counter of the datagrams the kernel dropped because the queue of
+    // the UDP socket was full (SO_RXQ_OVFL), and publications that could
+    // not be interpreted.
+    uint32_t kernel_drops;
+    uint64_t invalid_publications;
+
+    // Overload state: set while the lag is too high or the kernel drops
+    // datagrams, the time it was last seen and the number of episodes.
+    bool overloaded;
+    uint64_t last_overload_ms;
+    uint64_t overload_episodes;
+
+    // Time the last datagram was read.
+    uint64_t last_datagram_ms;
+
+    // Frames sent to the multiplexed connections and the deliveries to
+    // their sessions they carried.
+    uint64_t mux_frames;
+    uint64_t mux_deliveries;
+
+    // Set once the sockets were handed off to a new server, which keeps
+    // using the ring and the spill file after this one exits.
+    bool handed_off;
+
 
     /**
      * Returns a new sockaddr_in struct with the basic IPv4 specifications.
@@ -37,25 +469,206 @@ class Server {
     void prepare_udp_socket();
 
 
+    /**
+     * In the busy polling mode, asks the kernel to busy poll the device
+     * queue of the socket as well, instead of waiting for the interrupt.
+     */
+    void enable_busy_poll(int sockfd);
+
+
+    /**
+     * Pins the server to options.cpu, if set, so it does not migrate
+     * across cores (and lose its caches).
+     */
+    void pin_to_cpu();
+
+
     /**
      * Sets up the TCP socket for listening for new connections.
      */
     void prepare_tcp_socket();
 
 
+    /**
+     * Adds the pollfds of stdin and of the UDP and TCP sockets, which
+     * are the first ones in poll_fds.
+     */
+    void add_listen_pollfds();
+
+
+    /**
+     * Creates the spill file, if the sessions expire.
+     */
+    void prepare_spill();
+
+
+    /**
+     * Arms the timer of the spill file for the next compaction step, or
+     * else for the oldest record to expire (if they do).
+     */
+    void arm_spill_timer();
+
+
+    /**
+     * Expires a batch of the old records of the spill file and copies a
+     * step of its compaction, if one is needed.
+     */
+    void maintain_spill();
+
+
     /**
      * Parses input collected from the STDIN socket.
-     * @return true if the input is "exit", false otherwise.
+     * @return true if the input is "exit" (or a successful "handoff"),
+     * false otherwise.
      */
     bool check_stdin_data();
 
 
     /**
-     * Sends accept/deny message to the client who requested to connect.
+     * Gives everything to the new server waiting on the Unix socket at
+     * path: the listening sockets, the connections (with what is still
+     * queued for them), the sessions, the aggregates, the ring and the
+     * spill file. The pending fan-outs are delivered first.
+     * @return true if the new server took over, false if this one must
+     * keep serving
+     */
+    bool hand_off(const std::string &path);
+
+
+    /**
+     * Serializes the state for hand_off(), with the sockets and files
+     * it refers to added to fds.
+     */
+    std::string encode_state(std::vector<int> &fds);
+
+
+    /**
+     * Waits on options.takeover_path for the running server and takes
+     * over its sockets and state, instead of creating new ones.
+     */
+    void take_over();
+
+
+    /**
+     * Rebuilds the state sent by encode_state(), with the received fds.
+     * @return true on success, false if the state is not valid
+     */
+    bool restore_state(const std::string &state, std::vector<int> &fds);
+
+
+    /**
+     * Memory used by the subscriptions of the client, in bytes: what it
+     * owns (the array and the filters) and its share of the patterns,
+     * each pattern being split between all its subscribers.
+     */
+    void subscription_memory(client *target_client, size_t &own, double &shared);
+
+
+    /**
+     * Prints the memory used by the subscriptions of the given client (or
+     * of every client, if the id is empty) and by the pattern pool.
+     */
+    void print_memory_report(const std::string &client_id);
+
+
+    /**
+     * Prints the ingress counters: the kernel drops, the lag, and what
+     * was received and shed for each topic class.
+     */
+    void print_ingress_stats();
+
+
+    /**
+     * Prints what is queued for the connected clients, and how many
+     * publications were dropped because their queue was full.
+     */
+    void print_outbound_stats();
+
+
+    /**
+     * Prints how many clients use flow control, and what waits for credit.
+     */
+    void print_credit_stats();
+
+
+    /**
+     * Prints the multiplexed connections with their sessions, and how many
+     * deliveries each of their frames carried on average.
+     */
+    void print_mux_stats();
+
+
+    /**
+     * Prints how many connected clients use topic aliases, how often the
+     * aliases were defined and used, and the bytes this saved.
+     */
+    void print_alias_stats();
+
+
+    /**
+     * Prints the patterns of the current snapshot and how the topics of
+     * the publications were matched against them.
+     */
+    void print_match_stats();
+
+
+    /**
+     * Starts capturing the received datagrams to the file at path (after
+     * stopping the current capture), or only stops if path is empty.
+     */
+    void set_capture(const std::string &path);
+
+
+    /**
+     * Counts a received publication (len bytes, with the topic at its
+     * start) for its topic and its publisher.
+     */
+    void account_ingress(const char *topic, struct sockaddr_in &src_addr, size_t len);
+
+
+    /**
+     * Prints the count heaviest topics and publishers of every sketch.
+     */
+    void print_top(size_t count);
+
+
+    /**
+     * Updates the overload state with a new datagram: its age when it
+     * was read and the drop counter of the socket, if it was reported.
+     */
+    void update_overload(uint64_t lag_ns, bool has_drops, uint32_t drops);
+
+
+    /**
+     * Applies the shedding policy to a publication received from UDP.
+     * @param topic The null-terminated topic
+     * @return true if it must be dropped, false otherwise
+     */
+    bool shed_publication(const char *topic);
+
+
+    /**
+     * Encodes the accept/deny message for the client who requested to connect.
      * @param response true to accept connection, false to decline
-     * @param client_sockfd Socket to communicate with the requester
+     * @param info Details for the accepted client (i.e. where to find the
+     * shared memory ring), sent as payload if not empty
+     */
+    std::shared_ptr<std::string> encode_connection_response(bool response,
+                                                            const std::string &info = "");
+
+
+    /**
+     * Gives the client a consumer index of the shared memory ring (which
+     * is created if needed), if it connected from the same host.
+     * @return true on success, false if the client must use TCP
      */
-    void send_connection_response(bool response, int client_sockfd);
+    bool attach_shm_consumer(client *new_client, struct sockaddr_in &client_addr);
+
+
+    /**
+     * Describes, for the accepted client, the ring it must read from, if any.
+     */
+    std::string connection_info(client *new_client);
 
 
     /**
@@ -66,98 +679,673 @@ class Server {
 
 
     /**
-     * Manages new connection request from a TCP client. Accepts if
-     * the client had not been previously registered or if he tries
-     * to reconnect, declines otherwise.
+     * Removes the pollfd of the given fd (closed outside the loop over
+     * the poll_fds, i.e. by a timer). The last pollfd takes its place.
      */
-    void manage_connection_request();
+    void remove_pollfd(int fd);
 
 
     /**
-     * Traverses the client database and returns the <id, client> map
-     * entry pair for which the client has the requested fd (or a
-     * placeholder if no such entry exists).
+     * Enables or disables the POLLOUT event for the pollfd of the given fd.
      */
-    std::pair<std::string, client*> get_client_from_fd(int fd);
+    void set_pollout(int fd, bool enable);
 
 
     /**
-     * Checks if the client corresponding to client_fd can perform the
-     * requested subscribe/unsubscribe operation and sends success/failure
-     * message. If possible, executes the requested operation.
+     * Enables or disables events for the pollfd of the given fd (also the
+     * listen socket).
      */
-    void manage_subscribe_unsubscribe(int client_fd, tcp_message *req_msg);
+    void set_poll_events(int fd, short events, bool enable);
 
 
     /**
-     * Receives a message from a UDP client.
-     * Stores the sender details and the topic in the formatted_msg, then
-     * calls the interpret() method, to complete the rest of the message.
-     * If the message turns out to be valid, calls send_msg_if_subscribed()
-     * to send it to all the clients that are subscribed to the received topic.
-     *
-     * @param client_fd fd of the UDP client that sends the message
-     * @param buff Destination buffer for the received message
-     * @param formatted_msg Buffer to store the formatted message that would be
-     * sent to the TCP clients
+     * set_poll_events() for the coroutine runtime, context being the server.
      */
-    void manage_udp_message(int client_fd, char *buff, char *formatted_msg);
+    static void watch_fd(void *context, int fd, short events, bool enable);
 
 
     /**
-     * Interprets the message received from the UDP client, based on a
-     * predefined protocol. Appends it to formatted_msg.
-     *
-     * @param data_type Flag that announces the type of the payload data
-     * @param udp_payload The actual data received from the UDP client
-     * @param buffer Start of the memory zone of the formatted message
-     * where the actual message should be appended (before it, metadata
-     * was written).
-     * @return true if the message from UDP is in valid format, false otherwise
+     * Writes as much as possible from the outbound queue of the client and
+     * asks poll() to report when the socket becomes writable again if
+     * something is left.
      */
-    bool interpret_udp_payload(int data_type, char *udp_payload, char *formatted_msg);
+    void flush_client(client *dest_client);
 
 
     /**
-     * Iterates over the client database and sends the message to all
-     * the clients that are subscribed to the topic, also considering
-     * the wildcards.
+     * Puts a frame in the client's outbound queue and tries to send it. If
+     * the queue is over MAX_QUEUED_MESSAGES or MAX_QUEUED_BYTES, its oldest
+     * publications are dropped, from the low lane first.
+     * @param conflation_key Topic of the message if it may be overwritten
+     * by a newer one while still queued, empty string otherwise
+     * @param stamp_offset Where the send time goes in the frame, if any
+     * @param lane Priority lane of the frame in the queue
+     * @param topic_len Length of the topic of a publication that may be
+     * sent with an alias, 0 otherwise
+     * @return the queued frame it overwrote (conflated), if any, else NULL
      */
-    void send_msg_if_subscribed(char *topic, char *formatted_msg);
+    std::shared_ptr<std::string> queue_frame(client *dest_client,
+                                             std::shared_ptr<std::string> frame,
+                                             const std::string &conflation_key,
+                                             size_t stamp_offset = 0, int lane = LANE_NORMAL,
+                                             uint8_t topic_len = 0);
 
 
     /**
-     * Tokenizes the topic using '/' as delimiter and places the
-     * tokens into the tokens vector.
+     * Queues a message without payload (i.e. a subscribe answer) for the client.
      */
-    void tokenize_topic(std::string &topic, std::vector<std::string> &tokens);
+    void queue_command(client *dest_client, uint8_t command);
 
 
     /**
-     * Iterates over the client's topics, trying to match the given topic's
-     * tokens to one of the subscribed topics' tokens.
-     * @param topic Topic to search if the client is subscribed to
-     * @param subscr_topics Topics the client is subscribed to.
-     * @return true, if the client is subscribed to the topic, false otherwise
+     * Queues a publication for the client: directly, like queue_frame(),
+     * unless it uses flow control, in which case it waits for credit.
+     */
+    void queue_publication(client *dest_client, std::shared_ptr<std::string> frame,
+                           const std::string &conflation_key, size_t stamp_offset = 0,
+                           int lane = LANE_NORMAL, uint8_t topic_len = 0);
+
+
+    /**
+     * Moves the held publications of the client to its outbound queue,
+     * as long as it has credit.
+     */
+    void release_credit(client *dest_client);
+
+
+    /**
+     * Adds the credit of a CREDIT_GRANT (two 32-bit numbers in network
+     * order: publications and bytes) to the window of the client.
+     */
+    void manage_credit_grant(client *src_client, tcp_message *msg);
+
+
+    /**
+     * Arms the heartbeat timer of a new connection.
+     * @param owner The client or peer, the timers tell which by their kinds
+     */
+    void start_liveness(liveness *live, void *owner, int idle_kind, int stall_kind);
+
+
+    /**
+     * Disarms the timers of a connection that is closed.
+     */
+    void stop_liveness(liveness *live);
+
+
+    /**
+     * Updates the write stall timer after flushing an outbound queue: it
+     * is armed while the queue is not empty, and pushed back whenever
+     * some bytes are written.
+     * @param pending true if the queue is not empty
+     * @param progress true if the flush wrote something
+     */
+    void watch_write_stall(liveness *live, bool pending, bool progress);
+
+
+    /**
+     * Manages the expired heartbeat timer of a connection: it is armed
+     * again if something was received meanwhile, otherwise a heartbeat
+     * is sent or, if one was already sent, the connection is declared dead.
+     * @return true if the connection must be dropped
      */
-    bool check_wildcard_topic(std::string &topic,
-                              std::map<std::string, std::vector<std::string>> &subscr_topics);
+    bool idle_timer_expired(liveness *live, bool &send_ping);
 
 
     /**
-     * Wildcard topic matching algorithm.
-     * Executes the iteration over two vectors of string tokens,
-     * determining if they match (considering the wildcards).
-     * @param old_tokens Tokens from a topic the client is subscribed to
-     * (might contain wildcards)
-     * @param new_tokens Tokens of a queried topic
-     * @param star_str The string "*"
-     * @param plus_str The string "+"
-     * @return true, if the two vectors match, false, otherwise
+     * Manages the expired write stall timer of a connection.
+     * @return true if nothing could be written for WRITE_STALL_TIMEOUT_MS
+     */
+    bool stall_timer_expired(liveness *live);
+
+
+    /**
+     * Processes the timers that expired since the last call: closes the
+     * dead connections (and the late handshakes) and sends the heartbeats.
+     */
+    void expire_timers();
+
+
+    /**
+     * Adds the client to the connected ones, with its new socket.
+     */
+    void mark_connected(client *target_client, int fd);
+
+
+    /**
+     * Removes the client from the connected ones (in O(1), the last one
+     * taking its place) and arms its session expiry, if enabled.
+     */
+    void mark_disconnected(client *target_client);
+
+
+    /**
+     * Arms the session expiry of a disconnected client, if enabled.
+     */
+    void arm_session_expiry(client *target_client);
+
+
+    /**
+     * Serializes what outlives a connection: the subscriptions (with the
+     * state of their filters) and the aggregate specs.
+     */
+    std::string encode_session(client *target_client);
+
+
+    /**
+     * Adds the subscriptions and the aggregate specs of an encoded
+     * session to the client.
+     * @return true on success, false if the session is corrupted
+     */
+    bool decode_session(client *target_client, const std::string &session);
+
+
+    /**
+     * Loads the session of the client back from the spill file, if it
+     * was evicted, and registers it (as disconnected) with its aggregates.
+     * @return the client, or NULL if there is no such session
+     */
+    client *restore_session(const std::string &client_id);
+
+
+    /**
+     * Writes the session of a client that stayed disconnected for too long
+     * to the spill file and frees it, taking it out of its aggregates. It is
+     * postponed while a fan-out that started before the disconnection may
+     * still point to the client.
+     * @return true if the client was freed
+     */
+    bool evict_session(client *target_client);
+
+
+    /**
+     * Marks the client owning the pollfd as disconnected and closes its socket.
+     */
+    void disconnect_client(int client_fd);
+
+
+    /**
+     * Makes the listen socket non-blocking and starts the coroutine that
+     * accepts the connections.
+     */
+    void start_acceptor();
+
+
+    /**
+     * Coroutine accepting the TCP connections, each one getting its own
+     * coroutine. When out of fds, it waits a bit instead of spinning.
+     */
+    conn_task accept_connections(coro_conn *listen_conn);
+
+
+    /**
+     * Registers a connection and its pollfd, without starting its coroutine.
+     * @param pending_input Bytes already received on it (on a hot restart)
+     */
+    coro_conn *add_connection(int fd, const struct sockaddr_in &addr,
+                              const std::string &pending_input = "");
+
+
+    /**
+     * Coroutine serving a TCP connection: waits for its first message (for
+     * at most HANDSHAKE_TIMEOUT_MS) if both src_client and src_peer are
+     * NULL, then manages the messages of the client (or of the peer) until
+     * the connection is closed. The reads never block the loop, a partial
+     * message just suspends the coroutine.
+     */
+    conn_task serve_connection(coro_conn *conn, client *src_client, peer *src_peer = NULL);
+
+
+    /**
+     * Manages the first message of a connection. Accepts if the client had
+     * not been previously registered or if it tries to reconnect, queuing
+     * the response.
+     * @return the client, or NULL if it is already connected elsewhere
+     */
+    client *identify_client(coro_conn *conn, tcp_message *msg);
+
+
+    /**
+     * Manages a message of a connected client (anything but its id).
+     */
+    void manage_client_message(client *src_client, tcp_message *msg);
+
+
+    /**
+     * Identifies a client carried by the multiplexed connection of link
+     * (MUX_ATTACH: its tag, then its id) and answers with a MUX_FRAME. It
+     * is accepted like a client connecting on its own socket.
+     */
+    void attach_session(client *link, tcp_message *msg);
+
+
+    /**
+     * Disconnects a session of a multiplexed connection (MUX_DETACH, or
+     * when the connection itself is closed).
+     */
+    void detach_session(client *session);
+
+
+    /**
+     * Manages a MUX_FRAME received from a multiplexed connection, as a
+     * message of the session it is tagged with.
+     */
+    void manage_session_message(client *link, tcp_message *msg);
+
+
+    /**
+     * Closes a connection that is not a client's (anymore), from its coroutine.
+     */
+    void close_connection(coro_conn *conn);
+
+
+    /**
+     * Forgets the connection of a client disconnected outside of its
+     * coroutine (i.e. by a timer) and destroys the coroutine.
+     */
+    void cancel_connection(int fd);
+
+
+    /**
+     * Frees the connections whose coroutine ended.
+     */
+    void reap_connections();
+
+
+    /**
+     * Returns the <id, client> pair for which the client has the requested
+     * fd (or a placeholder if no such client exists).
+     */
+    std::pair<std::string, client*> get_client_from_fd(int fd);
+
+
+    /**
+     * Parses the options sent after the topic in a subscribe request
+     * (space separated words) and sets them in the subscription.
+     * @return true if all the options are valid, false otherwise
+     */
+    bool parse_subscription_options(const char *options, subscription &sub);
+
+
+    /**
+     * Compiles the words that follow "where" in the subscription options
+     * (i.e. "> 30", "between 10 20", "prefix abc", "changed") into a filter.
+     * @return true if the predicate is valid, false otherwise
+     */
+    bool parse_content_filter(std::vector<std::string> &words, content_filter &filter);
+
+
+    /**
+     * Evaluates the filter of a subscription on a decoded value. A filter
+     * that compares numbers never accepts strings and vice versa.
+     * @return true if the publication should be delivered, false otherwise
+     */
+    bool filter_accepts(content_filter &filter, decoded_value &value);
+
+
+    /**
+     * Finds the client's subscription to the pattern with the given id.
+     * @return the subscription, or NULL if there is none
+     */
+    subscription *find_subscription(client *target_client, uint32_t pattern_id);
+
+
+    /**
+     * Checks if the client can perform the requested subscribe/unsubscribe
+     * operation and sends success/failure message. If possible, executes
+     * the requested operation.
+     */
+    void manage_subscribe_unsubscribe(client *req_client, tcp_message *req_msg);
+
+
+    /**
+     * Checks if the client can subscribe to (or unsubscribe from) the
+     * requested aggregate and sends a success/failure message. The payload
+     * holds the topic, then the aggregate function and the window (i.e.
+     * "avg 1s").
+     */
+    void manage_aggregate_request(client *req_client, tcp_message *req_msg);
+
+
+    /**
+     * Adds the client to the subscribers of the aggregate, creating it from
+     * its spec if it does not exist.
+     * @return false if the spec is not valid
+     */
+    bool join_aggregate(const std::string &spec, const std::string &client_id);
+
+
+    /**
+     * Removes the client from the subscribers of the aggregate, which is
+     * deleted once nobody is subscribed to it.
+     */
+    void leave_aggregate(const std::string &spec, const std::string &client_id);
+
+
+    /**
+     * Adds the aggregate to the indexes by topic and arms the timer that
+     * closes its windows.
+     */
+    void index_aggregate(aggregate *agg);
+
+
+    /**
+     * Removes the aggregate from the indexes by topic and cancels its timer.
+     */
+    void unindex_aggregate(aggregate *agg);
+
+
+    /**
+     * Adds the value of a numeric publication to the window of its topic in
+     * all the aggregates whose topic matches.
+     */
+    void update_aggregates(char *topic, decoded_value &value);
+
+
+    /**
+     * Closes the windows of the aggregate, sending one summary message per
+     * topic to all its connected subscribers, then starts new ones.
+     */
+    void close_aggregate_windows(aggregate *agg);
+
+
+    /**
+     * Links this server to the peers given in the options, except those it
+     * is already linked to (after a hot restart).
+     */
+    void connect_to_peers();
+
+
+    /**
+     * Starts a non-blocking connection to the peer, unless it is linked
+     * already. The coroutine of the link sends the hello once it is made and
+     * waits for the answer.
+     */
+    void dial_peer(peer_dial *dial);
+
+
+    /**
+     * Tries to link to the peer again later, waiting twice as long as the
+     * previous time (up to PEER_RETRY_MAX_MS).
+     */
+    void retry_dial(peer_dial *dial);
+
+
+    /**
+     * Closes a link this server opened that was not made (unreachable or
+     * refused) and tries again later.
+     */
+    void retry_link(coro_conn *conn, peer_dial *dial);
+
+
+    /**
+     * Returns the PEER_HELLO message, with the node id.
+     * @param linked Whether it answers a link that is not kept, because the
+     * two servers are already linked
+     */
+    std::shared_ptr<std::string> encode_peer_hello(bool linked);
+
+
+    /**
+     * Registers a linked server and advertises the local interest to it,
+     * after answering its hello if needed.
+     */
+    peer *register_peer(int peer_sockfd, uint32_t peer_id, std::string address,
+                        bool send_hello);
+
+
+    /**
+     * Completes the handshake of a link, opened by this server (the hello
+     * is the answer) or by the other one (the hello is answered). Once the
+     * node of a dial answered, its link is made again whenever it is lost.
+     * When the two servers dialed each other, the link opened by the lower
+     * node id replaces the other one.
+     * @param hello The PEER_HELLO message it sent
+     * @return the new peer, or NULL if the two servers are already linked
+     */
+    peer *accept_peer(coro_conn *conn, tcp_message *hello);
+
+
+    /**
+     * Drops the link to a peer, together with its interest. A server given
+     * with --peer is dialed again later, unless another link to it is made
+     * or being made.
+     */
+    void remove_peer(int peer_sockfd);
+
+
+    /**
+     * Same as flush_client(), for the link to a peer.
+     */
+    void flush_peer(peer *dest_peer);
+
+
+    /**
+     * Manages an interest update or a publication forwarded by a peer.
+     */
+    void manage_peer_message(peer *src_peer, tcp_message *msg);
+
+
+    /**
+     * Sends an interest update (PEER_INTEREST_ADD/DEL) to all the peers.
+     */
+    void broadcast_interest(uint8_t command, const std::string &topic);
+
+
+    /**
+     * Adds the client to the subscribers of the pattern. A pattern that
+     * gets its first subscriber is added to the next snapshot.
+     */
+    void add_subscriber(uint32_t pattern_id, client *target_client);
+
+
+    /**
+     * Removes the client from the subscribers of the pattern (before the
+     * subscription releases it). A pattern that loses its last subscriber
+     * is removed from the next snapshot.
+     */
+    void remove_subscriber(uint32_t pattern_id, client *target_client);
+
+
+    /**
+     * Counts a new local subscription to the topic. The first one is
+     * advertised to the peers.
+     */
+    void add_local_interest(const std::string &topic);
+
+
+    /**
+     * Forgets a local subscription to the topic. When none is left, the
+     * peers are told to stop forwarding it.
+     */
+    void remove_local_interest(const std::string &topic);
+
+
+    /**
+     * Adds (or removes) all the topics of the client to (from) the local
+     * interest, when it connects (or disconnects).
+     */
+    void update_client_interest(client *target_client, bool connected);
+
+
+    /**
+     * Manages a PUBLISH batch: every record is a publication in the UDP
+     * format, preceded by its 32-bit length, and goes through the same
+     * pipeline as the datagrams, in order.
+     */
+    void manage_publish_batch(client *src_client, tcp_message *msg);
+
+
+    /**
+     * Copies a publication of at most MAX_PUBLISH_RECORD bytes in a zeroed
+     * buffer and calls process_publication() on it.
+     */
+    void process_record(const char *record, size_t len, struct sockaddr_in &src_addr,
+                        bool forward);
+
+
+    /**
+     * Forwards a publication received from UDP (or from a publisher over
+     * TCP) to the peers that have clients interested in its topic (and
+     * only to them).
+     */
+    void forward_to_peers(char *buff, int len, struct sockaddr_in &src_addr, char *topic);
+
+
+    /**
+     * Interprets a publication in the UDP format (received directly or
+     * forwarded by a peer) and delivers it to the local subscribers.
+     * @param buff The publication, followed by zeroes (at least up to the
+     * largest numeric payload)
+     * @param len Length of the publication
+     * @param src_addr Address of the client that published it
+     * @param formatted_msg Buffer for the message sent to the TCP clients,
+     * of at least len + MAX_UDP_MSG bytes
+     * @param forward true if the publication should also go to the peers
+     * @param rx_ns Time the publication was received, in nanoseconds
+     */
+    void process_publication(char *buff, int len, struct sockaddr_in &src_addr,
+                             char *formatted_msg, bool forward, uint64_t rx_ns);
+
+
+    /**
+     * Receives a datagram from a UDP client, with the kernel receive
+     * timestamp and drop counter, which update the overload state. The
+     * datagram is captured and counted first, then shed if the server is
+     * overloaded and its topic is in a shed (or sampled) class. Otherwise
+     * process_publication() interprets, forwards and delivers it.
+     *
+     * @param client_fd fd of the UDP client that sends the message
+     * @param buff Destination buffer for the received message
+     * @param formatted_msg Buffer to store the formatted message that would be
+     * sent to the TCP clients
+     */
+    void manage_udp_message(int client_fd, char *buff, char *formatted_msg);
+
+
+    /**
+     * Interprets the message received from the UDP client, based on a
+     * predefined protocol. Appends it to formatted_msg.
+     *
+     * @param data_type Flag that announces the type of the payload data
+     * @param udp_payload The actual data received from the UDP client
+     * @param buffer Start of the memory zone of the formatted message
+     * where the actual message should be appended (before it, metadata
+     * was written).
+     * @param value Destination for the decoded value, used by the filters
+     * @return true if the message from UDP is in valid format, false otherwise
+     */
+    bool interpret_udp_payload(int data_type, char *udp_payload, char *formatted_msg,
+                               decoded_value *value);
+
+
+    /**
+     * Encodes the message and hands it to the fan-out scheduler, which will
+     * send it to all the clients that are subscribed to the topic, also
+     * considering the wildcards.
+     */
+    void send_msg_if_subscribed(char *topic, char *formatted_msg, decoded_value &value,
+                                uint64_t rx_ns);
+
+
+    /**
+     * Encodes the MSG_FROM_UDP_TS version of the publication, if it was
+     * not done yet: the receive time, room for the send time, then the text.
+     */
+    void encode_timestamped(publication &pub);
+
+
+    /**
+     * Queues the first pending publication of the job for the client,
+     * if the client is subscribed to the job's topic.
+     */
+    void deliver_to_client(fanout_job *job, client *dest_client);
+
+
+    /**
+     * Sends all the datagrams of the job's UDP batch with sendmmsg(), each
+     * one made of its own header, the topic and the shared formatted text.
+     */
+    void flush_udp_batch(fanout_job *job);
+
+
+    /**
+     * Queues the job's publication for the sessions of its mux batch: one
+     * MUX_FRAME per connection (and lane), with the tags of the sessions.
+     */
+    void flush_mux_batch(fanout_job *job);
+
+
+    /**
+     * Parses the options sent after the id in a connection request
+     * (i.e. "udp=<port>") and sets them for the client.
+     * @param client_addr Address the client connected from
+     */
+    void parse_connect_options(tcp_message *msg, client *new_client,
+                               struct sockaddr_in &client_addr);
+
+
+    /**
+     * Sets the connection options of the client to their defaults.
+     */
+    void reset_connect_options(client *new_client, struct sockaddr_in &client_addr);
+
+
+    /**
+     * Checks the next (at most) max_clients targets of the job.
+     * @return true if the delivery of the first publication is done
+     */
+    bool advance_fanout_job(fanout_job *job, size_t max_clients);
+
+
+    /**
+     * Queues the job to find the patterns that match its topic, for its
+     * first publication: a matcher thread is given the topic, unless no
+     * pattern changed since the previous publication (or there are no
+     * threads, or they are too busy).
+     */
+    void start_matching(fanout_job *job);
+
+
+    /**
+     * Takes the results of the matcher threads.
+     */
+    void collect_matches();
+
+
+    /**
+     * Makes the matched jobs ready, in order, until one still waits for
+     * a thread. The ids found in an older snapshot than the current one
+     * (or not found yet) are matched in the loop. The connected
+     * subscribers of the patterns are the targets, each one once.
+     */
+    void release_matched_jobs();
+
+
+    /**
+     * Matches the new jobs and takes the results of the matcher threads,
+     * then advances the ready jobs in round-robin, a quantum of clients for
+     * each one, until all are done or the time budget of the event loop
+     * iteration is spent. Thus, the sockets are serviced between the
+     * slices of a big fan-out and small topics are not stuck behind it.
+     */
+    void run_fanout_scheduler();
+
+
+    /**
+     * Iterates over the client's topics, trying to match the given topic's
+     * levels to one of the subscribed topics that contain wildcards (the
+     * direct match is checked before).
+     * @param levels Topic to search if the client is subscribed to
+     * @param subscriptions Subscriptions of the client
+     * @param value Value of the publication, that must pass the filter of
+     * the matching subscription
+     * @return the matching subscription, or NULL if the client is not
+     * subscribed to the topic (or all the matches filter the value out)
      */
-    bool compare_token_vectors(std::vector<std::string> &old_tokens,
-                               std::vector<std::string> &new_tokens,
-                               std::string &star_str, std::string &plus_str);
+    subscription *check_wildcard_topic(const topic_levels &levels,
+                                       std::vector<subscription> &subscriptions,
+                                       decoded_value &value);
 
 
  public:
@@ -165,20 +1353,25 @@ class Server {
     /**
      * Constructor.
      * @param port The port the server program is being run on
+     * @param options Optional settings (i.e. the peers to link to)
      */
-    Server(uint16_t port);
+    Server(uint16_t port, server_options &options);
 
 
     /**
-     * Destructor. Sends signal to all clients to tell them to close.
-     * Closes all file descriptors and deletes the client structures.
+     * Destructor. Stops the matcher threads, closes the sockets (which the
+     * clients see as the end of their connection), deletes the clients,
+     * jobs, aggregates and peers, cancels the coroutines and closes the
+     * ring, the spill file and the capture. After a handoff, the ring and
+     * the spill file are left to the new server.
      */
     ~Server();
 
 
     /**
      * Initializes the server's TCP and UDP sockets and the pollfd
-     * structures for them and for stdin.
+     * structures for them and for stdin, then links to the peers (or
+     * takes all of them over from a running server).
      */
     void prepare();
 
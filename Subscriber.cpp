@@ -5,20 +5,79 @@
 #include <netinet/tcp.h>
 #include <unistd.h>
 #include <cstdlib>
+#include <cinttypes>
+#include <endian.h>
 #include "utils.h"
 
+// Empty reads of the ring before the reader thread goes to sleep.
+#define SHM_SPIN_READS 2000
+
+// The reader wakes up periodically to check if it must stop.
+#define SHM_WAIT_MS 100
+
 using namespace std;
 
 
-Subscriber::Subscriber(string id, uint32_t server_ip, uint16_t server_port) {
+Subscriber::Subscriber(string id, uint32_t server_ip, uint16_t server_port,
+                       subscriber_options &options) {
     this->id = id;
     this->server_ip = server_ip;
     this->server_port = server_port;
+    this->options = options;
+    this->udp_sockfd = -1;
+    this->shm_index = -1;
+    this->shm_cursor = 0;
+    this->stop_reader = false;
+    this->shm_received = 0;
+    this->shm_lost = 0;
+    this->clock_skewed = 0;
+    this->consumed_messages = 0;
+    this->consumed_bytes = 0;
+    this->sink_failed = 0;
+    this->next_tag = 0;
+    this->topic_aliases.resize(options.aliases);
 }
 
 
 Subscriber::~Subscriber() {
+    if (shm_reader.joinable()) {
+        stop_reader = true;
+        shm_reader.join();
+    }
+    shm_ring_close(&ring, false);
+    sink_close(&sink);
+
     close(tcp_sockfd);
+
+    if (udp_sockfd >= 0) {
+        close(udp_sockfd);
+    }
+}
+
+
+void Subscriber::prepare_udp_socket() {
+    udp_sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    DIE(udp_sockfd < 0, "Subscriber: UDP socket creation failed.\n");
+
+    // A bigger buffer absorbs the bursts of publications.
+    int buff_size = 4 * 1024 * 1024;
+    setsockopt(udp_sockfd, SOL_SOCKET, SO_RCVBUF, &buff_size, sizeof(int));
+
+    struct sockaddr_in udp_addr;
+    memset(&udp_addr, 0, sizeof(struct sockaddr_in));
+    udp_addr.sin_family = AF_INET;
+    udp_addr.sin_addr.s_addr = INADDR_ANY;
+    udp_addr.sin_port = htons(options.udp_port);
+
+    int rc = bind(udp_sockfd, (const struct sockaddr *)&udp_addr, sizeof(udp_addr));
+    DIE(rc < 0, "Subscriber: UDP socket bind failed.\n");
+
+    // Find out the port, in case any free one was requested.
+    socklen_t addr_len = sizeof(udp_addr);
+    rc = getsockname(udp_sockfd, (struct sockaddr *)&udp_addr, &addr_len);
+    DIE(rc < 0, "Subscriber: getsockname() failed.\n");
+
+    options.udp_port = ntohs(udp_addr.sin_port);
 }
 
 
@@ -42,6 +101,15 @@ void Subscriber::prepare() {
     // Connect to the server.
     rc = connect(tcp_sockfd, (const struct sockaddr *)&server_addr, sizeof(server_addr));
     DIE(rc < 0, "Subscriber: Connection to server failed.\n");
+
+    if (options.use_udp) {
+        prepare_udp_socket();
+    }
+
+    if (!options.sink_path.empty()) {
+        DIE(!sink_open(&sink, options.sink_path, options.sink_size),
+            "Subscriber: record sink creation failed.\n");
+    }
 }
 
 
@@ -50,12 +118,44 @@ bool Subscriber::check_connection_validity() {
     tcp_message *msg = (tcp_message*) calloc(1, sizeof(tcp_message));
     DIE(!msg, "calloc failed\n");
 
+    // The options of the connection follow the null-terminated id.
+    string connect_options;
+    if (options.use_udp) {
+        connect_options += "udp=" + to_string(options.udp_port);
+    }
+    if (options.use_shm) {
+        connect_options += string(connect_options.empty() ? "" : " ") + "shm";
+    }
+    if (options.timestamps) {
+        connect_options += string(connect_options.empty() ? "" : " ") + "timestamps";
+    }
+    if (options.mux) {
+        connect_options += string(connect_options.empty() ? "" : " ") + "mux";
+    }
+    if (options.aliases > 0) {
+        connect_options += string(connect_options.empty() ? "" : " ") + "aliases="
+                           + to_string(options.aliases);
+    }
+    if (options.credit_messages > 0) {
+        connect_options += string(connect_options.empty() ? "" : " ") + "credit="
+                           + to_string(options.credit_messages);
+        if (options.credit_bytes > 0) {
+            connect_options += ":" + to_string(options.credit_bytes);
+        }
+    }
+
     msg->command = CONNECT_REQ;
     msg->len = id.length() + 1;
+    if (!connect_options.empty()) {
+        msg->len += connect_options.length() + 1;
+    }
 
     msg->payload = (char *) malloc(msg->len);
     DIE(!msg->payload, "malloc failed\n");
     strcpy(msg->payload, id.c_str());
+    if (!connect_options.empty()) {
+        strcpy(msg->payload + id.length() + 1, connect_options.c_str());
+    }
 
     int rc = send_efficient(tcp_sockfd, msg);
     DIE(rc < 0, "Error sending id to the server\n");
@@ -68,6 +168,14 @@ bool Subscriber::check_connection_validity() {
     DIE(rc < 0, "Error receiving connect confirmation from the server\n");
 
     if (msg->command == CONNECT_ACCEPTED) {
+        // The server tells where the ring is, if it accepted to use it.
+        if (msg->len > 0) {
+            if (strncmp(msg->payload, "shm=", 4) == 0) {
+                attach_shm_ring(msg->payload + 4);
+            }
+            free(msg->payload);
+        }
+
         free(msg);
         return true;
     }
@@ -92,6 +200,13 @@ void Subscriber::run() {
     poll_fds.push_back(stdin_pollfd);
     poll_fds.push_back(tcp_pollfd);
 
+    if (udp_sockfd >= 0) {
+        pollfd udp_pollfd;
+        udp_pollfd.fd = udp_sockfd;
+        udp_pollfd.events = POLLIN;
+        poll_fds.push_back(udp_pollfd);
+    }
+
     tcp_message *msg = (tcp_message *) calloc(1, sizeof(tcp_message));
     DIE(!msg, "calloc failed\n");
 
@@ -114,48 +229,227 @@ void Subscriber::run() {
                 break;
             }
         }
+
+        if (poll_fds.size() > 2 && (poll_fds[2].revents & POLLIN)) {
+            // Got publications as datagrams.
+            manage_udp_data();
+        }
+    }
+}
+
+
+void Subscriber::send_request(tcp_message *msg, int tag) {
+    int rc;
+    if (tag < 0) {
+        rc = send_efficient(tcp_sockfd, msg);
+    } else {
+        // The request goes in a MUX_FRAME, the tag and the whole frame.
+        uint16_t session_tag = tag;
+        shared_ptr<string> frame = encode_mux_frame(&session_tag, 1, *encode_message(msg));
+
+        tcp_message mux_msg;
+        decode_frame(frame->data(), frame->size(), &mux_msg);
+        rc = send_efficient(tcp_sockfd, &mux_msg);
+        free(mux_msg.payload);
+    }
+
+    DIE(rc < 0, "Error sending request to the server\n");
+}
+
+
+int Subscriber::wait_for_answer(tcp_message *msg) {
+    // Messages for the topics the client is already subscribed to may
+    // come before the answer, so print them.
+    while (true) {
+        memset(msg, 0, sizeof(tcp_message));
+        int rc = recv_efficient(tcp_sockfd, msg);
+        if (rc <= 0) {
+            return -1;
+        }
+
+        if (msg->command == HEARTBEAT) {
+            send_command(tcp_sockfd, HEARTBEAT_ACK);
+            continue;
+        }
+
+        if (msg->command == ALIAS_DEFINE || msg->command == MSG_FROM_UDP_ALIASED) {
+            if (expand_alias(msg)) {
+                print_publication(msg);
+            }
+            free(msg->payload);
+            consume_credit(TCP_HEADER_LEN + msg->len);
+            continue;
+        }
+
+        if (msg->command == MSG_FROM_UDP || msg->command == MSG_FROM_UDP_TS) {
+            print_publication(msg);
+            free(msg->payload);
+            consume_credit(rc);
+            continue;
+        }
+
+        if (msg->command != MUX_FRAME) {
+            return rc;
+        }
+
+        tcp_message inner;
+        uint16_t tag;
+        bool printed = print_mux_publication(msg, &inner, tag);
+        free(msg->payload);
+
+        if (printed) {
+            consume_credit(rc);
+            continue;
+        }
+
+        // The answer for a session.
+        *msg = inner;
+        return rc;
+    }
+}
+
+
+bool Subscriber::print_mux_publication(tcp_message *msg, tcp_message *inner, uint16_t &tag) {
+    vector<uint16_t> tags;
+    memset(inner, 0, sizeof(tcp_message));
+    tag = 0;
+
+    if (!decode_mux_frame(msg->payload, msg->len, tags, inner)) {
+        fprintf(stderr, "Invalid tagged message from the server\n");
+        return true;
+    }
+
+    if (inner->command != MSG_FROM_UDP && inner->command != MSG_FROM_UDP_TS) {
+        tag = tags[0];
+        return false;
+    }
+
+    string sessions;
+    for (uint16_t session_tag : tags) {
+        auto it = session_ids.find(session_tag);
+        sessions += (sessions.empty() ? "" : ",")
+                    + (it != session_ids.end() ? it->second : to_string(session_tag));
+    }
+
+    print_publication(inner, sessions);
+    free(inner->payload);
+    return true;
+}
+
+
+void Subscriber::attach_detach_session(bool attach, const string &session_id) {
+    auto it = session_tags.find(session_id);
+
+    if (!attach) {
+        if (it == session_tags.end()) {
+            cout << "Session " << session_id << " is not attached\n";
+            return;
+        }
+
+        uint16_t net_tag = htons(it->second);
+        tcp_message msg;
+        msg.command = MUX_DETACH;
+        msg.len = sizeof(uint16_t);
+        msg.payload = (char *) &net_tag;
+        send_request(&msg, -1);
+
+        session_ids.erase(it->second);
+        session_tags.erase(it);
+        cout << "Session " << session_id << " detached\n";
+        return;
     }
+
+    if (it != session_tags.end() || session_ids.size() > UINT16_MAX) {
+        cout << "Session " << session_id << " is already attached\n";
+        return;
+    }
+
+    // The tags of the detached sessions are used again.
+    while (session_ids.count(next_tag)) {
+        next_tag++;
+    }
+    uint16_t tag = next_tag++;
+
+    // The payload is the tag, then the null-terminated id.
+    string payload(sizeof(uint16_t), '\0');
+    uint16_t net_tag = htons(tag);
+    memcpy(&payload[0], &net_tag, sizeof(uint16_t));
+    payload += session_id;
+    payload += '\0';
+
+    tcp_message msg;
+    msg.command = MUX_ATTACH;
+    msg.len = payload.length();
+    msg.payload = &payload[0];
+    send_request(&msg, -1);
+
+    int rc = wait_for_answer(&msg);
+    DIE(rc < 0, "Error receiving the answer for a session from the server\n");
+    free(msg.payload);
+
+    if (msg.command != CONNECT_ACCEPTED) {
+        cout << "Connection denied for session " << session_id << "\n";
+        return;
+    }
+
+    session_tags[session_id] = tag;
+    session_ids[tag] = session_id;
+    cout << "Session " << session_id << " attached\n";
 }
 
 
-void Subscriber::subscribe_unsubscribe_topic(uint8_t command, char *topic) {
+void Subscriber::subscribe_unsubscribe_topic(uint8_t command, char *topic, char *options,
+                                             int tag) {
     tcp_message *msg = (tcp_message *) calloc(1, sizeof(tcp_message));
     DIE(!msg, "calloc failed\n");
 
+    int topic_len = strlen(topic) + 1;
+    int options_len = options ? strlen(options) + 1 : 0;
+
+    // The payload is the null-terminated topic, followed by the
+    // null-terminated options, if there are any.
     msg->command = command;
-    msg->len = strlen(topic) + 1;
+    msg->len = topic_len + options_len;
     msg->payload = (char *) malloc(msg->len);
     DIE(!msg->payload, "malloc failed\n");
 
     strcpy(msg->payload, topic);
+    if (options) {
+        strcpy(msg->payload + topic_len, options);
+    }
 
     // Send the subscribe request to the server.
-    int rc = send_efficient(tcp_sockfd, msg);
-    DIE(rc < 0, "Error sending subscribe/unsubscribe request to the server\n");
-
+    send_request(msg, tag);
     free(msg->payload);
-    memset(msg, 0, sizeof(tcp_message));
 
     // Wait for confirmation from the server.
-    rc = recv_efficient(tcp_sockfd, msg);
+    int rc = wait_for_answer(msg);
     DIE(rc < 0, "Error receiving subscribe confirm from the server\n");
+    free(msg->payload);
+
+    // Aggregates are also described by the function and the window.
+    string description = topic;
+    if (command == SUBSCRIBE_AGG_REQ || command == UNSUBSCRIBE_AGG_REQ) {
+        description = string("aggregate ") + topic + " " + options;
+    }
 
-    if (command == SUBSCRIBE_REQ) {
+    if (command == SUBSCRIBE_REQ || command == SUBSCRIBE_AGG_REQ) {
         if (msg->command == SUBSCRIBE_SUCC) {
-            cout << "Subscribed to topic " << topic << "\n";
+            cout << "Subscribed to topic " << description << "\n";
         } else {
-            cout << "Already subscribed to topic " << topic << "\n";
+            cout << "Already subscribed to topic " << description
+                 << " (or invalid options)\n";
         }
 
         free(msg);
         return;
     }
 
-    // Command was UNSUBSCRIBE_REQ
+    // Command was UNSUBSCRIBE_REQ or UNSUBSCRIBE_AGG_REQ
     if (msg->command == UNSUBSCRIBE_SUCC) {
-        cout << "Unsubscribed from topic " << topic << "\n";
+        cout << "Unsubscribed from topic " << description << "\n";
     } else {
-        cout << "Not subscribed to topic " << topic << ", cannot unsubscribe\n";
+        cout << "Not subscribed to topic " << description << ", cannot unsubscribe\n";
     }
 
     free(msg);
@@ -172,29 +466,78 @@ bool Subscriber::manage_stdin_data() {
         return true;
     }
 
+    if (stdin_data == "stats") {
+        print_udp_stats();
+        return false;
+    }
+
+    if (stdin_data == "latency") {
+        print_latency();
+        return false;
+    }
+
     char *helper = strdup(stdin_data.c_str());
     DIE(!helper, "strdup failed\n");
 
     char *command = strtok(helper, " ");
 
-    if (!command) {
+    if (command && options.mux
+        && (strcmp(command, "attach") == 0 || strcmp(command, "detach") == 0)) {
+        char *session_id = strtok(NULL, "\n ");
+
+        if (!session_id || strlen(session_id) > 10) {
+            cout << "Invalid id. ID must have at most 10 characters.\n";
+        } else {
+            attach_detach_session(command[0] == 'a', session_id);
+        }
+
         free(helper);
-        cout << "Accepted commands: <exit> <subscribe> <unsubscribe>\n";
         return false;
     }
 
+    int tag = -1;
+    if (command && options.mux && strcmp(command, "as") == 0) {
+        // The request is for one of the sessions.
+        char *session_id = strtok(NULL, " ");
+        auto it = session_id ? session_tags.find(session_id) : session_tags.end();
+
+        if (it == session_tags.end()) {
+            cout << "Session " << (session_id ? session_id : "") << " is not attached\n";
+            free(helper);
+            return false;
+        }
+
+        tag = it->second;
+        command = strtok(NULL, " ");
+    }
+
+    run_command(command, tag);
+    free(helper);
+    return false;
+}
+
+
+void Subscriber::run_command(char *command, int tag) {
+    if (!command) {
+        cout << "Accepted commands: <exit> <subscribe> <unsubscribe> "
+             << "<subscribe-agg> <unsubscribe-agg> <stats>"
+             << (options.mux ? " <attach> <detach> <as <id> ...>" : "") << "\n";
+        return;
+    }
+
     if (strcmp(command, "subscribe") == 0) {
         char *topic = strtok(NULL, "\n ");
 
         if (!topic || strlen(topic) > 50) {
             cout << "Invalid topic. Topic must have at most 50 characters.\n";
-            free(helper);
-            return false;
+            return;
         }
 
-        subscribe_unsubscribe_topic(SUBSCRIBE_REQ, topic);
-        free(helper);
-        return false;
+        // Whatever follows the topic is a list of options.
+        char *options = strtok(NULL, "\n");
+
+        subscribe_unsubscribe_topic(SUBSCRIBE_REQ, topic, options, tag);
+        return;
     }
 
     if (strcmp(command, "unsubscribe") == 0) {
@@ -202,18 +545,34 @@ bool Subscriber::manage_stdin_data() {
 
         if (!topic || strlen(topic) > 50) {
             cout << "Invalid topic. Topic must have at most 50 characters.\n";
-            free(helper);
-            return false;
+            return;
         }
 
-        subscribe_unsubscribe_topic(UNSUBSCRIBE_REQ, topic);
-        free(helper);
-        return false;
+        subscribe_unsubscribe_topic(UNSUBSCRIBE_REQ, topic, NULL, tag);
+        return;
     }
 
-    free(helper);
-    cout << "Accepted commands: <exit> <subscribe> <unsubscribe>\n";
-    return false;
+    if (strcmp(command, "subscribe-agg") == 0 || strcmp(command, "unsubscribe-agg") == 0) {
+        char *topic = strtok(NULL, "\n ");
+
+        if (!topic || strlen(topic) > 50) {
+            cout << "Invalid topic. Topic must have at most 50 characters.\n";
+            return;
+        }
+
+        // The function and the window are checked by the server.
+        char *spec = strtok(NULL, "\n");
+        if (!spec) {
+            cout << "Usage: " << command << " <topic> <avg|min|max|sum|count> <window>\n";
+            return;
+        }
+
+        uint8_t agg_command = command[0] == 's' ? SUBSCRIBE_AGG_REQ : UNSUBSCRIBE_AGG_REQ;
+        subscribe_unsubscribe_topic(agg_command, topic, spec, tag);
+        return;
+    }
+
+    run_command(NULL, tag);
 }
 
 
@@ -228,15 +587,374 @@ bool Subscriber::manage_tcp_data(tcp_message *msg) {
         return true;
     }
 
+    if (msg->command == HEARTBEAT) {
+        // The server checks that the subscriber is still there.
+        rc = send_command(tcp_sockfd, HEARTBEAT_ACK);
+        return rc < 0;
+    }
+
+    if (msg->command == MUX_FRAME) {
+        // A publication for some of the sessions.
+        tcp_message inner;
+        uint16_t tag;
+        if (!print_mux_publication(msg, &inner, tag)) {
+            fprintf(stderr, "Unexpected message for a session\n");
+            free(inner.payload);
+        }
+
+        free(msg->payload);
+        consume_credit(rc);
+        return false;
+    }
+
+    if (msg->command == ALIAS_DEFINE || msg->command == MSG_FROM_UDP_ALIASED) {
+        // The topic was left out, put it back.
+        if (!expand_alias(msg)) {
+            free(msg->payload);
+            return false;
+        }
+
+        // The server counts the credit in bytes of the whole frame.
+        rc = TCP_HEADER_LEN + msg->len;
+    }
+
     // Got a message from the server.
-    if (msg->command != MSG_FROM_UDP) {
+    if (msg->command != MSG_FROM_UDP && msg->command != MSG_FROM_UDP_TS) {
         fprintf(stderr, "Big error: message is not coming from UDP\n");
         free(msg->payload);
         return false;
     }
 
-    cout << msg->payload << "\n";
+    print_publication(msg);
     free(msg->payload);
 
+    consume_credit(rc);
+
     return false;
 }
+
+
+void Subscriber::consume_credit(int frame_bytes) {
+    if (options.credit_messages == 0) {
+        return;
+    }
+
+    consumed_messages++;
+    consumed_bytes += frame_bytes;
+
+    // Half of the window, so the server does not stop while it waits.
+    bool grant = consumed_messages >= (options.credit_messages + 1) / 2
+                 || (options.credit_bytes > 0 && consumed_bytes >= options.credit_bytes / 2);
+    if (!grant) {
+        return;
+    }
+
+    uint32_t credit[2] = {htonl(consumed_messages),
+                          htonl(options.credit_bytes > 0 ? consumed_bytes : 0)};
+
+    tcp_message msg;
+    msg.command = CREDIT_GRANT;
+    msg.len = sizeof(credit);
+    msg.payload = (char *) credit;
+
+    int rc = send_efficient(tcp_sockfd, &msg);
+    DIE(rc < 0, "Error sending credit to the server\n");
+
+    consumed_messages = 0;
+    consumed_bytes = 0;
+}
+
+
+void Subscriber::output_publication(const char *text, size_t len, const string &sessions) {
+    if (options.sink_path.empty()) {
+        if (!sessions.empty()) {
+            cout << "[" << sessions << "] ";
+        }
+        cout.write(text, len) << "\n";
+        return;
+    }
+
+    lock_guard<mutex> guard(sink_lock);
+    if (!sink_append_publication(&sink, realtime_ns(), text, len)) {
+        sink_failed++;
+    }
+}
+
+
+bool Subscriber::expand_alias(tcp_message *msg) {
+    // The alias comes first, then the length of the topic it is given
+    // for a definition, then the text.
+    size_t header_len = msg->command == ALIAS_DEFINE ? 3 : 2;
+    if (msg->len <= header_len) {
+        fprintf(stderr, "Invalid aliased message from the server\n");
+        return false;
+    }
+
+    uint16_t alias = ((uint8_t) msg->payload[0] << 8) | (uint8_t) msg->payload[1];
+    char *text = msg->payload + header_len;
+    size_t text_len = msg->len - header_len;
+
+    // The topic follows the address of the publisher, "<ip>:<port> - ".
+    char *separator = (char *) memmem(text, text_len, " - ", 3);
+    if (alias >= topic_aliases.size() || !separator) {
+        fprintf(stderr, "Invalid aliased message from the server\n");
+        return false;
+    }
+    size_t prefix_len = separator + 3 - text;
+
+    if (msg->command == ALIAS_DEFINE) {
+        size_t topic_len = (uint8_t) msg->payload[2];
+        if (prefix_len + topic_len > text_len) {
+            fprintf(stderr, "Invalid aliased message from the server\n");
+            return false;
+        }
+
+        topic_aliases[alias].assign(text + prefix_len, topic_len);
+        memmove(msg->payload, text, text_len);
+        msg->len = text_len;
+        msg->command = MSG_FROM_UDP;
+        return true;
+    }
+
+    const string &topic = topic_aliases[alias];
+    if (topic.empty()) {
+        fprintf(stderr, "Unknown topic alias %hu\n", alias);
+        return false;
+    }
+
+    size_t len = text_len + topic.length() + 3;
+    char *payload = (char *) malloc(len);
+    DIE(!payload, "malloc failed\n");
+
+    memcpy(payload, text, prefix_len);
+    memcpy(payload + prefix_len, topic.data(), topic.length());
+    memcpy(payload + prefix_len + topic.length(), " - ", 3);
+    memcpy(payload + prefix_len + topic.length() + 3, text + prefix_len,
+           text_len - prefix_len);
+
+    free(msg->payload);
+    msg->payload = payload;
+    msg->len = len;
+    msg->command = MSG_FROM_UDP;
+    return true;
+}
+
+
+void Subscriber::print_publication(tcp_message *msg, const string &sessions) {
+    if (msg->command == MSG_FROM_UDP) {
+        output_publication(msg->payload, strnlen(msg->payload, msg->len), sessions);
+        return;
+    }
+
+    // The receive and the send times come before the text.
+    uint64_t now_ns = realtime_ns();
+    size_t header_len = 2 * sizeof(uint64_t);
+    if (msg->len <= header_len) {
+        fprintf(stderr, "Invalid timestamped message from the server\n");
+        return;
+    }
+
+    uint64_t rx_ns, send_ns;
+    memcpy(&rx_ns, msg->payload, sizeof(uint64_t));
+    memcpy(&send_ns, msg->payload + sizeof(uint64_t), sizeof(uint64_t));
+    rx_ns = be64toh(rx_ns);
+    send_ns = be64toh(send_ns);
+
+    histogram_record(&server_latency, send_ns >= rx_ns ? send_ns - rx_ns : 0);
+    if (now_ns >= send_ns) {
+        histogram_record(&delivery_latency, now_ns - send_ns);
+    } else {
+        clock_skewed++;
+    }
+
+    output_publication(msg->payload + header_len,
+                       strnlen(msg->payload + header_len, msg->len - header_len), sessions);
+}
+
+
+void Subscriber::print_latency() {
+    if (!options.timestamps) {
+        cout << "The publications have no timestamps (see --timestamps)\n";
+        return;
+    }
+
+    const char *names[] = {"server (kernel receive -> send)", "delivery (send -> receive)"};
+    latency_histogram *histograms[] = {&server_latency, &delivery_latency};
+
+    for (int i = 0; i < 2; i++) {
+        latency_histogram *histogram = histograms[i];
+        if (histogram->total == 0) {
+            cout << names[i] << ": no samples\n";
+            continue;
+        }
+
+        // Printed in microseconds.
+        printf("%s: %" PRIu64 " samples, min %.1f, p50 %.1f, p90 %.1f, p99 %.1f, "
+               "p99.9 %.1f, max %.1f us\n", names[i], histogram->total,
+               histogram->min / 1000.0,
+               histogram_percentile(histogram, 50) / 1000.0,
+               histogram_percentile(histogram, 90) / 1000.0,
+               histogram_percentile(histogram, 99) / 1000.0,
+               histogram_percentile(histogram, 99.9) / 1000.0,
+               histogram->max / 1000.0);
+    }
+
+    if (clock_skewed > 0) {
+        cout << clock_skewed << " publications arrived before they were sent "
+             << "(the clocks are not synchronized)\n";
+    }
+}
+
+
+void Subscriber::manage_udp_data() {
+    char buff[MAX_UDP_DELIVERY + 64];
+
+    while (true) {
+        int rc = recv(udp_sockfd, buff, sizeof(buff) - 1, MSG_DONTWAIT);
+        if (rc < 0) {
+            // Nothing left for now.
+            return;
+        }
+
+        // Header: sequence number, topic length, topic.
+        int header_len = sizeof(uint32_t) + sizeof(uint8_t);
+        if (rc < header_len || rc < header_len + (uint8_t) buff[4]) {
+            fprintf(stderr, "Invalid datagram from the server\n");
+            continue;
+        }
+
+        uint32_t seq;
+        memcpy(&seq, buff, sizeof(uint32_t));
+        seq = ntohl(seq);
+
+        uint8_t topic_len = buff[4];
+        string topic(buff + header_len, topic_len);
+
+        // Check for gaps in the numbering of the topic.
+        udp_topic_stats &stats = udp_stats[topic];
+        if (seq > stats.last_seq) {
+            stats.lost += seq - stats.last_seq - 1;
+            stats.last_seq = seq;
+        } else {
+            stats.late++;
+        }
+        stats.received++;
+
+        buff[rc] = '\0';
+        char *text = buff + header_len + topic_len;
+        output_publication(text, strlen(text));
+    }
+}
+
+
+void Subscriber::attach_shm_ring(char *info) {
+    char name[64];
+    uint64_t start;
+
+    if (sscanf(info, "%63s %d %" SCNu64, name, &shm_index, &start) != 3
+        || shm_index < 0 || shm_index >= SHM_MAX_CONSUMERS) {
+        fprintf(stderr, "Invalid shared memory ring details from the server\n");
+        shm_index = -1;
+        return;
+    }
+
+    // Without the ring the publications would be lost, so give up.
+    DIE(!shm_ring_open(&ring, name), "Subscriber: shared memory ring mapping failed.\n");
+
+    shm_cursor = start;
+    shm_reader = thread(&Subscriber::read_shm_ring, this);
+}
+
+
+void Subscriber::read_shm_ring() {
+    char buff[SHM_SLOT_DATA + 1];
+    uint64_t bit = 1ULL << shm_index;
+    uint64_t mask, lost = 0;
+    int empty_reads = 0;
+
+    // The messages are printed together, with a single write().
+    string output;
+
+    while (!stop_reader) {
+        int len = shm_ring_read(&ring, shm_cursor, buff, mask, lost);
+
+        if (len >= 0) {
+            empty_reads = 0;
+
+            if (mask & bit) {
+                if (!options.sink_path.empty()) {
+                    output_publication(buff, strnlen(buff, len));
+                } else {
+                    output.append(buff, len);
+                    output += '\n';
+                }
+                shm_received++;
+            }
+            continue;
+        }
+
+        if (!output.empty()) {
+            size_t written = 0;
+            while (written < output.length()) {
+                ssize_t rc = write(STDOUT_FILENO, output.data() + written,
+                                   output.length() - written);
+                if (rc < 0) {
+                    break;
+                }
+                written += rc;
+            }
+            output.clear();
+        }
+
+        if (lost > 0) {
+            shm_lost += lost;
+            lost = 0;
+        }
+
+        // The ring is empty: spin a bit, since the next message often
+        // follows shortly, then sleep.
+        if (++empty_reads < SHM_SPIN_READS) {
+            continue;
+        }
+        shm_ring_wait(&ring, shm_cursor, SHM_WAIT_MS);
+    }
+}
+
+
+void Subscriber::print_udp_stats() {
+    if (!options.sink_path.empty()) {
+        lock_guard<mutex> guard(sink_lock);
+        cout << "Sink: " << sink.records << " records in " << sink.path << "."
+             << sink.file_index << " (" << sink.rotations << " rotations), "
+             << sink_failed << " failed\n";
+    }
+
+    if (ring.fd >= 0) {
+        // The lost messages are not necessarily for this subscriber.
+        cout << "SHM: received " << shm_received << ", lost (any topic) "
+             << shm_lost << "\n";
+        return;
+    }
+
+    if (udp_sockfd < 0) {
+        cout << "The UDP channel is not used\n";
+        return;
+    }
+
+    uint64_t received = 0, lost = 0, late = 0;
+    for (auto &entry : udp_stats) {
+        received += entry.second.received;
+        lost += entry.second.lost;
+        late += entry.second.late;
+    }
+
+    cout << "UDP: received " << received << ", lost " << lost
+         << ", late/duplicated " << late << "\n";
+
+    for (auto &entry : udp_stats) {
+        if (entry.second.lost > 0) {
+            cout << "  " << entry.first << ": received " << entry.second.received
+                 << ", lost " << entry.second.lost << "\n";
+        }
+    }
+}
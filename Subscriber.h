@@ -4,9 +4,67 @@
 #include <string>
 #include <cstdint>
 #include <vector>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <mutex>
 #include <poll.h>
 
 #include "protocols.h"
+#include "shm_ring.h"
+#include "histogram.h"
+#include "record_sink.h"
+
+
+/**
+ * Optional settings of the subscriber, given as command line arguments.
+ */
+struct subscriber_options {
+    // Set to receive the publications as UDP datagrams on udp_port
+    // (0 for any free port).
+    bool use_udp = false;
+    uint16_t udp_port = 0;
+
+    // Set to read the publications from the shared memory ring of the
+    // server, if it runs on the same host.
+    bool use_shm = false;
+
+    // Set to get the publications with the times they were received and
+    // sent by the server, for the latency histograms.
+    bool timestamps = false;
+
+    // Credit window granted to the server, in publications (0 for no flow
+    // control) and in bytes (0 for no limit).
+    uint32_t credit_messages = 0;
+    uint32_t credit_bytes = 0;
+
+    // If set, the publications are written as binary records to the files
+    // <sink_path>.0, <sink_path>.1, ... of sink_size bytes, instead of
+    // being printed.
+    std::string sink_path;
+    uint64_t sink_size = SINK_DEFAULT_SIZE;
+
+    // Set to carry the sessions of other clients on the connection too
+    // (see the attach, detach and as commands).
+    bool mux = false;
+
+    // Number of topic aliases the server may use on the connection (0 for
+    // none), so most publications come without their topic.
+    uint16_t aliases = 0;
+};
+
+
+/**
+ * Statistics of the publications received as UDP datagrams for a topic.
+ */
+struct udp_topic_stats {
+    uint32_t last_seq = 0;
+    uint64_t received = 0;
+    uint64_t lost = 0;
+
+    // Datagrams that came after a newer one (late or duplicated).
+    uint64_t late = 0;
+};
 
 
 class Subscriber {
@@ -18,25 +76,191 @@ class Subscriber {
     int tcp_sockfd; // Socket to communicate with the server.
     std::vector<pollfd> poll_fds;
 
+    subscriber_options options;
+
+    int udp_sockfd; // Socket for the publications sent as datagrams.
+
+    // Mappings of <topic, statistics> type.
+    std::unordered_map<std::string, udp_topic_stats> udp_stats;
+
+    shm_ring ring; // Mapping of the server's ring, if it is used.
+    int shm_index; // Bit of this subscriber in the masks of the messages.
+    uint64_t shm_cursor; // Number of the next message to read.
+
+    // Thread that reads the ring, so the publications do not wait for
+    // the poll() loop.
+    std::thread shm_reader;
+    std::atomic<bool> stop_reader;
+    std::atomic<uint64_t> shm_received;
+    std::atomic<uint64_t> shm_lost;
+
+
+    // Latencies (in nanoseconds) from the kernel of the server receiving
+    // the publication to the server sending it, and from there to this
+    // subscriber receiving it.
+    latency_histogram server_latency;
+    latency_histogram delivery_latency;
+
+    // Publications that seemed to arrive before they were sent, because
+    // the clocks of the two hosts are not synchronized.
+    uint64_t clock_skewed;
+
+    // Credit consumed since the last CREDIT_GRANT.
+    uint32_t consumed_messages;
+    uint32_t consumed_bytes;
+
+    // Record sink, written by the main thread and by the reader of the ring.
+    record_sink sink;
+    std::mutex sink_lock;
+    uint64_t sink_failed;
+
+    // Sessions carried by the connection, by their id and by their tag.
+    std::unordered_map<std::string, uint16_t> session_tags;
+    std::unordered_map<uint16_t, std::string> session_ids;
+    uint16_t next_tag;
+
+    // Topics by their alias, as defined by the server (empty if unused).
+    std::vector<std::string> topic_aliases;
+
+
+    /**
+     * Turns a publication sent with the alias of its topic (ALIAS_DEFINE or
+     * MSG_FROM_UDP_ALIASED) back into a MSG_FROM_UDP message, learning the
+     * alias if it is defined.
+     * @return false if the message is not valid
+     */
+    bool expand_alias(tcp_message *msg);
+
+
+    /**
+     * Prints a publication (MSG_FROM_UDP or MSG_FROM_UDP_TS) received over
+     * TCP, recording its latencies if it has timestamps.
+     */
+    void print_publication(tcp_message *msg, const std::string &sessions = "");
+
+
+    /**
+     * Prints a publication, or appends it to the record sink if one is used.
+     * @param len Length of the text, without the '\0'
+     * @param sessions Ids of the sessions it was delivered to, printed
+     * before it, if it came in a MUX_FRAME
+     */
+    void output_publication(const char *text, size_t len, const std::string &sessions = "");
+
+
+    /**
+     * Prints the publication wrapped in a MUX_FRAME, once for all the
+     * sessions it is tagged with.
+     * @return false if it is not a publication, with the wrapped message
+     * left in inner (and its tag in tag) for the caller
+     */
+    bool print_mux_publication(tcp_message *msg, tcp_message *inner, uint16_t &tag);
+
+
+    /**
+     * Receives messages until the answer to a request arrives, printing
+     * the publications that come before it. The answer to a request of a
+     * session is unwrapped from its MUX_FRAME.
+     * @return the length of the answer, or -1 if the connection failed
+     */
+    int wait_for_answer(tcp_message *msg);
+
+
+    /**
+     * Sends a message, wrapped in a MUX_FRAME if it is for a session.
+     * @param tag Tag of the session, or -1 for the subscriber itself
+     */
+    void send_request(tcp_message *msg, int tag);
+
+
+    /**
+     * Attaches (MUX_ATTACH) or detaches (MUX_DETACH) the session of the
+     * client with the given id.
+     */
+    void attach_detach_session(bool attach, const std::string &session_id);
+
+
+    /**
+     * Counts a publication of frame_bytes bytes as consumed and grants
+     * the credit back to the server once half of the window is consumed.
+     */
+    void consume_credit(int frame_bytes);
+
+
+    /**
+     * Prints the percentiles of the latency histograms.
+     */
+    void print_latency();
+
+
+    /**
+     * Maps the ring described by the server in the connection response
+     * ("shm=<name> <index> <first message>") and starts the reader thread.
+     */
+    void attach_shm_ring(char *info);
+
+
+    /**
+     * Body of the reader thread: prints the messages of the ring that are
+     * marked for this subscriber, until stop_reader is set. Spins for a
+     * while when the ring is empty, then sleeps until the next write.
+     */
+    void read_shm_ring();
+
+
+    /**
+     * Creates and binds the socket the server will send the datagrams to.
+     */
+    void prepare_udp_socket();
+
+
+    /**
+     * Receives all the datagrams that are waiting on the UDP socket and
+     * prints them, checking the sequence numbers for gaps.
+     */
+    void manage_udp_data();
+
+
+    /**
+     * Prints the loss statistics of the UDP channel (or of the shared
+     * memory ring, if it is used) and what was written to the sink.
+     */
+    void print_udp_stats();
+
 
     /**
      * Sends subscribe/unsubscribe request to the server, then
      * waits for server's response.
-     * @param command Flag for subscribe/unsubscribe
+     * @param command Flag for subscribe/unsubscribe (to/from a topic or
+     * an aggregate)
      * @param topic topic to subscribe/unsubscribe to/from
+     * @param options Subscription options (i.e. "conflate"), or the function
+     * and the window of an aggregate, sent after the topic in the payload,
+     * or NULL if there are none
+     * @param tag Tag of the session the request is for, or -1
      */
-    void subscribe_unsubscribe_topic(uint8_t command, char *topic);
+    void subscribe_unsubscribe_topic(uint8_t command, char *topic, char *options,
+                                     int tag = -1);
 
 
     /**
      * Parses input collected from the STDIN socket.
-     * If the command is subscribe/unsubscribe, calls the
+     * If the command is (un)subscribe or (un)subscribe-agg, calls the
      * subscribe_unsubscribe_topic() method to manage it.
      * @return true if the input is "exit",false otherwise
      */
     bool manage_stdin_data();
 
 
+    /**
+     * Runs a request of the subscriber (after "as <id>", for a session).
+     * @param command First word of the request, the rest being left for
+     * strtok()
+     * @param tag Tag of the session, or -1
+     */
+    void run_command(char *command, int tag);
+
+
     /**
      * Receives a message from the server. It can either be a disconnection
      * announcement or a message that a UDP client had sent to the server.
@@ -51,24 +275,29 @@ class Subscriber {
     /**
      * Constructor.
      * @param id String id of the Subscriber (at most 10 characters)
+     * @param options Optional settings (i.e. the UDP delivery channel)
      */
-    Subscriber(std::string id, uint32_t server_ip, uint16_t server_port);
+    Subscriber(std::string id, uint32_t server_ip, uint16_t server_port,
+               subscriber_options &options);
 
 
     /**
-     * Destructor. Closes the tcp_sockfd.
+     * Destructor. Closes the tcp_sockfd (and the udp_sockfd), stops the
+     * reader of the ring and seals the record sink.
      */
     ~Subscriber();
 
 
     /**
-     * Sets up the TCP socket and connects to the server.
+     * Sets up the TCP socket and connects to the server (and the UDP
+     * socket and the record sink, if needed).
      */
     void prepare();
 
 
     /**
-     * Sends the ID to the server and waits for confirmation of acceptance.
+     * Sends the ID (and the UDP port, if needed) to the server and waits
+     * for confirmation of acceptance.
      * @return true, if the connection was accepted, false otherwise.
      */
     bool check_connection_validity();
@@ -0,0 +1,155 @@
+#include "capture_file.h"
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/stat.h>
+
+
+/**
+ * Writes the whole buffer.
+ * @return true on success, false otherwise
+ */
+static bool write_all(int fd, const char *buff, size_t len) {
+    while (len > 0) {
+        ssize_t rc = write(fd, buff, len);
+        if (rc <= 0) {
+            return false;
+        }
+
+        buff += rc;
+        len -= rc;
+    }
+
+    return true;
+}
+
+
+bool capture_open(capture_writer *writer, const std::string &path) {
+    writer->fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (writer->fd < 0) {
+        return false;
+    }
+
+    writer->path = path;
+    writer->records = 0;
+    writer->buffer.clear();
+    writer->buffer.reserve(CAPTURE_BUFFER_SIZE + sizeof(capture_record_header) + UINT16_MAX);
+    writer->buffer.append(CAPTURE_MAGIC, CAPTURE_MAGIC_LEN);
+
+    return true;
+}
+
+
+void capture_append(capture_writer *writer, uint64_t rx_ns,
+                    const struct sockaddr_in &src_addr, const char *data, uint16_t len) {
+    if (writer->fd < 0) {
+        return;
+    }
+
+    // The address is already in network order.
+    capture_record_header header;
+    header.rx_ns = htobe64(rx_ns);
+    header.src_ip = src_addr.sin_addr.s_addr;
+    header.src_port = src_addr.sin_port;
+    header.len = htons(len);
+
+    writer->buffer.append((char *) &header, sizeof(header));
+    writer->buffer.append(data, len);
+    writer->records++;
+
+    if (writer->buffer.size() >= CAPTURE_BUFFER_SIZE) {
+        capture_flush(writer);
+    }
+}
+
+
+bool capture_flush(capture_writer *writer) {
+    if (writer->fd < 0 || writer->buffer.empty()) {
+        return true;
+    }
+
+    bool written = write_all(writer->fd, writer->buffer.data(), writer->buffer.size());
+    writer->buffer.clear();
+
+    if (!written) {
+        // A file with a hole in the middle would be misleading, so stop.
+        perror("Capture: writing failed, stopping the capture");
+        close(writer->fd);
+        writer->fd = -1;
+    }
+
+    return written;
+}
+
+
+void capture_close(capture_writer *writer) {
+    if (writer->fd < 0) {
+        return;
+    }
+
+    capture_flush(writer);
+
+    if (writer->fd >= 0) {
+        close(writer->fd);
+        writer->fd = -1;
+    }
+}
+
+
+bool capture_load(const std::string &path, std::string &data,
+                  std::vector<capture_record> &records) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) < 0) {
+        close(fd);
+        return false;
+    }
+
+    data.resize(file_stat.st_size);
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t rc = read(fd, &data[done], data.size() - done);
+        if (rc <= 0) {
+            close(fd);
+            return false;
+        }
+        done += rc;
+    }
+    close(fd);
+
+    if (data.size() < CAPTURE_MAGIC_LEN || memcmp(data.data(), CAPTURE_MAGIC, CAPTURE_MAGIC_LEN)) {
+        return false;
+    }
+
+    records.clear();
+    size_t offset = CAPTURE_MAGIC_LEN;
+    while (offset + sizeof(capture_record_header) <= data.size()) {
+        capture_record_header header;
+        memcpy(&header, data.data() + offset, sizeof(header));
+        offset += sizeof(header);
+
+        capture_record record;
+        record.rx_ns = be64toh(header.rx_ns);
+        memset(&record.src_addr, 0, sizeof(record.src_addr));
+        record.src_addr.sin_family = AF_INET;
+        record.src_addr.sin_addr.s_addr = header.src_ip;
+        record.src_addr.sin_port = header.src_port;
+        record.offset = offset;
+        record.len = ntohs(header.len);
+
+        // The server may have been stopped in the middle of a write.
+        if (offset + record.len > data.size()) {
+            break;
+        }
+
+        records.push_back(record);
+        offset += record.len;
+    }
+
+    return true;
+}
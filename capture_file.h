@@ -0,0 +1,99 @@
+#ifndef CAPTURE_FILE_H
+#define CAPTURE_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <netinet/in.h>
+
+// Start of every capture file (8 bytes), with the version of the format.
+#define CAPTURE_MAGIC "SCAPCAP1"
+#define CAPTURE_MAGIC_LEN 8
+
+// The records are written when this much is buffered.
+#define CAPTURE_BUFFER_SIZE (256 * 1024)
+
+
+/**
+ * Header of a record, followed by the datagram. All the fields are in
+ * network order, so a file can be replayed on any host.
+ */
+struct __attribute__((packed)) capture_record_header {
+    // Time the datagram was received by the kernel (real time clock).
+    uint64_t rx_ns;
+
+    // Address of the publisher.
+    uint32_t src_ip;
+    uint16_t src_port;
+
+    uint16_t len;
+};
+
+
+/**
+ * A capture file being written by the server.
+ */
+struct capture_writer {
+    int fd = -1;
+    std::string path;
+
+    // Records not written yet.
+    std::string buffer;
+
+    uint64_t records = 0;
+};
+
+
+/**
+ * A datagram of a loaded capture file.
+ */
+struct capture_record {
+    uint64_t rx_ns;
+    struct sockaddr_in src_addr;
+
+    // Where the datagram is in the loaded file.
+    size_t offset;
+    uint16_t len;
+};
+
+
+/**
+ * Creates the file (truncating an older one) and writes its magic.
+ * @return true on success, false otherwise
+ */
+bool capture_open(capture_writer *writer, const std::string &path);
+
+
+/**
+ * Appends a datagram to the buffer, which is written when it is full.
+ * Nothing is done for a datagram if the file can not be written.
+ */
+void capture_append(capture_writer *writer, uint64_t rx_ns,
+                    const struct sockaddr_in &src_addr, const char *data, uint16_t len);
+
+
+/**
+ * Writes what is buffered.
+ * @return true on success, false otherwise
+ */
+bool capture_flush(capture_writer *writer);
+
+
+/**
+ * Writes what is buffered and closes the file.
+ */
+void capture_close(capture_writer *writer);
+
+
+/**
+ * Reads a whole capture file and indexes its records.
+ * @param data Destination of the content of the file
+ * @return true on success, false if it is not a valid capture file (a
+ * truncated last record is ignored)
+ */
+bool capture_load(const std::string &path, std::string &data,
+                  std::vector<capture_record> &records);
+
+
+#endif /* CAPTURE_FILE_H */
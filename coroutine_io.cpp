@@ -0,0 +1,354 @@
+#include "coroutine_io.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <poll.h>
+#include <sys/socket.h>
+#include "utils.h"
+
+// Free blocks of the frame pool, each one holding the next in its first bytes.
+static void *free_frames = NULL;
+
+
+void *coro_frame_alloc(size_t size) {
+    if (size > CORO_FRAME_BLOCK) {
+        void *frame = malloc(size);
+        DIE(!frame, "malloc failed\n");
+        return frame;
+    }
+
+    if (!free_frames) {
+        // The blocks are never given back to the heap, the pool stays as
+        // big as the most connections that were served at once.
+        char *chunk = (char *) malloc((size_t) CORO_FRAME_BLOCK * CORO_FRAME_CHUNK);
+        DIE(!chunk, "malloc failed\n");
+
+        for (int i = 0; i < CORO_FRAME_CHUNK; i++) {
+            void *block = chunk + (size_t) i * CORO_FRAME_BLOCK;
+            *(void **) block = free_frames;
+            free_frames = block;
+        }
+    }
+
+    void *frame = free_frames;
+    free_frames = *(void **) frame;
+
+    return frame;
+}
+
+
+void coro_frame_free(void *frame, size_t size) {
+    if (size > CORO_FRAME_BLOCK) {
+        free(frame);
+        return;
+    }
+
+    *(void **) frame = free_frames;
+    free_frames = frame;
+}
+
+
+/**
+ * Resumes the coroutine waiting on the connection and frees it if it
+ * ended, for the owner of the loop to free the connection too.
+ */
+static void resume_waiter(coro_conn *conn) {
+    std::coroutine_handle<> waiter = conn->waiter;
+    conn->waiter = nullptr;
+    waiter.resume();
+
+    if (conn->task && conn->task.done()) {
+        conn->task.destroy();
+        conn->task = nullptr;
+        conn->loop->finished.push_back(conn);
+    }
+}
+
+
+static void watch(coro_conn *conn, short events, bool enable) {
+    conn->loop->watch(conn->loop->context, conn->fd, events, enable);
+}
+
+
+/**
+ * Stops poll() from reporting a socket whose input waits to be read.
+ */
+static void pause_input(coro_conn *conn) {
+    if (!conn->input_paused) {
+        conn->input_paused = true;
+        watch(conn, POLLIN, false);
+    }
+}
+
+
+static void resume_input(coro_conn *conn) {
+    if (conn->input_paused) {
+        conn->input_paused = false;
+        watch(conn, POLLIN, true);
+    }
+}
+
+
+/**
+ * Checks if a read would not wait: a whole message (or an invalid one)
+ * was received, or the connection was closed.
+ */
+static bool input_ready(coro_conn *conn) {
+    return conn->closed
+           || decode_frame(conn->input.data() + conn->input_start,
+                           conn->input_end - conn->input_start, NULL) != 0;
+}
+
+
+void coro_init(coro_conn *conn, coro_loop *loop, int fd, const struct sockaddr_in &addr,
+               const std::string &pending_input) {
+    conn->loop = loop;
+    conn->fd = fd;
+    conn->addr = addr;
+
+    conn->input = pending_input;
+    conn->input_start = 0;
+    conn->input_end = pending_input.length();
+
+    conn->timer.kind = loop->timer_kind;
+    conn->timer.owner = conn;
+}
+
+
+void coro_spawn(coro_conn *conn, conn_task task) {
+    conn->task = task.handle;
+    conn->waiter = task.handle;
+    resume_waiter(conn);
+}
+
+
+void coro_cancel(coro_conn *conn) {
+    wheel_cancel(conn->loop->wheel, &conn->timer);
+    conn->waiter = nullptr;
+
+    if (conn->task) {
+        conn->task.destroy();
+        conn->task = nullptr;
+        conn->loop->finished.push_back(conn);
+    }
+}
+
+
+void coro_on_readable(coro_conn *conn) {
+    if (conn->listening) {
+        // The coroutine accepts by itself.
+        if (conn->wants_input) {
+            resume_waiter(conn);
+        } else {
+            pause_input(conn);
+        }
+        return;
+    }
+
+    if (!conn->closed) {
+        size_t pending = conn->input_end - conn->input_start;
+        size_t chunk = std::min((size_t) CORO_READ_CHUNK,
+                                std::max((size_t) CORO_READ_MIN, conn->input.size()));
+
+        // Move what is left of a message to the start, if the end is full.
+        if (conn->input_start > 0
+            && (pending == 0 || conn->input.size() - conn->input_end < chunk)) {
+            memmove(&conn->input[0], conn->input.data() + conn->input_start, pending);
+            conn->input_start = 0;
+            conn->input_end = pending;
+        }
+
+        if (conn->input.size() - conn->input_end < chunk) {
+            conn->input.resize(conn->input_end + chunk);
+        }
+
+        ssize_t rc = recv(conn->fd, &conn->input[conn->input_end],
+                          conn->input.size() - conn->input_end, MSG_DONTWAIT);
+        if (rc > 0) {
+            conn->input_end += rc;
+        } else if (rc == 0) {
+            conn->closed = true;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            conn->closed = true;
+            conn->error = errno;
+        }
+    }
+
+    if (!input_ready(conn)) {
+        return;
+    }
+
+    if (conn->wants_input) {
+        resume_waiter(conn);
+    } else {
+        pause_input(conn);
+    }
+}
+
+
+void coro_on_writable(coro_conn *conn) {
+    if (!conn->write_queue || !conn->waiter) {
+        return;
+    }
+
+    int rc = flush_outbound(conn->fd, conn->write_queue, SIZE_MAX);
+    if (rc == 0) {
+        return;
+    }
+
+    conn->write_result = rc;
+    conn->write_queue = NULL;
+    watch(conn, POLLOUT, false);
+    resume_waiter(conn);
+}
+
+
+void coro_on_timer(coro_conn *conn) {
+    conn->timed_out = true;
+
+    if (conn->waiter) {
+        resume_waiter(conn);
+    }
+}
+
+
+std::string coro_pending_input(const coro_conn *conn) {
+    return conn->input.substr(conn->input_start, conn->input_end - conn->input_start);
+}
+
+
+bool frame_awaiter::await_ready() {
+    conn->timed_out = false;
+    return input_ready(conn);
+}
+
+
+void frame_awaiter::await_suspend(std::coroutine_handle<> handle) {
+    conn->waiter = handle;
+    conn->wants_input = true;
+    resume_input(conn);
+
+    if (deadline_ms) {
+        wheel_arm(conn->loop->wheel, &conn->timer, deadline_ms);
+    }
+}
+
+
+int frame_awaiter::await_resume() {
+    conn->wants_input = false;
+    wheel_cancel(conn->loop->wheel, &conn->timer);
+
+    if (conn->timed_out) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    // The messages received before a close are still read.
+    int rc = decode_frame(conn->input.data() + conn->input_start,
+                          conn->input_end - conn->input_start, msg);
+    if (rc > 0) {
+        conn->input_start += rc;
+        if (conn->input_start == conn->input_end) {
+            conn->input_start = conn->input_end = 0;
+        }
+        return rc;
+    }
+
+    if (rc < 0) {
+        // The stream can not be trusted anymore.
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (conn->error) {
+        errno = conn->error;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+frame_awaiter coro_read_frame(coro_conn *conn, tcp_message *msg, uint64_t deadline_ms) {
+    return frame_awaiter{conn, msg, deadline_ms};
+}
+
+
+bool write_awaiter::await_ready() {
+    conn->write_result = flush_outbound(conn->fd, queue, SIZE_MAX);
+    return conn->write_result != 0;
+}
+
+
+void write_awaiter::await_suspend(std::coroutine_handle<> handle) {
+    conn->waiter = handle;
+    conn->write_queue = queue;
+    watch(conn, POLLOUT, true);
+}
+
+
+bool write_awaiter::await_resume() {
+    return conn->write_result > 0;
+}
+
+
+write_awaiter coro_write_frame(coro_conn *conn, outbound_queue *queue,
+                               std::shared_ptr<std::string> frame) {
+    enqueue_frame(queue, frame, "");
+    return write_awaiter{conn, queue};
+}
+
+
+bool accept_awaiter::await_ready() {
+    socklen_t addr_len = sizeof(struct sockaddr_in);
+    fd = accept4(listener->fd, (struct sockaddr *) addr, &addr_len, SOCK_NONBLOCK);
+    error = fd < 0 ? errno : 0;
+
+    return fd >= 0 || (error != EAGAIN && error != EWOULDBLOCK);
+}
+
+
+void accept_awaiter::await_suspend(std::coroutine_handle<> handle) {
+    listener->waiter = handle;
+    listener->wants_input = true;
+    resume_input(listener);
+}
+
+
+int accept_awaiter::await_resume() {
+    listener->wants_input = false;
+
+    if (fd < 0 && (error == EAGAIN || error == EWOULDBLOCK)) {
+        // Woken up by poll(), the connection is there.
+        socklen_t addr_len = sizeof(struct sockaddr_in);
+        fd = accept4(listener->fd, (struct sockaddr *) addr, &addr_len, SOCK_NONBLOCK);
+        error = fd < 0 ? errno : 0;
+    }
+
+    errno = error;
+    return fd;
+}
+
+
+accept_awaiter coro_accept(coro_conn *listener, struct sockaddr_in *addr) {
+    return accept_awaiter{listener, addr, -1, 0};
+}
+
+
+void sleep_awaiter::await_suspend(std::coroutine_handle<> handle) {
+    conn->waiter = handle;
+    conn->timed_out = false;
+    wheel_arm(conn->loop->wheel, &conn->timer, expires_ms);
+}
+
+
+void sleep_awaiter::await_resume() {
+    conn->timed_out = false;
+}
+
+
+sleep_awaiter coro_sleep_until(coro_conn *conn, uint64_t expires_ms) {
+    return sleep_awaiter{conn, expires_ms};
+}
@@ -0,0 +1,250 @@
+#ifndef COROUTINE_IO_H
+#define COROUTINE_IO_H
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <string>
+#include <vector>
+#include <netinet/in.h>
+
+#include "protocols.h"
+#include "timing_wheel.h"
+
+// The coroutine frames up to this size come from the pool, the bigger
+// ones from the heap.
+#define CORO_FRAME_BLOCK 1024
+
+// Blocks the pool takes from the heap when it is empty.
+#define CORO_FRAME_CHUNK 64
+
+// Bytes read from a socket each time poll() reports it readable. The
+// buffer of a connection starts at the smaller size and grows up to the
+// bigger one while it gets filled, so the idle connections stay cheap.
+#define CORO_READ_MIN 4096
+#define CORO_READ_CHUNK 65536
+
+
+/**
+ * Takes a block for a coroutine frame from the pool (single-threaded).
+ */
+void *coro_frame_alloc(size_t size);
+
+
+/**
+ * Gives the block of a coroutine frame back to the pool.
+ */
+void coro_frame_free(void *frame, size_t size);
+
+
+/**
+ * Return type of the coroutines that serve a connection. They start
+ * suspended (see coro_spawn()) and stay suspended at the end, so the
+ * runtime knows when they are done and frees them.
+ */
+struct conn_task {
+    struct promise_type {
+        conn_task get_return_object() {
+            return conn_task{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+
+        static void *operator new(size_t size) { return coro_frame_alloc(size); }
+        static void operator delete(void *frame, size_t size) { coro_frame_free(frame, size); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+
+struct coro_conn;
+
+
+/**
+ * What the runtime needs from the event loop that owns the connections.
+ */
+struct coro_loop {
+    // The timers of the connections go in this wheel, with this kind;
+    // the owner of the wheel calls coro_on_timer() when they expire.
+    timing_wheel *wheel = NULL;
+    int timer_kind = 0;
+
+    // Starts (enable) or stops watching events of an fd with poll().
+    void *context = NULL;
+    void (*watch)(void *context, int fd, short events, bool enable) = NULL;
+
+    // Connections whose coroutine ended or was cancelled, for the owner
+    // to free once it is done with them.
+    std::vector<coro_conn*> finished;
+};
+
+
+/**
+ * A socket served by a coroutine. The event loop reports what poll()
+ * saw on it (coro_on_readable(), coro_on_writable(), coro_on_timer()),
+ * which resumes the coroutine if it was waiting for that.
+ */
+struct coro_conn {
+    coro_loop *loop = NULL;
+    int fd = -1;
+    struct sockaddr_in addr;
+
+    // Set for a listening socket, which is only accepted from.
+    bool listening = false;
+
+    // Bytes received and not decoded yet are between input_start and
+    // input_end. The buffer only grows, so it is not cleared on each read.
+    std::string input;
+    size_t input_start = 0;
+    size_t input_end = 0;
+
+    // Set when the peer closed the connection (or it failed, with error).
+    bool closed = false;
+    int error = 0;
+
+    // Set while a complete message waits and nobody reads it, so poll()
+    // stops reporting the socket.
+    bool input_paused = false;
+
+    // The suspended coroutine and what it waits for.
+    std::coroutine_handle<> waiter;
+    bool wants_input = false;
+    outbound_queue *write_queue = NULL;
+    int write_result = 0;
+
+    // Deadline of the current wait, if any, and whether it expired.
+    wheel_timer timer;
+    bool timed_out = false;
+
+    // The coroutine serving the connection, until it ends.
+    std::coroutine_handle<> task;
+};
+
+
+/**
+ * Links the connection to its loop (before the first wait).
+ * @param pending_input Bytes that were already received on the socket
+ * (i.e. by the server that handed it off)
+ */
+void coro_init(coro_conn *conn, coro_loop *loop, int fd, const struct sockaddr_in &addr,
+               const std::string &pending_input = "");
+
+
+/**
+ * Starts the coroutine that serves the connection. It runs until its
+ * first wait, before this returns.
+ */
+void coro_spawn(coro_conn *conn, conn_task task);
+
+
+/**
+ * Destroys the coroutine of the connection, wherever it waits (not from
+ * the coroutine itself). The socket is left open.
+ */
+void coro_cancel(coro_conn *conn);
+
+
+/**
+ * Reads what arrived on the socket (or accepts, for a listening one) and
+ * resumes the coroutine if it waits for it.
+ */
+void coro_on_readable(coro_conn *conn);
+
+
+/**
+ * Goes on writing the queue the coroutine waits for, if any, and resumes
+ * it once the queue is empty.
+ */
+void coro_on_writable(coro_conn *conn);
+
+
+/**
+ * Resumes the coroutine waiting for the expired timer of the connection.
+ */
+void coro_on_timer(coro_conn *conn);
+
+
+/**
+ * Returns what was received and not decoded yet.
+ */
+std::string coro_pending_input(const coro_conn *conn);
+
+
+/**
+ * co_await coro_read_frame(conn, msg): waits for a whole message.
+ * Returns the length of its frame (the payload must be freed), 0 if the
+ * connection was closed, -1 on error or when the deadline (if not 0)
+ * passes first, with conn->timed_out set.
+ */
+struct frame_awaiter {
+    coro_conn *conn;
+    tcp_message *msg;
+    uint64_t deadline_ms;
+
+    bool await_ready();
+    void await_suspend(std::coroutine_handle<> handle);
+    int await_resume();
+};
+
+frame_awaiter coro_read_frame(coro_conn *conn, tcp_message *msg, uint64_t deadline_ms = 0);
+
+
+/**
+ * co_await coro_write_frame(conn, queue, frame): appends the frame to the
+ * queue and waits until the whole queue is written.
+ * Returns true on success, false if the connection failed.
+ */
+struct write_awaiter {
+    coro_conn *conn;
+    outbound_queue *queue;
+
+    bool await_ready();
+    void await_suspend(std::coroutine_handle<> handle);
+    bool await_resume();
+};
+
+write_awaiter coro_write_frame(coro_conn *conn, outbound_queue *queue,
+                               std::shared_ptr<std::string> frame);
+
+
+/**
+ * co_await coro_accept(listener, addr): waits for a new connection.
+ * Returns its non-blocking socket, or -1 (with errno set) on error.
+ */
+struct accept_awaiter {
+    coro_conn *listener;
+    struct sockaddr_in *addr;
+    int fd;
+    int error;
+
+    bool await_ready();
+    void await_suspend(std::coroutine_handle<> handle);
+    int await_resume();
+};
+
+accept_awaiter coro_accept(coro_conn *listener, struct sockaddr_in *addr);
+
+
+/**
+ * co_await coro_sleep_until(conn, expires_ms): waits until the given
+ * time of the wheel.
+ */
+struct sleep_awaiter {
+    coro_conn *conn;
+    uint64_t expires_ms;
+
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> handle);
+    void await_resume();
+};
+
+sleep_awaiter coro_sleep_until(coro_conn *conn, uint64_t expires_ms);
+
+
+#endif /* COROUTINE_IO_H */
@@ -0,0 +1,194 @@
+#include "handoff.h"
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+/**
+ * Fills the address of the Unix socket.
+ * @return false if the path is too long
+ */
+static bool fill_unix_addr(const std::string &path, struct sockaddr_un &addr) {
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+
+    if (path.length() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+
+    strcpy(addr.sun_path, path.c_str());
+    return true;
+}
+
+
+static bool send_all(int sockfd, const char *buff, size_t len) {
+    while (len > 0) {
+        ssize_t rc = send(sockfd, buff, len, MSG_NOSIGNAL);
+        if (rc <= 0) {
+            return false;
+        }
+
+        buff += rc;
+        len -= rc;
+    }
+
+    return true;
+}
+
+
+static bool recv_all(int sockfd, char *buff, size_t len) {
+    while (len > 0) {
+        ssize_t rc = recv(sockfd, buff, len, 0);
+        if (rc <= 0) {
+            return false;
+        }
+
+        buff += rc;
+        len -= rc;
+    }
+
+    return true;
+}
+
+
+int handoff_listen(const std::string &path) {
+    struct sockaddr_un addr;
+    if (!fill_unix_addr(path, addr)) {
+        return -1;
+    }
+
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        return -1;
+    }
+
+    unlink(path.c_str());
+    if (bind(sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(sockfd, 1) < 0) {
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+
+int handoff_connect(const std::string &path) {
+    struct sockaddr_un addr;
+    if (!fill_unix_addr(path, addr)) {
+        return -1;
+    }
+
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        return -1;
+    }
+
+    if (connect(sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+
+bool handoff_send(int sockfd, const std::string &state, const std::vector<int> &fds) {
+    // The lengths come first, so the receiver knows what to expect.
+    uint64_t header[2] = {state.size(), fds.size()};
+    if (!send_all(sockfd, (char *) header, sizeof(header))
+        || !send_all(sockfd, state.data(), state.size())) {
+        return false;
+    }
+
+    for (size_t start = 0; start < fds.size(); start += HANDOFF_FDS_PER_MSG) {
+        size_t count = std::min(fds.size() - start, (size_t) HANDOFF_FDS_PER_MSG);
+
+        // The descriptors travel with a single byte of data.
+        char byte = 0;
+        iovec iov;
+        iov.iov_base = &byte;
+        iov.iov_len = 1;
+
+        std::vector<char> control(CMSG_SPACE(count * sizeof(int)));
+
+        msghdr msg;
+        memset(&msg, 0, sizeof(msghdr));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds.data() + start, count * sizeof(int));
+
+        if (sendmsg(sockfd, &msg, MSG_NOSIGNAL) != 1) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+bool handoff_recv(int sockfd, std::string &state, std::vector<int> &fds) {
+    uint64_t header[2];
+    if (!recv_all(sockfd, (char *) header, sizeof(header))) {
+        return false;
+    }
+
+    state.resize(header[0]);
+    if (!recv_all(sockfd, &state[0], state.size())) {
+        return false;
+    }
+
+    fds.clear();
+    while (fds.size() < header[1]) {
+        // One byte at a time, so the descriptors of two batches are never
+        // read by the same call.
+        char byte;
+        iovec iov;
+        iov.iov_base = &byte;
+        iov.iov_len = 1;
+
+        std::vector<char> control(CMSG_SPACE(HANDOFF_FDS_PER_MSG * sizeof(int)));
+
+        msghdr msg;
+        memset(&msg, 0, sizeof(msghdr));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+
+        if (recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC) != 1 || (msg.msg_flags & MSG_CTRUNC)) {
+            return false;
+        }
+
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            return false;
+        }
+
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        size_t old_size = fds.size();
+        fds.resize(old_size + count);
+        memcpy(fds.data() + old_size, CMSG_DATA(cmsg), count * sizeof(int));
+    }
+
+    return fds.size() == header[1];
+}
+
+
+bool handoff_send_ack(int sockfd) {
+    char ack = HANDOFF_ACK;
+    return send_all(sockfd, &ack, 1);
+}
+
+
+bool handoff_recv_ack(int sockfd) {
+    char ack;
+    return recv_all(sockfd, &ack, 1) && ack == HANDOFF_ACK;
+}
@@ -0,0 +1,61 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Descriptors passed with each message (the kernel takes at most 253).
+#define HANDOFF_FDS_PER_MSG 250
+
+// Sent back by the new server once it took everything over.
+#define HANDOFF_ACK 'K'
+
+
+/**
+ * Creates the Unix socket the new server waits on for the running one
+ * (replacing a stale one left at the same path) and listens on it.
+ * @return the socket, or -1 on error
+ */
+int handoff_listen(const std::string &path);
+
+
+/**
+ * Connects the running server to the new one.
+ * @return the socket, or -1 on error
+ */
+int handoff_connect(const std::string &path);
+
+
+/**
+ * Sends the serialized state, then the descriptors it refers to (by their
+ * index in fds), in batches of HANDOFF_FDS_PER_MSG, with SCM_RIGHTS.
+ * @return true on success, false otherwise
+ */
+bool handoff_send(int sockfd, const std::string &state, const std::vector<int> &fds);
+
+
+/**
+ * Receives what handoff_send() sent. The descriptors are new ones,
+ * referring to the same sockets (and files) as in the sender.
+ * @return true on success, false otherwise
+ */
+bool handoff_recv(int sockfd, std::string &state, std::vector<int> &fds);
+
+
+/**
+ * Tells the running server that the new one took everything over.
+ * @return true on success, false otherwise
+ */
+bool handoff_send_ack(int sockfd);
+
+
+/**
+ * Waits for the acknowledgement of the new server.
+ * @return true if it was received, false if the new server failed
+ */
+bool handoff_recv_ack(int sockfd);
+
+
+#endif /* HANDOFF_H */
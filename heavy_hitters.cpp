@@ -0,0 +1,185 @@
+#include "heavy_hitters.h"
+#include <cstring>
+#include <algorithm>
+
+
+uint64_t hh_hash(const char *key, size_t len) {
+    // FNV-1a, the keys are short.
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t) key[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+
+static void heap_swap(space_saving *sketch, uint32_t a, uint32_t b) {
+    std::swap(sketch->heap[a], sketch->heap[b]);
+    sketch->entries[sketch->heap[a]].heap_pos = a;
+    sketch->entries[sketch->heap[b]].heap_pos = b;
+}
+
+
+static uint64_t heap_count(space_saving *sketch, uint32_t pos) {
+    return sketch->entries[sketch->heap[pos]].count;
+}
+
+
+static void sift_up(space_saving *sketch, uint32_t pos) {
+    while (pos > 0) {
+        uint32_t parent = (pos - 1) / 2;
+        if (heap_count(sketch, parent) <= heap_count(sketch, pos)) {
+            return;
+        }
+
+        heap_swap(sketch, parent, pos);
+        pos = parent;
+    }
+}
+
+
+static void sift_down(space_saving *sketch, uint32_t pos) {
+    while (true) {
+        uint32_t smallest = pos;
+        uint32_t left = 2 * pos + 1;
+        uint32_t right = left + 1;
+
+        if (left < sketch->size && heap_count(sketch, left) < heap_count(sketch, smallest)) {
+            smallest = left;
+        }
+        if (right < sketch->size && heap_count(sketch, right) < heap_count(sketch, smallest)) {
+            smallest = right;
+        }
+
+        if (smallest == pos) {
+            return;
+        }
+
+        heap_swap(sketch, smallest, pos);
+        pos = smallest;
+    }
+}
+
+
+/**
+ * Returns the slot of the key in the table, or the empty slot where it
+ * would be inserted.
+ */
+static uint32_t table_find(space_saving *sketch, const char *key, size_t len, uint64_t hash) {
+    uint32_t slot = hash & (HH_TABLE_SIZE - 1);
+
+    while (sketch->table[slot]) {
+        hh_entry &entry = sketch->entries[sketch->table[slot] - 1];
+        if (entry.hash == hash && entry.key_len == len && !memcmp(entry.key, key, len)) {
+            return slot;
+        }
+
+        slot = (slot + 1) & (HH_TABLE_SIZE - 1);
+    }
+
+    return slot;
+}
+
+
+/**
+ * Empties the slot, moving back the following keys of the cluster so
+ * none of them is separated from its home slot by an empty one.
+ */
+static void table_remove(space_saving *sketch, uint32_t slot) {
+    uint32_t next = slot;
+
+    while (true) {
+        next = (next + 1) & (HH_TABLE_SIZE - 1);
+        if (!sketch->table[next]) {
+            break;
+        }
+
+        uint32_t home = sketch->entries[sketch->table[next] - 1].hash & (HH_TABLE_SIZE - 1);
+
+        // The key can fill the hole if its home is not between the hole
+        // and its slot (cyclically).
+        bool movable = slot <= next ? (home <= slot || home > next)
+                                    : (home <= slot && home > next);
+        if (movable) {
+            sketch->table[slot] = sketch->table[next];
+            slot = next;
+        }
+    }
+
+    sketch->table[slot] = 0;
+}
+
+
+void hh_add(space_saving *sketch, const char *key, size_t len, uint64_t hash,
+            uint64_t weight) {
+    len = std::min(len, (size_t) HH_KEY_LEN);
+    sketch->total += weight;
+
+    uint32_t slot = table_find(sketch, key, len, hash);
+    if (sketch->table[slot]) {
+        hh_entry &entry = sketch->entries[sketch->table[slot] - 1];
+        entry.count += weight;
+        sift_down(sketch, entry.heap_pos);
+        return;
+    }
+
+    uint32_t index;
+    uint64_t error = 0;
+    bool replaced = sketch->size == HH_CAPACITY;
+    if (!replaced) {
+        index = sketch->size;
+        sketch->heap[index] = index;
+        sketch->entries[index].heap_pos = index;
+        sketch->entries[index].count = 0;
+        sketch->size++;
+    } else {
+        // The lightest key makes room; the new one may have been it.
+        index = sketch->heap[0];
+        hh_entry &old = sketch->entries[index];
+        table_remove(sketch, table_find(sketch, old.key, old.key_len, old.hash));
+        error = old.count;
+
+        // The removal may have moved the slot of the new key.
+        slot = table_find(sketch, key, len, hash);
+    }
+
+    hh_entry &entry = sketch->entries[index];
+    memcpy(entry.key, key, len);
+    entry.key_len = len;
+    entry.hash = hash;
+    entry.count = error + weight;
+    entry.error = error;
+    sketch->table[slot] = index + 1;
+
+    if (replaced) {
+        sift_down(sketch, entry.heap_pos);
+    } else {
+        sift_up(sketch, entry.heap_pos);
+    }
+}
+
+
+std::vector<const hh_entry*> hh_top(const space_saving *sketch, size_t count) {
+    std::vector<const hh_entry*> top;
+    for (uint32_t i = 0; i < sketch->size; i++) {
+        top.push_back(&sketch->entries[i]);
+    }
+
+    count = std::min(count, top.size());
+    std::partial_sort(top.begin(), top.begin() + count, top.end(),
+                      [](const hh_entry *a, const hh_entry *b) {
+                          return a->count > b->count;
+                      });
+    top.resize(count);
+
+    return top;
+}
+
+
+void hh_clear(space_saving *sketch) {
+    sketch->size = 0;
+    sketch->total = 0;
+    memset(sketch->table, 0, sizeof(sketch->table));
+}
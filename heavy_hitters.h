@@ -0,0 +1,85 @@
+#ifndef HEAVY_HITTERS_H
+#define HEAVY_HITTERS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Keys monitored by a sketch. Whatever the number of distinct keys, the
+// memory stays the same.
+#define HH_CAPACITY 64
+
+// Longest key (a topic); longer ones are cut.
+#define HH_KEY_LEN 50
+
+// Slots of the hash table of a sketch, a power of 2 kept at most 1/4 full.
+#define HH_TABLE_SIZE (HH_CAPACITY * 4)
+
+
+/**
+ * A monitored key and its estimated weight. The real weight is between
+ * count - error and count.
+ */
+struct hh_entry {
+    char key[HH_KEY_LEN];
+    uint8_t key_len;
+    uint64_t hash;
+
+    uint64_t count;
+    uint64_t error;
+
+    // Position of the entry in the heap of the sketch.
+    uint32_t heap_pos;
+};
+
+
+/**
+ * Space-Saving sketch: the HH_CAPACITY heaviest keys are monitored. A new
+ * key replaces the lightest one and inherits its count (as the error), so
+ * any key heavier than total / HH_CAPACITY is guaranteed to be in the
+ * sketch. The lightest entry is found with a min-heap and the entries of
+ * the keys with an open addressing table, so an update is O(1) on average
+ * (O(log HH_CAPACITY) to keep the heap) and never allocates.
+ */
+struct space_saving {
+    hh_entry entries[HH_CAPACITY];
+    uint32_t size = 0;
+
+    // Indexes of the entries, the lightest first.
+    uint32_t heap[HH_CAPACITY];
+
+    // Index + 1 of the entry of every key, 0 for an empty slot (linear
+    // probing, by the hash of the key).
+    uint32_t table[HH_TABLE_SIZE] = {};
+
+    // Weight of all the keys ever added.
+    uint64_t total = 0;
+};
+
+
+/**
+ * Hash of a key, computed once for all the sketches it is added to.
+ */
+uint64_t hh_hash(const char *key, size_t len);
+
+
+/**
+ * Adds weight to the key.
+ */
+void hh_add(space_saving *sketch, const char *key, size_t len, uint64_t hash,
+            uint64_t weight);
+
+
+/**
+ * Returns the (at most) count heaviest entries, the heaviest first.
+ */
+std::vector<const hh_entry*> hh_top(const space_saving *sketch, size_t count);
+
+
+/**
+ * Forgets all the keys.
+ */
+void hh_clear(space_saving *sketch);
+
+
+#endif /* HEAVY_HITTERS_H */
@@ -0,0 +1,74 @@
+#include "histogram.h"
+
+
+/**
+ * The values under HISTOGRAM_SUB_BUCKETS have a bucket each. Above, the
+ * bucket is given by the position of the highest bit and by the
+ * HISTOGRAM_SUB_BITS bits that follow it.
+ */
+static inline int bucket_index(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+
+    int highest_bit = 63 - __builtin_clzll(value);
+    int shift = highest_bit - HISTOGRAM_SUB_BITS;
+    int sub_bucket = (value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1);
+
+    return ((shift + 1) << HISTOGRAM_SUB_BITS) + sub_bucket;
+}
+
+
+/**
+ * Largest value that falls in the bucket.
+ */
+static inline uint64_t bucket_upper_bound(int index) {
+    int range = index >> HISTOGRAM_SUB_BITS;
+    uint64_t sub_bucket = index & (HISTOGRAM_SUB_BUCKETS - 1);
+
+    if (range == 0) {
+        return sub_bucket;
+    }
+
+    int shift = range - 1;
+    uint64_t lower = (HISTOGRAM_SUB_BUCKETS + sub_bucket) << shift;
+    return lower + ((1ULL << shift) - 1);
+}
+
+
+void histogram_record(latency_histogram *histogram, uint64_t value) {
+    histogram->counts[bucket_index(value)]++;
+    histogram->total++;
+
+    if (value < histogram->min) {
+        histogram->min = value;
+    }
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+
+uint64_t histogram_percentile(const latency_histogram *histogram, double percentile) {
+    if (histogram->total == 0) {
+        return 0;
+    }
+
+    // Rank of the value, starting from 1.
+    uint64_t rank = (uint64_t) (percentile / 100.0 * histogram->total + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            // The bucket bound may go over the largest value seen.
+            uint64_t bound = bucket_upper_bound(i);
+            return bound < histogram->max ? bound : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
@@ -0,0 +1,39 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <cstdint>
+
+// Each power of two is split in 2^HISTOGRAM_SUB_BITS buckets, so a value
+// is known with a relative error of at most 1/32 (about 3%).
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+
+/**
+ * HDR-style histogram: constant memory and constant time per value, with
+ * the same relative precision from nanoseconds to hours.
+ */
+struct latency_histogram {
+    uint64_t counts[HISTOGRAM_BUCKETS] = {};
+    uint64_t total = 0;
+    uint64_t min = UINT64_MAX;
+    uint64_t max = 0;
+};
+
+
+/**
+ * Counts a value.
+ */
+void histogram_record(latency_histogram *histogram, uint64_t value);
+
+
+/**
+ * @param percentile Between 0 and 100
+ * @return the (upper bound of the bucket of the) value under which the
+ * given percentage of the values are, or 0 if nothing was recorded
+ */
+uint64_t histogram_percentile(const latency_histogram *histogram, double percentile);
+
+
+#endif /* HISTOGRAM_H */
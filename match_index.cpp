@@ -0,0 +1,324 @@
+#include "match_index.h"
+#include <algorithm>
+
+
+void index_init(match_index *index) {
+    match_snapshot *first = new match_snapshot();
+    for (int i = 0; i < MATCH_SHARDS; i++) {
+        first->shards[i] = std::make_shared<const exact_shard>();
+    }
+    first->wildcards =
+        std::make_shared<const std::vector<std::shared_ptr<const indexed_pattern>>>();
+
+    index->current.store(first);
+}
+
+
+void index_destroy(match_index *index) {
+    for (auto &entry : index->retired) {
+        delete entry.first;
+    }
+    index->retired.clear();
+
+    delete index->current.exchange(NULL);
+}
+
+
+void index_change_pattern(match_index *index, bool add, uint32_t id,
+                          const compiled_pattern &pattern) {
+    index->changes.push_back({add, id, pattern});
+}
+
+
+static size_t shard_of(std::string_view pattern) {
+    return pattern_hash{}(pattern) % MATCH_SHARDS;
+}
+
+
+/**
+ * Frees the retired snapshots that no reader can be looking at: the
+ * readers are idle, or took a snapshot after they were retired.
+ */
+static void reclaim(match_index *index) {
+    size_t kept = 0;
+
+    for (auto &entry : index->retired) {
+        bool in_use = false;
+        for (int i = 0; i < MAX_MATCHERS && !in_use; i++) {
+            uint64_t epoch = index->readers[i].epoch.load();
+            in_use = epoch != 0 && epoch < entry.second;
+        }
+
+        if (in_use) {
+            index->retired[kept++] = entry;
+        } else {
+            delete entry.first;
+        }
+    }
+
+    index->retired.resize(kept);
+}
+
+
+bool index_publish(match_index *index) {
+    if (!index->retired.empty()) {
+        reclaim(index);
+    }
+
+    if (index->changes.empty()) {
+        return false;
+    }
+
+    const match_snapshot *old = index->current.load();
+    match_snapshot *next = new match_snapshot(*old);
+    next->version = old->version + 1;
+
+    // Each shard (and the wildcards) is copied once, for all the changes.
+    std::shared_ptr<exact_shard> shards[MATCH_SHARDS];
+    std::shared_ptr<std::vector<std::shared_ptr<const indexed_pattern>>> wildcards;
+
+    for (index_change &change : index->changes) {
+        if (!change.pattern.has_wildcards) {
+            size_t shard = shard_of(change.pattern.text);
+            if (!shards[shard]) {
+                shards[shard] = std::make_shared<exact_shard>(*old->shards[shard]);
+            }
+
+            auto &ids = shards[shard]->ids;
+            if (change.add) {
+                ids[change.pattern.text] = change.id;
+            } else {
+                auto it = ids.find(change.pattern.text);
+                if (it != ids.end() && it->second == change.id) {
+                    ids.erase(it);
+                }
+            }
+            continue;
+        }
+
+        if (!wildcards) {
+            wildcards = std::make_shared<std::vector<std::shared_ptr<const indexed_pattern>>>(
+                *old->wildcards);
+        }
+
+        if (change.add) {
+            wildcards->push_back(std::make_shared<const indexed_pattern>(
+                indexed_pattern{change.id, std::move(change.pattern)}));
+            continue;
+        }
+
+        for (size_t i = 0; i < wildcards->size(); i++) {
+            if ((*wildcards)[i]->id == change.id) {
+                (*wildcards)[i] = wildcards->back();
+                wildcards->pop_back();
+                break;
+            }
+        }
+    }
+    index->changes.clear();
+
+    for (int i = 0; i < MATCH_SHARDS; i++) {
+        if (shards[i]) {
+            next->shards[i] = std::move(shards[i]);
+        }
+    }
+    if (wildcards) {
+        next->wildcards = std::move(wildcards);
+    }
+
+    // The readers that take a snapshot from now on get the new one. Those
+    // that entered before the epoch moved may still use the old one.
+    index->current.store(next);
+    uint64_t retire_epoch = index->epoch.fetch_add(1) + 1;
+    index->retired.push_back({old, retire_epoch});
+
+    return true;
+}
+
+
+const match_snapshot *index_current(const match_index *index) {
+    return index->current.load(std::memory_order_relaxed);
+}
+
+
+const match_snapshot *index_enter(match_index *index, int reader) {
+    // Announced before the snapshot is read: if the loop did not see the
+    // announcement, the snapshot read is the one it just published.
+    index->readers[reader].epoch.store(index->epoch.load());
+    return index->current.load();
+}
+
+
+void index_leave(match_index *index, int reader) {
+    index->readers[reader].epoch.store(0, std::memory_order_release);
+}
+
+
+void snapshot_match(const match_snapshot *snapshot, std::string_view topic,
+                    const topic_levels &levels, std::vector<uint32_t> &ids) {
+    ids.clear();
+
+    const exact_shard &shard = *snapshot->shards[shard_of(topic)];
+    auto it = shard.ids.find(topic);
+    if (it != shard.ids.end()) {
+        ids.push_back(it->second);
+    }
+
+    for (auto &wildcard : *snapshot->wildcards) {
+        if (match_pattern(wildcard->pattern, levels)) {
+            ids.push_back(wildcard->id);
+        }
+    }
+}
+
+
+/**
+ * Matches the requests of a thread as they come, taking a snapshot for
+ * each batch of them, and sleeps when there are none.
+ */
+static void run_matcher(match_pool *pool, int number) {
+    matcher &self = pool->matchers[number];
+    match_ring &requests = self.requests;
+    match_ring &results = self.results;
+
+    while (!pool->stop.load(std::memory_order_acquire)) {
+        uint32_t head = requests.head.load(std::memory_order_relaxed);
+        uint32_t tail = requests.tail.load(std::memory_order_acquire);
+
+        if (head == tail) {
+            // Either the loop sees the flag after pushing, or this sees
+            // what it pushed.
+            self.idle.store(true);
+            uint32_t wake = self.wake.load();
+            if (requests.tail.load() == head && !pool->stop.load()) {
+                self.wake.wait(wake);
+            }
+            self.idle.store(false);
+            continue;
+        }
+
+        const match_snapshot *snapshot = index_enter(pool->index, number);
+
+        for (uint32_t i = head; i != tail; i++) {
+            match_request &request = requests.slots[i % MATCH_RING_SIZE];
+
+            // The loop never has more requests in flight than a ring
+            // holds, so there is room for the result.
+            uint32_t result_tail = results.tail.load(std::memory_order_relaxed);
+            match_request &result = results.slots[result_tail % MATCH_RING_SIZE];
+
+            result.owner = request.owner;
+            result.topic = request.topic;
+            result.levels = request.levels;
+            result.version = snapshot->version;
+            snapshot_match(snapshot, request.topic, *request.levels, result.ids);
+
+            results.tail.store(result_tail + 1, std::memory_order_release);
+        }
+
+        index_leave(pool->index, number);
+
+        requests.head.store(tail, std::memory_order_release);
+        self.matched.fetch_add(tail - head, std::memory_order_relaxed);
+    }
+}
+
+
+void matchers_start(match_pool *pool, match_index *index, int num_matchers) {
+    pool->index = index;
+    pool->num_matchers = std::min(std::max(num_matchers, 0), MAX_MATCHERS);
+    if (pool->num_matchers == 0) {
+        return;
+    }
+
+    pool->matchers.reset(new matcher[pool->num_matchers]);
+    for (int i = 0; i < pool->num_matchers; i++) {
+        pool->matchers[i].thread = std::thread(run_matcher, pool, i);
+    }
+}
+
+
+void matchers_stop(match_pool *pool) {
+    if (pool->num_matchers == 0) {
+        return;
+    }
+
+    pool->stop.store(true);
+    for (int i = 0; i < pool->num_matchers; i++) {
+        matcher &target = pool->matchers[i];
+        target.wake.fetch_add(1);
+        target.wake.notify_one();
+        target.thread.join();
+    }
+
+    pool->matchers.reset();
+    pool->num_matchers = 0;
+    pool->in_flight = 0;
+}
+
+
+bool matchers_submit(match_pool *pool, void *owner, std::string_view topic,
+                     const topic_levels *levels) {
+    if (pool->num_matchers == 0) {
+        return false;
+    }
+
+    int number = pool->next_request;
+    if (pool->pending[number] == MATCH_RING_SIZE) {
+        return false;
+    }
+    pool->next_request = (number + 1) % pool->num_matchers;
+
+    matcher &target = pool->matchers[number];
+    uint32_t tail = target.requests.tail.load(std::memory_order_relaxed);
+    match_request &request = target.requests.slots[tail % MATCH_RING_SIZE];
+
+    request.owner = owner;
+    request.topic = topic;
+    request.levels = levels;
+    target.requests.tail.store(tail + 1);
+
+    pool->pending[number]++;
+    pool->in_flight++;
+
+    // A system call only if the thread went to sleep.
+    if (target.idle.load()) {
+        target.wake.fetch_add(1);
+        target.wake.notify_one();
+    }
+
+    return true;
+}
+
+
+bool matchers_collect(match_pool *pool, match_request &result) {
+    if (pool->in_flight == 0) {
+        return false;
+    }
+
+    for (int i = 0; i < pool->num_matchers; i++) {
+        int number = (pool->next_result + i) % pool->num_matchers;
+        match_ring &results = pool->matchers[number].results;
+
+        uint32_t head = results.head.load(std::memory_order_relaxed);
+        if (head == results.tail.load(std::memory_order_acquire)) {
+            continue;
+        }
+
+        // The ids are swapped, so both vectors keep their memory.
+        match_request &slot = results.slots[head % MATCH_RING_SIZE];
+        result.owner = slot.owner;
+        result.topic = slot.topic;
+        result.levels = slot.levels;
+        result.version = slot.version;
+        result.ids.swap(slot.ids);
+        results.head.store(head + 1, std::memory_order_release);
+
+        pool->pending[number]--;
+        pool->in_flight--;
+        pool->next_result = (number + 1) % pool->num_matchers;
+        return true;
+    }
+
+    return false;
+}
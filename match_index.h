@@ -0,0 +1,246 @@
+#ifndef MATCH_INDEX_H
+#define MATCH_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "topic_pattern.h"
+
+// The patterns without wildcards are split in this many shards, so a
+// change copies only the shard of its pattern.
+#define MATCH_SHARDS 64
+
+// Most matcher threads, each one being a reader of the index.
+#define MAX_MATCHERS 32
+
+// Requests (and results) that can wait for a matcher.
+#define MATCH_RING_SIZE 1024
+
+
+struct pattern_hash {
+    using is_transparent = void;
+
+    size_t operator()(std::string_view pattern) const {
+        return std::hash<std::string_view>{}(pattern);
+    }
+};
+
+
+/**
+ * Ids of the patterns without wildcards of a shard, by their text.
+ */
+struct exact_shard {
+    std::unordered_map<std::string, uint32_t, pattern_hash, std::equal_to<>> ids;
+};
+
+
+struct indexed_pattern {
+    uint32_t id;
+    compiled_pattern pattern;
+};
+
+
+/**
+ * The patterns the clients are subscribed to, as they were at some point.
+ * A snapshot never changes once it is published: the next one shares the
+ * shards and the wildcards it did not change, so readers can match
+ * against it without any lock while the loop builds the next one.
+ */
+struct match_snapshot {
+    uint64_t version = 0;
+    std::shared_ptr<const exact_shard> shards[MATCH_SHARDS];
+    std::shared_ptr<const std::vector<std::shared_ptr<const indexed_pattern>>> wildcards;
+};
+
+
+/**
+ * A change of the patterns that is not published yet.
+ */
+struct index_change {
+    bool add;
+    uint32_t id;
+    compiled_pattern pattern;
+};
+
+
+/**
+ * Epoch of a reader, alone on its cache line, so the readers never write
+ * to the same line. 0 while it does not look at any snapshot.
+ */
+struct alignas(64) reader_epoch {
+    std::atomic<uint64_t> epoch{0};
+};
+
+
+/**
+ * The current snapshot of the patterns, updated only by the loop thread
+ * (copy-on-write) and read by any number of threads. The snapshots that
+ * were replaced are freed once no reader can still be looking at them:
+ * a reader announces the epoch in which it started, and a snapshot retired
+ * in a later epoch is safe from it.
+ */
+struct match_index {
+    std::atomic<const match_snapshot*> current{NULL};
+    std::vector<index_change> changes;
+
+    std::atomic<uint64_t> epoch{1};
+    reader_epoch readers[MAX_MATCHERS];
+    std::vector<std::pair<const match_snapshot*, uint64_t>> retired;
+};
+
+
+/**
+ * Publishes the first (empty) snapshot.
+ */
+void index_init(match_index *index);
+
+
+/**
+ * Frees all the snapshots, once no reader is left.
+ */
+void index_destroy(match_index *index);
+
+
+/**
+ * Records that the pattern got its first subscriber (add) or lost its last
+ * one; readers see it once the changes are published.
+ */
+void index_change_pattern(match_index *index, bool add, uint32_t id,
+                          const compiled_pattern &pattern);
+
+
+/**
+ * Publishes a new snapshot with the recorded changes, if any, and frees
+ * the retired snapshots that no reader uses anymore. Loop thread only.
+ * @return true if a new version was published
+ */
+bool index_publish(match_index *index);
+
+
+/**
+ * Current snapshot, for the loop thread, which is the only one that
+ * replaces it (so it needs no epoch).
+ */
+const match_snapshot *index_current(const match_index *index);
+
+
+/**
+ * Takes the current snapshot for the reader with the given number. It
+ * stays valid until index_leave().
+ */
+const match_snapshot *index_enter(match_index *index, int reader);
+
+
+void index_leave(match_index *index, int reader);
+
+
+/**
+ * Finds the ids of the patterns that match the topic: the one with the
+ * same text, if any, then the wildcards.
+ */
+void snapshot_match(const match_snapshot *snapshot, std::string_view topic,
+                    const topic_levels &levels, std::vector<uint32_t> &ids);
+
+
+/**
+ * A topic to match, then the result: the ids of the patterns it matches
+ * in the snapshot with the given version. The topic and its levels belong
+ * to the owner, which keeps them until it gets the result.
+ */
+struct match_request {
+    void *owner = NULL;
+    std::string_view topic;
+    const topic_levels *levels = NULL;
+
+    uint64_t version = 0;
+    std::vector<uint32_t> ids;
+};
+
+
+/**
+ * Ring with a single producer and a single consumer, which only share
+ * the two counters.
+ */
+struct match_ring {
+    match_request slots[MATCH_RING_SIZE];
+    alignas(64) std::atomic<uint32_t> head{0};
+    alignas(64) std::atomic<uint32_t> tail{0};
+};
+
+
+struct alignas(64) matcher {
+    std::thread thread;
+
+    // Requests from the loop and results for it.
+    match_ring requests;
+    match_ring results;
+
+    // Set while the thread waits for requests; the loop then bumps wake
+    // to wake it up.
+    std::atomic<bool> idle{false};
+    std::atomic<uint32_t> wake{0};
+
+    // Requests it matched.
+    std::atomic<uint64_t> matched{0};
+};
+
+
+/**
+ * Threads that match the topics of the publications against the index,
+ * while the loop goes on. The requests are given in turn to each thread;
+ * the results come back in the same order for each thread, but not
+ * across threads.
+ */
+struct match_pool {
+    match_index *index = NULL;
+    int num_matchers = 0;
+    std::unique_ptr<matcher[]> matchers;
+
+    std::atomic<bool> stop{false};
+
+    // Next thread to get a request and to give a result.
+    int next_request = 0;
+    int next_result = 0;
+
+    // Requests given to each thread and not collected yet. There are
+    // never more than MATCH_RING_SIZE, so its results always fit.
+    uint32_t pending[MAX_MATCHERS] = {};
+    size_t in_flight = 0;
+};
+
+
+/**
+ * Starts the threads (at most MAX_MATCHERS).
+ */
+void matchers_start(match_pool *pool, match_index *index, int num_matchers);
+
+
+/**
+ * Stops and joins the threads. The results not collected are dropped.
+ */
+void matchers_stop(match_pool *pool);
+
+
+/**
+ * Gives a topic to the next thread.
+ * @return false if its queue is full (the caller matches it itself)
+ */
+bool matchers_submit(match_pool *pool, void *owner, std::string_view topic,
+                     const topic_levels *levels);
+
+
+/**
+ * Takes a result of any thread, if one is ready.
+ * @return false if none is ready
+ */
+bool matchers_collect(match_pool *pool, match_request &result);
+
+
+#endif /* MATCH_INDEX_H */
@@ -1,53 +1,147 @@
 #include "protocols.h"
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <endian.h>
+#include <sys/uio.h>
 #include "utils.h"
 
 
 /**
- * Maybe not really elegant, but efficient for sure. It was a must to
- * receive the structure's attributes one by one, because, if command
- * and len were received continuously (by receiving at (uint8_t *) msg),
- * structure padding might have corrupted the data.
+ * Blocks until there is something to read on the socket. Needed when
+ * only a part of a message arrived on a non-blocking socket. Only the
+ * clients wait like this; the server reads with coroutines instead.
  */
-int recv_efficient(int sockfd, tcp_message *msg) {
-    int total_bytes_received = 0;
-    int bytes_recv;
-    int bytes_remaining;
-    uint8_t *buff;
+static void wait_readable(int sockfd) {
+    pollfd sock_pollfd;
+    sock_pollfd.fd = sockfd;
+    sock_pollfd.events = POLLIN;
+    sock_pollfd.revents = 0;
 
-    // Firstly, receive the command.
-    bytes_remaining = sizeof(msg->command);
-    buff = (uint8_t *) &msg->command;
+    poll(&sock_pollfd, 1, -1);
+}
+
+
+/**
+ * Receives exactly len bytes, waiting for them if the socket is
+ * non-blocking and only a part of them arrived.
+ * @return len on success, 0 if the connection was closed, -1 on error
+ */
+static int recv_exact(int sockfd, void *dest, size_t len) {
+    uint8_t *buff = (uint8_t *) dest;
+    size_t bytes_remaining = len;
 
     while (bytes_remaining) {
-        bytes_recv = recv(sockfd, buff, bytes_remaining, 0);
+        int bytes_recv = recv(sockfd, buff, bytes_remaining, 0);
+        if (bytes_recv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // The rest of the message has not arrived yet.
+            wait_readable(sockfd);
+            continue;
+        }
+
         if (bytes_recv <= 0) {
             // Error or connection closed.
             return bytes_recv;
         }
 
-        total_bytes_received += bytes_recv;
         buff += bytes_recv;
         bytes_remaining -= bytes_recv;
     }
 
-    // Then, receive the len.
-    bytes_remaining = sizeof(msg->len);
-    buff = (uint8_t *) &msg->len;
+    return len;
+}
+
+
+/**
+ * Sends exactly len bytes on a blocking socket.
+ * @return len on success, -1 on error
+ */
+static int send_exact(int sockfd, const void *src, size_t len) {
+    const uint8_t *buff = (const uint8_t *) src;
+    size_t bytes_remaining = len;
 
     while (bytes_remaining) {
-        bytes_recv = recv(sockfd, buff, bytes_remaining, 0);
-        if (bytes_recv <= 0) {
-            // Error or connection closed.
-            return bytes_recv;
+        int bytes_sent = send(sockfd, buff, bytes_remaining, 0);
+        if (bytes_sent < 0) {
+            // Error.
+            return -1;
         }
 
-        total_bytes_received += bytes_recv;
-        buff += bytes_recv;
-        bytes_remaining -= bytes_recv;
+        buff += bytes_sent;
+        bytes_remaining -= bytes_sent;
+    }
+
+    return len;
+}
+
+
+/**
+ * Writes the command and the (possibly extended) len of the message in
+ * network order, as they go on the wire.
+ * @return The length of the header
+ */
+static size_t encode_header(tcp_message *msg, uint8_t *header) {
+    header[0] = msg->command;
+
+    if (msg->len < TCP_EXTENDED_LEN) {
+        uint16_t net_len = htons(msg->len);
+        memcpy(header + 1, &net_len, sizeof(uint16_t));
+        return TCP_HEADER_LEN;
     }
 
+    // The escape value is followed by the actual length.
+    uint16_t escape = htons(TCP_EXTENDED_LEN);
+    uint32_t net_len = htonl(msg->len);
+    memcpy(header + 1, &escape, sizeof(uint16_t));
+    memcpy(header + TCP_HEADER_LEN, &net_len, sizeof(uint32_t));
+    return TCP_HEADER_LEN + sizeof(uint32_t);
+}
+
+
+/**
+ * Maybe not really elegant, but efficient for sure. It was a must to
+ * receive the structure's attributes one by one, because, if command
+ * and len were received continuously (by receiving at (uint8_t *) msg),
+ * structure padding might have corrupted the data.
+ */
+int recv_efficient(int sockfd, tcp_message *msg) {
+    int total_bytes_received = 0;
+    int rc;
+
+    // Firstly, receive the command.
+    rc = recv_exact(sockfd, &msg->command, sizeof(msg->command));
+    if (rc <= 0) {
+        return rc;
+    }
+    total_bytes_received += rc;
+
+    // Then, receive the len.
+    uint16_t short_len;
+    rc = recv_exact(sockfd, &short_len, sizeof(short_len));
+    if (rc <= 0) {
+        return rc;
+    }
+    total_bytes_received += rc;
+
     // Convert len to host order.
-    msg->len = ntohs(msg->len);
+    msg->len = ntohs(short_len);
+
+    if (msg->len == TCP_EXTENDED_LEN) {
+        // The payload is too big for 16 bits, the real len follows.
+        uint32_t long_len;
+        rc = recv_exact(sockfd, &long_len, sizeof(long_len));
+        if (rc <= 0) {
+            return rc;
+        }
+        total_bytes_received += rc;
+
+        msg->len = ntohl(long_len);
+        if (msg->len > MAX_TCP_PAYLOAD) {
+            // The stream can not be trusted anymore.
+            errno = EMSGSIZE;
+            return -1;
+        }
+    }
 
     // If len is 0, no payload should be received.
     if (msg->len == 0) {
@@ -58,84 +152,362 @@ int recv_efficient(int sockfd, tcp_message *msg) {
     msg->payload = (char *) malloc(msg->len);
     DIE(!msg->payload, "malloc failed\n");
 
-    bytes_remaining = msg->len;
-    buff = (uint8_t *) msg->payload;
+    rc = recv_exact(sockfd, msg->payload, msg->len);
+    if (rc <= 0) {
+        // The caller only frees the payload of a whole message.
+        free(msg->payload);
+        msg->payload = NULL;
+        return rc;
+    }
+    total_bytes_received += rc;
 
-    while (bytes_remaining) {
-        bytes_recv = recv(sockfd, buff, bytes_remaining, 0);
-        if (bytes_recv <= 0) {
-            // Error or connection closed.
-            return bytes_recv;
+    return total_bytes_received;
+}
+
+
+int decode_frame(const char *data, size_t len, tcp_message *msg) {
+    if (len < TCP_HEADER_LEN) {
+        return 0;
+    }
+
+    uint16_t short_len;
+    memcpy(&short_len, data + 1, sizeof(uint16_t));
+
+    size_t header_len = TCP_HEADER_LEN;
+    uint32_t payload_len = ntohs(short_len);
+
+    if (payload_len == TCP_EXTENDED_LEN) {
+        if (len < TCP_HEADER_LEN + sizeof(uint32_t)) {
+            return 0;
         }
 
-        total_bytes_received += bytes_recv;
-        buff += bytes_recv;
-        bytes_remaining -= bytes_recv;
+        uint32_t long_len;
+        memcpy(&long_len, data + TCP_HEADER_LEN, sizeof(uint32_t));
+        payload_len = ntohl(long_len);
+        header_len += sizeof(uint32_t);
+
+        if (payload_len > MAX_TCP_PAYLOAD) {
+            return -1;
+        }
     }
 
-    return total_bytes_received;
+    if (len < header_len + payload_len) {
+        return 0;
+    }
+
+    if (!msg) {
+        return header_len + payload_len;
+    }
+
+    msg->command = data[0];
+    msg->len = payload_len;
+    msg->payload = NULL;
+
+    if (payload_len > 0) {
+        msg->payload = (char *) malloc(payload_len);
+        DIE(!msg->payload, "malloc failed\n");
+        memcpy(msg->payload, data + header_len, payload_len);
+    }
+
+    return header_len + payload_len;
 }
 
 
 int send_efficient(int sockfd, tcp_message *msg) {
-    int total_bytes_sent = 0;
-    int bytes_sent;
-    int bytes_remaining;
-    uint8_t *buff;
+    // Firstly, send the command and the len, then the payload.
+    uint8_t header[TCP_HEADER_LEN + sizeof(uint32_t)];
+    size_t header_len = encode_header(msg, header);
 
-    // Convert len to network order to prepare for sending.
-    msg->len = htons(msg->len);
+    if (send_exact(sockfd, header, header_len) < 0) {
+        return -1;
+    }
 
-    // Firstly, send the command.
-    bytes_remaining = sizeof(msg->command);
-    buff = (uint8_t *) &msg->command;
+    if (send_exact(sockfd, msg->payload, msg->len) < 0) {
+        return -1;
+    }
 
-    while (bytes_remaining) {
-        bytes_sent = send(sockfd, buff, bytes_remaining, 0);
-        if (bytes_sent < 0) {
-            // Error.
-            return -1;
+    return header_len + msg->len;
+}
+
+
+int send_command(int sockfd, uint8_t command) {
+    tcp_message msg;
+    msg.command = command;
+    msg.len = 0;
+    msg.payload = NULL;
+
+    return send_efficient(sockfd, &msg);
+}
+
+
+std::shared_ptr<std::string> encode_message(tcp_message *msg) {
+    uint8_t header[TCP_HEADER_LEN + sizeof(uint32_t)];
+    size_t header_len = encode_header(msg, header);
+
+    auto frame = std::make_shared<std::string>();
+    frame->reserve(header_len + msg->len);
+
+    // Same order as in send_efficient(): command, len, payload.
+    frame->append((char *) header, header_len);
+    frame->append(msg->payload, msg->len);
+
+    return frame;
+}
+
+
+std::shared_ptr<std::string> encode_mux_frame(const uint16_t *tags, size_t num_tags,
+                                              const std::string &frame) {
+    std::string payload;
+    payload.reserve(sizeof(uint16_t) * (num_tags + 1) + frame.size());
+
+    uint16_t net_value = htons(num_tags);
+    payload.append((char *) &net_value, sizeof(uint16_t));
+    for (size_t i = 0; i < num_tags; i++) {
+        net_value = htons(tags[i]);
+        payload.append((char *) &net_value, sizeof(uint16_t));
+    }
+    payload += frame;
+
+    tcp_message msg;
+    msg.command = MUX_FRAME;
+    msg.len = payload.length();
+    msg.payload = (char *) payload.data();
+
+    return encode_message(&msg);
+}
+
+
+bool decode_mux_frame(const char *payload, size_t len, std::vector<uint16_t> &tags,
+                      tcp_message *msg) {
+    uint16_t num_tags;
+    if (len < sizeof(uint16_t)) {
+        return false;
+    }
+    memcpy(&num_tags, payload, sizeof(uint16_t));
+    num_tags = ntohs(num_tags);
+
+    size_t header_len = sizeof(uint16_t) * (num_tags + 1);
+    if (num_tags == 0 || num_tags > MUX_MAX_TAGS || len < header_len) {
+        return false;
+    }
+
+    tags.resize(num_tags);
+    for (size_t i = 0; i < num_tags; i++) {
+        memcpy(&tags[i], payload + sizeof(uint16_t) * (i + 1), sizeof(uint16_t));
+        tags[i] = ntohs(tags[i]);
+    }
+
+    // The wrapped frame must fill the rest of the payload exactly.
+    int rc = decode_frame(payload + header_len, len - header_len, NULL);
+    if (rc <= 0 || (size_t) rc != len - header_len) {
+        return false;
+    }
+
+    decode_frame(payload + header_len, len - header_len, msg);
+    return true;
+}
+
+
+std::shared_ptr<std::string> enqueue_frame(outbound_queue *queue,
+                                           std::shared_ptr<std::string> frame,
+                                           const std::string &conflation_key,
+                                           size_t stamp_offset, int lane, uint8_t topic_len) {
+    if (!conflation_key.empty()) {
+        auto it = queue->conflation_slots.find(conflation_key);
+        if (it != queue->conflation_slots.end()) {
+            // An older message for this topic was not sent yet, replace it.
+            std::shared_ptr<std::string> replaced = it->second->frame;
+            queue->bytes += frame->size() - replaced->size();
+            it->second->frame = frame;
+            it->second->stamp_offset = stamp_offset;
+            it->second->topic_len = topic_len;
+            return replaced;
         }
+    }
 
-        bytes_remaining -= bytes_sent;
-        total_bytes_sent += bytes_sent;
-        buff += bytes_sent;
+    queue->lanes[lane].push_back({frame, conflation_key, stamp_offset, topic_len});
+    queue->bytes += frame->size();
+
+    // Pointers to deque elements stay valid when pushing at the back
+    // and popping from the front, so they can be kept in the map.
+    if (!conflation_key.empty()) {
+        queue->conflation_slots[conflation_key] = &queue->lanes[lane].back();
     }
 
-    // Then, send the len.
-    bytes_remaining = sizeof(msg->len);
-    buff = (uint8_t *) &msg->len;
+    return NULL;
+}
 
-    while (bytes_remaining) {
-        bytes_sent = send(sockfd, buff, bytes_remaining, 0);
-        if (bytes_sent < 0) {
-            // Error.
-            return -1;
+
+size_t outbound_size(const outbound_queue *queue) {
+    size_t size = 0;
+    for (int lane = 0; lane < NUM_LANES; lane++) {
+        size += queue->lanes[lane].size();
+    }
+
+    return size;
+}
+
+
+int next_lane(const outbound_queue *queue) {
+    if (queue->front_offset > 0) {
+        return queue->sending_lane;
+    }
+
+    // The most urgent of the starved lanes, if any.
+    for (int lane = 0; lane < NUM_LANES; lane++) {
+        if (!queue->lanes[lane].empty() && queue->passed[lane] >= LANE_MAX_PASSED) {
+            return lane;
         }
+    }
 
-        bytes_remaining -= bytes_sent;
-        total_bytes_sent += bytes_sent;
-        buff += bytes_sent;
+    for (int lane = 0; lane < NUM_LANES; lane++) {
+        if (!queue->lanes[lane].empty()) {
+            return lane;
+        }
     }
 
-    // Set len back to host order.
-    msg->len = ntohs(msg->len);
+    return -1;
+}
+
 
-    // Now, send the payload.
-    bytes_remaining = msg->len;
-    buff = (uint8_t *) msg->payload;
+size_t drop_oldest(outbound_queue *queue, int lane) {
+    std::deque<pending_msg> &messages = queue->lanes[lane];
 
-    while (bytes_remaining) {
-        bytes_sent = send(sockfd, buff, bytes_remaining, 0);
+    // A frame that was partially written must be finished.
+    bool sending = queue->front_offset > 0 && queue->sending_lane == lane;
+    if (messages.size() <= (size_t) sending) {
+        return 0;
+    }
+
+    pending_msg &oldest = messages[sending];
+    auto slot = queue->conflation_slots.find(oldest.conflation_key);
+    if (slot != queue->conflation_slots.end() && slot->second == &oldest) {
+        queue->conflation_slots.erase(slot);
+    }
+
+    size_t size = oldest.frame->size();
+    queue->bytes -= size;
+
+    // Only popping from the front keeps the other slots valid, so the
+    // frame being sent takes the place of the dropped one.
+    if (sending) {
+        messages[1] = std::move(messages[0]);
+    }
+    messages.pop_front();
+
+    return size;
+}
+
+
+void pop_lane(outbound_queue *queue, int lane) {
+    queue->bytes -= queue->lanes[lane].front().frame->size();
+    queue->lanes[lane].pop_front();
+    queue->passed[lane] = 0;
+
+    for (int other = 0; other < NUM_LANES; other++) {
+        if (other != lane && !queue->lanes[other].empty()) {
+            queue->passed[other]++;
+        }
+    }
+}
+
+
+int flush_outbound(int sockfd, outbound_queue *queue, size_t max_bytes) {
+    size_t total_bytes_sent = 0;
+
+    int lane;
+    while ((lane = next_lane(queue)) >= 0) {
+        if (total_bytes_sent >= max_bytes) {
+            // Let the other sockets have their turn.
+            return 0;
+        }
+
+        pending_msg &front = queue->lanes[lane].front();
+
+        alias_table *aliases = queue->aliases;
+        if (aliases && queue->front_offset == 0) {
+            // The alias is chosen now, in the order the client reads.
+            aliases->active = front.topic_len
+                              && alias_encode(aliases, *front.frame, front.topic_len);
+        }
+        bool aliased = aliases && aliases->active;
+        const std::string &frame = aliased ? aliases->frame : *front.frame;
+
+        size_t head_len = 0;
+        if (front.stamp_offset) {
+            head_len = front.stamp_offset + sizeof(uint64_t);
+
+            if (queue->front_offset == 0) {
+                // The time it leaves the server, as late as possible.
+                uint64_t send_ns = htobe64(realtime_ns());
+                queue->stamped_head.assign(frame.data(), front.stamp_offset);
+                queue->stamped_head.append((char *) &send_ns, sizeof(uint64_t));
+            }
+        }
+
+        int bytes_sent;
+        if (queue->front_offset < head_len) {
+            // The stamped copy of the start, then the rest of the frame.
+            iovec iov[2];
+            iov[0].iov_base = (char *) queue->stamped_head.data() + queue->front_offset;
+            iov[0].iov_len = head_len - queue->front_offset;
+            iov[1].iov_base = (char *) frame.data() + head_len;
+            iov[1].iov_len = frame.size() - head_len;
+
+            msghdr msg;
+            memset(&msg, 0, sizeof(msghdr));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = 2;
+
+            bytes_sent = sendmsg(sockfd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        } else {
+            bytes_sent = send(sockfd, frame.data() + queue->front_offset,
+                              frame.size() - queue->front_offset,
+                              MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
         if (bytes_sent < 0) {
-            // Error.
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
             return -1;
         }
 
-        bytes_remaining -= bytes_sent;
+        if (queue->front_offset == 0 && !front.conflation_key.empty()) {
+            // Once sending started, the message can not be replaced anymore.
+            queue->conflation_slots.erase(front.conflation_key);
+        }
+
+        if (queue->front_offset == 0 && aliased) {
+            // The client will know the alias once it read the frame.
+            alias_commit(aliases);
+        }
+
+        queue->sending_lane = lane;
+        queue->front_offset += bytes_sent;
         total_bytes_sent += bytes_sent;
-        buff += bytes_sent;
+        if (queue->front_offset < frame.size()) {
+            // Partial write, the socket buffer is full.
+            return 0;
+        }
+
+        pop_lane(queue, lane);
+        queue->front_offset = 0;
     }
 
-    return total_bytes_sent;
+    return 1;
+}
+
+
+void clear_outbound(outbound_queue *queue) {
+    for (int lane = 0; lane < NUM_LANES; lane++) {
+        queue->lanes[lane].clear();
+        queue->passed[lane] = 0;
+    }
+    queue->conflation_slots.clear();
+    queue->front_offset = 0;
+    queue->bytes = 0;
+
+    if (queue->aliases) {
+        queue->aliases->active = false;
+    }
 }
@@ -11,9 +11,32 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <set>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+
+#include "topic_pattern.h"
+#include "timing_wheel.h"
+#include "topic_alias.h"
 
 #define MAX_UDP_MSG 1600
 
+// Largest publication that can be delivered as a single UDP datagram.
+#define MAX_UDP_DELIVERY 65000
+
+// Command and 16-bit len of a tcp_message, as they are on the wire.
+#define TCP_HEADER_LEN 3
+
+// Value of the 16-bit len announcing that a 32-bit len follows.
+#define TCP_EXTENDED_LEN 0xFFFF
+
+// Messages longer than this are refused, whatever the len encoding.
+#define MAX_TCP_PAYLOAD (64 * 1024 * 1024)
+
+// Largest publication of a PUBLISH batch (topic, type and content).
+#define MAX_PUBLISH_RECORD (1024 * 1024)
+
 #define CONNECT_REQ 0
 #define CONNECT_ACCEPTED 1
 #define CONNECT_DENIED 2
@@ -24,6 +47,201 @@
 #define UNSUBSCRIBE_SUCC 7
 #define UNSUBSCRIBE_FAIL 8
 #define MSG_FROM_UDP 9
+#define SUBSCRIBE_AGG_REQ 10
+#define UNSUBSCRIBE_AGG_REQ 11
+#define PEER_HELLO 12
+#define PEER_INTEREST_ADD 13
+#define PEER_INTEREST_DEL 14
+#define PEER_PUBLISH 15
+#define PUBLISH 16
+#define MSG_FROM_UDP_TS 17
+#define HEARTBEAT 18
+#define HEARTBEAT_ACK 19
+#define CREDIT_GRANT 20
+#define MUX_ATTACH 21
+#define MUX_DETACH 22
+#define MUX_FRAME 23
+#define ALIAS_DEFINE 24
+#define MSG_FROM_UDP_ALIASED 25
+
+// Sessions a MUX_FRAME can be addressed to at once.
+#define MUX_MAX_TAGS 4096
+
+#define INT_TYPE 0
+#define SHORT_REAL_TYPE 1
+#define FLOAT_TYPE 2
+#define STRING_TYPE 3
+
+// Priority lanes of the outbound queues, the most urgent first.
+#define LANE_HIGH 0
+#define LANE_NORMAL 1
+#define LANE_LOW 2
+#define NUM_LANES 3
+
+// Frames a waiting lane lets the more urgent ones send before its turn
+// comes anyway, so it is never starved.
+#define LANE_MAX_PASSED 32
+
+#define FILTER_NONE 0
+#define FILTER_LT 1
+#define FILTER_LE 2
+#define FILTER_GT 3
+#define FILTER_GE 4
+#define FILTER_EQ 5
+#define FILTER_NE 6
+#define FILTER_BETWEEN 7
+#define FILTER_PREFIX 8
+#define FILTER_CHANGED 9
+
+
+/**
+ * Predicate over the value of a publication, compiled from the text
+ * that follows "where" in a subscribe request.
+ */
+struct content_filter {
+    uint8_t op = FILTER_NONE;
+
+    // Operands. For FILTER_BETWEEN, the value must be in [low, high].
+    double low = 0;
+    double high = 0;
+
+    // Operand for strings (FILTER_PREFIX, FILTER_EQ and FILTER_NE
+    // with a non-numeric operand).
+    std::string text;
+    bool is_text = false;
+
+    // Last value that passed through, for FILTER_CHANGED, with its data
+    // type (a value of another type is always a change).
+    bool has_last = false;
+    uint8_t last_type = 0;
+    double last_number = 0;
+    std::string last_text;
+};
+
+
+/**
+ * A topic that a client is subscribed to, together with the options
+ * that were requested for it.
+ */
+struct subscription {
+    // Id of the topic in the pattern pool of the server, which keeps it
+    // compiled once for all the clients subscribed to it.
+    uint32_t pattern_id;
+
+    // Copied from the pattern, so the subscriptions that only match their
+    // own topic are skipped by the wildcard search without looking at it.
+    bool has_wildcards;
+
+    // If set, at most one message per topic is kept pending for the client,
+    // a newer one overwriting the older one if it was not yet sent.
+    bool conflate;
+
+    // Outbound lane of the publications delivered for this subscription.
+    uint8_t lane;
+
+    // Only the publications accepted by the filter are delivered. Most
+    // subscriptions have none, so it is only allocated when needed.
+    std::unique_ptr<content_filter> filter;
+};
+
+
+/**
+ * A message waiting to be written on a connection.
+ */
+struct pending_msg {
+    // The encoded tcp_message, shared by all the queues it was put in.
+    std::shared_ptr<std::string> frame;
+
+    // Topic of the message if it may be overwritten in place, empty otherwise.
+    std::string conflation_key;
+
+    // Offset of the 64-bit send time, filled in when the sending starts,
+    // or 0 if the message has none.
+    size_t stamp_offset = 0;
+
+    // Length of the topic of a publication that may be sent with the alias
+    // of its topic (see alias_encode()), 0 for any other message.
+    uint8_t topic_len = 0;
+};
+
+
+/**
+ * Messages that could not be written yet on a non-blocking socket,
+ * because the receiver is not reading fast enough. Each priority lane is
+ * a FIFO; the most urgent one that is not empty is sent first.
+ */
+struct outbound_queue {
+    std::deque<pending_msg> lanes[NUM_LANES];
+
+    // Lane whose front frame is being sent and the number of its bytes
+    // that were already sent. The frame is finished before any other.
+    int sending_lane = LANE_HIGH;
+    size_t front_offset = 0;
+
+    // Frames sent from the other lanes while each lane was waiting.
+    uint32_t passed[NUM_LANES] = {};
+
+    // Size of all the frames in the lanes.
+    size_t bytes = 0;
+
+    // Mappings of <topic, queued message> type, for the topics that are
+    // conflated. Only holds messages whose sending has not started yet.
+    std::unordered_map<std::string, pending_msg*> conflation_slots;
+
+    // Start of the front frame, up to its send time, if it has one. The
+    // frame is shared, so it is stamped in this copy.
+    std::string stamped_head;
+
+    // Topic aliases of the connection, if the client asked for them.
+    alias_table *aliases = NULL;
+};
+
+
+/**
+ * Flow control of a client that asked for it when connecting: the
+ * publications are only put in its outbound queue within the credit it
+ * granted (CREDIT_GRANT), the others wait in held. The client grants
+ * back what it consumed, so the window stays at its real capacity.
+ */
+struct credit_window {
+    bool enabled = false;
+
+    // Credit left, in publications and in bytes of frames. A frame may
+    // take the bytes below 0, it is enough to have some left to send it.
+    // The bytes are only checked if the client gave a limit for them.
+    int64_t messages = 0;
+    int64_t bytes = 0;
+    bool limit_bytes = false;
+
+    // Publications waiting for credit, at most held_limit of them (the
+    // oldest ones are dropped, so the memory used for the client stays
+    // proportional to its window), conflated like in the outbound queue.
+    outbound_queue held;
+    size_t held_limit = 0;
+    uint64_t dropped = 0;
+};
+
+
+/**
+ * What the server knows about the other end of a connection being alive:
+ * when it last heard from it and when it last managed to write to it.
+ * The timers are not moved on every message, they check these times
+ * when they expire and are armed again if there was some activity.
+ */
+struct liveness {
+    // Expires when a heartbeat must be sent, or when the connection
+    // must be dropped if the heartbeat was not answered.
+    wheel_timer idle_timer;
+
+    // Armed while the outbound queue is not empty.
+    wheel_timer stall_timer;
+
+    // Times in milliseconds (monotonic clock).
+    uint64_t last_recv = 0;
+    uint64_t last_progress = 0;
+
+    bool ping_sent = false;
+};
 
 
 /**
@@ -31,18 +249,106 @@
  * disconnect and of the topics they subscribe to and unsubscribe from.
  */
 struct client {
+    std::string id;
+
     // These will change when disconnecting and connecting again.
     int curr_fd;
     bool is_connected;
 
-    // Mappings of <topic, tokens> type.
-    std::map<std::string, std::vector<std::string>> subscribed_topics;
+    // Position in the array of the connected clients of the server.
+    size_t live_index;
+
+    // While disconnected: when it left, and the timer after which its
+    // session is moved out of memory (to the spill file).
+    uint64_t disconnected_at;
+    wheel_timer expiry_timer;
+
+    // Sorted by pattern id, so a subscription is found by binary search.
+    std::vector<subscription> subscriptions;
+
+    // Last fan-out it was taken as a target of, so a client subscribed to
+    // several patterns that match the topic is only checked once.
+    uint64_t target_mark;
+
+    // Messages not yet delivered to the client.
+    outbound_queue out;
+
+    // Publications dropped from out because it was full.
+    uint64_t out_dropped;
+
+    // Keys of the aggregates the client is subscribed to.
+    std::set<std::string> aggregate_specs;
+
+    // Set if the client asked (when connecting) for the publications to be
+    // sent as UDP datagrams to udp_addr. TCP is still used for the rest.
+    bool udp_mode;
+    struct sockaddr_in udp_addr;
+
+    // Mappings of <topic, sequence number of the last datagram> type.
+    std::unordered_map<std::string, uint32_t> udp_seqs;
+
+    // Index of the client among the consumers of the shared memory ring,
+    // or -1 if the publications are not read from there.
+    int shm_index;
+
+    // Address the client connected from, shown with its publications.
+    struct sockaddr_in tcp_addr;
+
+    // Set if the client asked for the publications to carry the time they
+    // were received by the server and sent to it (MSG_FROM_UDP_TS).
+    bool timestamps;
+
+    // Heartbeat and write stall timers, while connected.
+    liveness live;
+
+    // Credit-based flow control, if the client asked for it.
+    credit_window credit;
+
+    // Aliases of the topics sent on the connection, used by out if the
+    // client asked for them.
+    alias_table aliases;
+
+    // Set for a connection that carries the sessions of other clients
+    // (i.e. a gateway), found by their tags.
+    bool multiplexed;
+    std::unordered_map<uint16_t, client*> mux_sessions;
+
+    // For a session carried by a multiplexed connection: the client of
+    // that connection and the tag of the session on it, NULL otherwise.
+    // The session has no fd, queue or timers of its own.
+    client *mux_link;
+    uint16_t mux_tag;
+};
+
+
+/**
+ * Used by the server to keep track of the other servers of the cluster
+ * it is linked to and of the topics their clients are interested in.
+ */
+struct peer {
+    int fd;
+    uint32_t node_id;
+
+    // "<ip>:<port>" of the other end of the link.
+    std::string address;
+
+    // Whether this server opened the link (when two servers dial each
+    // other, the link opened by the lower node id is kept).
+    bool dialed = false;
+
+    // Topics (possibly with wildcards) the clients of the peer subscribed to.
+    std::map<std::string, compiled_pattern> interest;
+
+    // Messages not yet written on the link.
+    outbound_queue out;
+
+    liveness live;
 };
 
 
 struct tcp_message {
     uint8_t command;
-    uint16_t len; // length of the payload
+    uint32_t len; // length of the payload
     char *payload;
 };
 
@@ -51,9 +357,11 @@ struct tcp_message {
  * Specialized recv function that uses TCP's recv().
  * Receives a tcp_message struct, by first receiving the command, then the
  * len, then allocating memory for the payload for the len it just received.
- * Finally, it receives the payload.
+ * Finally, it receives the payload. A len of TCP_EXTENDED_LEN is followed
+ * by the actual 32-bit len, which can be at most MAX_TCP_PAYLOAD.
  *
- * Note that the payload must be freed manually by the user of this function.
+ * Note that the payload must be freed manually by the user of this function,
+ * once it received the whole message (on failure, it is already freed).
  * Arranges len in host order after receiving.
  *
  * @param sockfd Socket used to receive the message
@@ -63,14 +371,24 @@ struct tcp_message {
 int recv_efficient(int sockfd, tcp_message *msg);
 
 
+/**
+ * Decodes the message at the start of data, as recv_efficient() would
+ * receive it from the stream (the payload must be freed the same way).
+ * With a NULL msg, only checks if the message is complete.
+ * @return the length of the whole frame, 0 if it is not complete yet,
+ * -1 if its len is bigger than MAX_TCP_PAYLOAD
+ */
+int decode_frame(const char *data, size_t len, tcp_message *msg);
+
+
 /**
  * Specialized send function that uses TCP's send().
  * Sends a tcp_message struct, by first sending the command, then the
- * len, then finally sending the payload.
+ * len (extended, if it does not fit in 16 bits), then finally sending
+ * the payload.
  *
  * Arranges len in network order before sending, so the caller doesn't
- * have to do it, but then puts it back in host order, so the
- * overall message structure is left unmodified by this function.
+ * have to do it. The message structure is left unmodified.
  *
  * @param sockfd Socket used to send the message
  * @return Number of bytes sent on success, -1 on error
@@ -78,4 +396,98 @@ int recv_efficient(int sockfd, tcp_message *msg);
 int send_efficient(int sockfd, tcp_message *msg);
 
 
+/**
+ * Sends a message without payload (i.e. a HEARTBEAT_ACK) on a blocking socket.
+ * @return Number of bytes sent on success, -1 on error
+ */
+int send_command(int sockfd, uint8_t command);
+
+
+/**
+ * Serializes a tcp_message into the exact byte sequence send_efficient()
+ * would put on the wire, so it can be queued and sent later (possibly
+ * to more than one receiver).
+ */
+std::shared_ptr<std::string> encode_message(tcp_message *msg);
+
+
+/**
+ * Wraps a frame for sessions of a multiplexed connection (MUX_FRAME): the
+ * number of tags and the tags (16-bit, network order), then the frame as
+ * it is, so it is sent once for all of them.
+ */
+std::shared_ptr<std::string> encode_mux_frame(const uint16_t *tags, size_t num_tags,
+                                              const std::string &frame);
+
+
+/**
+ * Splits the payload of a MUX_FRAME into its tags and its frame, decoded
+ * into msg (the payload must be freed as for decode_frame()).
+ * @return true on success, false if the payload is not valid
+ */
+bool decode_mux_frame(const char *payload, size_t len, std::vector<uint16_t> &tags,
+                      tcp_message *msg);
+
+
+/**
+ * Appends a frame to the outbound queue. If conflation_key is not empty
+ * and a message with the same key is still waiting to be sent, that
+ * message is overwritten in place instead, so the queue holds at most
+ * one pending message per key.
+ * @param stamp_offset Offset of the send time in the frame, written just
+ * before sending, or 0 if there is none
+ * @param topic_len Length of the topic, if the frame is a MSG_FROM_UDP that
+ * may be sent with an alias
+ * @return the frame that was overwritten, or NULL if the frame was appended
+ */
+std::shared_ptr<std::string> enqueue_frame(outbound_queue *queue,
+                                           std::shared_ptr<std::string> frame,
+                                           const std::string &conflation_key,
+                                           size_t stamp_offset = 0, int lane = LANE_NORMAL,
+                                           uint8_t topic_len = 0);
+
+
+/**
+ * Number of messages in all the lanes of the outbound queue.
+ */
+size_t outbound_size(const outbound_queue *queue);
+
+
+/**
+ * Drops the oldest message of the lane whose sending did not start yet.
+ * @return the size of its frame, or 0 if there is none
+ */
+size_t drop_oldest(outbound_queue *queue, int lane);
+
+
+/**
+ * Returns the lane of the next message to send: the one being sent, or
+ * the most urgent lane that is not empty, unless a less urgent one was
+ * passed LANE_MAX_PASSED times already. -1 if the queue is empty.
+ */
+int next_lane(const outbound_queue *queue);
+
+
+/**
+ * Removes the front message of the lane, counting it as passing the
+ * other lanes that are waiting.
+ */
+void pop_lane(outbound_queue *queue, int lane);
+
+
+/**
+ * Writes as much of the outbound queue as the non-blocking socket accepts,
+ * but stops after about max_bytes, so other sockets get their turn.
+ * @return 1 if the queue was emptied, 0 if the socket would block or the
+ * budget was spent, -1 on error (the queue is left untouched).
+ */
+int flush_outbound(int sockfd, outbound_queue *queue, size_t max_bytes);
+
+
+/**
+ * Drops all the messages from the outbound queue.
+ */
+void clear_outbound(outbound_queue *queue);
+
+
 #endif /* PROTOCOLS_H */
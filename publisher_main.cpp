@@ -0,0 +1,66 @@
+#include <iostream>
+#include "utils.h"
+#include "Publisher.h"
+#include <arpa/inet.h>
+#include <cstring>
+#include <csignal>
+
+using namespace std;
+
+int main(int argc, char **argv) {
+    setvbuf(stdout, NULL, _IONBF, BUFSIZ);
+
+    if (argc < 4) {
+        cout << "Publisher Usage: " << argv[0]
+             << " <CLIENT_ID> <SERVER_IP> <SERVER_PORT> [--batch <COUNT>]\n";
+        return -1;
+    }
+
+    if (strlen(argv[1]) > 10) {
+        cout << "ID must have at most 10 characters\n";
+        return -1;
+    }
+
+    // Get server_port as number.
+    uint16_t server_port;
+    int rc = sscanf(argv[3], "%hu", &server_port);
+    DIE(rc != 1, "Invalid port number.\n");
+
+    // Get server_id as number in network order.
+    uint32_t server_ip = inet_addr(argv[2]);
+
+    // Parse the optional settings.
+    publisher_options options;
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            rc = sscanf(argv[++i], "%zu", &options.batch_size);
+            DIE(rc != 1 || options.batch_size == 0, "Invalid batch size.\n");
+            continue;
+        }
+
+        cout << "Publisher Usage: " << argv[0]
+             << " <CLIENT_ID> <SERVER_IP> <SERVER_PORT> [--batch <COUNT>]\n";
+        return -1;
+    }
+
+    // A closed connection is noticed from the return value of send().
+    signal(SIGPIPE, SIG_IGN);
+
+    Publisher *publisher;
+    try {
+        publisher = new Publisher(argv[1], server_ip, server_port, options);
+    } catch (bad_alloc &exception) {
+        fprintf(stderr, "Publisher alloc failed.\n");
+        exit(-1);
+    }
+
+    publisher->prepare();
+
+    if (publisher->check_connection_validity()) {
+        publisher->run();
+    }
+
+    delete publisher;
+
+    return 0;
+}
@@ -0,0 +1,436 @@
+#include "record_sink.h"
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include "protocols.h"
+
+// Larger decimal parts are left to strtod(), the fast way would round.
+#define SINK_EXACT_DIGITS 15
+
+
+static std::string file_name(const std::string &path, uint64_t file_index) {
+    return path + "." + std::to_string(file_index);
+}
+
+
+/**
+ * Creates the file with the given index, allocates all of its blocks (so
+ * the page faults of the writes do not have to) and maps it.
+ * @return true on success, false otherwise (errno is EEXIST if the file
+ * already exists)
+ */
+static bool open_file(record_sink *sink, uint64_t file_index) {
+    std::string name = file_name(sink->path, file_index);
+
+    int fd = open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    // Some file systems can not preallocate, the blocks come with the writes.
+    if (posix_fallocate(fd, 0, sink->capacity) != 0
+        && ftruncate(fd, sink->capacity) < 0) {
+        close(fd);
+        unlink(name.c_str());
+        return false;
+    }
+
+    void *zone = mmap(NULL, sink->capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (zone == MAP_FAILED) {
+        close(fd);
+        unlink(name.c_str());
+        return false;
+    }
+    madvise(zone, sink->capacity, MADV_SEQUENTIAL);
+
+    sink->fd = fd;
+    sink->base = (char *) zone;
+    sink->header = (sink_file_header *) zone;
+    sink->file_index = file_index;
+    sink->offset = SINK_HEADER_SIZE;
+
+    // The file is zero-filled; the magic comes last, the readers check it.
+    sink->header->version = SINK_VERSION;
+    sink->header->file_index = file_index;
+    sink->header->capacity = sink->capacity;
+    sink->header->committed.store(SINK_HEADER_SIZE, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    sink->header->magic = SINK_MAGIC;
+
+    return true;
+}
+
+
+/**
+ * Seals the current file, so its readers move on, and gives back the
+ * unused end of it.
+ */
+static void seal_file(record_sink *sink) {
+    sink->header->sealed.store(1, std::memory_order_release);
+
+    munmap(sink->base, sink->capacity);
+    if (ftruncate(sink->fd, sink->offset) < 0) {
+        perror("Record sink: ftruncate() failed");
+    }
+    close(sink->fd);
+
+    sink->fd = -1;
+    sink->base = NULL;
+    sink->header = NULL;
+}
+
+
+bool sink_open(record_sink *sink, const std::string &path, uint64_t capacity) {
+    if (capacity < 2 * SINK_HEADER_SIZE) {
+        return false;
+    }
+
+    sink->path = path;
+    sink->capacity = capacity;
+    sink->records = 0;
+    sink->rotations = 0;
+
+    for (uint64_t file_index = 0; ; file_index++) {
+        if (open_file(sink, file_index)) {
+            return true;
+        }
+        if (errno != EEXIST) {
+            return false;
+        }
+    }
+}
+
+
+/**
+ * Parses "<a>.<b>.<c>.<d>:<port> - " at the start of the text.
+ * @return the length of what was parsed, 0 if it is not an address
+ */
+static size_t parse_source(const char *text, size_t len, uint32_t &ip, uint16_t &port) {
+    uint32_t parts[5];
+    size_t pos = 0;
+
+    for (int i = 0; i < 5; i++) {
+        size_t start = pos;
+        uint32_t part = 0;
+        while (pos < len && text[pos] >= '0' && text[pos] <= '9' && pos - start < 5) {
+            part = part * 10 + (text[pos] - '0');
+            pos++;
+        }
+
+        char separator = i < 3 ? '.' : (i == 3 ? ':' : ' ');
+        if (pos == start || pos >= len || text[pos] != separator
+            || part > (i < 4 ? 255u : 65535u)) {
+            return 0;
+        }
+        parts[i] = part;
+        pos++;
+    }
+
+    if (pos + 2 > len || text[pos] != '-' || text[pos + 1] != ' ') {
+        return 0;
+    }
+
+    ip = htonl(parts[0] << 24 | parts[1] << 16 | parts[2] << 8 | parts[3]);
+    port = parts[4];
+
+    return pos + 2;
+}
+
+
+/**
+ * Parses the text of a SHORT_REAL or a FLOAT value. The digits are read
+ * as an integer and divided by a power of 10, which is what strtod()
+ * returns when both are exact doubles.
+ */
+static double parse_real(const char *text, size_t len, uint16_t &decimals) {
+    static const double powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8,
+                                    1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15};
+
+    size_t pos = 0;
+    bool negative = len > 0 && text[0] == '-';
+    if (negative) {
+        pos++;
+    }
+
+    uint64_t digits = 0;
+    int digit_count = 0;
+    int point = -1;
+    for (; pos < len; pos++) {
+        if (text[pos] == '.' && point < 0) {
+            point = digit_count;
+            continue;
+        }
+        digits = digits * 10 + (text[pos] - '0');
+        digit_count++;
+    }
+
+    decimals = point < 0 ? 0 : digit_count - point;
+    if (digit_count > SINK_EXACT_DIGITS) {
+        char buff[MAX_UDP_MSG];
+        len = std::min(len, sizeof(buff) - 1);
+        memcpy(buff, text, len);
+        buff[len] = '\0';
+        return strtod(buff, NULL);
+    }
+
+    double real = digits / powers[decimals];
+    return negative ? -real : real;
+}
+
+
+static int64_t parse_integer(const char *text, size_t len) {
+    size_t pos = 0;
+    bool negative = len > 0 && text[0] == '-';
+    if (negative) {
+        pos++;
+    }
+
+    int64_t integer = 0;
+    for (; pos < len; pos++) {
+        integer = integer * 10 + (text[pos] - '0');
+    }
+
+    return negative ? -integer : integer;
+}
+
+
+/**
+ * Splits a publication formatted by the server into the fields of a
+ * record. The topic and the text are left where they are in the line.
+ * @return false if the line is in another format
+ */
+static bool parse_publication(const char *text, size_t len, sink_record &record,
+                              const char *&topic, const char *&value_text) {
+    size_t pos = parse_source(text, len, record.src_ip, record.src_port);
+    if (pos == 0) {
+        return false;
+    }
+
+    // The topic ends at the first " - ".
+    const char *end = (const char *) memmem(text + pos, len - pos, " - ", 3);
+    if (!end || end - (text + pos) > UINT8_MAX) {
+        return false;
+    }
+    topic = text + pos;
+    record.topic_len = end - topic;
+    pos = end + 3 - text;
+
+    static const struct {
+        const char *name;
+        size_t len;
+        uint8_t type;
+    } types[] = {{"INT - ", 6, INT_TYPE}, {"SHORT_REAL - ", 13, SHORT_REAL_TYPE},
+                 {"FLOAT - ", 8, FLOAT_TYPE}, {"STRING - ", 9, STRING_TYPE}};
+
+    for (auto &type : types) {
+        if (len - pos < type.len || memcmp(text + pos, type.name, type.len) != 0) {
+            continue;
+        }
+
+        pos += type.len;
+        record.type = type.type;
+        value_text = text + pos;
+
+        switch (type.type) {
+            case INT_TYPE:
+                record.value.integer = parse_integer(value_text, len - pos);
+                break;
+            case SHORT_REAL_TYPE:
+            case FLOAT_TYPE:
+                record.value.real = parse_real(value_text, len - pos, record.decimals);
+                break;
+            default:
+                record.text_len = std::min(len - pos, (size_t) UINT16_MAX);
+                break;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+
+bool sink_append_publication(record_sink *sink, uint64_t rx_ns, const char *text, size_t len) {
+    if (!sink->base) {
+        return false;
+    }
+
+    // The lines may come with their '\0'.
+    while (len > 0 && text[len - 1] == '\0') {
+        len--;
+    }
+
+    sink_record record;
+    memset(&record, 0, sizeof(record));
+    record.rx_ns = rx_ns;
+
+    const char *topic = NULL;
+    const char *value_text = NULL;
+    if (!parse_publication(text, len, record, topic, value_text)) {
+        memset(&record, 0, sizeof(record));
+        record.rx_ns = rx_ns;
+        record.type = SINK_TEXT_TYPE;
+        record.text_len = std::min(len, (size_t) UINT16_MAX);
+        value_text = text;
+    }
+
+    size_t body_len = sizeof(sink_record) + record.topic_len + record.text_len;
+    record.len = (body_len + SINK_ALIGN - 1) & ~(size_t) (SINK_ALIGN - 1);
+
+    if (sink->offset + record.len > sink->capacity) {
+        if (SINK_HEADER_SIZE + record.len > sink->capacity) {
+            return false;
+        }
+
+        seal_file(sink);
+        if (!open_file(sink, sink->file_index + 1)) {
+            return false;
+        }
+        sink->rotations++;
+    }
+
+    char *dest = sink->base + sink->offset;
+    memcpy(dest, &record, sizeof(sink_record));
+    memcpy(dest + sizeof(sink_record), topic, record.topic_len);
+    memcpy(dest + sizeof(sink_record) + record.topic_len, value_text, record.text_len);
+
+    sink->offset += record.len;
+    sink->records++;
+
+    // Publishes the record to the readers.
+    sink->header->records.store(sink->header->records.load(std::memory_order_relaxed) + 1,
+                                std::memory_order_relaxed);
+    sink->header->committed.store(sink->offset, std::memory_order_release);
+
+    return true;
+}
+
+
+void sink_close(record_sink *sink) {
+    if (sink->base) {
+        seal_file(sink);
+    }
+}
+
+
+bool sink_reader_open(sink_reader *reader, const std::string &path, uint64_t file_index) {
+    int fd = open(file_name(path, file_index).c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    // A file that is still being created is not ready.
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < SINK_HEADER_SIZE) {
+        close(fd);
+        return false;
+    }
+
+    void *zone = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (zone == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    sink_file_header *header = (sink_file_header *) zone;
+    if (header->magic != SINK_MAGIC || header->version != SINK_VERSION) {
+        munmap(zone, st.st_size);
+        close(fd);
+        return false;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    reader->path = path;
+    reader->file_index = file_index;
+    reader->fd = fd;
+    reader->base = (char *) zone;
+    reader->mapped = st.st_size;
+    reader->header = header;
+    reader->offset = SINK_HEADER_SIZE;
+
+    return true;
+}
+
+
+const sink_record *sink_reader_next(sink_reader *reader) {
+    while (reader->base) {
+        if (reader->offset < reader->header->committed.load(std::memory_order_acquire)) {
+            const sink_record *record = (const sink_record *) (reader->base + reader->offset);
+            reader->offset += record->len;
+            return record;
+        }
+
+        if (!reader->header->sealed.load(std::memory_order_acquire)) {
+            return NULL;
+        }
+
+        // The writer may have added records just before it sealed the file.
+        if (reader->offset < reader->header->committed.load(std::memory_order_acquire)) {
+            continue;
+        }
+
+        sink_reader next;
+        if (!sink_reader_open(&next, reader->path, reader->file_index + 1)) {
+            return NULL;
+        }
+
+        sink_reader_close(reader);
+        *reader = next;
+    }
+
+    return NULL;
+}
+
+
+void sink_reader_close(sink_reader *reader) {
+    if (reader->base) {
+        munmap(reader->base, reader->mapped);
+        close(reader->fd);
+    }
+
+    reader->fd = -1;
+    reader->base = NULL;
+    reader->header = NULL;
+}
+
+
+int sink_format_record(const sink_record *record, char *buff, size_t size) {
+    const char *data = (const char *) (record + 1);
+
+    if (record->type == SINK_TEXT_TYPE) {
+        return snprintf(buff, size, "%.*s", record->text_len, data);
+    }
+
+    struct in_addr addr;
+    addr.s_addr = record->src_ip;
+    char source[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr, source, sizeof(source));
+
+    int len = snprintf(buff, size, "%s:%hu - %.*s - ", source, record->src_port,
+                       record->topic_len, data);
+    if (len < 0 || (size_t) len >= size) {
+        return len;
+    }
+    buff += len;
+    size -= len;
+
+    switch (record->type) {
+        case INT_TYPE:
+            return len + snprintf(buff, size, "INT - %lld", (long long) record->value.integer);
+        case SHORT_REAL_TYPE:
+            return len + snprintf(buff, size, "SHORT_REAL - %.2lf", record->value.real);
+        case FLOAT_TYPE:
+            return len + snprintf(buff, size, "FLOAT - %.*lf", record->decimals,
+                                  record->value.real);
+        default:
+            return len + snprintf(buff, size, "STRING - %.*s", record->text_len,
+                                  data + record->topic_len);
+    }
+}
@@ -0,0 +1,173 @@
+#ifndef RECORD_SINK_H
+#define RECORD_SINK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <string>
+
+#define SINK_MAGIC 0x4b4e4953
+#define SINK_VERSION 1
+
+// The records start after the header page.
+#define SINK_HEADER_SIZE 4096
+
+// Default size of a file of the sink, before it is rotated.
+#define SINK_DEFAULT_SIZE (64ULL * 1024 * 1024)
+
+// Type of the records that are kept as text, because they are not
+// publications of a topic (i.e. aggregates).
+#define SINK_TEXT_TYPE 255
+
+// The records are aligned to this many bytes.
+#define SINK_ALIGN 8
+
+
+/**
+ * Start of every file of the sink. The writer publishes a record by
+ * moving committed past it (release), so a reader that loads committed
+ * (acquire) can read all the records before it without any lock. Once
+ * sealed is set, the writer has moved on to the next file.
+ */
+struct sink_file_header {
+    uint32_t magic;
+    uint32_t version;
+
+    // Number of the file in the rotation (<path>.<index>).
+    uint64_t file_index;
+
+    // Size of the file while it is written.
+    uint64_t capacity;
+
+    // Offset after the last complete record.
+    std::atomic<uint64_t> committed;
+
+    std::atomic<uint64_t> records;
+
+    std::atomic<uint32_t> sealed;
+};
+
+
+/**
+ * Fixed part of a record, followed by the topic and the text (of a STRING
+ * or a SINK_TEXT_TYPE record), then padded to SINK_ALIGN bytes. The fields
+ * are in host order, the sink is read on the same host.
+ */
+struct sink_record {
+    // Whole record, with the padding.
+    uint32_t len;
+
+    uint8_t type;
+    uint8_t topic_len;
+    uint16_t text_len;
+
+    // Time the publication was received by the subscriber (real time clock).
+    uint64_t rx_ns;
+
+    // Address of the publisher, in network order (0 if unknown).
+    uint32_t src_ip;
+    uint16_t src_port;
+
+    // Digits after the decimal point of a FLOAT.
+    uint16_t decimals;
+
+    // INT records use integer, SHORT_REAL and FLOAT records use real.
+    union {
+        int64_t integer;
+        double real;
+    } value;
+};
+
+
+/**
+ * The file of the sink being written by a subscriber.
+ */
+struct record_sink {
+    std::string path;
+    uint64_t capacity = SINK_DEFAULT_SIZE;
+
+    int fd = -1;
+    char *base = NULL;
+    sink_file_header *header = NULL;
+    uint64_t file_index = 0;
+
+    // Where the next record goes.
+    uint64_t offset = 0;
+
+    uint64_t records = 0;
+    uint64_t rotations = 0;
+};
+
+
+/**
+ * A file of the sink mapped by a reader.
+ */
+struct sink_reader {
+    std::string path;
+    uint64_t file_index = 0;
+
+    int fd = -1;
+    char *base = NULL;
+    size_t mapped = 0;
+    sink_file_header *header = NULL;
+
+    // Offset of the next record to read.
+    uint64_t offset = 0;
+};
+
+
+/**
+ * Opens the first file of the sink that does not exist yet
+ * (<path>.0, <path>.1, ...), so the files of a previous run are kept.
+ * @param capacity Size of every file, at least twice SINK_HEADER_SIZE
+ * @return true on success, false otherwise
+ */
+bool sink_open(record_sink *sink, const std::string &path, uint64_t capacity);
+
+
+/**
+ * Appends a publication, as formatted by the server
+ * ("<ip>:<port> - <topic> - <TYPE> - <value>"). Lines in another format
+ * are kept as SINK_TEXT_TYPE records. The file is rotated when it is full.
+ * @return false if the record could not be written
+ */
+bool sink_append_publication(record_sink *sink, uint64_t rx_ns, const char *text, size_t len);
+
+
+/**
+ * Seals the current file, truncates it to its records and closes it.
+ */
+void sink_close(record_sink *sink);
+
+
+/**
+ * Maps the file with the given index of the sink, for reading.
+ * @return true on success, false if it does not exist (yet) or is not a
+ * file of a sink
+ */
+bool sink_reader_open(sink_reader *reader, const std::string &path, uint64_t file_index);
+
+
+/**
+ * Returns the next complete record, or NULL if there is none for now.
+ * When the file is sealed and read to its end, the reader moves on to
+ * the next file, as soon as it exists.
+ */
+const sink_record *sink_reader_next(sink_reader *reader);
+
+
+/**
+ * Unmaps the file of the reader.
+ */
+void sink_reader_close(sink_reader *reader);
+
+
+/**
+ * Formats a record the way the server formats a publication, without
+ * the receive time.
+ * @return the length of the text (cut to size - 1 bytes, like snprintf)
+ */
+int sink_format_record(const sink_record *record, char *buff, size_t size);
+
+
+#endif /* RECORD_SINK_H */
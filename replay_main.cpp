@@ -0,0 +1,76 @@
+#include <iostream>
+#include "utils.h"
+#include "Replayer.h"
+#include <arpa/inet.h>
+#include <cstring>
+
+using namespace std;
+
+int main(int argc, char **argv) {
+    setvbuf(stdout, NULL, _IONBF, BUFSIZ);
+
+    if (argc < 4) {
+        cout << "Replay Usage: " << argv[0] << " <CAPTURE_FILE> <SERVER_IP> <SERVER_PORT>"
+             << " [--speed <N> | --max] [--threads <COUNT>] [--loop <COUNT>]\n";
+        return -1;
+    }
+
+    // Get server_port as number.
+    uint16_t server_port;
+    int rc = sscanf(argv[3], "%hu", &server_port);
+    DIE(rc != 1, "Invalid port number.\n");
+
+    // Get server_id as number in network order.
+    uint32_t server_ip = inet_addr(argv[2]);
+
+    // Parse the optional settings.
+    replay_options options;
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            rc = sscanf(argv[++i], "%lf", &options.speed);
+            DIE(rc != 1 || options.speed <= 0, "Invalid speed.\n");
+            continue;
+        }
+
+        if (strcmp(argv[i], "--max") == 0) {
+            options.max_speed = true;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            rc = sscanf(argv[++i], "%zu", &options.threads);
+            DIE(rc != 1 || options.threads == 0, "Invalid number of threads.\n");
+            continue;
+        }
+
+        if (strcmp(argv[i], "--loop") == 0 && i + 1 < argc) {
+            rc = sscanf(argv[++i], "%zu", &options.loops);
+            DIE(rc != 1 || options.loops == 0, "Invalid number of loops.\n");
+            continue;
+        }
+
+        cout << "Replay Usage: " << argv[0] << " <CAPTURE_FILE> <SERVER_IP> <SERVER_PORT>"
+             << " [--speed <N> | --max] [--threads <COUNT>] [--loop <COUNT>]\n";
+        return -1;
+    }
+
+    Replayer *replayer;
+    try {
+        replayer = new Replayer(argv[1], server_ip, server_port, options);
+    } catch (bad_alloc &exception) {
+        fprintf(stderr, "Replayer alloc failed.\n");
+        exit(-1);
+    }
+
+    if (!replayer->load()) {
+        fprintf(stderr, "%s is not a valid capture file.\n", argv[1]);
+        delete replayer;
+        return -1;
+    }
+
+    replayer->run();
+
+    delete replayer;
+
+    return 0;
+}
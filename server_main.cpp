@@ -1,4 +1,7 @@
 #include <iostream>
+#include <cstring>
+#include <cinttypes>
+#include <sched.h>
 #include "Server.h"
 #include "utils.h"
 
@@ -8,8 +11,13 @@ using namespace std;
 int main(int argc, char **argv) {
     setvbuf(stdout, NULL, _IONBF, BUFSIZ);
 
-    if (argc != 2) {
-        cout << "Server usage: " << argv[0] << " <PORT>\n";
+    if (argc < 2) {
+        cout << "Server usage: " << argv[0] << " <PORT> [--peer <IP:PORT>]..."
+             << " [--busy-poll <IDLE_US>] [--cpu <CPU>] [--heartbeat <MS>]"
+             << " [--session-expiry <SECONDS> [--spill <PATH>] [--spill-ttl <SECONDS>]]"
+             << " [--takeover <PATH>]"
+             << " [--shed <PREFIX>]... [--sample <PREFIX> <N>]... [--max-lag <US>]"
+             << " [--capture <PATH>] [--matchers <N>]\n";
         return -1;
     }
 
@@ -18,9 +26,103 @@ int main(int argc, char **argv) {
     int rc = sscanf(argv[1], "%hu", &port);
     DIE(rc != 1, "Invalid port number.\n");
 
+    // Parse the optional settings.
+    server_options options;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--peer") == 0 && i + 1 < argc) {
+            options.peers.push_back(argv[++i]);
+            continue;
+        }
+
+        if (strcmp(argv[i], "--busy-poll") == 0 && i + 1 < argc) {
+            options.busy_poll = true;
+            rc = sscanf(argv[++i], "%" SCNu64, &options.busy_poll_idle_us);
+            DIE(rc != 1, "Invalid busy polling idle period.\n");
+            continue;
+        }
+
+        if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc) {
+            rc = sscanf(argv[++i], "%d", &options.cpu);
+            DIE(rc != 1 || options.cpu < 0, "Invalid CPU number.\n");
+            // CPU_SET() does not check its argument.
+            DIE(options.cpu >= CPU_SETSIZE,
+                "Invalid CPU number, it must be below CPU_SETSIZE.\n");
+            continue;
+        }
+
+        if (strcmp(argv[i], "--heartbeat") == 0 && i + 1 < argc) {
+            rc = sscanf(argv[++i], "%" SCNu64, &options.heartbeat_ms);
+            DIE(rc != 1 || options.heartbeat_ms == 0, "Invalid heartbeat interval.\n");
+            continue;
+        }
+
+        if (strcmp(argv[i], "--session-expiry") == 0 && i + 1 < argc) {
+            rc = sscanf(argv[++i], "%" SCNu64, &options.session_expiry_s);
+            DIE(rc != 1 || options.session_expiry_s == 0, "Invalid session expiry.\n");
+            continue;
+        }
+
+        if (strcmp(argv[i], "--spill") == 0 && i + 1 < argc) {
+            options.spill_path = argv[++i];
+            continue;
+        }
+
+        if (strcmp(argv[i], "--spill-ttl") == 0 && i + 1 < argc) {
+            rc = sscanf(argv[++i], "%" SCNu64, &options.spill_ttl_s);
+            DIE(rc != 1, "Invalid spill TTL.\n");
+            continue;
+        }
+
+        if (strcmp(argv[i], "--takeover") == 0 && i + 1 < argc) {
+            options.takeover_path = argv[++i];
+            continue;
+        }
+
+        if (strcmp(argv[i], "--shed") == 0 && i + 1 < argc) {
+            options.shed_rules.push_back({argv[++i], 0});
+            continue;
+        }
+
+        if (strcmp(argv[i], "--sample") == 0 && i + 2 < argc) {
+            shed_rule rule;
+            rule.prefix = argv[++i];
+            rc = sscanf(argv[++i], "%u", &rule.sample_every);
+            DIE(rc != 1 || rule.sample_every < 2, "Invalid sampling rate.\n");
+
+            options.shed_rules.push_back(rule);
+            continue;
+        }
+
+        if (strcmp(argv[i], "--max-lag") == 0 && i + 1 < argc) {
+            rc = sscanf(argv[++i], "%" SCNu64, &options.max_lag_us);
+            DIE(rc != 1 || options.max_lag_us == 0, "Invalid maximum lag.\n");
+            continue;
+        }
+
+        if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+            options.capture_path = argv[++i];
+            continue;
+        }
+
+        if (strcmp(argv[i], "--matchers") == 0 && i + 1 < argc) {
+            rc = sscanf(argv[++i], "%d", &options.matchers);
+            DIE(rc != 1 || options.matchers < 0 || options.matchers > MAX_MATCHERS,
+                "Invalid number of matcher threads.\n");
+            continue;
+        }
+
+        cout << "Server usage: " << argv[0] << " <PORT> [--peer <IP:PORT>]..."
+             << " [--busy-poll <IDLE_US>] [--cpu <CPU>] [--heartbeat <MS>]"
+             << " [--session-expiry <SECONDS> [--spill <PATH>] [--spill-ttl <SECONDS>]]"
+             << " [--takeover <PATH>]"
+             << " [--shed <PREFIX>]... [--sample <PREFIX> <N>]... [--max-lag <US>]"
+             << " [--capture <PATH>] [--matchers <N>]\n";
+        return -1;
+    }
+
     Server *server;
     try {
-        server = new Server(port);
+        server = new Server(port, options);
     } catch (bad_alloc &exception) {
         fprintf(stderr, "Server alloc failed.\n");
         exit(-1);
@@ -0,0 +1,242 @@
+#include "session_spill.h"
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+/**
+ * Writes the whole buffer at the given offset.
+ * @return true on success, false otherwise
+ */
+static bool write_at(int fd, const char *buff, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t rc = pwrite(fd, buff, len, offset);
+        if (rc <= 0) {
+            return false;
+        }
+
+        buff += rc;
+        len -= rc;
+        offset += rc;
+    }
+
+    return true;
+}
+
+
+/**
+ * Reads exactly len bytes from the given offset.
+ * @return true on success, false otherwise
+ */
+static bool read_at(int fd, char *buff, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t rc = pread(fd, buff, len, offset);
+        if (rc <= 0) {
+            return false;
+        }
+
+        buff += rc;
+        len -= rc;
+        offset += rc;
+    }
+
+    return true;
+}
+
+
+/**
+ * Counts the record as dead, in the file it is in.
+ */
+static void kill_record(session_spill *spill, const spill_record &record) {
+    if (record.gen == spill->gen) {
+        spill->dead_bytes += record.len;
+    } else {
+        spill->next_dead_bytes += record.len;
+    }
+}
+
+
+/**
+ * Starts writing the next file, whose records are copied by the next steps.
+ * @return true on success, false otherwise
+ */
+static bool start_compaction(session_spill *spill) {
+    std::string tmp_path = spill->path + ".tmp";
+    spill->next_fd = open(tmp_path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0600);
+    if (spill->next_fd < 0) {
+        return false;
+    }
+
+    spill->next_end = 0;
+    spill->next_dead_bytes = 0;
+    spill->to_copy.clear();
+    for (auto &entry : spill->index) {
+        spill->to_copy.push_back(entry.first);
+    }
+
+    return true;
+}
+
+
+/**
+ * Replaces the file with the next one, once all the records were copied.
+ * @return true on success, false if the rename failed
+ */
+static bool finish_compaction(session_spill *spill) {
+    std::string tmp_path = spill->path + ".tmp";
+    if (rename(tmp_path.c_str(), spill->path.c_str()) < 0) {
+        return false;
+    }
+
+    close(spill->fd);
+    spill->fd = spill->next_fd;
+    spill->end = spill->next_end;
+    spill->dead_bytes = spill->next_dead_bytes;
+    spill->next_fd = -1;
+
+    // Every live record is in the next file, which becomes the current one.
+    spill->gen++;
+
+    return true;
+}
+
+
+bool spill_open(session_spill *spill, const std::string &path) {
+    spill->fd = open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0600);
+    if (spill->fd < 0) {
+        return false;
+    }
+
+    spill->path = path;
+    spill->end = 0;
+    spill->dead_bytes = 0;
+    spill->index.clear();
+    spill->order.clear();
+
+    return true;
+}
+
+
+bool spill_put(session_spill *spill, const std::string &id, const std::string &session,
+               uint64_t now_ms) {
+    // While compacting, the new records go straight to the next file.
+    bool compacting = spill->next_fd >= 0;
+    int fd = compacting ? spill->next_fd : spill->fd;
+    uint64_t &end = compacting ? spill->next_end : spill->end;
+
+    if (!write_at(fd, session.data(), session.size(), end)) {
+        return false;
+    }
+
+    auto it = spill->index.find(id);
+    if (it != spill->index.end()) {
+        kill_record(spill, it->second);
+    }
+
+    spill->index[id] = {end, (uint32_t) session.size(), now_ms, spill->gen + compacting};
+    spill->order.push_back({id, now_ms});
+    end += session.size();
+
+    return true;
+}
+
+
+bool spill_take(session_spill *spill, const std::string &id, std::string &session) {
+    auto it = spill->index.find(id);
+    if (it == spill->index.end()) {
+        return false;
+    }
+
+    int fd = it->second.gen == spill->gen ? spill->fd : spill->next_fd;
+    session.resize(it->second.len);
+    bool found = read_at(fd, &session[0], session.size(), it->second.offset);
+
+    kill_record(spill, it->second);
+    spill->index.erase(it);
+
+    return found;
+}
+
+
+bool spill_expire(session_spill *spill, uint64_t before_ms, size_t max_records) {
+    for (size_t i = 0; i < max_records; i++) {
+        if (spill->order.empty() || spill->order.front().second >= before_ms) {
+            return false;
+        }
+
+        // Only the entry of the last write of the id drops its record.
+        auto &oldest = spill->order.front();
+        auto it = spill->index.find(oldest.first);
+        if (it != spill->index.end() && it->second.spilled_ms == oldest.second) {
+            kill_record(spill, it->second);
+            spill->index.erase(it);
+            spill->expired++;
+        }
+        spill->order.pop_front();
+    }
+
+    return !spill->order.empty() && spill->order.front().second < before_ms;
+}
+
+
+int spill_compact_step(session_spill *spill, size_t max_bytes) {
+    if (spill->next_fd < 0) {
+        uint64_t live_bytes = spill->end - spill->dead_bytes;
+        if (spill->dead_bytes <= SPILL_COMPACT_MIN || spill->dead_bytes <= live_bytes) {
+            return 0;
+        }
+
+        if (!start_compaction(spill)) {
+            return -1;
+        }
+    }
+
+    std::string buff;
+    size_t copied = 0;
+
+    while (!spill->to_copy.empty() && copied < max_bytes) {
+        // Records taken back or written again since the start are skipped.
+        auto it = spill->index.find(spill->to_copy.back());
+        if (it != spill->index.end() && it->second.gen == spill->gen) {
+            spill_record &record = it->second;
+
+            buff.resize(record.len);
+            if (!read_at(spill->fd, &buff[0], buff.size(), record.offset)
+                || !write_at(spill->next_fd, buff.data(), buff.size(), spill->next_end)) {
+                return -1;
+            }
+
+            spill->dead_bytes += record.len;
+            record.offset = spill->next_end;
+            record.gen = spill->gen + 1;
+            spill->next_end += record.len;
+            copied += record.len;
+        }
+        spill->to_copy.pop_back();
+    }
+
+    if (!spill->to_copy.empty()) {
+        return 1;
+    }
+
+    return finish_compaction(spill) ? 0 : -1;
+}
+
+
+void spill_close(session_spill *spill, bool remove) {
+    if (spill->fd < 0) {
+        return;
+    }
+
+    close(spill->fd);
+    if (remove) {
+        unlink(spill->path.c_str());
+    }
+    spill->fd = -1;
+
+    if (spill->next_fd >= 0) {
+        close(spill->next_fd);
+        unlink((spill->path + ".tmp").c_str());
+        spill->next_fd = -1;
+    }
+}
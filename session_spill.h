@@ -0,0 +1,113 @@
+#ifndef SESSION_SPILL_H
+#define SESSION_SPILL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// The file is compacted when the dead records take more than this and
+// more than the live ones.
+#define SPILL_COMPACT_MIN (4 * 1024 * 1024)
+
+
+/**
+ * Where the session of a client is in the spill file.
+ */
+struct spill_record {
+    uint64_t offset;
+    uint32_t len;
+
+    // When the session was written, in milliseconds.
+    uint64_t spilled_ms;
+
+    // Generation of the file the record is in: the current one, or the
+    // next one while a compaction is running.
+    uint32_t gen;
+};
+
+
+/**
+ * Append-only file holding the sessions evicted from memory, with an
+ * index from the client id to its record. A record is dead once the
+ * session is loaded back or expires, and the space is reclaimed by
+ * compaction, a few records at a time.
+ */
+struct session_spill {
+    int fd = -1;
+    std::string path;
+
+    // Size of the file and bytes taken by the dead records.
+    uint64_t end = 0;
+    uint64_t dead_bytes = 0;
+
+    std::unordered_map<std::string, spill_record> index;
+
+    // Ids in the order they were written, with the time, for the expiry.
+    // A record taken back or written again leaves a stale entry behind.
+    std::deque<std::pair<std::string, uint64_t>> order;
+    uint64_t expired = 0;
+
+    // Generation of the file, increased by every compaction.
+    uint32_t gen = 0;
+
+    // While compacting: the next file (where the new records go too), its
+    // size and dead bytes, and the ids whose records are left to copy.
+    int next_fd = -1;
+    uint64_t next_end = 0;
+    uint64_t next_dead_bytes = 0;
+    std::vector<std::string> to_copy;
+};
+
+
+/**
+ * Creates the file (truncating an older one: the index only lives in
+ * memory, so its records would be unreachable anyway).
+ * @return true on success, false otherwise
+ */
+bool spill_open(session_spill *spill, const std::string &path);
+
+
+/**
+ * Appends the session of the client (replacing an older one, if any).
+ * @param now_ms Current time, from which the record expires
+ * @return true on success, false if it could not be written
+ */
+bool spill_put(session_spill *spill, const std::string &id, const std::string &session,
+               uint64_t now_ms);
+
+
+/**
+ * Reads the session of the client and removes it from the file.
+ * @return true if it was found and read, false otherwise
+ */
+bool spill_take(session_spill *spill, const std::string &id, std::string &session);
+
+
+/**
+ * Drops at most max_records of the records written before the given time.
+ * @return true if more of them are left, false otherwise
+ */
+bool spill_expire(session_spill *spill, uint64_t before_ms, size_t max_records);
+
+
+/**
+ * Copies about max_bytes of the live records to the next file, starting a
+ * compaction if the dead records take too much space, and replaces the
+ * file once they are all copied.
+ * @return 1 if the compaction goes on, 0 if there is nothing to do, -1 if
+ * a record could not be copied (it is tried again on the next step)
+ */
+int spill_compact_step(session_spill *spill, size_t max_bytes);
+
+
+/**
+ * Closes the file and deletes it, unless another server took it over.
+ */
+void spill_close(session_spill *spill, bool remove);
+
+
+#endif /* SESSION_SPILL_H */
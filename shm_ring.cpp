@@ -0,0 +1,212 @@
+#include "shm_ring.h"
+#include <cstring>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define SHM_SLOTS_SIZE (sizeof(shm_slot) * SHM_RING_SLOTS)
+
+
+/**
+ * There is no glibc wrapper for futex(). The futexes are not private,
+ * because they are shared between processes.
+ */
+static long futex(std::atomic<uint32_t> *word, int op, uint32_t val,
+                  const struct timespec *timeout) {
+    return syscall(SYS_futex, (uint32_t *) word, op, val, timeout, NULL, 0);
+}
+
+
+bool shm_ring_create(shm_ring *ring, const std::string &name) {
+    // Start from an empty ring, whatever was left by an older producer.
+    shm_unlink(name.c_str());
+
+    ring->fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+    if (ring->fd < 0) {
+        return false;
+    }
+
+    if (ftruncate(ring->fd, SHM_HEADER_SIZE + SHM_SLOTS_SIZE) < 0) {
+        close(ring->fd);
+        return false;
+    }
+
+    void *zone = mmap(NULL, SHM_HEADER_SIZE + SHM_SLOTS_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, ring->fd, 0);
+    if (zone == MAP_FAILED) {
+        close(ring->fd);
+        return false;
+    }
+
+    // The file is zero-filled, so all the slots are empty.
+    ring->name = name;
+    ring->header = (shm_ring_header *) zone;
+    ring->slots = (shm_slot *) ((char *) zone + SHM_HEADER_SIZE);
+
+    ring->header->slot_count = SHM_RING_SLOTS;
+    ring->header->magic = SHM_RING_MAGIC;
+
+    return true;
+}
+
+
+bool shm_ring_adopt(shm_ring *ring, int fd, const std::string &name) {
+    void *zone = mmap(NULL, SHM_HEADER_SIZE + SHM_SLOTS_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    if (zone == MAP_FAILED) {
+        return false;
+    }
+
+    shm_ring_header *header = (shm_ring_header *) zone;
+    if (header->magic != SHM_RING_MAGIC || header->slot_count != SHM_RING_SLOTS) {
+        munmap(zone, SHM_HEADER_SIZE + SHM_SLOTS_SIZE);
+        return false;
+    }
+
+    ring->fd = fd;
+    ring->name = name;
+    ring->header = header;
+    ring->slots = (shm_slot *) ((char *) zone + SHM_HEADER_SIZE);
+
+    return true;
+}
+
+
+bool shm_ring_open(shm_ring *ring, const std::string &name) {
+    ring->fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (ring->fd < 0) {
+        return false;
+    }
+
+    void *header = mmap(NULL, SHM_HEADER_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, ring->fd, 0);
+    void *slots = mmap(NULL, SHM_SLOTS_SIZE, PROT_READ, MAP_SHARED,
+                       ring->fd, SHM_HEADER_SIZE);
+
+    if (header == MAP_FAILED || slots == MAP_FAILED) {
+        close(ring->fd);
+        return false;
+    }
+
+    ring->name = name;
+    ring->header = (shm_ring_header *) header;
+    ring->slots = (shm_slot *) slots;
+
+    if (ring->header->magic != SHM_RING_MAGIC || ring->header->slot_count != SHM_RING_SLOTS) {
+        shm_ring_close(ring, false);
+        return false;
+    }
+
+    return true;
+}
+
+
+void shm_ring_close(shm_ring *ring, bool unlink) {
+    if (ring->fd < 0) {
+        return;
+    }
+
+    if (unlink) {
+        // The producer mapped everything in one go.
+        munmap(ring->header, SHM_HEADER_SIZE + SHM_SLOTS_SIZE);
+        shm_unlink(ring->name.c_str());
+    } else {
+        munmap(ring->header, SHM_HEADER_SIZE);
+        munmap(ring->slots, SHM_SLOTS_SIZE);
+    }
+
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+
+void shm_ring_write(shm_ring *ring, uint64_t consumer_mask, const char *data, uint32_t len) {
+    shm_ring_header *header = ring->header;
+    uint64_t number = header->write_seq.load(std::memory_order_relaxed);
+    shm_slot *slot = &ring->slots[number % SHM_RING_SLOTS];
+
+    // Readers that see the slot busy (or changed after reading it)
+    // know that the message they were reading was overwritten.
+    slot->seq.store(SHM_SLOT_BUSY, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot->consumer_mask = consumer_mask;
+    slot->len = len;
+    memcpy(slot->data, data, len);
+
+    slot->seq.store(number + 1, std::memory_order_release);
+    header->write_seq.store(number + 1, std::memory_order_release);
+
+    header->futex_word.fetch_add(1, std::memory_order_seq_cst);
+    if (header->waiters.load(std::memory_order_seq_cst) > 0) {
+        futex(&header->futex_word, FUTEX_WAKE, INT_MAX, NULL);
+    }
+}
+
+
+int shm_ring_read(shm_ring *ring, uint64_t &cursor, char *buff,
+                  uint64_t &consumer_mask, uint64_t &lost) {
+    shm_ring_header *header = ring->header;
+
+    while (true) {
+        uint64_t written = header->write_seq.load(std::memory_order_acquire);
+        if (cursor >= written) {
+            return -1;
+        }
+
+        if (written - cursor > SHM_RING_SLOTS) {
+            // The producer went around the ring, skip to the oldest message.
+            lost += written - SHM_RING_SLOTS - cursor;
+            cursor = written - SHM_RING_SLOTS;
+        }
+
+        shm_slot *slot = &ring->slots[cursor % SHM_RING_SLOTS];
+
+        uint64_t seq_before = slot->seq.load(std::memory_order_acquire);
+        if (seq_before == cursor + 1) {
+            uint32_t len = slot->len;
+            consumer_mask = slot->consumer_mask;
+
+            if (len <= SHM_SLOT_DATA) {
+                memcpy(buff, slot->data, len);
+            }
+
+            // The copy is valid only if the slot did not change meanwhile.
+            std::atomic_thread_fence(std::memory_order_acquire);
+            uint64_t seq_after = slot->seq.load(std::memory_order_relaxed);
+
+            if (seq_after == seq_before && len <= SHM_SLOT_DATA) {
+                cursor++;
+                return len;
+            }
+        }
+
+        // Overwritten while (or before) reading it.
+        lost++;
+        cursor++;
+    }
+}
+
+
+void shm_ring_wait(shm_ring *ring, uint64_t cursor, int timeout_ms) {
+    shm_ring_header *header = ring->header;
+
+    header->waiters.fetch_add(1, std::memory_order_seq_cst);
+
+    // If a message is written after reading the word, the word changes
+    // and futex() returns immediately, so no wake up can be missed.
+    uint32_t word = header->futex_word.load(std::memory_order_seq_cst);
+    if (header->write_seq.load(std::memory_order_seq_cst) <= cursor) {
+        struct timespec timeout;
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_nsec = (long) (timeout_ms % 1000) * 1000000;
+
+        futex(&header->futex_word, FUTEX_WAIT, word, &timeout);
+    }
+
+    header->waiters.fetch_sub(1, std::memory_order_seq_cst);
+}
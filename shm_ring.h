@@ -0,0 +1,127 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <string>
+
+#define SHM_RING_MAGIC 0x53524e47
+#define SHM_RING_SLOTS 4096
+#define SHM_SLOT_DATA 2024
+#define SHM_MAX_CONSUMERS 64
+
+// Size of the header zone, mapped separately from the slots.
+#define SHM_HEADER_SIZE 4096
+
+
+/**
+ * Start of the shared memory zone. It is the only part the consumers
+ * map with write access, to announce that they sleep.
+ */
+struct shm_ring_header {
+    uint32_t magic;
+    uint32_t slot_count;
+
+    // Number of messages written since the ring was created.
+    std::atomic<uint64_t> write_seq;
+
+    // Incremented after every write, the consumers sleep on it (futex).
+    std::atomic<uint32_t> futex_word;
+
+    // Number of consumers that are sleeping, so the producer only makes
+    // the wake up system call when it is needed.
+    std::atomic<uint32_t> waiters;
+};
+
+
+/**
+ * A message of the ring. The seq field works as a sequence lock: it is
+ * the message number + 1 when the slot is complete (0 if it was never
+ * written) and SHM_SLOT_BUSY while the producer is writing it.
+ */
+struct shm_slot {
+    std::atomic<uint64_t> seq;
+
+    // Bit i is set if the consumer with index i is subscribed to the topic.
+    uint64_t consumer_mask;
+
+    uint32_t len;
+    char data[SHM_SLOT_DATA];
+};
+
+#define SHM_SLOT_BUSY UINT64_MAX
+
+
+/**
+ * A mapping of the ring, in the producer or in a consumer.
+ */
+struct shm_ring {
+    std::string name;
+    int fd = -1;
+
+    shm_ring_header *header = NULL;
+    shm_slot *slots = NULL;
+};
+
+
+/**
+ * Creates (or recreates) the ring with the given name in /dev/shm
+ * and maps it with write access, for the producer.
+ * @return true on success, false otherwise
+ */
+bool shm_ring_create(shm_ring *ring, const std::string &name);
+
+
+/**
+ * Maps the ring behind an fd received from the previous producer (on a
+ * server handoff) with write access, keeping its messages and sequence.
+ * @return true on success, false otherwise
+ */
+bool shm_ring_adopt(shm_ring *ring, int fd, const std::string &name);
+
+
+/**
+ * Maps an existing ring for a consumer: the slots are read-only, only
+ * the header can be written.
+ * @return true on success, false otherwise
+ */
+bool shm_ring_open(shm_ring *ring, const std::string &name);
+
+
+/**
+ * Unmaps the ring. The producer also removes it from /dev/shm.
+ */
+void shm_ring_close(shm_ring *ring, bool unlink);
+
+
+/**
+ * Writes a message in the next slot (overwriting the oldest one) and
+ * wakes up the consumers, if any of them sleeps. The message must fit
+ * in SHM_SLOT_DATA bytes.
+ */
+void shm_ring_write(shm_ring *ring, uint64_t consumer_mask, const char *data, uint32_t len);
+
+
+/**
+ * Reads the message with the number given by the cursor, if it was
+ * already written, then advances the cursor. If the producer went around
+ * the ring and overwrote messages that were not read yet, the cursor
+ * jumps to the oldest message still available and the skipped ones are
+ * added to lost.
+ * @param buff Destination of at least SHM_SLOT_DATA bytes
+ * @return the length of the message (-1 if there is no new message),
+ * with consumer_mask set to the mask of the message
+ */
+int shm_ring_read(shm_ring *ring, uint64_t &cursor, char *buff,
+                  uint64_t &consumer_mask, uint64_t &lost);
+
+
+/**
+ * Sleeps until a message after the cursor is written, or at most
+ * timeout_ms milliseconds. Returns immediately if there is one already.
+ */
+void shm_ring_wait(shm_ring *ring, uint64_t cursor, int timeout_ms);
+
+
+#endif /* SHM_RING_H */
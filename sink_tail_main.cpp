@@ -0,0 +1,69 @@
+#include <iostream>
+#include "utils.h"
+#include "record_sink.h"
+#include "protocols.h"
+#include <cstring>
+#include <cinttypes>
+#include <unistd.h>
+
+// Pause of --follow when there is no new record.
+#define TAIL_POLL_US 1000
+
+using namespace std;
+
+int main(int argc, char **argv) {
+    setvbuf(stdout, NULL, _IOFBF, 1024 * 1024);
+
+    if (argc < 2) {
+        cout << "Sink tail Usage: " << argv[0] << " <SINK_PATH> [--from <FILE_INDEX>] [--follow]\n";
+        return -1;
+    }
+
+    // Parse the optional settings.
+    uint64_t file_index = 0;
+    bool follow = false;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--from") == 0 && i + 1 < argc) {
+            int rc = sscanf(argv[++i], "%" SCNu64, &file_index);
+            DIE(rc != 1, "Invalid file index.\n");
+            continue;
+        }
+
+        if (strcmp(argv[i], "--follow") == 0) {
+            follow = true;
+            continue;
+        }
+
+        cout << "Sink tail Usage: " << argv[0] << " <SINK_PATH> [--from <FILE_INDEX>] [--follow]\n";
+        return -1;
+    }
+
+    sink_reader reader;
+    if (!sink_reader_open(&reader, argv[1], file_index)) {
+        fprintf(stderr, "%s.%" PRIu64 " is not a file of a record sink.\n", argv[1], file_index);
+        return -1;
+    }
+
+    // The text of a record is at most as long as the datagram it came from.
+    char buff[2 * MAX_UDP_DELIVERY];
+
+    while (true) {
+        const sink_record *record = sink_reader_next(&reader);
+        if (!record) {
+            if (!follow) {
+                break;
+            }
+
+            fflush(stdout);
+            usleep(TAIL_POLL_US);
+            continue;
+        }
+
+        sink_format_record(record, buff, sizeof(buff));
+        printf("%" PRIu64 " %s\n", record->rx_ns, buff);
+    }
+
+    sink_reader_close(&reader);
+
+    return 0;
+}
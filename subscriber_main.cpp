@@ -3,15 +3,18 @@
 #include "Subscriber.h"
 #include <arpa/inet.h>
 #include <cstring>
+#include <cinttypes>
 
 using namespace std;
 
 int main(int argc, char **argv) {
     setvbuf(stdout, NULL, _IONBF, BUFSIZ);
 
-    if (argc != 4) {
+    if (argc < 4) {
         cout << "Subscriber Usage: " << argv[0]
-             << " <CLIENT_ID> <SERVER_IP> <SERVER_PORT> \n";
+             << " <CLIENT_ID> <SERVER_IP> <SERVER_PORT> [--udp <LOCAL_PORT>] [--shm] [--timestamps]"
+             << " [--credit <MESSAGES>[:<BYTES>]] [--sink <PATH>] [--sink-size <MB>] [--mux]"
+             << " [--aliases <COUNT>]\n";
         return -1;
     }
 
@@ -28,9 +31,66 @@ int main(int argc, char **argv) {
     // Get server_id as number in network order.
     uint32_t server_ip = inet_addr(argv[2]);
 
+    // Parse the optional settings.
+    subscriber_options options;
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "--udp") == 0 && i + 1 < argc) {
+            options.use_udp = true;
+            rc = sscanf(argv[++i], "%hu", &options.udp_port);
+            DIE(rc != 1, "Invalid UDP port number.\n");
+            continue;
+        }
+
+        if (strcmp(argv[i], "--shm") == 0) {
+            options.use_shm = true;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--timestamps") == 0) {
+            options.timestamps = true;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--credit") == 0 && i + 1 < argc) {
+            rc = sscanf(argv[++i], "%u:%u", &options.credit_messages, &options.credit_bytes);
+            DIE(rc < 1 || options.credit_messages == 0, "Invalid credit window.\n");
+            continue;
+        }
+
+        if (strcmp(argv[i], "--mux") == 0) {
+            options.mux = true;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--aliases") == 0 && i + 1 < argc) {
+            rc = sscanf(argv[++i], "%hu", &options.aliases);
+            DIE(rc != 1, "Invalid number of aliases.\n");
+            continue;
+        }
+
+        if (strcmp(argv[i], "--sink") == 0 && i + 1 < argc) {
+            options.sink_path = argv[++i];
+            continue;
+        }
+
+        if (strcmp(argv[i], "--sink-size") == 0 && i + 1 < argc) {
+            uint64_t megabytes;
+            rc = sscanf(argv[++i], "%" SCNu64, &megabytes);
+            DIE(rc != 1 || megabytes == 0, "Invalid sink size.\n");
+            options.sink_size = megabytes * 1024 * 1024;
+            continue;
+        }
+
+        cout << "Subscriber Usage: " << argv[0]
+             << " <CLIENT_ID> <SERVER_IP> <SERVER_PORT> [--udp <LOCAL_PORT>] [--shm] [--timestamps]"
+             << " [--credit <MESSAGES>[:<BYTES>]] [--sink <PATH>] [--sink-size <MB>] [--mux]"
+             << " [--aliases <COUNT>]\n";
+        return -1;
+    }
+
     Subscriber *subscriber;
     try {
-        subscriber = new Subscriber(argv[1], server_ip, server_port);
+        subscriber = new Subscriber(argv[1], server_ip, server_port, options);
     } catch (bad_alloc &exception) {
         fprintf(stderr, "Subscriber alloc failed.\n");
         exit(-1);
@@ -5,6 +5,8 @@ import time
 import os
 import pprint
 import json
+import socket
+import struct
 
 from contextlib import contextmanager
 from subprocess import Popen, PIPE, STDOUT
@@ -43,8 +45,22 @@ tests = {
   "c2_subscribe_star_wildcard": "not executed",
   "c2_subscribe_compound_wildcard": "not executed",
   "c2_subscribe_wildcard_set_inclusion": "not executed",
+  "c2_subscribe_star_levels": "not executed",
   "quick_flow": "not executed",
   "server_stop": "not executed",
+  "silent_client_dropped": "not executed",
+  "session_expiry_timer": "not executed",
+  "matchers_subscribe_all": "not executed",
+  "matchers_data_subscribed": "not executed",
+  "matchers_subscribe": "not executed",
+  "matchers_plus_wildcard": "not executed",
+  "matchers_star_wildcard": "not executed",
+  "matchers_compound_wildcard": "not executed",
+  "matchers_wildcard_set_inclusion": "not executed",
+  "matchers_star_levels": "not executed",
+  "matchers_subscribe_in_flight": "not executed",
+  "conflate_last_value": "not executed",
+  "credit_window": "not executed",
 }
 
 def pass_test(test):
@@ -274,6 +290,40 @@ def run_udp_client(mode=True, types=["0"], input_file="sample_payloads.json"):
     udpcl.send_input("exit")
     udpcl.finish()
 
+def send_int(topic, value, pause=0.05):
+  """Sends one INT publication on a topic, as a UDP client would."""
+  sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+  payload = topic.encode().ljust(50, b"\0") + bytes([0, 1 if value < 0 else 0]) + struct.pack("!I", abs(value))
+  sock.sendto(payload, (ip, int(port)))
+  sock.close()
+  sleep(pause)
+
+def start_extra_server(server_port, args):
+  """Starts another server with the given options, which the next clients use."""
+  global port
+  port = server_port
+
+  print("Starting the server on port " + port + " with " + " ".join(args))
+  server = Process(["./server", port] + args)
+  server.start()
+  sleep(1)
+  return server
+
+def stop_extra_server(server):
+  """Stops a server started by start_extra_server()."""
+  server.send_input("exit")
+  sleep(1)
+  server.finish()
+
+def wait_server_output(server, target, tout):
+  """Reads the output of the server until a line contains target, for at most tout seconds."""
+  deadline = time.time() + tout
+  while time.time() < deadline:
+    outs = server.get_output_timeout(1)
+    if target in outs:
+      return outs
+  return ""
+
 def start_and_check_client(server, id, restart=False, test=True):
   """Starts a TCP client and checks that it starts."""
   if test:
@@ -394,9 +444,9 @@ def run_test_data_unsubscribed(server, c1):
   if not failed:
     pass_test("data_unsubscribed")
 
-def run_test_c1_subscribe_all(server, c1, topics):
+def run_test_c1_subscribe_all(server, c1, topics, test="c1_subscribe_all"):
   """Tests that subscriber C1 can subscribe to all topics."""
-  fail_test("c1_subscribe_all")
+  fail_test(test)
   print("Subscribing C1 to all topics")
 
   failed = False
@@ -409,11 +459,11 @@ def run_test_c1_subscribe_all(server, c1, topics):
       break
 
   if not failed:
-    pass_test("c1_subscribe_all")
+    pass_test(test)
 
-def run_test_data_subscribed(server, c1, topics):
+def run_test_data_subscribed(server, c1, topics, test="data_subscribed"):
   """Tests that subscriber C1 receives messages on subscribed topics."""
-  fail_test("data_subscribed")
+  fail_test(test)
 
   # generate one message for each topic
   print("Generating one message for each topic")
@@ -425,7 +475,7 @@ def run_test_data_subscribed(server, c1, topics):
     success = check_subscriber_output(c1, "1", topic.print()) and success
 
   if success:
-    pass_test("data_subscribed")
+    pass_test(test)
 
 def run_test_c1_stop(server, c1):
   """Tests that subscriber C1 stops correctly."""
@@ -482,9 +532,9 @@ def run_test_c2_start(server):
   """Tests that a subscriber C2 starts correctly."""
   return start_and_check_client(server, "2")
 
-def run_test_c2_subscribe(c2, topics):
+def run_test_c2_subscribe(c2, topics, test="c2_subscribe"):
   """Tests that subscriber C2 can subscribe to a topic."""
-  fail_test("c2_subscribe")
+  fail_test(test)
   topic = topics[0]
 
   print("Subscribing C2 to topic " + topic.name)
@@ -495,7 +545,7 @@ def run_test_c2_subscribe(c2, topics):
     print("Error: C2 not subscribed to topic " + topic.name)
     return
 
-  pass_test("c2_subscribe")
+  pass_test(test)
 
 def run_test_c2_stop(server, c2):
   """Tests that subscriber C2 stops correctly."""
@@ -562,10 +612,10 @@ def run_test_server_stop(server, c1):
   if success:
     pass_test("server_stop")
 
-def run_test_c2_subscribe_plus_wildcard(c2, topics):
+def run_test_c2_subscribe_plus_wildcard(c2, topics, test="c2_subscribe_plus_wildcard"):
   """Tests that subscriber C2 can subscribe to a topic with wildcard."""
   # setup the test and the wildcard flow
-  fail_test("c2_subscribe_plus_wildcard")
+  fail_test(test)
 
   # subscribe to topics
   wildcard = '+/ec/100/pressure'
@@ -622,13 +672,13 @@ def run_test_c2_subscribe_plus_wildcard(c2, topics):
   c2.get_output_timeout(1)
 
   if success:
-    pass_test("c2_subscribe_plus_wildcard")
+    pass_test(test)
 
 
-def run_test_c2_subscribe_star_wildcard(c2, topics):
+def run_test_c2_subscribe_star_wildcard(c2, topics, test="c2_subscribe_star_wildcard"):
   """Tests that subscriber C2 can subscribe to a topic with wildcard."""
   # setup the test
-  fail_test("c2_subscribe_star_wildcard")
+  fail_test(test)
 
   # subscribe to topics
   wildcard = '*/pressure'
@@ -705,12 +755,12 @@ def run_test_c2_subscribe_star_wildcard(c2, topics):
   c2.get_output_timeout(1)
 
   if success:
-    pass_test("c2_subscribe_star_wildcard")
+    pass_test(test)
 
-def run_test_c2_subscribe_compound_wildcard(c2, topics):
+def run_test_c2_subscribe_compound_wildcard(c2, topics, test="c2_subscribe_compound_wildcard"):
   """Tests that subscriber C2 can subscribe to a topic with wildcard."""
   # setup the test
-  fail_test("c2_subscribe_compound_wildcard")
+  fail_test(test)
 
   # subscribe to topics
   wildcard = 'upb/+/100/+'
@@ -790,12 +840,12 @@ def run_test_c2_subscribe_compound_wildcard(c2, topics):
   c2.get_output_timeout(1)
 
   if success:
-    pass_test("c2_subscribe_compound_wildcard")
+    pass_test(test)
 
-def run_test_c2_subscribe_wildcard_set_inclusion(c2, topics):
+def run_test_c2_subscribe_wildcard_set_inclusion(c2, topics, test="c2_subscribe_wildcard_set_inclusion"):
   """Tests that subscriber C2 can subscribe to a topic with wildcard."""
   # setup the test
-  fail_test("c2_subscribe_wildcard_set_inclusion")
+  fail_test(test)
 
   # subscribe to topics
   wildcards = ['upb/precis/100/+']
@@ -825,7 +875,239 @@ def run_test_c2_subscribe_wildcard_set_inclusion(c2, topics):
   c2.get_output_timeout(1)
 
   if success:
-    pass_test("c2_subscribe_wildcard_set_inclusion")
+    pass_test(test)
+
+def run_test_c2_subscribe_star_levels(c2, test="c2_subscribe_star_levels"):
+  """Tests that * stands for one or more levels, wherever it is in the pattern."""
+  fail_test(test)
+
+  # (pattern, [(topic, whether it matches)])
+  cases = [
+    ("a/*", [("a", False), ("a/b", True), ("a/b/c/d", True)]),
+    ("a/*/b/c", [("a/b/c", False), ("a/x/b/c", True), ("a/b/x/b/c", True), ("a/b/x/b/d", False)]),
+    ("+/*/c", [("x/c", False), ("x/y/c", True), ("x/y/z/c", True), ("x/y/z/d", False)]),
+  ]
+
+  success = True
+  for wildcard, topics in cases:
+    print("Subscribing C2 to topics " + wildcard)
+    if subscribe_to_topic(c2, "", wildcard) == -1:
+      return
+
+    # a different value for every topic, so a late message is noticed
+    for value, (topic, matches) in enumerate(topics):
+      send_int(topic, value)
+      if matches:
+        success = check_subscriber_output(c2, "2", topic + " - INT - " + str(value)) and success
+    success = check_subscriber_output(c2, "2", "timeout") and success
+
+    c2.send_input("unsubscribe " + wildcard)
+    c2.get_output_timeout(1)
+
+  if success:
+    pass_test(test)
+
+def run_test_silent_client_dropped(server):
+  """Tests that a client which stops answering the heartbeats is dropped."""
+  fail_test("silent_client_dropped")
+
+  c7, success = start_and_check_client(server, "7", test=False)
+  if not success:
+    return
+
+  # the process can not read nor answer anything while it is stopped
+  print("Stopping subscriber C7")
+  os.kill(c7.proc.pid, signal.SIGSTOP)
+  outs = wait_server_output(server, "Client C7", 5)
+  os.kill(c7.proc.pid, signal.SIGCONT)
+  c7.finish()
+
+  if outs.rstrip() != "Client C7 is not responding.":
+    print("Error: server did not drop the silent C7")
+    return
+
+  outs = server.get_output_timeout(1)
+  if outs.rstrip() != "Client C7 disconnected.":
+    print("Error: server did not disconnect the silent C7")
+    return
+
+  pass_test("silent_client_dropped")
+
+def run_test_session_expiry_timer(server):
+  """Tests that a session expires after its timer of more than 256 ticks, and is loaded back."""
+  fail_test("session_expiry_timer")
+
+  c8, success = start_and_check_client(server, "8", test=False)
+  if not success or subscribe_to_topic(c8, "expiry/topic") == -1:
+    return
+  if not check_subscriber_stop(server, c8, "8"):
+    return
+
+  # the session expires after 1000 ms, so its timer cascades down the wheel
+  # (the one of C7 expired too)
+  sleep(2)
+  server.send_input("mem")
+  outs = wait_server_output(server, "Spill file:", 2)
+  if not outs.startswith("Spill file: 2 sessions"):
+    print("Error: the sessions of C7 and C8 were not moved to the spill file [" + outs.rstrip() + "]")
+    return
+  wait_server_output(server, "Total:", 2)
+
+  # the subscription is back when C8 reconnects
+  c8, success = start_and_check_client(server, "8", test=False)
+  if not success:
+    return
+  send_int("expiry/topic", 8)
+  success = check_subscriber_output(c8, "8", "expiry/topic - INT - 8")
+  c8.send_input("exit")
+  sleep(1)
+  c8.finish()
+
+  if success:
+    pass_test("session_expiry_timer")
+
+def read_values(c, topic, count):
+  """Reads the values a TCP client got on a topic, until count of them or a timeout."""
+  values = []
+  while len(values) < count:
+    outc = c.get_output_timeout(2)
+    if outc == "timeout" or outc == "":
+      break
+    if " - " + topic + " - INT - " in outc:
+      values.append(int(outc.split(" - ")[-1]))
+  return values
+
+def run_test_matchers_subscribe_in_flight(server):
+  """Tests that subscribing and unsubscribing while publications are being matched loses nothing."""
+  fail_test("matchers_subscribe_in_flight")
+
+  if not make_target("publisher"):
+    print("Error: publisher could not be built")
+    return
+
+  c3, success = start_and_check_client(server, "3", test=False)
+  if not success:
+    return
+  c4, success = start_and_check_client(server, "4", test=False)
+  if not success:
+    return
+  if subscribe_to_topic(c3, "load/+") == -1 or subscribe_to_topic(c4, "load/x") == -1:
+    return
+
+  publisher = Process(["./publisher", "P1", ip, port])
+  publisher.start()
+  sleep(1)
+
+  # C4 also matches the bursts through load/* every other moment, which must
+  # not give it any message twice
+  bursts, burst_size = 20, 2000
+  print("Publishing " + str(bursts) + " bursts while C4 subscribes and unsubscribes")
+  for i in range(bursts):
+    publisher.send_input("burst load/x " + str(burst_size))
+    c4.send_input("subscribe load/*")
+    sleep(0.025)
+    c4.send_input("unsubscribe load/*")
+    sleep(0.025)
+
+  expected = list(range(burst_size)) * bursts
+  success = True
+  for c, id in [(c3, "3"), (c4, "4")]:
+    values = read_values(c, "load/x", len(expected))
+    if values != expected:
+      print("Error: C" + id + " got " + str(len(values)) + " of the " + str(len(expected))
+            + " publications, or not in order")
+      success = False
+
+  publisher.send_input("exit")
+  for c in [c3, c4]:
+    c.send_input("exit")
+  sleep(1)
+  for process in [publisher, c3, c4]:
+    process.finish()
+
+  if success:
+    pass_test("matchers_subscribe_in_flight")
+
+def run_test_conflate_last_value(server):
+  """Tests that a conflating subscription only gets the last of the values queued for it."""
+  fail_test("conflate_last_value")
+
+  if not make_target("publisher"):
+    print("Error: publisher could not be built")
+    return
+
+  c5, success = start_and_check_client(server, "5", test=False)
+  if not success:
+    return
+  if subscribe_to_topic(c5, "filler") == -1 or subscribe_to_topic(c5, "conflated/x", " conflate") == -1:
+    return
+
+  # while C5 is stopped, the filler takes the socket buffers, so the values
+  # that follow wait in the outbound queue
+  print("Stopping subscriber C5 and filling its connection")
+  os.kill(c5.proc.pid, signal.SIGSTOP)
+
+  publisher = Process(["./publisher", "P2", ip, port])
+  publisher.start()
+  sleep(1)
+  publisher.proc.stdin.write(("filler STRING " + "x" * 1400 + "\n") * 12000)
+  publisher.proc.stdin.flush()
+  sleep(2)
+
+  for value in range(1, 6):
+    send_int("conflated/x", value)
+
+  os.kill(c5.proc.pid, signal.SIGCONT)
+  values = read_values(c5, "conflated/x", 5)
+
+  publisher.send_input("exit")
+  c5.send_input("exit")
+  sleep(1)
+  publisher.finish()
+  c5.finish()
+
+  if values != [5]:
+    print("Error: C5 should only get the last value, got " + str(values))
+    return
+
+  pass_test("conflate_last_value")
+
+def run_test_credit_window(server):
+  """Tests what a stopped subscriber with a credit window gets once it resumes."""
+  fail_test("credit_window")
+
+  print("Starting subscriber C6 with a credit of 4 messages")
+  c6 = Process(["./subscriber", "C6", ip, port, "--credit", "4"])
+  c6.start()
+  if wait_server_output(server, "New client C6 connected from", 5) == "":
+    print("Error: server did not print that C6 is connected")
+    c6.finish()
+    return
+  if subscribe_to_topic(c6, "credit/x") == -1:
+    c6.finish()
+    return
+
+  print("Stopping subscriber C6 and publishing 200 values")
+  os.kill(c6.proc.pid, signal.SIGSTOP)
+  for value in range(200):
+    send_int("credit/x", value, 0.002)
+  sleep(1)
+
+  os.kill(c6.proc.pid, signal.SIGCONT)
+  values = read_values(c6, "credit/x", 200)
+
+  c6.send_input("exit")
+  sleep(1)
+  c6.finish()
+
+  # the first window goes out before C6 stops answering, then the server
+  # holds 8 windows of 4 and drops the oldest of them
+  expected = list(range(4)) + list(range(168, 200))
+  if values != expected:
+    print("Error: C6 should get " + str(expected) + ", got " + str(values))
+    return
+
+  pass_test("credit_window")
 
 def h2_test():
   """Runs all the tests."""
@@ -889,6 +1171,9 @@ def h2_test():
           # subscribe C2 to topics containing wildcards and check for duplicate messages
           run_test_c2_subscribe_wildcard_set_inclusion(c2, wildcard_topics)
 
+          # check how many levels * stands for, with backtracking and mixed with +
+          run_test_c2_subscribe_star_levels(c2)
+
           # stop C2 and check it exits correctly
           success = run_test_c2_stop(server, c2)
 
@@ -898,6 +1183,45 @@ def h2_test():
   # close the server and check that C1 also closes
   run_test_server_stop(server, c1)
 
+  # check the timers with a short heartbeat and session expiry
+  timers_server = start_extra_server("12346", ["--heartbeat", "100", "--session-expiry", "1"])
+  run_test_silent_client_dropped(timers_server)
+  run_test_session_expiry_timer(timers_server)
+  stop_extra_server(timers_server)
+
+  # the subscription and wildcard cases again, matched by two threads
+  matchers_server = start_extra_server("12347", ["--matchers", "2"])
+  c1, success = start_and_check_client(matchers_server, "1", test=False)
+  if success:
+    c2, success = start_and_check_client(matchers_server, "2", test=False)
+  if success:
+    run_test_c1_subscribe_all(matchers_server, c1, topics, "matchers_subscribe_all")
+    run_test_data_subscribed(matchers_server, c1, topics, "matchers_data_subscribed")
+    run_test_c2_subscribe(c2, topics, "matchers_subscribe")
+    run_test_c2_subscribe_plus_wildcard(c2, wildcard_topics, "matchers_plus_wildcard")
+    run_test_c2_subscribe_star_wildcard(c2, wildcard_topics, "matchers_star_wildcard")
+    run_test_c2_subscribe_compound_wildcard(c2, wildcard_topics, "matchers_compound_wildcard")
+    run_test_c2_subscribe_wildcard_set_inclusion(c2, wildcard_topics, "matchers_wildcard_set_inclusion")
+    run_test_c2_subscribe_star_levels(c2, "matchers_star_levels")
+    for c in [c1, c2]:
+      c.send_input("exit")
+    sleep(1)
+    c1.finish()
+    c2.finish()
+
+    # drain what the server printed about C1 and C2
+    while matchers_server.get_output_timeout(1) != "timeout":
+      pass
+
+    run_test_matchers_subscribe_in_flight(matchers_server)
+  stop_extra_server(matchers_server)
+
+  # the slow consumer and flow control cases
+  flow_server = start_extra_server("12348", [])
+  run_test_conflate_last_value(flow_server)
+  run_test_credit_window(flow_server)
+  stop_extra_server(flow_server)
+
   # clean up
   make_clean()
 
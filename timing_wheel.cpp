@@ -0,0 +1,170 @@
+#include "timing_wheel.h"
+#include <climits>
+
+
+/**
+ * Links the timer in the slot matching its expiration: the lowest level
+ * whose turn (from the current time) reaches it.
+ */
+static void place_timer(timing_wheel *wheel, wheel_timer *timer) {
+    uint64_t delay = timer->expires - wheel->current;
+
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delay >> ((level + 1) * WHEEL_SLOT_BITS)) {
+        level++;
+    }
+
+    size_t index = (timer->expires >> (level * WHEEL_SLOT_BITS)) & WHEEL_SLOT_MASK;
+    wheel_timer **slot = &wheel->slots[level][index];
+
+    timer->prev = NULL;
+    timer->next = *slot;
+    timer->slot = slot;
+    if (*slot) {
+        (*slot)->prev = timer;
+    }
+    *slot = timer;
+
+    if (level == 0) {
+        wheel->busy[index / 64] |= 1ULL << (index % 64);
+    }
+}
+
+
+/**
+ * Moves the timers of the current slot of the level to the lower levels.
+ * When the level starts a new turn, the level above is cascaded first,
+ * because some of its timers may land in that slot.
+ */
+static void cascade(timing_wheel *wheel, int level) {
+    size_t index = (wheel->current >> (level * WHEEL_SLOT_BITS)) & WHEEL_SLOT_MASK;
+    if (index == 0 && level + 1 < WHEEL_LEVELS) {
+        cascade(wheel, level + 1);
+    }
+
+    wheel_timer *timer = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+
+    while (timer) {
+        wheel_timer *next = timer->next;
+        place_timer(wheel, timer);
+        timer = next;
+    }
+}
+
+
+void wheel_init(timing_wheel *wheel, uint64_t now) {
+    *wheel = timing_wheel();
+    wheel->current = now;
+}
+
+
+void wheel_arm(timing_wheel *wheel, wheel_timer *timer, uint64_t expires) {
+    wheel_cancel(wheel, timer);
+
+    // The ticks up to the current one were already processed.
+    if (expires <= wheel->current) {
+        expires = wheel->current + 1;
+    }
+    if (expires - wheel->current > WHEEL_MAX_DELAY) {
+        expires = wheel->current + WHEEL_MAX_DELAY;
+    }
+
+    timer->expires = expires;
+    timer->armed = true;
+    place_timer(wheel, timer);
+    wheel->count++;
+}
+
+
+void wheel_cancel(timing_wheel *wheel, wheel_timer *timer) {
+    if (!timer->armed) {
+        return;
+    }
+
+    if (timer->prev) {
+        timer->prev->next = timer->next;
+    } else {
+        *timer->slot = timer->next;
+    }
+    if (timer->next) {
+        timer->next->prev = timer->prev;
+    }
+
+    // Keep the map of the busy slots of the first level exact.
+    size_t index = timer->slot - wheel->slots[0];
+    if (!*timer->slot && index < WHEEL_SLOTS) {
+        wheel->busy[index / 64] &= ~(1ULL << (index % 64));
+    }
+
+    timer->armed = false;
+    timer->prev = timer->next = NULL;
+    timer->slot = NULL;
+    wheel->count--;
+}
+
+
+void wheel_advance(timing_wheel *wheel, uint64_t now, std::vector<wheel_timer*> &expired) {
+    while (wheel->current < now) {
+        if (wheel->count == 0) {
+            // Nothing to expire on the way, jump directly.
+            wheel->current = now;
+            break;
+        }
+
+        wheel->current++;
+
+        size_t index = wheel->current & WHEEL_SLOT_MASK;
+        if (index == 0) {
+            cascade(wheel, 1);
+        }
+
+        wheel_timer *timer = wheel->slots[0][index];
+        wheel->slots[0][index] = NULL;
+        wheel->busy[index / 64] &= ~(1ULL << (index % 64));
+
+        while (timer) {
+            wheel_timer *next = timer->next;
+
+            timer->armed = false;
+            timer->prev = timer->next = NULL;
+            timer->slot = NULL;
+            wheel->count--;
+
+            expired.push_back(timer);
+            timer = next;
+        }
+    }
+}
+
+
+int wheel_timeout(timing_wheel *wheel, uint64_t now) {
+    if (wheel->count == 0) {
+        return -1;
+    }
+
+    // The first level only holds the timers that expire before the end
+    // of its turn, where the level above is cascaded.
+    size_t position = wheel->current & WHEEL_SLOT_MASK;
+    uint64_t delay = WHEEL_SLOTS - position;
+
+    size_t start = position + 1;
+    for (size_t word = start / 64; word < WHEEL_SLOTS / 64; word++) {
+        uint64_t bits = wheel->busy[word];
+        if (word == start / 64) {
+            bits &= ~0ULL << (start % 64);
+        }
+
+        if (bits) {
+            delay = word * 64 + __builtin_ctzll(bits) - position;
+            break;
+        }
+    }
+
+    uint64_t deadline = wheel->current + delay;
+    if (deadline <= now) {
+        return 0;
+    }
+
+    return deadline - now > INT_MAX ? INT_MAX : deadline - now;
+}
@@ -0,0 +1,94 @@
+#ifndef TIMING_WHEEL_H
+#define TIMING_WHEEL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Each level has 256 slots, each slot of a level covering a whole turn
+// of the level below. With 1ms ticks, 4 levels reach about 49 days.
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOT_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_SLOT_BITS)
+#define WHEEL_SLOT_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_MAX_DELAY ((1ULL << (WHEEL_LEVELS * WHEEL_SLOT_BITS)) - 1)
+
+
+/**
+ * A timer, embedded in the structure it belongs to (no allocation when
+ * it is armed). The wheel only links it in the list of a slot.
+ */
+struct wheel_timer {
+    // Expiration time, in milliseconds.
+    uint64_t expires = 0;
+
+    // What the timer is for and the structure it belongs to, so the
+    // owner of the wheel knows what to do when it expires.
+    int kind = 0;
+    void *owner = NULL;
+
+    bool armed = false;
+
+    // Neighbours in the list of the slot and the head of that list.
+    wheel_timer *prev = NULL;
+    wheel_timer *next = NULL;
+    wheel_timer **slot = NULL;
+};
+
+
+/**
+ * Hierarchical timing wheel: a timer goes in the lowest level whose turn
+ * covers its delay and is moved to a lower level (cascaded) when the
+ * wheel reaches its slot. Arming and cancelling a timer are O(1), and so
+ * is each tick, whatever the number of timers.
+ */
+struct timing_wheel {
+    // Time of the last tick that was processed, in milliseconds.
+    uint64_t current = 0;
+
+    wheel_timer *slots[WHEEL_LEVELS][WHEEL_SLOTS] = {};
+
+    // Bit i is set if slot i of the first level is not empty, to find the
+    // next expiration without looking at every slot.
+    uint64_t busy[WHEEL_SLOTS / 64] = {};
+
+    // Number of armed timers.
+    size_t count = 0;
+};
+
+
+/**
+ * Starts the wheel at the given time.
+ */
+void wheel_init(timing_wheel *wheel, uint64_t now);
+
+
+/**
+ * Arms the timer (or moves it, if it is already armed) to expire at the
+ * given time. A time that already passed expires on the next tick.
+ */
+void wheel_arm(timing_wheel *wheel, wheel_timer *timer, uint64_t expires);
+
+
+/**
+ * Disarms the timer, if it is armed.
+ */
+void wheel_cancel(timing_wheel *wheel, wheel_timer *timer);
+
+
+/**
+ * Processes the ticks up to now, appending the timers that expired to
+ * the given vector. They are disarmed, so they can be armed again.
+ */
+void wheel_advance(timing_wheel *wheel, uint64_t now, std::vector<wheel_timer*> &expired);
+
+
+/**
+ * Returns the number of milliseconds poll() can sleep for without
+ * missing an expiration, or -1 if no timer is armed. It may be earlier
+ * than the first expiration, when a higher level has to be cascaded.
+ */
+int wheel_timeout(timing_wheel *wheel, uint64_t now);
+
+
+#endif /* TIMING_WHEEL_H */
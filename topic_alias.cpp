@@ -0,0 +1,106 @@
+#include "topic_alias.h"
+#include <cstring>
+#include <arpa/inet.h>
+#include "protocols.h"
+
+
+void alias_reset(alias_table *table, uint16_t capacity) {
+    table->capacity = capacity;
+    table->by_topic.clear();
+    table->lru.clear();
+    table->active = false;
+    table->defined = 0;
+    table->reused = 0;
+    table->saved_bytes = 0;
+}
+
+
+/**
+ * Appends the 3-byte header of a frame (the publications are always
+ * shorter than TCP_EXTENDED_LEN).
+ */
+static void append_header(std::string &frame, uint8_t command, size_t len) {
+    frame += (char) command;
+    frame += (char) (len >> 8);
+    frame += (char) (len & 0xFF);
+}
+
+
+bool alias_encode(alias_table *table, const std::string &frame, size_t topic_len) {
+    if (table->capacity == 0 || frame.size() <= TCP_HEADER_LEN
+        || (uint8_t) frame[0] != MSG_FROM_UDP) {
+        return false;
+    }
+
+    size_t payload_len = ((uint8_t) frame[1] << 8) | (uint8_t) frame[2];
+    if (payload_len == TCP_EXTENDED_LEN || frame.size() != TCP_HEADER_LEN + payload_len) {
+        return false;
+    }
+
+    // "<ip>:<port> - <topic> - <TYPE> - <value>", the address has no " - ".
+    const char *text = frame.data() + TCP_HEADER_LEN;
+    const char *separator = (const char *) memmem(text, payload_len, " - ", 3);
+    if (!separator) {
+        return false;
+    }
+
+    size_t topic_start = separator + 3 - text;
+    if (topic_start + topic_len + 3 > payload_len
+        || memcmp(text + topic_start + topic_len, " - ", 3) != 0) {
+        return false;
+    }
+
+    std::string_view topic(text + topic_start, topic_len);
+    auto it = table->by_topic.find(topic);
+
+    table->frame.clear();
+    table->topic = topic;
+    table->defines = it == table->by_topic.end();
+
+    if (table->defines) {
+        // A new alias, or the one of the least recently used topic.
+        table->alias = table->lru.size() < table->capacity ? table->lru.size()
+                                                           : table->lru.back().alias;
+
+        append_header(table->frame, ALIAS_DEFINE, payload_len + 3);
+        table->frame += (char) (table->alias >> 8);
+        table->frame += (char) (table->alias & 0xFF);
+        table->frame += (char) topic_len;
+        table->frame.append(text, payload_len);
+        return true;
+    }
+
+    // The text without "<topic> - ", which the client puts back.
+    table->alias = it->second->alias;
+
+    append_header(table->frame, MSG_FROM_UDP_ALIASED, payload_len - topic_len - 3 + 2);
+    table->frame += (char) (table->alias >> 8);
+    table->frame += (char) (table->alias & 0xFF);
+    table->frame.append(text, topic_start);
+    table->frame.append(text + topic_start + topic_len + 3,
+                        payload_len - topic_start - topic_len - 3);
+    return true;
+}
+
+
+void alias_commit(alias_table *table) {
+    if (!table->defines) {
+        auto it = table->by_topic.find(table->topic);
+        table->lru.splice(table->lru.begin(), table->lru, it->second);
+        table->reused++;
+        table->saved_bytes += table->topic.length() + 1;
+        return;
+    }
+
+    if (table->lru.size() == table->capacity) {
+        table->by_topic.erase(table->lru.back().topic);
+        table->lru.pop_back();
+    }
+
+    table->lru.push_front({std::string(table->topic), table->alias});
+    table->by_topic[table->lru.front().topic] = table->lru.begin();
+    table->defined++;
+
+    // The alias and the length of the topic.
+    table->saved_bytes -= 3;
+}
@@ -0,0 +1,79 @@
+#ifndef TOPIC_ALIAS_H
+#define TOPIC_ALIAS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Most aliases a connection may ask for.
+#define ALIAS_MAX_CAPACITY 4096
+
+
+struct alias_entry {
+    std::string topic;
+    uint16_t alias;
+};
+
+
+/**
+ * Numeric aliases of the topics of the publications sent on a connection,
+ * at most capacity of them; a new topic takes the alias of the least
+ * recently used one when the table is full. The aliases are chosen while
+ * the frames are written, so the table always follows the order in which
+ * the client reads them, whatever the queue did before (lanes, conflation,
+ * flow control).
+ */
+struct alias_table {
+    uint16_t capacity = 0;
+
+    // Most recently used first. The keys of the map are the topics of the
+    // list, whose nodes never move.
+    std::list<alias_entry> lru;
+    std::unordered_map<std::string_view, std::list<alias_entry>::iterator> by_topic;
+
+    // The frame being written instead of the front publication of the
+    // queue, if active, and the topic and alias it uses, which are only
+    // recorded once its first bytes are written (see alias_commit()).
+    std::string frame;
+    bool active = false;
+    std::string_view topic;
+    uint16_t alias = 0;
+    bool defines = false;
+
+    // Aliases defined and used since the connection was made, and the
+    // bytes this saved (the definitions cost a few).
+    uint64_t defined = 0;
+    uint64_t reused = 0;
+    int64_t saved_bytes = 0;
+};
+
+
+/**
+ * Forgets all the aliases (i.e. for a new connection).
+ * @param capacity Number of aliases the client accepts, 0 to disable them
+ */
+void alias_reset(alias_table *table, uint16_t capacity);
+
+
+/**
+ * Builds in table->frame what is sent instead of a MSG_FROM_UDP frame:
+ * ALIAS_DEFINE if its topic has no alias yet, MSG_FROM_UDP_ALIASED
+ * otherwise. The table itself does not change until alias_commit().
+ * @param topic_len Length of the topic, which follows the first " - " of
+ * the text
+ * @return false if the frame is sent as it is
+ */
+bool alias_encode(alias_table *table, const std::string &frame, size_t topic_len);
+
+
+/**
+ * Records the alias used by the frame built by alias_encode(), once its
+ * sending started. The frame it was built from must still be alive.
+ */
+void alias_commit(alias_table *table);
+
+
+#endif /* TOPIC_ALIAS_H */
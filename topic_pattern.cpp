@@ -0,0 +1,233 @@
+#include "topic_pattern.h"
+#include <cstring>
+
+
+/**
+ * FNV-1a, enough to tell most of the different levels apart without
+ * comparing their bytes.
+ */
+static uint64_t hash_level(const char *data, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t) data[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+
+bool compile_pattern(const std::string &pattern, compiled_pattern &compiled) {
+    compiled.text = pattern;
+    compiled.levels.clear();
+    compiled.has_star = false;
+    compiled.has_wildcards = false;
+
+    // The levels are located with 16-bit offsets.
+    if (pattern.length() > UINT16_MAX) {
+        return false;
+    }
+
+    size_t start = 0;
+    while (true) {
+        size_t end = pattern.find('/', start);
+        if (end == std::string::npos) {
+            end = pattern.length();
+        }
+
+        pattern_level level;
+        level.offset = start;
+        level.len = end - start;
+        level.hash = hash_level(pattern.data() + start, level.len);
+        level.op = LEVEL_LITERAL;
+
+        if (level.len == 1 && pattern[start] == '+') {
+            level.op = LEVEL_PLUS;
+            compiled.has_wildcards = true;
+        } else if (level.len == 1 && pattern[start] == '*') {
+            level.op = LEVEL_STAR;
+            compiled.has_wildcards = true;
+            compiled.has_star = true;
+        }
+
+        compiled.levels.push_back(level);
+
+        if (end == pattern.length()) {
+            break;
+        }
+        start = end + 1;
+    }
+
+    return compiled.levels.size() <= MAX_TOPIC_LEVELS;
+}
+
+
+bool split_topic(std::string_view topic, topic_levels &split) {
+    split.count = 0;
+
+    size_t start = 0;
+    while (true) {
+        size_t end = topic.find('/', start);
+        if (end == std::string_view::npos) {
+            end = topic.length();
+        }
+
+        if (split.count == MAX_TOPIC_LEVELS) {
+            return false;
+        }
+
+        split.levels[split.count] = topic.substr(start, end - start);
+        split.hashes[split.count] = hash_level(topic.data() + start, end - start);
+        split.count++;
+
+        if (end == topic.length()) {
+            return true;
+        }
+        start = end + 1;
+    }
+}
+
+
+/**
+ * Checks a literal level of the pattern against a level of the topic.
+ */
+static inline bool level_equals(const compiled_pattern &pattern, const pattern_level &level,
+                                const topic_levels &topic, size_t index) {
+    return level.hash == topic.hashes[index]
+           && level.len == topic.levels[index].length()
+           && memcmp(pattern.text.data() + level.offset, topic.levels[index].data(),
+                     level.len) == 0;
+}
+
+
+bool match_pattern(const compiled_pattern &pattern, const topic_levels &topic) {
+    const std::vector<pattern_level> &levels = pattern.levels;
+    size_t num_levels = levels.size();
+
+    if (!pattern.has_star && num_levels != topic.count) {
+        // Every level of the pattern takes exactly one level of the topic.
+        return false;
+    }
+
+    size_t it_pattern = 0; // iterator through the pattern levels
+    size_t it_topic = 0; // iterator through the topic levels
+
+    // The last "*" seen, and the first topic level it does not cover yet.
+    // Only the last one needs to be extended on a mismatch: whatever the
+    // earlier ones would take more, the last one can take instead.
+    bool star_seen = false;
+    size_t star_pattern = 0;
+    size_t star_end = 0;
+
+    while (it_topic < topic.count) {
+        if (it_pattern < num_levels) {
+            const pattern_level &level = levels[it_pattern];
+
+            if (level.op == LEVEL_STAR) {
+                // Give the star a single level, for now.
+                star_seen = true;
+                star_pattern = it_pattern;
+                star_end = it_topic + 1;
+
+                it_pattern++;
+                it_topic = star_end;
+                continue;
+            }
+
+            if (level.op == LEVEL_PLUS || level_equals(pattern, level, topic, it_topic)) {
+                it_pattern++;
+                it_topic++;
+                continue;
+            }
+        }
+
+        if (!star_seen) {
+            return false;
+        }
+
+        // Backtrack: the star takes one more level, then the rest of the
+        // pattern is tried again after it.
+        star_end++;
+        it_pattern = star_pattern + 1;
+        it_topic = star_end;
+    }
+
+    // Every level left in the pattern would need at least one more level.
+    return it_pattern == num_levels;
+}
+
+
+uint32_t pool_intern(pattern_pool &pool, const std::string &pattern) {
+    auto it = pool.index.find(pattern);
+    if (it != pool.index.end()) {
+        pool.entries[it->second].refs++;
+        return it->second;
+    }
+
+    compiled_pattern compiled;
+    if (!compile_pattern(pattern, compiled)) {
+        return NO_PATTERN;
+    }
+
+    // Reuse the id of a pattern that was freed, if there is one.
+    uint32_t id;
+    if (!pool.free_ids.empty()) {
+        id = pool.free_ids.back();
+        pool.free_ids.pop_back();
+    } else {
+        id = pool.entries.size();
+        pool.entries.emplace_back();
+    }
+
+    pooled_pattern &entry = pool.entries[id];
+    entry.pattern = std::move(compiled);
+    entry.refs = 1;
+
+    pool.index.insert({entry.pattern.text, id});
+    return id;
+}
+
+
+void pool_release(pattern_pool &pool, uint32_t id) {
+    pooled_pattern &entry = pool.entries[id];
+    if (--entry.refs > 0) {
+        return;
+    }
+
+    pool.index.erase(entry.pattern.text);
+
+    // Give the memory back, the entry stays until the id is reused.
+    entry.pattern = compiled_pattern();
+    pool.free_ids.push_back(id);
+}
+
+
+uint32_t pool_find(const pattern_pool &pool, std::string_view pattern) {
+    auto it = pool.index.find(pattern);
+    return it == pool.index.end() ? NO_PATTERN : it->second;
+}
+
+
+size_t pattern_memory(const compiled_pattern &pattern) {
+    size_t bytes = pattern.levels.capacity() * sizeof(pattern_level);
+
+    // Short texts are stored inside the string object.
+    const char *text = pattern.text.data();
+    const char *object = (const char *) &pattern.text;
+    if (text < object || text >= object + sizeof(std::string)) {
+        bytes += pattern.text.capacity() + 1;
+    }
+
+    return bytes;
+}
+
+
+size_t pool_entry_memory(const pattern_pool &pool, uint32_t id) {
+    // A node of the index holds the key, the id, the cached hash and the
+    // link to the next node, and takes a bucket.
+    size_t index_node = sizeof(std::pair<const std::string_view, uint32_t>)
+                        + 3 * sizeof(void *);
+
+    return sizeof(pooled_pattern) + pattern_memory(pool.entries[id].pattern) + index_node;
+}
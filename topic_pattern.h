@@ -0,0 +1,149 @@
+#ifndef TOPIC_PATTERN_H
+#define TOPIC_PATTERN_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+
+// A topic has at most 50 characters, so at most 51 levels.
+#define MAX_TOPIC_LEVELS 64
+
+#define LEVEL_LITERAL 0
+#define LEVEL_PLUS 1 // "+", exactly one level
+#define LEVEL_STAR 2 // "*", one or more levels
+
+// Id of no pattern of a pattern_pool.
+#define NO_PATTERN UINT32_MAX
+
+
+/**
+ * A level of a compiled pattern: either a wildcard or a slice of the
+ * pattern text, with its hash.
+ */
+struct pattern_level {
+    uint8_t op;
+    uint16_t offset;
+    uint16_t len;
+    uint64_t hash;
+};
+
+
+/**
+ * A subscription topic, compiled once at subscribe time so matching a
+ * publication needs no allocation and no tokenization.
+ */
+struct compiled_pattern {
+    // The pattern itself, the literal levels point into it.
+    std::string text;
+    std::vector<pattern_level> levels;
+
+    // Set if there is a "*" (the number of levels can vary) or any
+    // wildcard at all (otherwise only the same topic matches).
+    bool has_star = false;
+    bool has_wildcards = false;
+};
+
+
+/**
+ * A publication topic, split once into views of its levels, with their
+ * hashes. It must not outlive the string it was split from.
+ */
+struct topic_levels {
+    std::string_view levels[MAX_TOPIC_LEVELS];
+    uint64_t hashes[MAX_TOPIC_LEVELS];
+    size_t count = 0;
+};
+
+
+/**
+ * A compiled pattern shared by all the subscriptions to it.
+ */
+struct pooled_pattern {
+    compiled_pattern pattern;
+
+    // Number of subscriptions to it. The id is reused when none is left.
+    uint32_t refs = 0;
+};
+
+
+/**
+ * Interned patterns: each distinct pattern is compiled and stored once,
+ * whatever the number of clients subscribed to it, and is named by a
+ * 32-bit id, which is all a subscription has to keep.
+ */
+struct pattern_pool {
+    // Indexed by id. Entries of a deque never move, so the keys of the
+    // index can point into their texts.
+    std::deque<pooled_pattern> entries;
+    std::vector<uint32_t> free_ids;
+
+    std::unordered_map<std::string_view, uint32_t> index;
+};
+
+
+/**
+ * Compiles the pattern (a topic that may contain wildcards).
+ * @return false if it is too long or has too many levels to ever match
+ */
+bool compile_pattern(const std::string &pattern, compiled_pattern &compiled);
+
+
+/**
+ * Splits the topic by '/' into levels.
+ * @return false if it has more than MAX_TOPIC_LEVELS levels
+ */
+bool split_topic(std::string_view topic, topic_levels &split);
+
+
+/**
+ * Checks if the topic matches the pattern. Each "*" is first given a
+ * single level, and more only when the rest of the pattern fails to
+ * match, so a plain pattern is matched in a single pass.
+ */
+bool match_pattern(const compiled_pattern &pattern, const topic_levels &topic);
+
+
+/**
+ * Takes a reference to the pattern, which is compiled and added to the
+ * pool if it is not there yet.
+ * @return its id, or NO_PATTERN if it can not be compiled
+ */
+uint32_t pool_intern(pattern_pool &pool, const std::string &pattern);
+
+
+/**
+ * Drops a reference to the pattern. The last one frees it.
+ */
+void pool_release(pattern_pool &pool, uint32_t id);
+
+
+/**
+ * Looks for the pattern, without taking a reference to it.
+ * @return its id, or NO_PATTERN if no one is subscribed to it
+ */
+uint32_t pool_find(const pattern_pool &pool, std::string_view pattern);
+
+
+static inline const compiled_pattern &pool_pattern(const pattern_pool &pool, uint32_t id) {
+    return pool.entries[id].pattern;
+}
+
+
+/**
+ * Heap memory used by a compiled pattern, in bytes (the text, if it does
+ * not fit in the string itself, and the levels).
+ */
+size_t pattern_memory(const compiled_pattern &pattern);
+
+
+/**
+ * Memory used by a pattern of the pool, in bytes: its entry, its heap
+ * memory and its node of the index.
+ */
+size_t pool_entry_memory(const pattern_pool &pool, uint32_t id);
+
+
+#endif /* TOPIC_PATTERN_H */
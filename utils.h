@@ -3,6 +3,8 @@
 
 #include <iostream>
 #include <cstdlib>
+#include <cstdint>
+#include <ctime>
 
 
 /*
@@ -18,4 +20,25 @@
 	} while (0)
 
 
+/*
+ * Current value of the monotonic clock, in microseconds.
+ */
+static inline uint64_t monotonic_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/*
+ * Current value of the real time clock (the one of the kernel timestamps),
+ * in nanoseconds.
+ */
+static inline uint64_t realtime_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
 #endif /* UTILS_H */